@@ -0,0 +1,268 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include "adpcm.h"
+#include "log.h"
+
+// Step sizes of IMA ADPCM, and change of the step index after each code
+static int const ima_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+    45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190,
+    209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724,
+    796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272,
+    2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132,
+    7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500,
+    20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static int const ima_index_steps[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+// Predictor coefficients of MS ADPCM, in 1/256, and scale of its delta
+// after each code
+int16_t const adpcm_ms_coefs[ADPCM_MS_COEFS][2] = {
+    { 256, 0 }, { 512, -256 }, { 0, 0 }, { 192, 64 },
+    { 240, 0 }, { 460, -208 }, { 392, -232 }
+};
+
+static int const ms_adaptation[16] = {
+    230, 230, 230, 230, 307, 409, 512, 614,
+    768, 614, 512, 409, 307, 230, 230, 230
+};
+
+
+/**
+ * (internal) Read a little-endian 16-bit sample
+ */
+static int read_s16(unsigned char const *p)
+{
+    return (int16_t) (p[0] | p[1] << 8);
+}
+
+
+/**
+ * (internal) Clamp a prediction to the 16-bit range
+ */
+static int clamp_s16(int x)
+{
+    return x < -32768 ? -32768 : x > 32767 ? 32767 : x;
+}
+
+
+/**
+ * Number of frames in a block of size bytes, which is shorter than the
+ * block alignment at the end of a file. Return 0 if it has no header.
+ */
+size_t adpcm_block_frames(unsigned encoding, size_t size, unsigned channels)
+{
+    if (channels == 0) return 0;
+    if (encoding == WAVE_FORMAT_IMA_ADPCM) {
+        // Channels take turns with 4 bytes, 8 codes, after the header
+        if (size < 4 * channels) return 0;
+        return (size - 4 * channels) / (4 * channels) * 8 + 1;
+    }
+    if (encoding == WAVE_FORMAT_ADPCM) {
+        if (size < 7 * channels) return 0;
+        return (size - 7 * channels) * 2 / channels + 2;
+    }
+    return 0;
+}
+
+
+/**
+ * (internal) Decode a block of IMA ADPCM. Each channel has a header with
+ * its first sample and step index, then groups of 8 codes, low nibbles
+ * first.
+ */
+static size_t decode_ima(int16_t *out, unsigned char const *block, size_t size,
+                         unsigned channels)
+{
+    size_t const frames = adpcm_block_frames(WAVE_FORMAT_IMA_ADPCM, size, channels);
+    size_t const groups = (frames - 1) / 8;
+    unsigned c;
+    for (c = 0; c < channels; c++) {
+        unsigned char const *p = block + 4 * c;
+        int sample = read_s16(p);
+        int index = p[2];
+        if (index > 88) return 0;
+        int16_t *o = out + c;
+        *o = sample;
+        o += channels;
+
+        size_t g;
+        for (g = 0; g < groups; g++) {
+            unsigned char const *q = block + 4 * channels + (g * channels + c) * 4;
+            unsigned k;
+            for (k = 0; k < 8; k++) {
+                unsigned const code = k & 1 ? q[k / 2] >> 4 : q[k / 2] & 0xf;
+                int const step = ima_steps[index];
+                int diff = step >> 3;
+                if (code & 4) diff += step;
+                if (code & 2) diff += step >> 1;
+                if (code & 1) diff += step >> 2;
+                sample = clamp_s16(code & 8 ? sample - diff : sample + diff);
+                index += ima_index_steps[code];
+                index = index < 0 ? 0 : index > 88 ? 88 : index;
+                *o = sample;
+                o += channels;
+            }
+        }
+    }
+    return frames;
+}
+
+
+/**
+ * (internal) Decode a block of MS ADPCM. The header holds the predictor,
+ * delta and last two samples of each channel, and codes of the channels
+ * follow in turn, high nibbles first.
+ */
+static size_t decode_ms(int16_t *out, unsigned char const *block, size_t size,
+                        unsigned channels)
+{
+    size_t const frames = adpcm_block_frames(WAVE_FORMAT_ADPCM, size, channels);
+    int coef1[8], coef2[8], delta[8], s1[8], s2[8];
+    unsigned c;
+    if (channels > 8) return 0;
+    for (c = 0; c < channels; c++) {
+        if (block[c] >= ADPCM_MS_COEFS) return 0;
+        coef1[c] = adpcm_ms_coefs[block[c]][0];
+        coef2[c] = adpcm_ms_coefs[block[c]][1];
+        delta[c] = read_s16(block + channels + 2 * c);
+        s1[c] = read_s16(block + 3 * channels + 2 * c);
+        s2[c] = read_s16(block + 5 * channels + 2 * c);
+        // The older sample comes first
+        out[c] = s2[c];
+        out[channels + c] = s1[c];
+    }
+
+    unsigned char const *p = block + 7 * channels;
+    size_t const codes = (frames - 2) * channels;
+    int16_t *o = out + 2 * channels;
+    size_t i;
+    c = 0;
+    for (i = 0; i < codes; i++) {
+        unsigned const code = i & 1 ? p[i / 2] & 0xf : p[i / 2] >> 4;
+        int const signed_code = code & 8 ? (int) code - 16 : (int) code;
+        int const predicted = (s1[c] * coef1[c] + s2[c] * coef2[c]) / 256;
+        int const sample = clamp_s16(predicted + signed_code * delta[c]);
+        s2[c] = s1[c];
+        s1[c] = sample;
+        delta[c] = ms_adaptation[code] * delta[c] / 256;
+        if (delta[c] < 16) delta[c] = 16;
+        *o++ = sample;
+        if (++c == channels) c = 0;
+    }
+    return frames;
+}
+
+
+/**
+ * Decode a block of size bytes to interleaved 16-bit native-endian samples.
+ * Return the number of frames, 0 if the block is too short or corrupted.
+ */
+size_t adpcm_decode_block(unsigned encoding, int16_t *out, unsigned char const *block,
+                          size_t size, unsigned channels)
+{
+    if (adpcm_block_frames(encoding, size, channels) == 0) return 0;
+    switch (encoding) {
+        case WAVE_FORMAT_IMA_ADPCM:
+            return decode_ima(out, block, size, channels);
+        case WAVE_FORMAT_ADPCM:
+            return decode_ms(out, block, size, channels);
+        default:
+            return 0;
+    }
+}
+
+
+/**
+ * Prepare a decoder for a stream of blocks of block_align bytes and
+ * block_frames frames. The decoder must be zeroed or initialised, and its
+ * buffers are reused.
+ * Return 1 if the allocation failed.
+ */
+int adpcm_init(adpcm_t *adpcm, unsigned encoding, unsigned channels, size_t block_align,
+               size_t block_frames)
+{
+    unsigned char *const block = realloc(adpcm->block, block_align);
+    if (block == NULL) return 1;
+    adpcm->block = block;
+    int16_t *const frames = realloc(adpcm->frames, block_frames * channels * sizeof(int16_t));
+    if (frames == NULL) return 1;
+    adpcm->frames = frames;
+    adpcm->encoding = encoding;
+    adpcm->channels = channels;
+    adpcm->block_align = block_align;
+    adpcm->block_frames = block_frames;
+    adpcm->pos = adpcm->count = 0;
+    return 0;
+}
+
+
+/**
+ * Drop the frames which wait in a decoder, after the file was moved to
+ * another block
+ */
+void adpcm_reset(adpcm_t *adpcm)
+{
+    adpcm->pos = adpcm->count = 0;
+}
+
+
+/**
+ * Free the buffers of a decoder
+ */
+void adpcm_destroy(adpcm_t *adpcm)
+{
+    free(adpcm->block);
+    free(adpcm->frames);
+    memset(adpcm, 0, sizeof(*adpcm));
+}
+
+
+/**
+ * Read the next frames of a stream of blocks from a file, decoded to
+ * interleaved 16-bit native-endian samples.
+ * Return the number of frames, less than asked at the end of the stream,
+ * or -1 if the file couldn't be read.
+ */
+long adpcm_read(adpcm_t *adpcm, FILE *file, int16_t *out, size_t frames)
+{
+    unsigned const channels = adpcm->channels;
+    size_t done = 0;
+    while (done < frames) {
+        if (adpcm->pos < adpcm->count) {
+            size_t n = adpcm->count - adpcm->pos;
+            if (n > frames - done) n = frames - done;
+            memcpy(out + done * channels, adpcm->frames + adpcm->pos * channels,
+                   n * channels * sizeof(int16_t));
+            adpcm->pos += n;
+            done += n;
+            continue;
+        }
+
+        // Whole blocks are decoded straight into the output, and only the
+        // last one goes through the decoder
+        int const whole = frames - done >= adpcm->block_frames;
+        size_t const size = fread(adpcm->block, 1, adpcm->block_align, file);
+        if (size < adpcm->block_align && ferror(file)) return -1;
+        if (size == 0) break;
+        int16_t *const dest = whole ? out + done * channels : adpcm->frames;
+        size_t const n = adpcm_decode_block(adpcm->encoding, dest, adpcm->block, size,
+                                            channels);
+        if (n == 0) {
+            LOG_WARNING("Corrupted ADPCM block, the stream ends here.");
+            break;
+        }
+        if (whole) {
+            done += n;
+        } else {
+            adpcm->pos = 0;
+            adpcm->count = n;
+        }
+    }
+    return done;
+}
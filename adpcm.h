@@ -0,0 +1,47 @@
+#ifndef ADPCM_H
+#define ADPCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Encodings of WAVE files: samples as they are, or compressed to 4 bits
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_ADPCM 2
+#define WAVE_FORMAT_IMA_ADPCM 0x11
+
+// Number of predictors of MS ADPCM, whose coefficients are the standard ones
+#define ADPCM_MS_COEFS 7
+
+/**
+ * Decoder of a stream of ADPCM blocks to 16-bit native-endian samples.
+ * Each block starts with the state of the predictors, so blocks decode on
+ * their own and a stream may start at any block. Whole blocks are decoded
+ * straight into the output, and the frames of the last block which don't
+ * fit wait in the decoder for the next read.
+ */
+typedef struct {
+    unsigned encoding;
+    unsigned channels;
+    size_t block_align;
+    size_t block_frames;
+
+    // Last block read, and its frames which were not read yet
+    unsigned char *block;
+    int16_t *frames;
+    size_t pos;
+    size_t count;
+} adpcm_t;
+
+size_t adpcm_block_frames(unsigned encoding, size_t size, unsigned channels);
+size_t adpcm_decode_block(unsigned encoding, int16_t *out, unsigned char const *block,
+                          size_t size, unsigned channels);
+int adpcm_init(adpcm_t *adpcm, unsigned encoding, unsigned channels, size_t block_align,
+               size_t block_frames);
+void adpcm_reset(adpcm_t *adpcm);
+void adpcm_destroy(adpcm_t *adpcm);
+long adpcm_read(adpcm_t *adpcm, FILE *file, int16_t *out, size_t frames);
+
+extern int16_t const adpcm_ms_coefs[ADPCM_MS_COEFS][2];
+
+#endif /* ADPCM_H */
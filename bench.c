@@ -0,0 +1,1011 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/soundcard.h>
+#include <sys/wait.h>
+#include "adpcm.h"
+#include "dsp.h"
+#include "eq.h"
+#include "kernels.h"
+#include "library.h"
+#include "log.h"
+#include "matrix.h"
+#include "meter.h"
+#include "player.h"
+#include "playlist.h"
+#include "silence.h"
+#include "status.h"
+#include "stretch.h"
+
+// Results are written here while stdout, which receives the logs of the
+// benchmarked code, goes to /dev/null
+static FILE *out = NULL;
+
+/**
+ * (internal) Monotonic time in seconds
+ */
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Length in seconds of the streams decoded by the ADPCM benchmark
+#define BENCH_ADPCM_SEC 60
+
+/**
+ * Decoding speed of IMA and MS ADPCM files at 44.1 kHz, read from a file in
+ * the page cache by 40 ms blocks like the playing thread does
+ */
+static int bench_adpcm(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        unsigned encoding;
+        unsigned channels;
+        size_t block_align;
+    } streams[] = {
+        { "IMA ADPCM mono", WAVE_FORMAT_IMA_ADPCM, 1, 1024 },
+        { "IMA ADPCM stereo", WAVE_FORMAT_IMA_ADPCM, 2, 2048 },
+        { "MS ADPCM mono", WAVE_FORMAT_ADPCM, 1, 1024 },
+        { "MS ADPCM stereo", WAVE_FORMAT_ADPCM, 2, 2048 },
+    };
+    size_t const frames = 44100 * 40 / 1000;
+    srand(1);
+    size_t i;
+    for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+        unsigned const channels = streams[i].channels;
+        size_t const block_align = streams[i].block_align;
+        size_t const block_frames = adpcm_block_frames(streams[i].encoding, block_align,
+                                                       channels);
+        size_t const blocks = BENCH_ADPCM_SEC * 44100 / block_frames;
+
+        // Blocks of random codes, with valid headers
+        FILE *file = tmpfile();
+        unsigned char *block = malloc(block_align);
+        int16_t *buf = malloc(frames * channels * sizeof(int16_t));
+        adpcm_t decoder;
+        memset(&decoder, 0, sizeof(decoder));
+        if (file == NULL || block == NULL || buf == NULL ||
+            adpcm_init(&decoder, streams[i].encoding, channels, block_align,
+                       block_frames)) {
+            perror("adpcm");
+            if (file != NULL) fclose(file);
+            free(block);
+            free(buf);
+            adpcm_destroy(&decoder);
+            return 1;
+        }
+        size_t b, j;
+        for (b = 0; b < blocks; b++) {
+            for (j = 0; j < block_align; j++) block[j] = rand();
+            unsigned c;
+            for (c = 0; c < channels; c++) {
+                if (streams[i].encoding == WAVE_FORMAT_IMA_ADPCM) {
+                    block[4 * c + 2] %= 89;
+                } else {
+                    block[c] %= ADPCM_MS_COEFS;
+                    block[channels + 2 * c + 1] = 0x01;
+                }
+            }
+            fwrite(block, 1, block_align, file);
+        }
+
+        double best = 1e9;
+        size_t decoded = 0;
+        int r;
+        for (r = 0; r < 5; r++) {
+            rewind(file);
+            adpcm_reset(&decoder);
+            decoded = 0;
+            double const t = now_sec();
+            long n;
+            while ((n = adpcm_read(&decoder, file, buf, frames)) > 0) decoded += n;
+            double const elapsed = now_sec() - t;
+            if (elapsed < best) best = elapsed;
+        }
+        fprintf(out, "adpcm: %-16s %8.1f Mframes/s, %6.0fx real time, %5.2f MB/s read\n",
+                streams[i].name, decoded / best * 1e-6, decoded / best / 44100,
+                blocks * block_align / best * 1e-6);
+        fclose(file);
+        free(block);
+        free(buf);
+        adpcm_destroy(&decoder);
+    }
+    return 0;
+}
+
+
+// Number of blocks processed by the gain benchmark, per channel count
+#define BENCH_GAIN_BLOCKS 2000
+
+/**
+ * Cost of the gain stage on 40 ms blocks of 16-bit samples at 44.1 kHz,
+ * with ramps on every other block, as a share of real time
+ */
+static int bench_gain(int argc, char **argv)
+{
+    static const unsigned channel_counts[] = { 1, 2, 6, 8 };
+    size_t const frames = 44100 * 40 / 1000;
+    size_t i;
+    for (i = 0; i < sizeof(channel_counts) / sizeof(channel_counts[0]); i++) {
+        unsigned const channels = channel_counts[i];
+        size_t const samples = frames * channels;
+        int16_t *buf = malloc(samples * sizeof(int16_t));
+        float *work = malloc(samples * sizeof(float));
+        if (buf == NULL || work == NULL) {
+            free(buf);
+            free(work);
+            return 1;
+        }
+        size_t j;
+        for (j = 0; j < samples; j++) {
+            buf[j] = (int16_t) (j * 7919);
+        }
+        dsp_gain_t stream, output;
+        dsp_gain_init(&stream, 0.5);
+        dsp_gain_init(&output, 1);
+        double const start = now_sec();
+        int b;
+        for (b = 0; b < BENCH_GAIN_BLOCKS; b++) {
+            if (b % 2 == 0) {
+                dsp_gain_set(&output, b % 4 ? 1 : 0.8, 441);
+            }
+            dsp_decode(work, buf, samples, AFMT_S16_NE);
+            dsp_gain_apply(&stream, work, frames, channels);
+            dsp_gain_apply(&output, work, frames, channels);
+            dsp_encode(buf, work, samples, AFMT_S16_NE);
+        }
+        double const elapsed = now_sec() - start;
+        fprintf(out, "gain: %u channels, %8.1f us/block, %6.3f%% of a core in real time\n",
+                channels, elapsed * 1e6 / BENCH_GAIN_BLOCKS,
+                elapsed / (BENCH_GAIN_BLOCKS * 0.040) * 100);
+        free(buf);
+        free(work);
+    }
+    return 0;
+}
+
+
+// Number of blocks processed by each kernel in the kernels benchmark
+#define BENCH_KERNELS_BLOCKS 4000
+
+/**
+ * Time per sample of every variant of the kernels which this CPU runs, on
+ * 40 ms blocks of stereo at 44.1 kHz, and difference of its results with
+ * the scalar variant of the same format
+ */
+static int bench_kernels(int argc, char **argv)
+{
+    size_t const samples = 44100 * 40 / 1000 * 2;
+    int16_t *buf = malloc(samples * sizeof(int16_t));
+    int16_t *ref_buf = malloc(samples * sizeof(int16_t));
+    float *work = malloc(samples * sizeof(float));
+    float *ref = malloc(samples * sizeof(float));
+    if (buf == NULL || ref_buf == NULL || work == NULL || ref == NULL) {
+        free(buf);
+        free(ref_buf);
+        free(work);
+        free(ref);
+        return 1;
+    }
+    unsigned const isa = kernels_isa();
+    fprintf(out, "kernels: CPU runs %s\n", kernels_isa_name(isa));
+    size_t count, i, j;
+    int b;
+
+    // Decoders and encoders of every format
+    kernel_decoder_t const *decoders = kernels_decoders(&count);
+    for (i = 0; i < count; i++) {
+        if (decoders[i].isa > isa) continue;
+        for (j = 0; j < samples; j++) {
+            buf[j] = (int16_t) (j * 7919);
+        }
+        kernel_decoder_t const *scalar = decoders;
+        while (scalar->format != decoders[i].format) scalar++;
+        scalar->fn(ref, buf, samples);
+        double const start = now_sec();
+        for (b = 0; b < BENCH_KERNELS_BLOCKS; b++) {
+            decoders[i].fn(work, buf, samples);
+        }
+        double const elapsed = now_sec() - start;
+        float diff = 0;
+        for (j = 0; j < samples; j++) {
+            float const d = work[j] > ref[j] ? work[j] - ref[j] : ref[j] - work[j];
+            if (d > diff) diff = d;
+        }
+        fprintf(out, "kernels: decode %-13s %6.3f ns/sample, max difference %g\n",
+                decoders[i].name, elapsed * 1e9 / (BENCH_KERNELS_BLOCKS * samples), diff);
+    }
+    kernel_encoder_t const *encoders = kernels_encoders(&count);
+    for (i = 0; i < count; i++) {
+        if (encoders[i].isa > isa) continue;
+        for (j = 0; j < samples; j++) {
+            work[j] = (int16_t) (j * 7919) * (1.3f / 32768);
+        }
+        kernel_encoder_t const *scalar = encoders;
+        while (scalar->format != encoders[i].format) scalar++;
+        scalar->fn(ref_buf, work, samples);
+        double const start = now_sec();
+        for (b = 0; b < BENCH_KERNELS_BLOCKS; b++) {
+            encoders[i].fn(buf, work, samples);
+        }
+        double const elapsed = now_sec() - start;
+        // Samples may only differ by rounding of halves
+        unsigned long differ = 0;
+        size_t const bytes = encoders[i].format == AFMT_U8 ||
+            encoders[i].format == AFMT_S8 ? samples : 2 * samples;
+        for (j = 0; j < bytes; j++) {
+            differ += ((unsigned char *) buf)[j] != ((unsigned char *) ref_buf)[j];
+        }
+        fprintf(out, "kernels: encode %-13s %6.3f ns/sample, %lu bytes differ\n",
+                encoders[i].name, elapsed * 1e9 / (BENCH_KERNELS_BLOCKS * samples), differ);
+    }
+
+    // Gains with a ramp every other block, for their number of channels
+    for (j = 0; j < samples; j++) {
+        ref[j] = (int16_t) (j * 7919) * (1.0f / 32768);
+    }
+    kernel_gainer_t const *gainers = kernels_gainers(&count);
+    for (i = 0; i < count; i++) {
+        if (gainers[i].isa > isa) continue;
+        unsigned const channels = gainers[i].channels ? gainers[i].channels : 6;
+        size_t const frames = samples / channels;
+        dsp_gain_t gain;
+        dsp_gain_init(&gain, 1);
+        double const start = now_sec();
+        for (b = 0; b < BENCH_KERNELS_BLOCKS; b++) {
+            if (b % 2 == 0) {
+                dsp_gain_set(&gain, b % 4 ? 1 : 0.8, 441);
+            }
+            // Samples are reset so that they never become denormals
+            memcpy(work, ref, frames * channels * sizeof(float));
+            gainers[i].fn(&gain, work, frames, channels);
+        }
+        double const elapsed = now_sec() - start;
+        fprintf(out, "kernels: gain   %-13s %6.3f ns/sample, %u channels\n",
+                gainers[i].name, elapsed * 1e9 / (BENCH_KERNELS_BLOCKS * frames * channels),
+                channels);
+    }
+    free(buf);
+    free(ref_buf);
+    free(work);
+    free(ref);
+    return 0;
+}
+
+
+// Number of blocks processed by the equalizer benchmark, per configuration
+#define BENCH_EQ_BLOCKS 500
+
+/**
+ * Time per frame of the equalizer on 40 ms blocks at 44.1 kHz, for 1 to
+ * EQ_MAX_BANDS peak bands on stereo and 8-channel streams
+ */
+static int bench_eq(int argc, char **argv)
+{
+    static const unsigned channel_counts[] = { 2, 8 };
+    size_t const frames = 44100 * 40 / 1000;
+    size_t i;
+    for (i = 0; i < sizeof(channel_counts) / sizeof(channel_counts[0]); i++) {
+        unsigned const channels = channel_counts[i];
+        size_t const samples = frames * channels;
+        float *work = malloc(samples * sizeof(float));
+        if (work == NULL) return 1;
+        unsigned bands;
+        for (bands = 1; bands <= EQ_MAX_BANDS; bands++) {
+            eq_t eq;
+            memset(&eq, 0, sizeof(eq));
+            eq_set_rate(&eq, 44100, 441);
+            unsigned b;
+            for (b = 0; b < bands; b++) {
+                eq_band_t const band = { EQ_PEAK, 31.25f * (2 << b), b % 2 ? 3 : -3, 1 };
+                eq_set_band(&eq, b, &band);
+            }
+            size_t j;
+            for (j = 0; j < samples; j++) {
+                work[j] = (int16_t) (j * 7919) * (1.0f / 32768);
+            }
+            double const start = now_sec();
+            int k;
+            for (k = 0; k < BENCH_EQ_BLOCKS; k++) {
+                eq_process(&eq, work, frames, channels);
+            }
+            double const elapsed = now_sec() - start;
+            fprintf(out, "eq: %u channels, %2u bands, %7.2f ns/frame, %6.3f%% of a core in real time\n",
+                    channels, bands, elapsed * 1e9 / (BENCH_EQ_BLOCKS * frames),
+                    elapsed / (BENCH_EQ_BLOCKS * 0.040) * 100);
+        }
+        free(work);
+    }
+    return 0;
+}
+
+
+// Number of output blocks of the time-stretch benchmark, per configuration
+#define BENCH_STRETCH_BLOCKS 500
+
+/**
+ * Cost of the time-stretch on 40 ms output blocks at 44.1 kHz, at several
+ * speeds, on a chirp which keeps the similarity search busy
+ */
+static int bench_stretch(int argc, char **argv)
+{
+    static const float speeds[] = { 0.75, 1, 1.25, 1.5, 2, 3 };
+    static const unsigned channel_counts[] = { 1, 2, 6 };
+    size_t const frames = 44100 * 40 / 1000;
+    size_t i, j;
+    for (i = 0; i < sizeof(channel_counts) / sizeof(channel_counts[0]); i++) {
+        unsigned const channels = channel_counts[i];
+        float *in = malloc(frames * channels * sizeof(float));
+        float *work = malloc(frames * channels * sizeof(float));
+        stretch_t st;
+        if (in == NULL || work == NULL ||
+            stretch_init(&st, channels, 44100, frames)) {
+            free(in);
+            free(work);
+            return 1;
+        }
+        for (j = 0; j < sizeof(speeds) / sizeof(speeds[0]); j++) {
+            stretch_reset(&st);
+            stretch_set_speed(&st, speeds[j]);
+            double phase = 0;
+            size_t pushed = 0;
+            double const start = now_sec();
+            int b;
+            for (b = 0; b < BENCH_STRETCH_BLOCKS; b++) {
+                size_t done = 0;
+                while ((done += stretch_pull(&st, work + done * channels,
+                                             frames - done)) < frames) {
+                    size_t f;
+                    for (f = 0; f < frames; f++, pushed++) {
+                        phase += 0.01 + (pushed % 441000) * 1e-7;
+                        unsigned c;
+                        for (c = 0; c < channels; c++) {
+                            in[f * channels + c] = 0.5f * (float) (phase - (long) phase) - 0.25f;
+                        }
+                    }
+                    stretch_push(&st, in, frames);
+                }
+            }
+            double const elapsed = now_sec() - start;
+            fprintf(out, "stretch: %u channels, speed %.2f, %8.1f us/block, "
+                    "%6.3f%% of a core in real time\n",
+                    channels, speeds[j], elapsed * 1e6 / BENCH_STRETCH_BLOCKS,
+                    elapsed / (BENCH_STRETCH_BLOCKS * 0.040) * 100);
+        }
+        stretch_destroy(&st);
+        free(in);
+        free(work);
+    }
+    return 0;
+}
+
+
+// Number of blocks processed by the channel matrix benchmark, per layout
+#define BENCH_MATRIX_BLOCKS 2000
+
+/**
+ * Time per frame of the default channel mixes on 40 ms blocks at 44.1 kHz
+ */
+static int bench_matrix(int argc, char **argv)
+{
+    static const unsigned shapes[][2] = {
+        { 1, 2 }, { 2, 1 }, { 6, 2 }, { 8, 2 }, { 2, 6 }, { 8, 6 }
+    };
+    size_t const frames = 44100 * 40 / 1000;
+    float *in = malloc(frames * MATRIX_MAX_CHANNELS * sizeof(float));
+    float *work = malloc(frames * MATRIX_MAX_CHANNELS * sizeof(float));
+    if (in == NULL || work == NULL) {
+        free(in);
+        free(work);
+        return 1;
+    }
+    size_t i;
+    for (i = 0; i < frames * MATRIX_MAX_CHANNELS; i++) {
+        in[i] = (int16_t) (i * 7919) * (1.0f / 32768);
+    }
+    for (i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        matrix_t matrix;
+        matrix_init_default(&matrix, shapes[i][0], shapes[i][1]);
+        double const start = now_sec();
+        int b;
+        for (b = 0; b < BENCH_MATRIX_BLOCKS; b++) {
+            matrix_apply(&matrix, work, in, frames);
+        }
+        double const elapsed = now_sec() - start;
+        fprintf(out, "matrix: %u to %u channels, %6.2f ns/frame, "
+                "%6.3f%% of a core in real time\n",
+                shapes[i][0], shapes[i][1], elapsed * 1e9 / (BENCH_MATRIX_BLOCKS * frames),
+                elapsed / (BENCH_MATRIX_BLOCKS * 0.040) * 100);
+    }
+    free(in);
+    free(work);
+    return 0;
+}
+
+
+/**
+ * Time to find the silent ends of a one-hour 16-bit stereo file at 44.1 kHz,
+ * with SECONDS of silence at each end, and of a file which is silent all
+ * along. The file is sparse, so reads come from memory.
+ */
+static int bench_silence(int argc, char **argv)
+{
+    double seconds = 10;
+    if (argc > 1 || (argc == 1 && (seconds = atof(argv[0])) <= 0)) {
+        fprintf(stderr, "Usage: silence [SECONDS]\n");
+        return 1;
+    }
+    uint64_t const frames = 3600 * 44100ull;
+    uint64_t const data_size = frames * 4;
+    uint64_t const lead = seconds * 44100;
+    if (2 * lead >= frames) {
+        fprintf(stderr, "silence: ends are longer than the file\n");
+        return 1;
+    }
+    FILE *file = tmpfile();
+    if (file == NULL || ftruncate(fileno(file), data_size)) {
+        perror("silence");
+        if (file != NULL) fclose(file);
+        return 1;
+    }
+    int const threshold = silence_threshold(SILENCE_DEFAULT_DB);
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            int16_t const loud[2] = { 1000, -1000 };
+            if (pwrite(fileno(file), loud, 4, lead * 4) != 4 ||
+                pwrite(fileno(file), loud, 4, (frames - lead - 1) * 4) != 4) {
+                perror("pwrite");
+                fclose(file);
+                return 1;
+            }
+        }
+        uint64_t start = 0, end = 0;
+        double best = 1e9;
+        int r;
+        for (r = 0; r < 5; r++) {
+            double const t = now_sec();
+            if (silence_scan(fileno(file), 0, data_size, AFMT_S16_NE, 2, threshold,
+                             &start, &end)) {
+                fclose(file);
+                return 1;
+            }
+            double const elapsed = now_sec() - t;
+            if (elapsed < best) best = elapsed;
+        }
+        fprintf(out, "silence: %s, audio from %.2f to %.2f s, %8.3f ms, %6.2f GB/s\n",
+                pass ? "1 hour with silent ends" : "1 hour of silence",
+                start / 44100., end / 44100., best * 1e3,
+                (pass ? 2 * lead * 4 : data_size) / best * 1e-9);
+    }
+    fclose(file);
+    return 0;
+}
+
+
+/**
+ * Time to load an M3U playlist of ENTRIES entries with their titles, the
+ * memory of its index, and time to pick the next entry in order and
+ * shuffled
+ */
+static int bench_playlist(int argc, char **argv)
+{
+    long entries = 100000;
+    if (argc > 1 || (argc == 1 && (entries = atol(argv[0])) <= 0)) {
+        fprintf(stderr, "Usage: playlist [ENTRIES]\n");
+        return 1;
+    }
+    char file_name[] = "/tmp/bench-playlist-XXXXXX";
+    int const fd = mkstemp(file_name);
+    FILE *file = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (file == NULL) {
+        perror("playlist");
+        if (fd != -1) close(fd);
+        return 1;
+    }
+    long i;
+    fprintf(file, "#EXTM3U\n");
+    for (i = 0; i < entries; i++) {
+        fprintf(file, "#EXTINF:%ld,Artist %ld - Title %ld\n", 180 + i % 120, i / 12, i);
+        fprintf(file, "music/artist %04ld/album %02ld/%02ld title %ld.wav\n",
+                i / 120, i / 12 % 10, i % 12, i);
+    }
+    fclose(file);
+
+    playlist_t playlist;
+    playlist_init(&playlist);
+    double best = 1e9;
+    int r;
+    for (r = 0; r < 5; r++) {
+        double const t = now_sec();
+        if (playlist_load(&playlist, file_name)) {
+            unlink(file_name);
+            return 1;
+        }
+        double const elapsed = now_sec() - t;
+        if (elapsed < best) best = elapsed;
+    }
+    fprintf(out, "playlist: load %ld entries %8.2f ms, %6.1f ns/entry, %5lu KB of index\n",
+            entries, best * 1e3, best / entries * 1e9,
+            (unsigned long) playlist_memory(&playlist) / 1024);
+
+    char path[PLAYLIST_PATH_MAX];
+    int shuffle;
+    for (shuffle = 0; shuffle < 2; shuffle++) {
+        playlist_load(&playlist, file_name);
+        playlist_set_shuffle(&playlist, shuffle);
+        size_t len = 0;
+        double const t = now_sec();
+        while (!playlist_peek(&playlist, path, sizeof(path))) {
+            len += strlen(path);
+            playlist_advance(&playlist);
+        }
+        double const elapsed = now_sec() - t;
+        fprintf(out, "playlist: next entry %-8s %6.1f ns/entry, %lu bytes of paths\n",
+                shuffle ? "shuffled" : "in order", elapsed / entries * 1e9,
+                (unsigned long) len);
+    }
+    playlist_destroy(&playlist);
+    unlink(file_name);
+    return 0;
+}
+
+
+// Number of blocks measured by the levels benchmark, per configuration
+#define BENCH_LEVELS_BLOCKS 2000
+
+/**
+ * Cost of the levels tap on 40 ms blocks at 44.1 kHz: disabled, with peak
+ * and RMS levels, and with a spectrum 10 and 25 times per second
+ */
+static int bench_levels(int argc, char **argv)
+{
+    static const unsigned channel_counts[] = { 1, 2, 6, 8 };
+    static const int spectrum_hz[] = { -1, 0, 10, 25 };
+    size_t const frames = 44100 * 40 / 1000;
+    meter_t *meter = malloc(sizeof(meter_t));
+    float *work = malloc(frames * METER_MAX_CHANNELS * sizeof(float));
+    if (meter == NULL || work == NULL) {
+        free(meter);
+        free(work);
+        return 1;
+    }
+    meter_init(meter);
+    size_t i, j;
+    for (i = 0; i < frames * METER_MAX_CHANNELS; i++) {
+        work[i] = (int16_t) (i * 7919) * (1.0f / 32768);
+    }
+    for (i = 0; i < sizeof(channel_counts) / sizeof(channel_counts[0]); i++) {
+        unsigned const channels = channel_counts[i];
+        for (j = 0; j < sizeof(spectrum_hz) / sizeof(spectrum_hz[0]); j++) {
+            meter_enable(meter, spectrum_hz[j] >= 0, spectrum_hz[j] > 0 ? spectrum_hz[j] : 0);
+            double const start = now_sec();
+            int b;
+            for (b = 0; b < BENCH_LEVELS_BLOCKS; b++) {
+                // Like the playing thread, which only tests the flag when
+                // the tap is disabled
+                if (meter_enabled(meter)) {
+                    meter_process(meter, work, frames, channels, 44100);
+                }
+            }
+            double const elapsed = now_sec() - start;
+            char mode[32];
+            if (spectrum_hz[j] < 0) {
+                snprintf(mode, sizeof(mode), "disabled");
+            } else if (spectrum_hz[j] == 0) {
+                snprintf(mode, sizeof(mode), "peak and RMS");
+            } else {
+                snprintf(mode, sizeof(mode), "spectrum %d/s", spectrum_hz[j]);
+            }
+            fprintf(out, "levels: %u channels, %-14s %7.2f ns/frame, "
+                    "%6.3f%% of a core in real time\n",
+                    channels, mode, elapsed * 1e9 / (BENCH_LEVELS_BLOCKS * frames),
+                    elapsed / (BENCH_LEVELS_BLOCKS * 0.040) * 100);
+        }
+    }
+    free(meter);
+    free(work);
+    return 0;
+}
+
+
+/**
+ * Scan a directory tree with an increasing number of threads
+ */
+static int bench_scan(int argc, char **argv)
+{
+    if (argc != 1) {
+        fprintf(stderr, "Usage: scan DIR\n");
+        return 1;
+    }
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+
+    // The first scan only fills the page cache
+    unsigned nthreads = 0;
+    int warmup = 1;
+    while (nthreads < ncpu) {
+        nthreads = warmup || nthreads == 0 ? 1 :
+            2 * nthreads > ncpu ? ncpu : 2 * nthreads;
+        library_t lib;
+        library_init(&lib);
+        double const start = now_sec();
+        if (library_scan(&lib, argv[0], nthreads)) {
+            library_destroy(&lib);
+            return 1;
+        }
+        library_wait(&lib);
+        double const elapsed = now_sec() - start;
+        if (!warmup) {
+            fprintf(out, "scan: %2u threads, %8lu files, %8lu tracks, %8.3f s, %10.0f files/s\n",
+                    nthreads, lib.files, (unsigned long) lib.count, elapsed,
+                    lib.files / elapsed);
+        }
+        library_destroy(&lib);
+        if (warmup) {
+            warmup = 0;
+            nthreads = 0;
+        }
+    }
+    return 0;
+}
+
+
+// Number of messages logged by each thread
+#define BENCH_LOG_CALLS 100000
+
+/**
+ * (internal) Log messages and return the mean time per call in nanoseconds
+ */
+static void* routine_bench_log(void *arg)
+{
+    double *ns_per_call = arg;
+    double const start = now_sec();
+    int i;
+    for (i = 0; i < BENCH_LOG_CALLS; i++) {
+        LOG_INFO("[Bench] Message %d from a logging thread", i);
+    }
+    *ns_per_call = (now_sec() - start) * 1e9 / BENCH_LOG_CALLS;
+    return NULL;
+}
+
+
+/**
+ * Time per log call with an increasing number of logging threads
+ */
+static int bench_log(int argc, char **argv)
+{
+    unsigned const max_threads = argc >= 1 ? atoi(argv[0]) : 8;
+    unsigned nthreads;
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        pthread_t threads[nthreads];
+        double ns_per_call[nthreads];
+        unsigned long written, dropped, written_before, dropped_before;
+        log_stats(&written_before, &dropped_before);
+        if (log_start()) return 1;
+        unsigned i;
+        for (i = 0; i < nthreads; i++) {
+            if (pthread_create(&threads[i], NULL, routine_bench_log, &ns_per_call[i])) {
+                fprintf(stderr, "pthread_create failed\n");
+                return 1;
+            }
+        }
+        double mean = 0, max = 0;
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            mean += ns_per_call[i] / nthreads;
+            if (ns_per_call[i] > max) max = ns_per_call[i];
+        }
+        log_stop();
+        log_stats(&written, &dropped);
+        fprintf(out, "log: %2u threads, %6.1f ns/call mean, %6.1f ns/call slowest thread, "
+                "%8lu written, %8lu dropped\n", nthreads, mean, max,
+                written - written_before, dropped - dropped_before);
+    }
+    return 0;
+}
+
+
+// Number of cold starts of the startup benchmark, and time after which a
+// start which doesn't play is given up
+#define BENCH_STARTUP_RUNS 5
+#define BENCH_STARTUP_TIMEOUT_SEC 10.0
+
+/**
+ * (internal) Start the player with "--play FILE" and time its readiness
+ * and its first sample, which is written when the status page counts a
+ * block. The daemon is then terminated.
+ * Return 0 on success, 1 if it didn't start or play.
+ */
+static int run_bench_startup(const char *player, const char *file_name,
+                             double *ready_sec, double *first_sec)
+{
+    int in[2], outp[2];
+    if (pipe(in) == -1 || pipe(outp) == -1) {
+        perror("pipe");
+        return 1;
+    }
+    double const start = now_sec();
+    pid_t const pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(outp[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(outp[0]);
+        close(outp[1]);
+        execl(player, player, "--play", file_name, (char *) NULL);
+        perror("execl");
+        _exit(127);
+    }
+    close(in[0]);
+    close(outp[1]);
+
+    // The interface prints a line once the daemon is ready
+    FILE *interface = fdopen(outp[0], "r");
+    char line[256];
+    int ret = 1;
+    *ready_sec = *first_sec = 0;
+    while (interface != NULL && fgets(line, sizeof(line), interface) != NULL) {
+        if (!strncmp(line, "Daemon is ready", 15)) {
+            *ready_sec = now_sec() - start;
+            ret = !strcmp(line, "Daemon is ready.\n") ? 0 : 1;
+            break;
+        } else if (strstr(line, "already running") != NULL) {
+            fprintf(stderr, "A daemon is already running, exit it first\n");
+            break;
+        }
+    }
+
+    // The status page of the new daemon tells when the first block is
+    // written
+    player_status_t *status = NULL;
+    while (!ret) {
+        if (status == NULL) status = status_open(0);
+        if (status != NULL) {
+            player_status_t copy;
+            if (status_read(status, &copy) >= 0 && copy.blocks_written) {
+                *first_sec = now_sec() - start;
+                break;
+            }
+        }
+        if (now_sec() - start > BENCH_STARTUP_TIMEOUT_SEC) {
+            fprintf(stderr, "%s didn't play in time\n", file_name);
+            ret = 1;
+        }
+        struct timespec const interval = { 0, 100000 };
+        nanosleep(&interval, NULL);
+    }
+    if (status != NULL) status_close(status, 0);
+
+    // Terminate the daemon and wait for its PID file to go
+    if (write(in[1], "exit\n", 5) == -1) perror("write(exit)");
+    close(in[1]);
+    if (interface != NULL) {
+        while (fgets(line, sizeof(line), interface) != NULL);
+        fclose(interface);
+    } else {
+        close(outp[0]);
+    }
+    waitpid(pid, NULL, 0);
+    double const exiting = now_sec();
+    while (!access("daemon.pid", F_OK) && now_sec() - exiting < BENCH_STARTUP_TIMEOUT_SEC) {
+        struct timespec const interval = { 0, 1000000 };
+        nanosleep(&interval, NULL);
+    }
+    return ret;
+}
+
+
+/**
+ * Time from a cold start of the player to its readiness and to its first
+ * written sample, with the file to play given on the command line
+ */
+static int bench_startup(int argc, char **argv)
+{
+    if (argc < 1 || argc > 2) {
+        fprintf(stderr, "Usage: startup FILE [PLAYER]\n");
+        return 1;
+    }
+    const char *const player = argc >= 2 ? argv[1] : "./player";
+    double ready_sum = 0, first_sum = 0, first_max = 0;
+    int run;
+    for (run = 0; run < BENCH_STARTUP_RUNS; run++) {
+        double ready, first;
+        if (run_bench_startup(player, argv[0], &ready, &first)) return 1;
+        fprintf(out, "startup: run %d, ready after %7.2f ms, first sample after %7.2f ms\n",
+                run + 1, ready * 1e3, first * 1e3);
+        ready_sum += ready;
+        first_sum += first;
+        if (first > first_max) first_max = first;
+    }
+    fprintf(out, "startup: %d runs, ready after %7.2f ms mean, first sample after "
+            "%7.2f ms mean, %7.2f ms slowest\n", BENCH_STARTUP_RUNS,
+            ready_sum * 1e3 / BENCH_STARTUP_RUNS, first_sum * 1e3 / BENCH_STARTUP_RUNS,
+            first_max * 1e3);
+    return 0;
+}
+
+
+// Duration of each status benchmark
+#define BENCH_STATUS_SEC 1.0
+
+/**
+ * State shared by status readers and the writer
+ */
+typedef struct {
+    player_status_t *status;
+    long write_us;
+    int running;
+    unsigned long reads;
+    unsigned long retries;
+    double ns_per_read;
+} bench_status_t;
+
+/**
+ * (internal) Update the status like the playing thread does after each write
+ */
+static void* routine_bench_status_writer(void *arg)
+{
+    bench_status_t *bench = arg;
+    struct timespec const interval = {
+        bench->write_us / 1000000, (bench->write_us % 1000000) * 1000
+    };
+    uint64_t frames = 0;
+    while (__atomic_load_n(&(bench->running), __ATOMIC_RELAXED)) {
+        frames += 1764;
+        playback_clock_update(&(bench->status->clock), frames, 3528, 1);
+        status_begin_update(bench->status);
+        bench->status->blocks_written++;
+        bench->status->bytes_written += 7056;
+        bench->status->buffer_queued = 14112;
+        bench->status->peaks[0] = frames & 0x7fff;
+        bench->status->peaks[1] = frames & 0x7fff;
+        status_end_update(bench->status);
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * (internal) Poll the status as fast as possible
+ */
+static void* routine_bench_status_reader(void *arg)
+{
+    bench_status_t *bench = arg;
+    player_status_t copy;
+    unsigned long reads = 0, retries = 0;
+    double const start = now_sec();
+    double elapsed;
+    do {
+        int i;
+        for (i = 0; i < 1000; i++) {
+            int const r = status_read(bench->status, &copy);
+            if (r > 0) retries += r;
+            playback_clock_position(&(copy.clock), NULL);
+        }
+        reads += 1000;
+        elapsed = now_sec() - start;
+    } while (elapsed < BENCH_STATUS_SEC);
+    bench->reads = reads;
+    bench->retries = retries;
+    bench->ns_per_read = elapsed * 1e9 / reads;
+    return NULL;
+}
+
+
+/**
+ * Cost of a status read with an increasing number of polling readers while
+ * the status is updated every WRITE_US microseconds
+ */
+static int bench_status(int argc, char **argv)
+{
+    unsigned const max_readers = argc >= 1 ? atoi(argv[0]) : 4;
+    long const write_us = argc >= 2 ? atol(argv[1]) : 1000;
+    // A private page, so that a running daemon is not disturbed
+    player_status_t *status = calloc(1, sizeof(player_status_t));
+    if (status == NULL) return 1;
+    playback_clock_reset(&(status->clock), 44100);
+
+    unsigned nreaders;
+    for (nreaders = 1; nreaders <= max_readers; nreaders *= 2) {
+        pthread_t writer, readers[nreaders];
+        bench_status_t benchs[nreaders];
+        bench_status_t writer_bench = { status, write_us, 1, 0, 0, 0 };
+        if (pthread_create(&writer, NULL, routine_bench_status_writer, &writer_bench)) {
+            fprintf(stderr, "pthread_create failed\n");
+            free(status);
+            return 1;
+        }
+        unsigned i;
+        for (i = 0; i < nreaders; i++) {
+            benchs[i] = writer_bench;
+            pthread_create(&readers[i], NULL, routine_bench_status_reader, &benchs[i]);
+        }
+        unsigned long reads = 0, retries = 0;
+        double mean = 0;
+        for (i = 0; i < nreaders; i++) {
+            pthread_join(readers[i], NULL);
+            reads += benchs[i].reads;
+            retries += benchs[i].retries;
+            mean += benchs[i].ns_per_read / nreaders;
+        }
+        __atomic_store_n(&(writer_bench.running), 0, __ATOMIC_RELAXED);
+        pthread_join(writer, NULL);
+        fprintf(out, "status: %2u readers, %6.1f ns/read mean, %12.0f reads/s, "
+                "%8lu retries, %8llu updates\n", nreaders, mean,
+                reads / BENCH_STATUS_SEC, retries,
+                (unsigned long long) status->blocks_written);
+        status->blocks_written = 0;
+    }
+    free(status);
+    return 0;
+}
+
+
+/**
+ * Entry point of the benchmarks
+ */
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        int (*run)(int argc, char **argv);
+        const char *usage;
+    } benchs[] = {
+        { "adpcm", bench_adpcm, "adpcm         frames per second of the ADPCM decoders" },
+        { "eq", bench_eq, "eq            time per frame of 1 to 10 equalizer bands" },
+        { "gain", bench_gain, "gain          cost of the gain stage on 16-bit blocks" },
+        { "kernels", bench_kernels,
+          "kernels       time per sample of every variant of the kernels" },
+        { "levels", bench_levels, "levels        cost of the levels and spectrum tap" },
+        { "log", bench_log, "log [THREADS] time per log call with up to THREADS threads" },
+        { "matrix", bench_matrix, "matrix        time per frame of the channel mixes" },
+        { "playlist", bench_playlist,
+          "playlist [ENTRIES] time to load a playlist and pick its entries" },
+        { "scan", bench_scan, "scan DIR      files per second of a library scan" },
+        { "silence", bench_silence,
+          "silence [SECONDS] time to find silent ends of a one-hour file" },
+        { "startup", bench_startup,
+          "startup FILE [PLAYER] time from a cold start to the first sample of FILE" },
+        { "status", bench_status,
+          "status [READERS [WRITE_US]] cost of polling the status page" },
+        { "stretch", bench_stretch,
+          "stretch       cost of the time-stretch at several speeds" },
+    };
+    size_t const nbenchs = sizeof(benchs) / sizeof(benchs[0]);
+    size_t i;
+
+    if (argc >= 2) {
+        for (i = 0; i < nbenchs; i++) {
+            if (!strcmp(argv[1], benchs[i].name)) {
+                out = fdopen(dup(STDOUT_FILENO), "w");
+                if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+                    perror("Redirecting stdout");
+                    return 1;
+                }
+                int ret = benchs[i].run(argc - 2, argv + 2);
+                fclose(out);
+                return ret;
+            }
+        }
+    }
+    fprintf(stderr, "Usage: %s BENCHMARK [ARGS]\nBenchmarks:\n", argv[0]);
+    for (i = 0; i < nbenchs; i++) {
+        fprintf(stderr, "    %s\n", benchs[i].usage);
+    }
+    return 1;
+}
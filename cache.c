@@ -0,0 +1,359 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/soundcard.h>
+#include "cache.h"
+#include "log.h"
+#include "player.h"
+
+/**
+ * Initialise an empty clip cache
+ */
+int clip_cache_init(clip_cache_t *cache, size_t budget)
+{
+    if (cache == NULL) return 1;
+    memset(cache, 0, sizeof(*cache));
+    cache->budget = budget;
+    int ret = pthread_mutex_init(&(cache->mutex), NULL);
+    if (ret) {
+        LOG_ERROR("pthread_mutex_init failed: %d", ret);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * (internal) Free a clip
+ */
+static void free_clip(clip_t *clip)
+{
+    free(clip->name);
+    free(clip->samples);
+    free(clip);
+}
+
+/**
+ * (internal) Remove a clip from the LRU list. Cache must be locked.
+ */
+static void unlink_clip(clip_cache_t *cache, clip_t *clip)
+{
+    if (clip->prev) clip->prev->next = clip->next;
+    else cache->head = clip->next;
+    if (clip->next) clip->next->prev = clip->prev;
+    else cache->tail = clip->prev;
+    clip->prev = clip->next = NULL;
+    cache->used -= clip->bytes;
+}
+
+/**
+ * (internal) Insert a clip at the head of the LRU list. Cache must be locked.
+ */
+static void push_clip(clip_cache_t *cache, clip_t *clip)
+{
+    clip->prev = NULL;
+    clip->next = cache->head;
+    if (cache->head) cache->head->prev = clip;
+    else cache->tail = clip;
+    cache->head = clip;
+    cache->used += clip->bytes;
+}
+
+/**
+ * (internal) Find a clip by name. Cache must be locked.
+ */
+static clip_t* find_clip(clip_cache_t *cache, const char *name)
+{
+    clip_t *clip;
+    for (clip = cache->head; clip != NULL; clip = clip->next) {
+        if (!strcmp(clip->name, name)) return clip;
+    }
+    return NULL;
+}
+
+/**
+ * Free every clip. No voice may be playing any clip.
+ */
+int clip_cache_destroy(clip_cache_t *cache)
+{
+    if (cache == NULL) return 1;
+    while (cache->head != NULL) {
+        clip_t *clip = cache->head;
+        unlink_clip(cache, clip);
+        free_clip(clip);
+    }
+    int ret = pthread_mutex_destroy(&(cache->mutex));
+    if (ret) {
+        LOG_ERROR("pthread_mutex_destroy failed: %d", ret);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * (internal) Decode the blocks of an opened compressed music file to 16-bit
+ * native-endian samples. Streamed files, of unknown size, don't fit.
+ */
+static int decode_adpcm_clip(music_file_t *info, clip_t *clip, size_t budget)
+{
+    size_t const frame_bytes = info->channels * sizeof(int16_t);
+    if (info->data_size > budget) {
+        LOG_ERROR("Clip exceeds the cache budget.");
+        return 1;
+    }
+    clip->channels = info->channels;
+    clip->sample_rate = info->sample_rate;
+    clip->samples = malloc(info->data_size ? info->data_size : 1);
+    if (clip->samples == NULL) {
+        LOG_ERROR("Couldn't allocate %lu bytes to load the clip.",
+                  (unsigned long) info->data_size);
+        return 2;
+    }
+
+    adpcm_t decoder;
+    memset(&decoder, 0, sizeof(decoder));
+    if (adpcm_init(&decoder, info->encoding, info->channels, info->block_align,
+                   info->block_frames)) {
+        LOG_ERROR("Couldn't allocate the ADPCM decoder.");
+        return 2;
+    }
+    long const frames = adpcm_read(&decoder, info->file, clip->samples,
+                                   info->data_size / frame_bytes);
+    adpcm_destroy(&decoder);
+    if (frames < 0) {
+        LOG_ERROR("fread failed");
+        return 2;
+    }
+    clip->frames = frames;
+    clip->bytes = clip->frames * frame_bytes;
+    return 0;
+}
+
+/**
+ * (internal) Decode the samples of an opened music file to 16-bit
+ * native-endian samples
+ */
+static int decode_clip(music_file_t *info, clip_t *clip, size_t budget)
+{
+    size_t const sample_bytes = info->bits_per_sample / 8;
+    size_t const frame_bytes = sample_bytes * info->channels;
+    if (frame_bytes == 0) return 1;
+    if (info->encoding != WAVE_FORMAT_PCM) return decode_adpcm_clip(info, clip, budget);
+
+    // Read every data byte. data_size may be wrong in streamed files,
+    // so read until the end of file within the budget.
+    size_t const max_bytes = budget / 2 * sample_bytes;
+    size_t size = info->data_size ? info->data_size : 65536;
+    if (size > max_bytes) size = max_bytes;
+    unsigned char *raw = malloc(size);
+    if (raw == NULL) {
+        LOG_ERROR("Couldn't allocate %lu bytes to load the clip.",
+                  (unsigned long) size);
+        return 2;
+    }
+    size_t len = 0;
+    for (;;) {
+        len += fread(raw + len, 1, size - len, info->file);
+        if (len < size) break;
+        if (size >= max_bytes) {
+            LOG_ERROR("Clip exceeds the cache budget.");
+            free(raw);
+            return 1;
+        }
+        size_t new_size = 2 * size > max_bytes ? max_bytes : 2 * size;
+        unsigned char *new_raw = realloc(raw, new_size);
+        if (new_raw == NULL) {
+            LOG_ERROR("Couldn't allocate %lu bytes to load the clip.",
+                      (unsigned long) new_size);
+            free(raw);
+            return 2;
+        }
+        raw = new_raw;
+        size = new_size;
+    }
+    if (ferror(info->file)) {
+        LOG_ERROR("fread failed");
+        free(raw);
+        return 2;
+    }
+
+    clip->frames = len / frame_bytes;
+    clip->channels = info->channels;
+    clip->sample_rate = info->sample_rate;
+    clip->bytes = clip->frames * clip->channels * sizeof(int16_t);
+    clip->samples = malloc(clip->bytes ? clip->bytes : 1);
+    if (clip->samples == NULL) {
+        LOG_ERROR("Couldn't allocate %lu bytes to load the clip.",
+                  (unsigned long) clip->bytes);
+        free(raw);
+        return 2;
+    }
+
+    size_t i;
+    size_t const count = clip->frames * clip->channels;
+    for (i = 0; i < count; i++) {
+        switch (info->oss_format) {
+            case AFMT_U8:
+                clip->samples[i] = (int16_t) ((raw[i] - 128) << 8);
+                break;
+            case AFMT_S8:
+                clip->samples[i] = (int16_t) (((signed char) raw[i]) << 8);
+                break;
+            case AFMT_S16_LE:
+                clip->samples[i] = (int16_t) (raw[2 * i] | raw[2 * i + 1] << 8);
+                break;
+            case AFMT_S16_BE:
+                clip->samples[i] = (int16_t) (raw[2 * i] << 8 | raw[2 * i + 1]);
+                break;
+            default:
+                LOG_ERROR("Unsupported clip sample format.");
+                free(raw);
+                return 1;
+        }
+    }
+    free(raw);
+    return 0;
+}
+
+/**
+ * Decode a music file and store it in the cache under the given name.
+ * Least recently used clips are evicted to keep within the memory budget.
+ */
+int clip_cache_load(clip_cache_t *cache, const char *name, const char *file_name)
+{
+    clip_t *clip = calloc(1, sizeof(clip_t));
+    if (clip == NULL) {
+        LOG_ERROR("Couldn't allocate a clip.");
+        return 2;
+    }
+    clip->cache = cache;
+    clip->name = strdup(name);
+    if (clip->name == NULL) {
+        LOG_ERROR("Couldn't allocate a clip.");
+        free(clip);
+        return 2;
+    }
+
+    music_file_t info;
+    int ret = open_music_file(file_name, &info);
+    if (ret) {
+        free_clip(clip);
+        return ret;
+    }
+    ret = decode_clip(&info, clip, cache->budget);
+    fclose(info.file);
+    if (ret) {
+        free_clip(clip);
+        return ret;
+    }
+
+    pthread_mutex_lock(&(cache->mutex));
+    clip_t *old = find_clip(cache, name);
+    if (old != NULL) {
+        if (old->refcount) {
+            pthread_mutex_unlock(&(cache->mutex));
+            LOG_ERROR("Clip %s is playing, unable to replace it.", name);
+            free_clip(clip);
+            return 1;
+        }
+        unlink_clip(cache, old);
+        free_clip(old);
+    }
+
+    // Evict least recently used clips which are not playing
+    clip_t *victim = cache->tail;
+    while (victim != NULL && cache->used + clip->bytes > cache->budget) {
+        clip_t *prev = victim->prev;
+        if (!victim->refcount) {
+            LOG_INFO("[Cache] Evicting clip %s (%lu bytes)", victim->name,
+                     (unsigned long) victim->bytes);
+            unlink_clip(cache, victim);
+            free_clip(victim);
+            cache->evictions++;
+        }
+        victim = prev;
+    }
+    if (cache->used + clip->bytes > cache->budget) {
+        pthread_mutex_unlock(&(cache->mutex));
+        LOG_ERROR("Clip %s does not fit in the cache budget.", name);
+        free_clip(clip);
+        return 1;
+    }
+    push_clip(cache, clip);
+    LOG_INFO("[Cache] Loaded clip %s: %lu frames, %lu channels, %lu Hz, %lu bytes",
+             name, (unsigned long) clip->frames, (unsigned long) clip->channels,
+             (unsigned long) clip->sample_rate, (unsigned long) clip->bytes);
+    pthread_mutex_unlock(&(cache->mutex));
+    return 0;
+}
+
+/**
+ * Get a clip by name and mark it as used.
+ * Return NULL if the clip is not in the cache.
+ * Call clip_release() when the clip is no longer used.
+ */
+clip_t* clip_cache_acquire(clip_cache_t *cache, const char *name)
+{
+    pthread_mutex_lock(&(cache->mutex));
+    clip_t *clip = find_clip(cache, name);
+    if (clip == NULL) {
+        cache->misses++;
+    } else {
+        cache->hits++;
+        clip->refcount++;
+        // Move to the head of the LRU list
+        unlink_clip(cache, clip);
+        push_clip(cache, clip);
+    }
+    pthread_mutex_unlock(&(cache->mutex));
+    return clip;
+}
+
+/**
+ * Release a clip acquired with clip_cache_acquire()
+ */
+void clip_release(clip_t *clip)
+{
+    clip_cache_t *cache = clip->cache;
+    pthread_mutex_lock(&(cache->mutex));
+    clip->refcount--;
+    pthread_mutex_unlock(&(cache->mutex));
+}
+
+/**
+ * Record the latency between a trigger command and the moment the clip is
+ * heard on the device
+ */
+void clip_cache_record_latency(clip_cache_t *cache, unsigned long latency_us)
+{
+    pthread_mutex_lock(&(cache->mutex));
+    cache->triggers++;
+    cache->latency_sum_us += latency_us;
+    if (latency_us > cache->latency_max_us) {
+        cache->latency_max_us = latency_us;
+    }
+    pthread_mutex_unlock(&(cache->mutex));
+}
+
+/**
+ * Print cache statistics
+ */
+void clip_cache_print_stats(clip_cache_t *cache)
+{
+    pthread_mutex_lock(&(cache->mutex));
+    unsigned count = 0;
+    clip_t *clip;
+    for (clip = cache->head; clip != NULL; clip = clip->next) {
+        count++;
+    }
+    LOG_INFO("[Cache] %u clips, %lu/%lu bytes, %lu hits, %lu misses, %lu evictions",
+             count, (unsigned long) cache->used, (unsigned long) cache->budget,
+             cache->hits, cache->misses, cache->evictions);
+    if (cache->triggers) {
+        LOG_INFO("[Cache] Trigger to sound latency: avg %lu us, max %lu us over %lu triggers",
+                 cache->latency_sum_us / cache->triggers, cache->latency_max_us,
+                 cache->triggers);
+    }
+    pthread_mutex_unlock(&(cache->mutex));
+}
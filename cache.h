@@ -0,0 +1,60 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Default memory budget of the clip cache, in bytes
+#define CLIP_CACHE_BUDGET (16 * 1024 * 1024)
+
+struct clip_cache;
+
+/**
+ * Short sound clip decoded once in memory, as 16-bit native samples
+ */
+typedef struct clip {
+    char *name;
+    int16_t *samples;
+    uint_fast32_t frames;
+    uint_fast32_t channels;
+    uint_fast32_t sample_rate;
+    size_t bytes;
+
+    // Number of voices currently playing this clip
+    unsigned refcount;
+
+    // Owner cache and LRU list, most recently used first
+    struct clip_cache *cache;
+    struct clip *prev;
+    struct clip *next;
+} clip_t;
+
+/**
+ * Clip cache with a LRU eviction policy and a memory budget
+ */
+typedef struct clip_cache {
+    pthread_mutex_t mutex;
+    clip_t *head;
+    clip_t *tail;
+    size_t used;
+    size_t budget;
+
+    // Statistics
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long triggers;
+    unsigned long latency_sum_us;
+    unsigned long latency_max_us;
+} clip_cache_t;
+
+int clip_cache_init(clip_cache_t *cache, size_t budget);
+int clip_cache_destroy(clip_cache_t *cache);
+int clip_cache_load(clip_cache_t *cache, const char *name, const char *file_name);
+clip_t* clip_cache_acquire(clip_cache_t *cache, const char *name);
+void clip_release(clip_t *clip);
+void clip_cache_record_latency(clip_cache_t *cache, unsigned long latency_us);
+void clip_cache_print_stats(clip_cache_t *cache);
+
+#endif /* CACHE_H */
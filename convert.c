@@ -0,0 +1,156 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/soundcard.h>
+#include "convert.h"
+
+
+/**
+ * Prepare the conversion of a stream of in_format samples to floats of the
+ * output, for blocks of at most block_frames input frames.
+ * Return 1 if the format or the channels are not supported or the
+ * allocation failed.
+ */
+int convert_init(convert_t *conv, unsigned in_format, unsigned in_channels, uint32_t in_rate,
+                 unsigned out_channels, uint32_t out_rate, size_t block_frames)
+{
+    memset(conv, 0, sizeof(*conv));
+    conv->decode = kernels_decoder(in_format);
+    if (conv->decode == NULL || in_rate == 0 || out_rate == 0) return 1;
+    conv->in_format = in_format;
+    conv->in_channels = in_channels;
+    conv->in_frame_bytes = in_channels * (in_format == AFMT_U8 || in_format == AFMT_S8 ? 1 : 2);
+    conv->in_rate = in_rate;
+    conv->out_channels = out_channels;
+    conv->out_rate = out_rate;
+    if (in_channels != out_channels) {
+        if (matrix_init_default(&(conv->matrix), in_channels, out_channels)) return 1;
+        conv->mixing = 1;
+    }
+    conv->step = ((uint64_t) in_rate << 32) / out_rate;
+
+    // The frame at the position and the next one stay between two blocks
+    conv->block_frames = block_frames;
+    conv->input_size = block_frames + 2;
+    conv->raw = malloc(block_frames * conv->in_frame_bytes);
+    conv->decoded = malloc(block_frames * in_channels * sizeof(float));
+    conv->input = malloc(conv->input_size * out_channels * sizeof(float));
+    if (!conv->raw || !conv->decoded || !conv->input) {
+        convert_destroy(conv);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Free the buffers of a conversion
+ */
+void convert_destroy(convert_t *conv)
+{
+    free(conv->raw);
+    free(conv->decoded);
+    free(conv->input);
+    conv->raw = NULL;
+    conv->decoded = conv->input = NULL;
+    conv->input_frames = 0;
+}
+
+
+/**
+ * Number of input frames which can be pushed
+ */
+size_t convert_room(convert_t const *conv)
+{
+    size_t const room = conv->input_size - conv->input_frames;
+    return room < conv->block_frames ? room : conv->block_frames;
+}
+
+
+/**
+ * Number of input frames to push before frames output frames can be
+ * pulled, at most the room for them
+ */
+size_t convert_needed(convert_t const *conv, size_t frames)
+{
+    if (frames == 0) return 0;
+    // A frame between two input frames needs both
+    uint64_t const last = conv->pos + (uint64_t) (frames - 1) * conv->step;
+    uint64_t const needed = (last >> 32) + ((last & 0xffffffff) ? 2 : 1);
+    if (needed <= conv->input_frames) return 0;
+    size_t const room = convert_room(conv);
+    return needed - conv->input_frames < room ? needed - conv->input_frames : room;
+}
+
+
+/**
+ * Append input frames, as many as there is room for.
+ * Return the number of frames which were consumed.
+ */
+size_t convert_push(convert_t *conv, void const *in, size_t frames)
+{
+    if (frames > convert_room(conv)) frames = convert_room(conv);
+    float *const dest = conv->input + conv->input_frames * conv->out_channels;
+    if (conv->mixing) {
+        conv->decode->fn(conv->decoded, in, frames * conv->in_channels);
+        matrix_apply(&(conv->matrix), dest, conv->decoded, frames);
+    } else {
+        conv->decode->fn(dest, in, frames * conv->in_channels);
+    }
+    conv->input_frames += frames;
+    return frames;
+}
+
+
+/**
+ * Get up to frames output frames. Fewer frames are returned when more
+ * input is needed.
+ */
+size_t convert_pull(convert_t *conv, float *out, size_t frames)
+{
+    unsigned const channels = conv->out_channels;
+    float *restrict o = out;
+    size_t done;
+    for (done = 0; done < frames; done++) {
+        size_t const i = conv->pos >> 32;
+        uint32_t const frac = conv->pos & 0xffffffff;
+        if (i >= conv->input_frames || (frac && i + 1 == conv->input_frames)) break;
+        float const *a = conv->input + i * channels;
+        unsigned c;
+        if (frac == 0) {
+            memcpy(o + done * channels, a, channels * sizeof(float));
+        } else {
+            float const t = frac * (1.0f / 4294967296.0f);
+            float const *b = a + channels;
+            for (c = 0; c < channels; c++) {
+                o[done * channels + c] = a[c] + (b[c] - a[c]) * t;
+            }
+        }
+        conv->pos += conv->step;
+    }
+
+    // Drop the frames before the position
+    size_t drop = conv->pos >> 32;
+    if (drop > conv->input_frames) drop = conv->input_frames;
+    if (drop) {
+        memmove(conv->input, conv->input + drop * channels,
+                (conv->input_frames - drop) * channels * sizeof(float));
+        conv->input_frames -= drop;
+        conv->pos -= (uint64_t) drop << 32;
+    }
+    return done;
+}
+
+
+/**
+ * Number of output frames which can be pulled without pushing more input
+ */
+size_t convert_pending(convert_t const *conv)
+{
+    // Frames before the last input frame, and the one right on it
+    if (conv->input_frames == 0) return 0;
+    uint64_t const end = (uint64_t) (conv->input_frames - 1) << 32;
+    if (conv->pos > end) return 0;
+    return (end - conv->pos) / conv->step + 1;
+}
@@ -0,0 +1,55 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kernels.h"
+#include "matrix.h"
+
+/**
+ * Conversion of a stream to the format of the output: its samples are
+ * decoded to floats, its channels are mixed with a matrix and its rate is
+ * converted by linear interpolation, each only if it differs.
+ *
+ * Frames are pushed in blocks in the input format and pulled as
+ * interleaved floats of the output.
+ */
+typedef struct {
+    // Input format, and the kernel which decodes its samples
+    unsigned in_format;
+    unsigned in_channels;
+    unsigned in_frame_bytes;
+    uint32_t in_rate;
+    kernel_decoder_t const *decode;
+    // Output channels and rate, and the mix of the input channels
+    unsigned out_channels;
+    uint32_t out_rate;
+    int mixing;
+    matrix_t matrix;
+
+    // Bytes of an input block, which the caller reads into, and its frames
+    // as floats
+    unsigned char *raw;
+    float *decoded;
+    size_t block_frames;
+
+    // Input frames at the output channels which wait for the rate
+    // conversion. pos is the position of the next output frame in them and
+    // step the increment per output frame, in 32.32 fixed point.
+    float *input;
+    size_t input_frames;
+    size_t input_size;
+    uint64_t pos;
+    uint64_t step;
+} convert_t;
+
+int convert_init(convert_t *conv, unsigned in_format, unsigned in_channels, uint32_t in_rate,
+                 unsigned out_channels, uint32_t out_rate, size_t block_frames);
+void convert_destroy(convert_t *conv);
+size_t convert_room(convert_t const *conv);
+size_t convert_needed(convert_t const *conv, size_t frames);
+size_t convert_push(convert_t *conv, void const *in, size_t frames);
+size_t convert_pull(convert_t *conv, float *out, size_t frames);
+size_t convert_pending(convert_t const *conv);
+
+#endif /* CONVERT_H */
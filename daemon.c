@@ -1,11 +1,15 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include "daemon.h"
 
@@ -157,12 +161,88 @@ int daemon_create_pid_file(const char *pidfile)
 }
 
 /**
- * Call all other functions
+ * Tell the service manager that the daemon is ready, if it set
+ * NOTIFY_SOCKET like systemd does. Names which start with '@' are in the
+ * abstract namespace.
+ */
+static void daemon_notify_socket(const char *state)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (path == NULL || (path[0] != '/' && path[0] != '@')) {
+        return;
+    }
+    struct sockaddr_un addr;
+    size_t const len = strlen(path);
+    if (len >= sizeof(addr.sun_path)) {
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') {
+        addr.sun_path[0] = 0;
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("socket(notify)");
+        return;
+    }
+    if (sendto(fd, state, strlen(state), 0, (struct sockaddr *) &addr,
+               offsetof(struct sockaddr_un, sun_path) + len) == -1) {
+        perror("sendto(notify)");
+    }
+    close(fd);
+}
+
+/**
+ * Tell the process which started the daemon that it is ready, or that it
+ * failed with a non-zero status, and close the readiness pipe
+ */
+void daemon_notify_ready(int ready_fd, unsigned char status)
+{
+    if (status == 0) {
+        char state[64];
+        snprintf(state, sizeof(state), "READY=1\nMAINPID=%d", (int) getpid());
+        daemon_notify_socket(state);
+    }
+    if (ready_fd == -1) {
+        return;
+    }
+    if (write(ready_fd, &status, 1) != 1) {
+        perror("write(ready)");
+    }
+    close(ready_fd);
+}
+
+/**
+ * Wait until the daemon is ready, for as long as it takes: the pipe ends
+ * when the daemon exits, so it can't be waited for forever
+ * @return 0 when it is ready, its status if it failed, -1 if it exited
+ * without telling
+ */
+int daemon_wait_ready(int ready_fd)
+{
+    unsigned char status;
+    ssize_t ret;
+    do {
+        ret = read(ready_fd, &status, 1);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) perror("read(ready)");
+    close(ready_fd);
+    return ret == 1 ? status : -1;
+}
+
+/**
+ * Call all other functions.
+ * ready_fd is set to the end of a pipe which tells when the daemon is
+ * ready: the daemon writes to it with daemon_notify_ready() and the parent
+ * reads it with daemon_wait_ready(). It is -1 if a daemon was running.
  * Return 0 for the daemon, 1 for the parent, -1 if fork failed.
  */
 int daemonize(const char* dirpath, const char* lockfile,
-              const char *logfile, const char *pidfile)
+              const char *logfile, const char *pidfile, int *ready_fd)
 {
+    *ready_fd = -1;
     // Try to lock file to see if there already is a daemon
     int lockfd = daemon_lock(lockfile);
     if (lockfd == -1) {
@@ -173,9 +253,20 @@ int daemonize(const char* dirpath, const char* lockfile,
     }
 
     // Fork
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        return -1;
+    }
     int ret = daemon_fork();
-    if (ret == -1) return -1;
-    else if (ret == 0) {
+    if (ret == -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    close(pipefd[ret == 0 ? 0 : 1]);
+    *ready_fd = pipefd[ret == 0 ? 1 : 0];
+    if (ret == 0) {
         // Set up daemon-specific things
         // Set current working directory
         if (dirpath != NULL && chdir(dirpath) == -1) {
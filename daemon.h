@@ -6,7 +6,9 @@ int daemon_lock(const char* lockfile);
 int daemon_new_session();
 int daemon_dissociate_term(const char *logfile);
 int daemon_create_pid_file(const char *pidfile);
+void daemon_notify_ready(int ready_fd, unsigned char status);
+int daemon_wait_ready(int ready_fd);
 int daemonize(const char* dirpath, const char* lockfile,
-              const char *logfile, const char *pidfile);
+              const char *logfile, const char *pidfile, int *ready_fd);
 
 #endif /* DAEMON_H */
@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include "dsp.h"
+#include "kernels.h"
+
+// Samples are processed as floats between -1 and 1. Conversions and gains
+// run the best kernels of the CPU, which streams select once instead.
+
+
+/**
+ * Start a gain at a value, without ramp
+ */
+void dsp_gain_init(dsp_gain_t *gain, float value)
+{
+    gain->current = gain->target = value;
+    gain->step = 0;
+}
+
+
+/**
+ * Move a gain to a new target over ramp_frames frames
+ */
+void dsp_gain_set(dsp_gain_t *gain, float target, unsigned ramp_frames)
+{
+    gain->target = target;
+    if (ramp_frames == 0) {
+        gain->current = target;
+        gain->step = 0;
+    } else {
+        gain->step = (target - gain->current) / ramp_frames;
+    }
+}
+
+
+/**
+ * Multiply interleaved samples by a gain, following its ramp
+ */
+void dsp_gain_apply(dsp_gain_t *gain, float *samples, size_t frames, unsigned channels)
+{
+    kernels_gainer(channels)->fn(gain, samples, frames, channels);
+}
+
+
+/**
+ * Mix in into out with equal-power curves: out fades out and in fades in
+ * from frame pos of a crossfade of length frames. After the crossfade, out
+ * only holds in.
+ */
+void dsp_crossfade(float *out, float const *in, size_t frames, unsigned channels,
+                   size_t pos, size_t length)
+{
+    float *restrict o = out;
+    float const *restrict s = in;
+    // The gains are the cosine and the sine of an angle which goes from 0 to
+    // pi/2, rotated by a constant step from frame to frame
+    double const step = 1.57079632679489661923 / length;
+    double const angle = pos * step;
+    float c = cos(angle), d = sin(angle);
+    float const cs = cos(step), ds = sin(step);
+    size_t f;
+    for (f = 0; f < frames; f++) {
+        if (pos + f >= length) {
+            c = 0;
+            d = 1;
+        }
+        unsigned ch;
+        for (ch = 0; ch < channels; ch++) {
+            size_t const i = f * channels + ch;
+            o[i] = o[i] * c + s[i] * d;
+        }
+        float const next_c = c * cs - d * ds;
+        d = d * cs + c * ds;
+        c = next_c;
+    }
+}
+
+
+/**
+ * Convert samples in an OSS format to floats.
+ * Return 1 if the format is not supported.
+ */
+int dsp_decode(float *out, void const *in, size_t samples, unsigned oss_format)
+{
+    kernel_decoder_t const *decoder = kernels_decoder(oss_format);
+    if (decoder == NULL) return 1;
+    decoder->fn(out, in, samples);
+    return 0;
+}
+
+
+/**
+ * Convert floats to samples in an OSS format, clipping them.
+ * Return 1 if the format is not supported.
+ */
+int dsp_encode(void *out, float const *in, size_t samples, unsigned oss_format)
+{
+    kernel_encoder_t const *encoder = kernels_encoder(oss_format);
+    if (encoder == NULL) return 1;
+    encoder->fn(out, in, samples);
+    return 0;
+}
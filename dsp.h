@@ -0,0 +1,24 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+
+/**
+ * Gain applied to a stream. Changes move linearly from the current value
+ * to the target over a ramp so that they don't click.
+ */
+typedef struct {
+    float current;
+    float target;
+    float step;
+} dsp_gain_t;
+
+void dsp_gain_init(dsp_gain_t *gain, float value);
+void dsp_gain_set(dsp_gain_t *gain, float target, unsigned ramp_frames);
+void dsp_gain_apply(dsp_gain_t *gain, float *samples, size_t frames, unsigned channels);
+void dsp_crossfade(float *out, float const *in, size_t frames, unsigned channels,
+                   size_t pos, size_t length);
+int dsp_decode(float *out, void const *in, size_t samples, unsigned oss_format);
+int dsp_encode(void *out, float const *in, size_t samples, unsigned oss_format);
+
+#endif /* DSP_H */
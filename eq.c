@@ -0,0 +1,299 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include "eq.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Each filter runs over the whole block before the next one, so that its
+// coefficients and its state stay in registers. Channels of a frame are
+// independent and are processed together, 4 per SSE2 vector.
+
+static const char *const type_names[] = {
+    "off", "peak", "lowshelf", "highshelf", "lowpass", "highpass"
+};
+
+// Coefficients of a filter which doesn't change its input
+static const eq_coefs_t identity = { 1, 0, 0, 0, 0 };
+
+// Denormal floats are very slow to compute with, and the state of a filter
+// decays through them after the end of a sound. SSE2 flushes them to zero
+// while the chain runs, and the scalar code flushes the states which fall
+// below this magnitude at each sample.
+#define EQ_DENORMAL 1e-15f
+
+// Flush to zero and denormals are zero bits of the MXCSR register
+#define EQ_MXCSR_FTZ_DAZ 0x8040
+
+
+/**
+ * (internal) Compute the coefficients of a band at a sample rate, from the
+ * Audio EQ Cookbook of Robert Bristow-Johnson.
+ * Bands at or above the Nyquist frequency don't filter anything.
+ */
+static eq_coefs_t band_coefs(eq_band_t const *band, unsigned sample_rate)
+{
+    if (band->type == EQ_OFF || sample_rate == 0 || band->freq >= sample_rate / 2.0) {
+        return identity;
+    }
+    double const w0 = 2 * 3.14159265358979323846 * band->freq / sample_rate;
+    double const cw = cos(w0);
+    double const alpha = sin(w0) / (2 * band->q);
+    double const a = pow(10, band->gain / 40);
+    double const sa = 2 * sqrt(a) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+    switch (band->type) {
+        case EQ_PEAK:
+            b0 = 1 + alpha * a;
+            b1 = -2 * cw;
+            b2 = 1 - alpha * a;
+            a0 = 1 + alpha / a;
+            a1 = -2 * cw;
+            a2 = 1 - alpha / a;
+            break;
+        case EQ_LOWSHELF:
+            b0 = a * ((a + 1) - (a - 1) * cw + sa);
+            b1 = 2 * a * ((a - 1) - (a + 1) * cw);
+            b2 = a * ((a + 1) - (a - 1) * cw - sa);
+            a0 = (a + 1) + (a - 1) * cw + sa;
+            a1 = -2 * ((a - 1) + (a + 1) * cw);
+            a2 = (a + 1) + (a - 1) * cw - sa;
+            break;
+        case EQ_HIGHSHELF:
+            b0 = a * ((a + 1) + (a - 1) * cw + sa);
+            b1 = -2 * a * ((a - 1) + (a + 1) * cw);
+            b2 = a * ((a + 1) + (a - 1) * cw - sa);
+            a0 = (a + 1) - (a - 1) * cw + sa;
+            a1 = 2 * ((a - 1) - (a + 1) * cw);
+            a2 = (a + 1) - (a - 1) * cw - sa;
+            break;
+        case EQ_LOWPASS:
+            b0 = b2 = (1 - cw) / 2;
+            b1 = 1 - cw;
+            a0 = 1 + alpha;
+            a1 = -2 * cw;
+            a2 = 1 - alpha;
+            break;
+        case EQ_HIGHPASS:
+            b0 = b2 = (1 + cw) / 2;
+            b1 = -(1 + cw);
+            a0 = 1 + alpha;
+            a1 = -2 * cw;
+            a2 = 1 - alpha;
+            break;
+        default:
+            return identity;
+    }
+    eq_coefs_t const coefs = { b0 / a0, b1 / a0, b2 / a0, a1 / a0, a2 / a0 };
+    return coefs;
+}
+
+
+/**
+ * (internal) Start moving the coefficients of a filter to the ones of its
+ * band, over ramp_frames frames
+ */
+static void start_ramp(eq_filter_t *filter, unsigned sample_rate, unsigned ramp_frames)
+{
+    filter->target = band_coefs(&(filter->band), sample_rate);
+    if (!filter->active) {
+        // A new filter starts from the identity, with an empty state
+        filter->coefs = identity;
+        memset(filter->z1, 0, sizeof(filter->z1));
+        memset(filter->z2, 0, sizeof(filter->z2));
+        filter->active = 1;
+    }
+    if (ramp_frames == 0) {
+        filter->coefs = filter->target;
+        filter->ramp_left = 0;
+        return;
+    }
+    filter->step.b0 = (filter->target.b0 - filter->coefs.b0) / ramp_frames;
+    filter->step.b1 = (filter->target.b1 - filter->coefs.b1) / ramp_frames;
+    filter->step.b2 = (filter->target.b2 - filter->coefs.b2) / ramp_frames;
+    filter->step.a1 = (filter->target.a1 - filter->coefs.a1) / ramp_frames;
+    filter->step.a2 = (filter->target.a2 - filter->coefs.a2) / ramp_frames;
+    filter->ramp_left = ramp_frames;
+}
+
+
+/**
+ * Configure the chain for a new stream. ramp_frames is the duration of
+ * later changes. When the sample rate changes, coefficients are computed
+ * for it without ramp and filters start with an empty state, otherwise the
+ * filters go on as they are.
+ */
+void eq_set_rate(eq_t *eq, unsigned sample_rate, unsigned ramp_frames)
+{
+    eq->ramp_frames = ramp_frames;
+    if (sample_rate == eq->sample_rate) return;
+    eq->sample_rate = sample_rate;
+    unsigned i;
+    for (i = 0; i < EQ_MAX_BANDS; i++) {
+        eq_filter_t *filter = &(eq->filters[i]);
+        filter->active = 0;
+        if (filter->band.type != EQ_OFF) {
+            start_ramp(filter, sample_rate, 0);
+        }
+    }
+}
+
+
+/**
+ * Change a band of the chain, EQ_OFF to remove it. The filter moves to its
+ * new response over a ramp.
+ * Return 1 if the index or the settings are invalid.
+ */
+int eq_set_band(eq_t *eq, unsigned index, eq_band_t const *band)
+{
+    if (index >= EQ_MAX_BANDS || band->type < EQ_OFF || band->type > EQ_HIGHPASS) return 1;
+    if (band->type != EQ_OFF && (!(band->freq > 0) || !(band->q > 0) ||
+                                 fabsf(band->gain) > 48)) {
+        return 1;
+    }
+    eq_filter_t *filter = &(eq->filters[index]);
+    if (band->type == EQ_OFF && !filter->active) {
+        filter->band.type = EQ_OFF;
+        return 0;
+    }
+    filter->band = *band;
+    if (eq->sample_rate) {
+        start_ramp(filter, eq->sample_rate, eq->ramp_frames);
+    }
+    return 0;
+}
+
+
+/**
+ * (internal) Run a filter with constant coefficients over frames frames of
+ * interleaved samples, of which the first count channels are filtered
+ */
+static void run_filter(eq_filter_t *filter, float *samples, size_t frames,
+                       unsigned channels, unsigned count)
+{
+    float *restrict s = samples;
+    eq_coefs_t const k = filter->coefs;
+    unsigned c = 0;
+    size_t f;
+#ifdef __SSE2__
+    __m128 const b0 = _mm_set1_ps(k.b0), b1 = _mm_set1_ps(k.b1), b2 = _mm_set1_ps(k.b2);
+    __m128 const a1 = _mm_set1_ps(k.a1), a2 = _mm_set1_ps(k.a2);
+    for (; c + 4 <= count; c += 4) {
+        __m128 z1 = _mm_loadu_ps(filter->z1 + c);
+        __m128 z2 = _mm_loadu_ps(filter->z2 + c);
+        for (f = 0; f < frames; f++) {
+            float *const p = s + f * channels + c;
+            __m128 const x = _mm_loadu_ps(p);
+            __m128 const y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+            z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+            z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+            _mm_storeu_ps(p, y);
+        }
+        _mm_storeu_ps(filter->z1 + c, z1);
+        _mm_storeu_ps(filter->z2 + c, z2);
+    }
+    if (c + 2 <= count) {
+        // Pairs of channels, like stereo, use the low half of a vector
+        __m128 z1 = _mm_castpd_ps(_mm_load_sd((double const *) (filter->z1 + c)));
+        __m128 z2 = _mm_castpd_ps(_mm_load_sd((double const *) (filter->z2 + c)));
+        for (f = 0; f < frames; f++) {
+            float *const p = s + f * channels + c;
+            __m128 const x = _mm_castpd_ps(_mm_load_sd((double const *) p));
+            __m128 const y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+            z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+            z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+            _mm_store_sd((double *) p, _mm_castps_pd(y));
+        }
+        _mm_store_sd((double *) (filter->z1 + c), _mm_castps_pd(z1));
+        _mm_store_sd((double *) (filter->z2 + c), _mm_castps_pd(z2));
+        c += 2;
+    }
+#endif
+    for (; c < count; c++) {
+        float z1 = filter->z1[c], z2 = filter->z2[c];
+        for (f = 0; f < frames; f++) {
+            float const x = s[f * channels + c];
+            float const y = k.b0 * x + z1;
+            z1 = k.b1 * x - k.a1 * y + z2;
+            z2 = k.b2 * x - k.a2 * y;
+#ifndef __SSE2__
+            if (fabsf(z1) < EQ_DENORMAL) z1 = 0;
+            if (fabsf(z2) < EQ_DENORMAL) z2 = 0;
+#endif
+            s[f * channels + c] = y;
+        }
+        filter->z1[c] = z1;
+        filter->z2[c] = z2;
+    }
+}
+
+
+/**
+ * Filter interleaved samples through every band of the chain.
+ * Channels after the first EQ_MAX_CHANNELS ones are not filtered.
+ */
+void eq_process(eq_t *eq, float *samples, size_t frames, unsigned channels)
+{
+    unsigned const count = channels < EQ_MAX_CHANNELS ? channels : EQ_MAX_CHANNELS;
+#ifdef __SSE2__
+    unsigned const csr = _mm_getcsr();
+    _mm_setcsr(csr | EQ_MXCSR_FTZ_DAZ);
+#endif
+    unsigned i;
+    for (i = 0; i < EQ_MAX_BANDS; i++) {
+        eq_filter_t *filter = &(eq->filters[i]);
+        if (!filter->active) continue;
+
+        // Coefficients change from frame to frame during a ramp
+        size_t f = 0;
+        for (; f < frames && filter->ramp_left > 0; f++) {
+            filter->coefs.b0 += filter->step.b0;
+            filter->coefs.b1 += filter->step.b1;
+            filter->coefs.b2 += filter->step.b2;
+            filter->coefs.a1 += filter->step.a1;
+            filter->coefs.a2 += filter->step.a2;
+            if (--filter->ramp_left == 0) {
+                filter->coefs = filter->target;
+            }
+            run_filter(filter, samples + f * channels, 1, channels, count);
+        }
+        if (f < frames) {
+            run_filter(filter, samples + f * channels, frames - f, channels, count);
+        }
+
+        // Removed bands stop once they reached the identity
+        if (filter->band.type == EQ_OFF && filter->ramp_left == 0) {
+            filter->active = 0;
+        }
+    }
+#ifdef __SSE2__
+    _mm_setcsr(csr);
+#endif
+}
+
+
+/**
+ * Get a filter type from its name, -1 if unknown
+ */
+int eq_parse_type(const char *name)
+{
+    int type;
+    for (type = EQ_OFF; type <= EQ_HIGHPASS; type++) {
+        if (!strcasecmp(name, type_names[type])) return type;
+    }
+    return -1;
+}
+
+
+/**
+ * Get the name of a filter type
+ */
+const char* eq_type_name(int type)
+{
+    if (type < EQ_OFF || type > EQ_HIGHPASS) return "?";
+    return type_names[type];
+}
@@ -0,0 +1,66 @@
+#ifndef EQ_H
+#define EQ_H
+
+#include <stddef.h>
+
+// Number of filters in the chain, and of channels which are filtered
+#define EQ_MAX_BANDS 10
+#define EQ_MAX_CHANNELS 8
+
+// Filter types
+#define EQ_OFF 0
+#define EQ_PEAK 1
+#define EQ_LOWSHELF 2
+#define EQ_HIGHSHELF 3
+#define EQ_LOWPASS 4
+#define EQ_HIGHPASS 5
+
+/**
+ * Settings of a band: center or cutoff frequency in Hz, gain in dB for
+ * peaks and shelves, and quality factor
+ */
+typedef struct {
+    int type;
+    float freq;
+    float gain;
+    float q;
+} eq_band_t;
+
+/**
+ * Normalized biquad coefficients, a0 being 1
+ */
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} eq_coefs_t;
+
+/**
+ * Biquad filter of a band, in transposed direct form II. New coefficients
+ * are reached by linear steps over a ramp so that changes don't click.
+ */
+typedef struct {
+    eq_band_t band;
+    int active;
+    eq_coefs_t coefs;
+    eq_coefs_t target;
+    eq_coefs_t step;
+    unsigned ramp_left;
+    float z1[EQ_MAX_CHANNELS];
+    float z2[EQ_MAX_CHANNELS];
+} eq_filter_t;
+
+/**
+ * Chain of filters applied to a stream. A zeroed chain has no band.
+ */
+typedef struct {
+    unsigned sample_rate;
+    unsigned ramp_frames;
+    eq_filter_t filters[EQ_MAX_BANDS];
+} eq_t;
+
+void eq_set_rate(eq_t *eq, unsigned sample_rate, unsigned ramp_frames);
+int eq_set_band(eq_t *eq, unsigned index, eq_band_t const *band);
+void eq_process(eq_t *eq, float *samples, size_t frames, unsigned channels);
+int eq_parse_type(const char *name);
+const char* eq_type_name(int type);
+
+#endif /* EQ_H */
@@ -0,0 +1,709 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/soundcard.h>
+#include "fanout.h"
+#include "kernels.h"
+#include "log.h"
+#include "trace.h"
+
+// Size of the ring of a device, and fill kept by the drift correction, in
+// output blocks. The ring is emptied down to the target when it gets more
+// than half full, after a stall of the device.
+#define FANOUT_RING_BLOCKS 8
+#define FANOUT_TARGET_BLOCKS 2
+
+// Drift correction: weight of the last fill in its average, and change of
+// the ratio when the average is a whole target above or below it
+#define FANOUT_FILL_SMOOTHING 0.02
+#define FANOUT_DRIFT_GAIN 0.02
+
+// Number of blocks over which the fill is averaged, without correction,
+// after playback starts. The average is the fill kept afterwards, so that
+// only drift is corrected and not how the writes of the devices line up.
+#define FANOUT_SETTLE_BLOCKS 25
+
+// Longest wait of a writer for room in its device, after which a copy
+// gives up its block and a closing device the frames it holds, and of the
+// playing thread for room in the ring of the main device, after which the
+// oldest frames are dropped
+#define FANOUT_WRITE_TIMEOUT_MSEC 500
+
+// Longest wait for a closing device to play the frames it holds
+#define FANOUT_DRAIN_MSEC 2000
+
+
+/**
+ * (internal) Monotonic time in nanoseconds
+ */
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * (internal) Monotonic time in msec milliseconds, for timed waits on the
+ * condition of a device
+ */
+static struct timespec deadline(unsigned msec)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += msec / 1000;
+    ts.tv_nsec += (long) (msec % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+
+/**
+ * Initialise a set of devices, which is empty
+ */
+void fanout_init(fanout_t *fanout)
+{
+    memset(fanout, 0, sizeof(*fanout));
+}
+
+
+/**
+ * (internal) Number of frames of input the resampler needs for frames
+ * output frames, besides those it holds
+ */
+static size_t frames_needed(fanout_device_t const *dev, size_t frames)
+{
+    size_t const last = (size_t) (dev->phase + (frames - 1) * dev->ratio) + 2;
+    return last > dev->in_frames ? last - dev->in_frames : 0;
+}
+
+
+/**
+ * (internal) Number of output frames, up to frames, the resampler can
+ * produce with the input it holds
+ */
+static size_t frames_available(fanout_device_t const *dev, size_t frames)
+{
+    if (dev->in_frames < 2) return 0;
+    size_t n = (size_t) ((dev->in_frames - 2 - dev->phase) / dev->ratio) + 1;
+    if (n > frames) n = frames;
+    while (n > 0 && (size_t) (dev->phase + (n - 1) * dev->ratio) + 2 > dev->in_frames) n--;
+    return n;
+}
+
+
+/**
+ * (internal) Resample frames output frames from the input with linear
+ * interpolation, and drop the input frames which are not needed anymore
+ */
+static void resample(fanout_device_t *dev, size_t frames)
+{
+    unsigned const channels = dev->channels;
+    if (dev->ratio == 1 && dev->phase == 0) {
+        memcpy(dev->out, dev->in, frames * channels * sizeof(float));
+    } else {
+        size_t k;
+        for (k = 0; k < frames; k++) {
+            double const pos = dev->phase + k * dev->ratio;
+            size_t const i = (size_t) pos;
+            float const frac = pos - i;
+            float const *a = dev->in + i * channels;
+            unsigned c;
+            for (c = 0; c < channels; c++) {
+                dev->out[k * channels + c] = a[c] + (a[channels + c] - a[c]) * frac;
+            }
+        }
+    }
+    double const end = dev->phase + frames * dev->ratio;
+    size_t drop = (size_t) end;
+    if (drop > dev->in_frames) drop = dev->in_frames;
+    memmove(dev->in, dev->in + drop * channels,
+            (dev->in_frames - drop) * channels * sizeof(float));
+    dev->in_frames -= drop;
+    dev->phase = end - drop;
+}
+
+
+/**
+ * (internal) Move frames from the ring to the input of the resampler.
+ * Mutex must be locked.
+ */
+static void take_frames(fanout_device_t *dev, size_t frames)
+{
+    unsigned const channels = dev->channels;
+    float *dest = dev->in + dev->in_frames * channels;
+    size_t const first = dev->ring_frames - dev->read_pos < frames ?
+        dev->ring_frames - dev->read_pos : frames;
+    memcpy(dest, dev->ring + dev->read_pos * channels, first * channels * sizeof(float));
+    memcpy(dest + first * channels, dev->ring, (frames - first) * channels * sizeof(float));
+    dev->read_pos = (dev->read_pos + frames) % dev->ring_frames;
+    dev->fill -= frames;
+    dev->in_frames += frames;
+}
+
+
+/**
+ * (internal) Follow the fill of the ring with the resampling ratio, or
+ * drop frames when the device is far behind. Mutex must be locked.
+ * The fill is measured as if the last block had been pushed frame by frame
+ * since it came, or else it would step by a block whenever the writes of
+ * the main device and of this one cross.
+ */
+static void correct_drift(fanout_device_t *dev)
+{
+    if (dev->fill > dev->ring_frames / 2) {
+        size_t const skip = dev->fill - dev->target_fill;
+        dev->read_pos = (dev->read_pos + skip) % dev->ring_frames;
+        dev->fill -= skip;
+        dev->settle_blocks = 0;
+        dev->resyncs++;
+        LOG_RATELIMITED(LOG_LEVEL_WARNING, "%s fell behind, skipping %lu frames",
+                        dev->path, (unsigned long) skip);
+    }
+    double const since_push = (now_ns() - dev->push_ns) * 1e-9 * dev->sample_rate;
+    double const fill = (double) dev->fill - dev->push_frames +
+        (since_push < dev->push_frames ? since_push : dev->push_frames);
+    if (dev->settle_blocks < FANOUT_SETTLE_BLOCKS) {
+        dev->settle_blocks++;
+        dev->avg_fill = dev->settle_blocks == 1 ? fill :
+            dev->avg_fill + (fill - dev->avg_fill) / dev->settle_blocks;
+        dev->setpoint = dev->avg_fill;
+        dev->ratio = 1;
+        return;
+    }
+    dev->avg_fill += (fill - dev->avg_fill) * FANOUT_FILL_SMOOTHING;
+    double ratio = 1 + FANOUT_DRIFT_GAIN * (dev->avg_fill - dev->setpoint) /
+        dev->target_fill;
+    if (ratio > 1 + FANOUT_MAX_DRIFT) ratio = 1 + FANOUT_MAX_DRIFT;
+    if (ratio < 1 - FANOUT_MAX_DRIFT) ratio = 1 - FANOUT_MAX_DRIFT;
+    dev->ratio = ratio;
+}
+
+
+/**
+ * (internal) Write bytes of the encoded block with non-blocking writes,
+ * polling for room in the device for at most FANOUT_WRITE_TIMEOUT_MSEC at a
+ * time. A copy gives up the block when its device stalls that long, the
+ * main device only when it is closing. The rest of the block is dropped
+ * when the device is reset meanwhile.
+ * Return the number of bytes written, -1 if the device failed.
+ */
+static ssize_t write_device(fanout_device_t *dev, size_t bytes, unsigned resets)
+{
+    size_t const frame_bytes = dev->device_channels * dev->sample_bytes;
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t const ret = write(dev->fd, dev->buf + done, bytes - done);
+        if (ret == -1 && errno != EAGAIN && errno != EINTR) return -1;
+        if (ret > 0) {
+            done += ret;
+            pthread_mutex_lock(&(dev->mutex));
+            dev->writing = (bytes - done + frame_bytes - 1) / frame_bytes;
+            int const reset = dev->resets != resets;
+            pthread_cond_broadcast(&(dev->cond));
+            pthread_mutex_unlock(&(dev->mutex));
+            if (reset) break;
+            continue;
+        }
+
+        pthread_mutex_lock(&(dev->mutex));
+        dev->full = 1;
+        pthread_mutex_unlock(&(dev->mutex));
+        struct pollfd pfd;
+        pfd.fd = dev->fd;
+        pfd.events = POLLOUT;
+        TRACE_BEGIN("output_poll");
+        int const ready = poll(&pfd, 1, FANOUT_WRITE_TIMEOUT_MSEC);
+        TRACE_END("output_poll");
+        if (ready == -1 && errno != EINTR) return -1;
+        if (ready != 0) continue;
+        pthread_mutex_lock(&(dev->mutex));
+        dev->stalls++;
+        int const cut = !dev->primary || dev->closing || dev->resets != resets;
+        pthread_mutex_unlock(&(dev->mutex));
+        LOG_RATELIMITED(LOG_LEVEL_WARNING, "%s accepted nothing for %d ms",
+                        dev->path, FANOUT_WRITE_TIMEOUT_MSEC);
+        if (cut) break;
+    }
+    return done;
+}
+
+
+/**
+ * (internal) Write blocks of the ring to the device until it is closed and
+ * its ring is empty, then give the device the time to play them. A copy
+ * restarts at the target fill when its ring runs dry, after a pause or an
+ * underrun, while the main device writes whatever is queued.
+ */
+static void* routine_writer(void *arg)
+{
+    fanout_device_t *dev = arg;
+    trace_set_thread_name("output");
+    size_t const block = dev->block_frames;
+    size_t const frame_bytes = dev->device_channels * dev->sample_bytes;
+    int stalled = 0;
+    for (;;) {
+        pthread_mutex_lock(&(dev->mutex));
+        while (!dev->closing) {
+            if (dev->primary) {
+                if (dev->fill > 0) break;
+            } else {
+                if (dev->started && dev->fill < frames_needed(dev, block)) {
+                    dev->started = 0;
+                }
+                if (!dev->started && dev->fill >= dev->target_fill) {
+                    dev->started = 1;
+                    dev->settle_blocks = 0;
+                }
+                if (dev->started) break;
+            }
+            pthread_cond_wait(&(dev->cond), &(dev->mutex));
+        }
+        size_t frames = 0;
+        if (dev->primary) {
+            frames = dev->fill < block ? dev->fill : block;
+            take_frames(dev, frames);
+            dev->in_frames = 0;
+        } else {
+            if (dev->started) {
+                correct_drift(dev);
+            }
+            size_t needed = frames_needed(dev, block);
+            if (needed > dev->fill) needed = dev->fill;
+            take_frames(dev, needed);
+        }
+        unsigned const resets = dev->resets;
+        int const closing = dev->closing;
+        pthread_mutex_unlock(&(dev->mutex));
+
+        float const *out = dev->in;
+        if (!dev->primary) {
+            frames = frames_available(dev, block);
+            if (frames > 0) {
+                resample(dev, frames);
+                out = dev->out;
+            }
+        }
+        if (frames == 0) {
+            if (closing) break;
+            continue;
+        }
+        if (dev->remapping) {
+            matrix_apply(&(dev->matrix), dev->device_work, out, frames);
+            out = dev->device_work;
+        }
+        dev->encode(dev->buf, out, frames * dev->device_channels);
+        size_t const bytes = frames * frame_bytes;
+        pthread_mutex_lock(&(dev->mutex));
+        int const reset = dev->resets != resets;
+        if (!reset) dev->writing = frames;
+        pthread_mutex_unlock(&(dev->mutex));
+        if (reset) continue;
+        TRACE_BEGIN("output_write");
+        ssize_t const ret = write_device(dev, bytes, resets);
+        TRACE_END_ARG("output_write", bytes);
+
+        pthread_mutex_lock(&(dev->mutex));
+        dev->writing = 0;
+        if (ret == (ssize_t) bytes) {
+            dev->frames_written += frames;
+        } else if (ret == -1) {
+            dev->write_errors++;
+            dev->failed = 1;
+        }
+        stalled = ret != (ssize_t) bytes && dev->closing;
+        pthread_cond_broadcast(&(dev->cond));
+        pthread_mutex_unlock(&(dev->mutex));
+        if (stalled) break;
+        if (ret == -1) {
+            // Don't spin on a device which is gone, but keep up with the
+            // stream to play again if it comes back
+            LOG_RATELIMITED(LOG_LEVEL_ERROR, "Writing to %s failed.", dev->path);
+            struct timespec const wait = {
+                0, (long) ((uint64_t) frames * 1000000000 / dev->sample_rate)
+            };
+            nanosleep(&wait, NULL);
+        }
+    }
+
+    // A SYNC would wait as long as the device hangs, so the writer only
+    // sleeps for what the device says it holds, up to a bound
+    int delay = 0;
+    if (!stalled && ioctl(dev->fd, SNDCTL_DSP_GETODELAY, &delay) != -1 && delay > 0) {
+        uint64_t ns = (uint64_t) (delay / frame_bytes) * 1000000000 / dev->sample_rate;
+        if (ns > (uint64_t) FANOUT_DRAIN_MSEC * 1000000) {
+            ns = (uint64_t) FANOUT_DRAIN_MSEC * 1000000;
+        }
+        struct timespec const wait = { ns / 1000000000, ns % 1000000000 };
+        nanosleep(&wait, NULL);
+    }
+    return NULL;
+}
+
+
+/**
+ * (internal) Free the buffers of a device
+ */
+static void free_device(fanout_device_t *dev)
+{
+    free(dev->ring);
+    free(dev->in);
+    free(dev->out);
+    free(dev->device_work);
+    free(dev->buf);
+}
+
+
+/**
+ * (internal) Set up a device and start its writer, which writes blocks of
+ * at most block_frames frames from a ring of ring_frames frames. The device
+ * is closed on failure.
+ * Return 1 on error.
+ */
+static int start_device(fanout_device_t *dev, const char *path, int fd, unsigned channels,
+                        unsigned device_channels, unsigned oss_format,
+                        unsigned sample_rate, size_t block_frames, size_t ring_frames,
+                        int primary)
+{
+    memset(dev, 0, sizeof(*dev));
+    snprintf(dev->path, sizeof(dev->path), "%s", path);
+    dev->fd = fd;
+    dev->channels = channels;
+    dev->device_channels = device_channels;
+    dev->oss_format = oss_format;
+    dev->sample_rate = sample_rate;
+    dev->sample_bytes = oss_format == AFMT_U8 || oss_format == AFMT_S8 ? 1 : 2;
+    dev->block_frames = block_frames;
+    dev->ring_frames = ring_frames;
+    dev->target_fill = FANOUT_TARGET_BLOCKS * block_frames;
+    dev->ratio = 1;
+    kernel_encoder_t const *encoder = kernels_encoder(oss_format);
+    if (encoder == NULL) {
+        close(fd);
+        return 1;
+    }
+    dev->encode = encoder->fn;
+    dev->remapping = device_channels != channels;
+    if (dev->remapping && matrix_init_default(&(dev->matrix), channels, device_channels)) {
+        LOG_ERROR("%s can't play %u channels", path, channels);
+        close(fd);
+        return 1;
+    }
+    int const flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        LOG_ERRNO("fcntl(O_NONBLOCK)");
+        close(fd);
+        return 1;
+    }
+
+    // The resampler of a copy holds at most a block at the largest ratio,
+    // and the frames it keeps between blocks. The main device takes its
+    // blocks as they are.
+    dev->ring = malloc(ring_frames * channels * sizeof(float));
+    dev->in = malloc((primary ? block_frames : 2 * block_frames + 2) *
+                     channels * sizeof(float));
+    dev->out = primary ? NULL : malloc(block_frames * channels * sizeof(float));
+    dev->device_work = dev->remapping ?
+        malloc(block_frames * device_channels * sizeof(float)) : NULL;
+    dev->buf = malloc(block_frames * device_channels * dev->sample_bytes);
+    if (!dev->ring || !dev->in || (!primary && !dev->out) || !dev->buf ||
+        (dev->remapping && !dev->device_work)) {
+        LOG_ERROR("Couldn't allocate the buffers of %s", path);
+        free_device(dev);
+        close(fd);
+        return 1;
+    }
+
+    // Timed waits on the condition follow the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&(dev->mutex), NULL);
+    pthread_cond_init(&(dev->cond), &attr);
+    pthread_condattr_destroy(&attr);
+    dev->primary = primary;
+    int ret = pthread_create(&(dev->thread), NULL, routine_writer, dev);
+    if (ret) {
+        LOG_ERROR("pthread_create returned error code %d", ret);
+        pthread_cond_destroy(&(dev->cond));
+        pthread_mutex_destroy(&(dev->mutex));
+        free_device(dev);
+        close(fd);
+        dev->primary = 0;
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Open the configured main device, which plays channels channels, and
+ * start its writer. Its ring holds ring_frames frames. The device is closed
+ * on failure.
+ * Return 1 on error.
+ */
+int fanout_open(fanout_t *fanout, const char *path, int fd, unsigned channels,
+                unsigned oss_format, unsigned sample_rate, size_t ring_frames)
+{
+    return start_device(&(fanout->main), path, fd, channels, channels, oss_format,
+                        sample_rate, ring_frames, ring_frames, 1);
+}
+
+
+/**
+ * Add a configured device, which plays device_channels channels of the
+ * channels of the main device, and start its writer. Its samples are
+ * written in blocks of block_frames frames. The device is closed on failure.
+ * Return 1 on error.
+ */
+int fanout_add(fanout_t *fanout, const char *path, int fd, unsigned channels,
+               unsigned device_channels, unsigned oss_format, unsigned sample_rate,
+               size_t block_frames)
+{
+    if (fanout->count >= FANOUT_MAX_DEVICES) {
+        close(fd);
+        return 1;
+    }
+    fanout_device_t *dev = &(fanout->devices[fanout->count]);
+    if (start_device(dev, path, fd, channels, device_channels, oss_format, sample_rate,
+                     block_frames, FANOUT_RING_BLOCKS * block_frames, 0)) {
+        return 1;
+    }
+    if (dev->remapping) {
+        LOG_INFO("Mixing %u channels to %u on %s", channels, device_channels, path);
+    }
+    fanout->count++;
+    return 0;
+}
+
+
+/**
+ * (internal) Append frames to the ring of a device, dropping the oldest
+ * ones if there is no room for them. Mutex must be locked.
+ */
+static void append_frames(fanout_device_t *dev, float const *samples, size_t frames)
+{
+    unsigned const channels = dev->channels;
+    if (frames > dev->ring_frames) {
+        samples += (frames - dev->ring_frames) * channels;
+        frames = dev->ring_frames;
+    }
+    if (dev->fill + frames > dev->ring_frames) {
+        size_t const drop = dev->fill + frames - dev->ring_frames;
+        dev->read_pos = (dev->read_pos + drop) % dev->ring_frames;
+        dev->fill -= drop;
+        dev->dropped_frames += drop;
+    }
+    size_t const write_pos = (dev->read_pos + dev->fill) % dev->ring_frames;
+    size_t const first = dev->ring_frames - write_pos < frames ?
+        dev->ring_frames - write_pos : frames;
+    memcpy(dev->ring + write_pos * channels, samples, first * channels * sizeof(float));
+    memcpy(dev->ring, samples + first * channels, (frames - first) * channels * sizeof(float));
+    dev->fill += frames;
+    dev->push_ns = now_ns();
+    dev->push_frames = frames;
+}
+
+
+/**
+ * Append output frames to the ring of the main device, waiting for room at
+ * most FANOUT_WRITE_TIMEOUT_MSEC. The oldest frames are dropped when the
+ * device stalls longer. The writer is only woken by fanout_flush(), or
+ * when the ring is full.
+ */
+void fanout_queue(fanout_t *fanout, float const *samples, size_t frames)
+{
+    fanout_device_t *dev = &(fanout->main);
+    if (!dev->primary) return;
+    pthread_mutex_lock(&(dev->mutex));
+    if (dev->fill + frames > dev->ring_frames) {
+        struct timespec const until = deadline(FANOUT_WRITE_TIMEOUT_MSEC);
+        pthread_cond_broadcast(&(dev->cond));
+        while (dev->fill + frames > dev->ring_frames && frames <= dev->ring_frames) {
+            if (pthread_cond_timedwait(&(dev->cond), &(dev->mutex), &until) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+    append_frames(dev, samples, frames);
+    pthread_mutex_unlock(&(dev->mutex));
+}
+
+
+/**
+ * Wake the writer of the main device, and wait until at most keep_frames of
+ * its frames are not written yet, for at most FANOUT_WRITE_TIMEOUT_MSEC.
+ * waited tells if the thread waited for room in the device, rather than
+ * only for the writer to write.
+ * Return 1 if a write to the device failed since the last flush.
+ */
+int fanout_flush(fanout_t *fanout, size_t keep_frames, int *waited)
+{
+    fanout_device_t *dev = &(fanout->main);
+    *waited = 0;
+    if (!dev->primary) return 1;
+    pthread_mutex_lock(&(dev->mutex));
+    pthread_cond_broadcast(&(dev->cond));
+    if (dev->fill + dev->writing > keep_frames) {
+        struct timespec const until = deadline(FANOUT_WRITE_TIMEOUT_MSEC);
+        dev->full = 0;
+        while (dev->fill + dev->writing > keep_frames && !dev->failed) {
+            if (pthread_cond_timedwait(&(dev->cond), &(dev->mutex), &until) == ETIMEDOUT) {
+                break;
+            }
+        }
+        *waited = dev->full;
+    }
+    int const failed = dev->failed;
+    dev->failed = 0;
+    pthread_mutex_unlock(&(dev->mutex));
+    return failed;
+}
+
+
+/**
+ * Number of frames of the main device which are not written to it yet
+ */
+size_t fanout_queued(fanout_t *fanout)
+{
+    fanout_device_t *dev = &(fanout->main);
+    if (!dev->primary) return 0;
+    pthread_mutex_lock(&(dev->mutex));
+    size_t const frames = dev->fill + dev->writing;
+    pthread_mutex_unlock(&(dev->mutex));
+    return frames;
+}
+
+
+/**
+ * Append output frames of the main device to the ring of every other
+ * device. The oldest frames of a device which is behind are dropped, so
+ * this never waits for a device.
+ */
+void fanout_push(fanout_t *fanout, float const *samples, size_t frames)
+{
+    unsigned d;
+    for (d = 0; d < fanout->count; d++) {
+        fanout_device_t *dev = &(fanout->devices[d]);
+        pthread_mutex_lock(&(dev->mutex));
+        append_frames(dev, samples, frames);
+        pthread_cond_signal(&(dev->cond));
+        pthread_mutex_unlock(&(dev->mutex));
+    }
+}
+
+
+/**
+ * (internal) Drop the frames of a device which are not played yet. The
+ * block being written is cut short, so that nothing reaches the device
+ * after its reset.
+ */
+static void reset_device(fanout_device_t *dev)
+{
+    pthread_mutex_lock(&(dev->mutex));
+    dev->resets++;
+    dev->read_pos = 0;
+    dev->fill = 0;
+    pthread_cond_broadcast(&(dev->cond));
+    while (dev->writing) {
+        pthread_cond_wait(&(dev->cond), &(dev->mutex));
+    }
+    pthread_mutex_unlock(&(dev->mutex));
+    if (ioctl(dev->fd, SNDCTL_DSP_RESET, NULL) == -1) {
+        LOG_ERRNO("ioctl(SNDCTL_DSP_RESET)");
+    }
+}
+
+
+/**
+ * Drop the frames which the devices did not play yet
+ */
+void fanout_reset(fanout_t *fanout)
+{
+    if (fanout->main.primary) {
+        reset_device(&(fanout->main));
+    }
+    unsigned d;
+    for (d = 0; d < fanout->count; d++) {
+        reset_device(&(fanout->devices[d]));
+    }
+}
+
+
+/**
+ * (internal) Join the writer of a device which is closing, and close it
+ */
+static void close_device(fanout_device_t *dev)
+{
+    int ret = pthread_join(dev->thread, NULL);
+    if (ret) {
+        LOG_ERROR("pthread_join returned error code %d", ret);
+    }
+    close(dev->fd);
+    pthread_cond_destroy(&(dev->cond));
+    pthread_mutex_destroy(&(dev->mutex));
+    free_device(dev);
+}
+
+
+/**
+ * Let every device play what it holds, then stop their writers and close
+ * them. This waits for a device which stalls only for a bounded time.
+ */
+void fanout_close(fanout_t *fanout)
+{
+    fanout_device_t *devices[FANOUT_MAX_DEVICES + 1];
+    unsigned count = 0;
+    if (fanout->main.primary) {
+        devices[count++] = &(fanout->main);
+    }
+    unsigned d;
+    for (d = 0; d < fanout->count; d++) {
+        devices[count++] = &(fanout->devices[d]);
+    }
+    for (d = 0; d < count; d++) {
+        pthread_mutex_lock(&(devices[d]->mutex));
+        devices[d]->closing = 1;
+        pthread_cond_broadcast(&(devices[d]->cond));
+        pthread_mutex_unlock(&(devices[d]->mutex));
+    }
+    for (d = 0; d < count; d++) {
+        close_device(devices[d]);
+    }
+    fanout->main.primary = 0;
+    fanout->count = 0;
+}
+
+
+/**
+ * Log the state of every device
+ */
+void fanout_print(fanout_t *fanout)
+{
+    unsigned d;
+    for (d = 0; d <= fanout->count; d++) {
+        fanout_device_t *dev = d ? &(fanout->devices[d - 1]) : &(fanout->main);
+        if (d == 0 && !dev->primary) continue;
+        pthread_mutex_lock(&(dev->mutex));
+        LOG_INFO("[Output] %s: %u channels, %.0f ms buffered, drift %+.0f ppm, "
+                 "%.1f s written, %lu frames dropped, %lu resyncs, %lu write errors, "
+                 "%lu stalls",
+                 dev->path, dev->device_channels,
+                 (dev->fill + dev->writing) * 1000. / dev->sample_rate,
+                 (dev->ratio - 1) * 1e6, (double) dev->frames_written / dev->sample_rate,
+                 dev->dropped_frames, dev->resyncs, dev->write_errors, dev->stalls);
+        pthread_mutex_unlock(&(dev->mutex));
+    }
+}
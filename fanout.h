@@ -0,0 +1,114 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "kernels.h"
+#include "matrix.h"
+
+// Largest number of devices played besides the main one, and length of
+// their paths
+#define FANOUT_MAX_DEVICES 4
+#define FANOUT_PATH_MAX 64
+
+// Largest correction of the clock drift of a device, as a ratio of rates
+#define FANOUT_MAX_DRIFT 0.005
+
+/**
+ * Device fed with the output by its own writer thread.
+ * The main device paces the stream: the playing thread waits for room in
+ * its ring, and its writer takes every frame queued at once. The other
+ * devices play a copy: the playing thread only appends frames to their
+ * rings, and drops the oldest ones when a device falls behind, so that a
+ * slow device never stalls the others. Their writers resample by a ratio
+ * close to 1 to keep the ring at its target fill, which makes up for the
+ * drift of the device clock.
+ * Writes don't block: a writer waits for room in its device for a bounded
+ * time, so that a device which hangs never holds up a reset or a close.
+ */
+typedef struct {
+    char path[FANOUT_PATH_MAX];
+    int fd;
+    pthread_t thread;
+
+    // Ring of stream frames and state, protected by the mutex
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    float *ring;
+    size_t ring_frames;
+    size_t read_pos;
+    size_t fill;
+    size_t target_fill;
+    int64_t push_ns;
+    size_t push_frames;
+    int started;
+    int closing;
+    int primary;
+    // Frames the writer took from the ring and didn't write yet, number of
+    // resets which drop them, and whether a write failed, or the writer
+    // waited for room in the device, since the last flush of the main
+    // device
+    size_t writing;
+    unsigned resets;
+    int failed;
+    int full;
+
+    // Format, and mix of the stream channels for the device
+    unsigned channels;
+    unsigned device_channels;
+    unsigned oss_format;
+    unsigned sample_rate;
+    unsigned sample_bytes;
+    kernel_encode_t encode;
+    int remapping;
+    matrix_t matrix;
+
+    // Resampler, used by the writer thread only: frames not consumed yet,
+    // position of the next output frame between the first two of them, and
+    // input frames per output frame, which follows the average fill of the
+    // ring around its setpoint. The ratio is also read under the mutex.
+    size_t block_frames;
+    float *in;
+    size_t in_frames;
+    double phase;
+    double ratio;
+    unsigned settle_blocks;
+    double avg_fill;
+    double setpoint;
+    float *out;
+    float *device_work;
+    unsigned char *buf;
+
+    // Statistics, protected by the mutex
+    uint64_t frames_written;
+    unsigned long dropped_frames;
+    unsigned long resyncs;
+    unsigned long write_errors;
+    unsigned long stalls;
+} fanout_device_t;
+
+/**
+ * Main device, and devices played besides it
+ */
+typedef struct {
+    fanout_device_t main;
+    fanout_device_t devices[FANOUT_MAX_DEVICES];
+    unsigned count;
+} fanout_t;
+
+void fanout_init(fanout_t *fanout);
+int fanout_open(fanout_t *fanout, const char *path, int fd, unsigned channels,
+                unsigned oss_format, unsigned sample_rate, size_t ring_frames);
+void fanout_queue(fanout_t *fanout, float const *samples, size_t frames);
+int fanout_flush(fanout_t *fanout, size_t keep_frames, int *waited);
+size_t fanout_queued(fanout_t *fanout);
+int fanout_add(fanout_t *fanout, const char *path, int fd, unsigned channels,
+               unsigned device_channels, unsigned oss_format, unsigned sample_rate,
+               size_t block_frames);
+void fanout_push(fanout_t *fanout, float const *samples, size_t frames);
+void fanout_reset(fanout_t *fanout);
+void fanout_close(fanout_t *fanout);
+void fanout_print(fanout_t *fanout);
+
+#endif /* FANOUT_H */
@@ -0,0 +1,537 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/soundcard.h>
+#include "kernels.h"
+
+// Vector kernels are built for their instruction set whatever the compiler
+// flags, and only called when the CPU runs it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// 16-bit samples in the other byte order than the CPU
+#if AFMT_S16_NE == AFMT_S16_LE
+#define AFMT_S16_OE AFMT_S16_BE
+#else
+#define AFMT_S16_OE AFMT_S16_LE
+#endif
+
+
+/**
+ * (internal) Scale a float sample to a signed integer of the given
+ * magnitude, with saturation and rounding to nearest even like vector
+ * conversions, so that every variant gives the same samples
+ */
+static inline int32_t scale_sample(float x, float scale)
+{
+    x *= scale;
+    x = x > scale - 1 ? scale - 1 : x < -scale ? -scale : x;
+    // Adding 1.5 * 2^23 leaves no bits for the fraction
+    return (int32_t) ((x + 12582912.0f) - 12582912.0f);
+}
+
+
+// Scalar kernels of each format. Their loops have no dependency between
+// iterations so that compilers may vectorize them.
+#define DEFINE_SCALAR_DECODER(NAME, SAMPLE) \
+    static void NAME(float *out, void const *in, size_t samples) \
+    { \
+        float *restrict o = out; \
+        unsigned char const *restrict p = in; \
+        size_t i; \
+        for (i = 0; i < samples; i++) { \
+            o[i] = (SAMPLE); \
+        } \
+    }
+
+DEFINE_SCALAR_DECODER(decode_u8_scalar, (p[i] - 128) * (1.0f / 128))
+DEFINE_SCALAR_DECODER(decode_s8_scalar, ((signed char) p[i]) * (1.0f / 128))
+DEFINE_SCALAR_DECODER(decode_s16le_scalar,
+                      (int16_t) (p[2 * i] | p[2 * i + 1] << 8) * (1.0f / 32768))
+DEFINE_SCALAR_DECODER(decode_s16be_scalar,
+                      (int16_t) (p[2 * i] << 8 | p[2 * i + 1]) * (1.0f / 32768))
+
+#define DEFINE_SCALAR_ENCODER(NAME, STORE) \
+    static void NAME(void *out, float const *in, size_t samples) \
+    { \
+        float const *restrict s = in; \
+        unsigned char *restrict p = out; \
+        size_t i; \
+        for (i = 0; i < samples; i++) { \
+            STORE; \
+        } \
+    }
+
+DEFINE_SCALAR_ENCODER(encode_u8_scalar,
+                      p[i] = (unsigned char) (scale_sample(s[i], 128) + 128))
+DEFINE_SCALAR_ENCODER(encode_s8_scalar,
+                      p[i] = (unsigned char) scale_sample(s[i], 128))
+DEFINE_SCALAR_ENCODER(encode_s16le_scalar,
+                      int32_t const x = scale_sample(s[i], 32768);
+                      p[2 * i] = x & 0xff;
+                      p[2 * i + 1] = (x >> 8) & 0xff)
+DEFINE_SCALAR_ENCODER(encode_s16be_scalar,
+                      int32_t const x = scale_sample(s[i], 32768);
+                      p[2 * i] = (x >> 8) & 0xff;
+                      p[2 * i + 1] = x & 0xff)
+
+#if AFMT_S16_NE == AFMT_S16_LE
+#define decode_s16ne_scalar decode_s16le_scalar
+#define decode_s16oe_scalar decode_s16be_scalar
+#define encode_s16ne_scalar encode_s16le_scalar
+#define encode_s16oe_scalar encode_s16be_scalar
+#else
+#define decode_s16ne_scalar decode_s16be_scalar
+#define decode_s16oe_scalar decode_s16le_scalar
+#define encode_s16ne_scalar encode_s16be_scalar
+#define encode_s16oe_scalar encode_s16le_scalar
+#endif
+
+
+/**
+ * (internal) Follow the ramp of a gain over the first frames, and return
+ * the number of frames after which the gain is constant. A step which
+ * doesn't move the gain, like a step rounded to 0, or which moves it past
+ * the target ends the ramp at the target.
+ */
+static inline size_t gain_ramp(dsp_gain_t *gain, float *restrict s, size_t frames,
+                               unsigned channels)
+{
+    float g = gain->current;
+    size_t f = 0;
+    if (g == gain->target) return 0;
+    for (; f < frames && g != gain->target; f++) {
+        float const next = g + gain->step;
+        if (next == g || (gain->step > 0 && next > gain->target) ||
+            (gain->step < 0 && next < gain->target)) {
+            g = gain->target;
+        } else {
+            g = next;
+        }
+        unsigned c;
+        for (c = 0; c < channels; c++) {
+            s[f * channels + c] *= g;
+        }
+    }
+    gain->current = g;
+    return f;
+}
+
+/**
+ * (internal) Multiply samples by a constant
+ */
+static inline void scale_scalar(float *restrict s, size_t n, float g)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        s[i] *= g;
+    }
+}
+
+// Gain kernels: the ramp is unrolled for the given number of channels, and
+// the constant part uses the given scaling loop
+#define DEFINE_GAIN(NAME, TARGET, CHANNELS, SCALE) \
+    TARGET static void NAME(dsp_gain_t *gain, float *samples, size_t frames, \
+                            unsigned channels) \
+    { \
+        size_t const f = gain_ramp(gain, samples, frames, (CHANNELS)); \
+        if (gain->current != 1) { \
+            SCALE(samples + f * (CHANNELS), (frames - f) * (CHANNELS), gain->current); \
+        } \
+        (void) channels; \
+    }
+
+#define NO_TARGET
+DEFINE_GAIN(gain_1ch_scalar, NO_TARGET, 1, scale_scalar)
+DEFINE_GAIN(gain_2ch_scalar, NO_TARGET, 2, scale_scalar)
+DEFINE_GAIN(gain_any_scalar, NO_TARGET, channels, scale_scalar)
+
+
+#ifdef KERNELS_X86
+
+/**
+ * (internal) Swap the bytes of 16-bit samples
+ */
+TARGET_SSE2 static inline __m128i swap16_sse2(__m128i x)
+{
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+/**
+ * (internal) Convert 8 16-bit samples to floats
+ */
+TARGET_SSE2 static inline void store_s16_sse2(float *o, __m128i x, __m128 scale)
+{
+    // Sign-extend to 32 bits by shifting the duplicated halves
+    __m128i const lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i const hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(o + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+}
+
+/**
+ * (internal) Convert 8 floats to saturated 16-bit samples
+ */
+TARGET_SSE2 static inline __m128i load_s16_sse2(float const *s, __m128 scale)
+{
+    __m128 const max = _mm_set1_ps(32767);
+    __m128 const min = _mm_set1_ps(-32768);
+    __m128 const lo = _mm_mul_ps(_mm_loadu_ps(s), scale);
+    __m128 const hi = _mm_mul_ps(_mm_loadu_ps(s + 4), scale);
+    return _mm_packs_epi32(_mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(lo, max), min)),
+                           _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(hi, max), min)));
+}
+
+// 16-bit kernels, in the byte order of the CPU or swapped
+#define DEFINE_S16_SSE2(SUFFIX, SWAP) \
+    TARGET_SSE2 static void decode_##SUFFIX##_sse2(float *out, void const *in, \
+                                                   size_t samples) \
+    { \
+        unsigned char const *p = in; \
+        __m128 const scale = _mm_set1_ps(1.0f / 32768); \
+        size_t i = 0; \
+        for (; i + 8 <= samples; i += 8) { \
+            __m128i x = _mm_loadu_si128((__m128i const *) (p + 2 * i)); \
+            if (SWAP) x = swap16_sse2(x); \
+            store_s16_sse2(out + i, x, scale); \
+        } \
+        decode_##SUFFIX##_scalar(out + i, p + 2 * i, samples - i); \
+    } \
+    TARGET_SSE2 static void encode_##SUFFIX##_sse2(void *out, float const *in, \
+                                                   size_t samples) \
+    { \
+        unsigned char *p = out; \
+        __m128 const scale = _mm_set1_ps(32768); \
+        size_t i = 0; \
+        for (; i + 8 <= samples; i += 8) { \
+            __m128i x = load_s16_sse2(in + i, scale); \
+            if (SWAP) x = swap16_sse2(x); \
+            _mm_storeu_si128((__m128i *) (p + 2 * i), x); \
+        } \
+        encode_##SUFFIX##_scalar(p + 2 * i, in + i, samples - i); \
+    }
+
+DEFINE_S16_SSE2(s16ne, 0)
+DEFINE_S16_SSE2(s16oe, 1)
+
+// 8-bit kernels, unsigned samples being signed ones with the sign bit
+// flipped
+#define DEFINE_8_SSE2(SUFFIX, FLIP) \
+    TARGET_SSE2 static void decode_##SUFFIX##_sse2(float *out, void const *in, \
+                                                   size_t samples) \
+    { \
+        unsigned char const *p = in; \
+        __m128 const scale = _mm_set1_ps(1.0f / 32768); \
+        __m128i const flip = _mm_set1_epi8((char) (FLIP)); \
+        size_t i = 0; \
+        for (; i + 16 <= samples; i += 16) { \
+            __m128i const x = _mm_xor_si128( \
+                _mm_loadu_si128((__m128i const *) (p + i)), flip); \
+            /* Bytes become the high bytes of 16-bit samples */ \
+            store_s16_sse2(out + i, _mm_unpacklo_epi8(_mm_setzero_si128(), x), scale); \
+            store_s16_sse2(out + i + 8, _mm_unpackhi_epi8(_mm_setzero_si128(), x), \
+                           scale); \
+        } \
+        decode_##SUFFIX##_scalar(out + i, p + i, samples - i); \
+    } \
+    TARGET_SSE2 static void encode_##SUFFIX##_sse2(void *out, float const *in, \
+                                                   size_t samples) \
+    { \
+        unsigned char *p = out; \
+        __m128 const scale = _mm_set1_ps(128); \
+        __m128i const flip = _mm_set1_epi8((char) (FLIP)); \
+        size_t i = 0; \
+        for (; i + 16 <= samples; i += 16) { \
+            __m128i const x = _mm_packs_epi16(load_s16_sse2(in + i, scale), \
+                                              load_s16_sse2(in + i + 8, scale)); \
+            _mm_storeu_si128((__m128i *) (p + i), _mm_xor_si128(x, flip)); \
+        } \
+        encode_##SUFFIX##_scalar(p + i, in + i, samples - i); \
+    }
+
+DEFINE_8_SSE2(u8, 0x80)
+DEFINE_8_SSE2(s8, 0)
+
+/**
+ * (internal) Multiply samples by a constant, 4 at a time
+ */
+TARGET_SSE2 static inline void scale_sse2(float *s, size_t n, float g)
+{
+    __m128 const vg = _mm_set1_ps(g);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(s + i, _mm_mul_ps(_mm_loadu_ps(s + i), vg));
+    }
+    for (; i < n; i++) {
+        s[i] *= g;
+    }
+}
+
+DEFINE_GAIN(gain_1ch_sse2, TARGET_SSE2, 1, scale_sse2)
+DEFINE_GAIN(gain_2ch_sse2, TARGET_SSE2, 2, scale_sse2)
+DEFINE_GAIN(gain_any_sse2, TARGET_SSE2, channels, scale_sse2)
+
+
+/**
+ * (internal) Swap the bytes of 16-bit samples
+ */
+TARGET_AVX2 static inline __m256i swap16_avx2(__m256i x)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8));
+}
+
+// 16-bit kernels handle 16 samples at a time. Packing works within 128-bit
+// lanes, so packed quarters are put back in order.
+#define DEFINE_S16_AVX2(SUFFIX, SWAP) \
+    TARGET_AVX2 static void decode_##SUFFIX##_avx2(float *out, void const *in, \
+                                                   size_t samples) \
+    { \
+        unsigned char const *p = in; \
+        __m256 const scale = _mm256_set1_ps(1.0f / 32768); \
+        size_t i = 0; \
+        for (; i + 16 <= samples; i += 16) { \
+            __m256i x = _mm256_loadu_si256((__m256i const *) (p + 2 * i)); \
+            if (SWAP) x = swap16_avx2(x); \
+            __m256i const lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x)); \
+            __m256i const hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1)); \
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale)); \
+            _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale)); \
+        } \
+        decode_##SUFFIX##_scalar(out + i, p + 2 * i, samples - i); \
+    } \
+    TARGET_AVX2 static void encode_##SUFFIX##_avx2(void *out, float const *in, \
+                                                   size_t samples) \
+    { \
+        unsigned char *p = out; \
+        __m256 const scale = _mm256_set1_ps(32768); \
+        __m256 const max = _mm256_set1_ps(32767); \
+        __m256 const min = _mm256_set1_ps(-32768); \
+        size_t i = 0; \
+        for (; i + 16 <= samples; i += 16) { \
+            __m256 const lo = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale); \
+            __m256 const hi = _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale); \
+            __m256i x = _mm256_packs_epi32( \
+                _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(lo, max), min)), \
+                _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(hi, max), min))); \
+            x = _mm256_permute4x64_epi64(x, 0xd8); \
+            if (SWAP) x = swap16_avx2(x); \
+            _mm256_storeu_si256((__m256i *) (p + 2 * i), x); \
+        } \
+        encode_##SUFFIX##_scalar(p + 2 * i, in + i, samples - i); \
+    }
+
+DEFINE_S16_AVX2(s16ne, 0)
+DEFINE_S16_AVX2(s16oe, 1)
+
+/**
+ * (internal) Multiply samples by a constant, 8 at a time
+ */
+TARGET_AVX2 static inline void scale_avx2(float *s, size_t n, float g)
+{
+    __m256 const vg = _mm256_set1_ps(g);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(s + i, _mm256_mul_ps(_mm256_loadu_ps(s + i), vg));
+    }
+    for (; i < n; i++) {
+        s[i] *= g;
+    }
+}
+
+DEFINE_GAIN(gain_1ch_avx2, TARGET_AVX2, 1, scale_avx2)
+DEFINE_GAIN(gain_2ch_avx2, TARGET_AVX2, 2, scale_avx2)
+DEFINE_GAIN(gain_any_avx2, TARGET_AVX2, channels, scale_avx2)
+
+#endif /* KERNELS_X86 */
+
+
+// Registry of the variants, by format or number of channels and then from
+// the most portable instruction set
+static const kernel_decoder_t decoders[] = {
+    { "u8_scalar", KERNEL_SCALAR, AFMT_U8, decode_u8_scalar },
+    { "s8_scalar", KERNEL_SCALAR, AFMT_S8, decode_s8_scalar },
+    { "s16ne_scalar", KERNEL_SCALAR, AFMT_S16_NE, decode_s16ne_scalar },
+    { "s16oe_scalar", KERNEL_SCALAR, AFMT_S16_OE, decode_s16oe_scalar },
+#ifdef KERNELS_X86
+    { "u8_sse2", KERNEL_SSE2, AFMT_U8, decode_u8_sse2 },
+    { "s8_sse2", KERNEL_SSE2, AFMT_S8, decode_s8_sse2 },
+    { "s16ne_sse2", KERNEL_SSE2, AFMT_S16_NE, decode_s16ne_sse2 },
+    { "s16oe_sse2", KERNEL_SSE2, AFMT_S16_OE, decode_s16oe_sse2 },
+    { "s16ne_avx2", KERNEL_AVX2, AFMT_S16_NE, decode_s16ne_avx2 },
+    { "s16oe_avx2", KERNEL_AVX2, AFMT_S16_OE, decode_s16oe_avx2 },
+#endif
+};
+
+static const kernel_encoder_t encoders[] = {
+    { "u8_scalar", KERNEL_SCALAR, AFMT_U8, encode_u8_scalar },
+    { "s8_scalar", KERNEL_SCALAR, AFMT_S8, encode_s8_scalar },
+    { "s16ne_scalar", KERNEL_SCALAR, AFMT_S16_NE, encode_s16ne_scalar },
+    { "s16oe_scalar", KERNEL_SCALAR, AFMT_S16_OE, encode_s16oe_scalar },
+#ifdef KERNELS_X86
+    { "u8_sse2", KERNEL_SSE2, AFMT_U8, encode_u8_sse2 },
+    { "s8_sse2", KERNEL_SSE2, AFMT_S8, encode_s8_sse2 },
+    { "s16ne_sse2", KERNEL_SSE2, AFMT_S16_NE, encode_s16ne_sse2 },
+    { "s16oe_sse2", KERNEL_SSE2, AFMT_S16_OE, encode_s16oe_sse2 },
+    { "s16ne_avx2", KERNEL_AVX2, AFMT_S16_NE, encode_s16ne_avx2 },
+    { "s16oe_avx2", KERNEL_AVX2, AFMT_S16_OE, encode_s16oe_avx2 },
+#endif
+};
+
+static const kernel_gainer_t gainers[] = {
+    { "1ch_scalar", KERNEL_SCALAR, 1, gain_1ch_scalar },
+    { "2ch_scalar", KERNEL_SCALAR, 2, gain_2ch_scalar },
+    { "any_scalar", KERNEL_SCALAR, 0, gain_any_scalar },
+#ifdef KERNELS_X86
+    { "1ch_sse2", KERNEL_SSE2, 1, gain_1ch_sse2 },
+    { "2ch_sse2", KERNEL_SSE2, 2, gain_2ch_sse2 },
+    { "any_sse2", KERNEL_SSE2, 0, gain_any_sse2 },
+    { "1ch_avx2", KERNEL_AVX2, 1, gain_1ch_avx2 },
+    { "2ch_avx2", KERNEL_AVX2, 2, gain_2ch_avx2 },
+    { "any_avx2", KERNEL_AVX2, 0, gain_any_avx2 },
+#endif
+};
+
+#define COUNT(table) (sizeof(table) / sizeof(table[0]))
+
+// Best instruction set of the CPU, found once
+static pthread_once_t isa_once = PTHREAD_ONCE_INIT;
+static unsigned cpu_isa = KERNEL_SCALAR;
+
+
+/**
+ * (internal) Ask the CPU which instruction sets it runs
+ */
+static void detect_isa()
+{
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        cpu_isa = KERNEL_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        cpu_isa = KERNEL_SSE2;
+    }
+#endif
+}
+
+
+/**
+ * Best instruction set which kernels use on this CPU
+ */
+unsigned kernels_isa()
+{
+    pthread_once(&isa_once, detect_isa);
+    return cpu_isa;
+}
+
+
+/**
+ * Name of an instruction set
+ */
+const char *kernels_isa_name(unsigned isa)
+{
+    switch (isa) {
+        case KERNEL_SSE2:
+            return "sse2";
+        case KERNEL_AVX2:
+            return "avx2";
+    }
+    return "scalar";
+}
+
+
+/**
+ * Best decoder of a format on this CPU, or NULL if the format is not
+ * supported
+ */
+kernel_decoder_t const *kernels_decoder(unsigned format)
+{
+    unsigned const isa = kernels_isa();
+    kernel_decoder_t const *best = NULL;
+    size_t i;
+    for (i = 0; i < COUNT(decoders); i++) {
+        if (decoders[i].format == format && decoders[i].isa <= isa) {
+            best = &(decoders[i]);
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Best encoder of a format on this CPU, or NULL if the format is not
+ * supported
+ */
+kernel_encoder_t const *kernels_encoder(unsigned format)
+{
+    unsigned const isa = kernels_isa();
+    kernel_encoder_t const *best = NULL;
+    size_t i;
+    for (i = 0; i < COUNT(encoders); i++) {
+        if (encoders[i].format == format && encoders[i].isa <= isa) {
+            best = &(encoders[i]);
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Best gain of a number of channels on this CPU, specialized for it if
+ * there is such a variant
+ */
+kernel_gainer_t const *kernels_gainer(unsigned channels)
+{
+    unsigned const isa = kernels_isa();
+    kernel_gainer_t const *best = NULL;
+    size_t i;
+    for (i = 0; i < COUNT(gainers); i++) {
+        if ((gainers[i].channels == channels || gainers[i].channels == 0) &&
+            gainers[i].isa <= isa &&
+            (best == NULL || gainers[i].isa > best->isa || gainers[i].channels)) {
+            best = &(gainers[i]);
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Select the kernels of a stream, which is decoded from in_format and
+ * encoded to out_format.
+ * Return 1 if a format is not supported.
+ */
+int kernels_select(kernels_t *kernels, unsigned in_format, unsigned out_format,
+                   unsigned channels)
+{
+    kernels->decode = kernels_decoder(in_format);
+    kernels->encode = kernels_encoder(out_format);
+    kernels->gain = kernels_gainer(channels);
+    return kernels->decode == NULL || kernels->encode == NULL;
+}
+
+
+/**
+ * List every variant, for benchmarks
+ */
+kernel_decoder_t const *kernels_decoders(size_t *count)
+{
+    *count = COUNT(decoders);
+    return decoders;
+}
+
+kernel_encoder_t const *kernels_encoders(size_t *count)
+{
+    *count = COUNT(encoders);
+    return encoders;
+}
+
+kernel_gainer_t const *kernels_gainers(size_t *count)
+{
+    *count = COUNT(gainers);
+    return gainers;
+}
@@ -0,0 +1,65 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include "dsp.h"
+
+// Instruction sets of the kernels, from the most portable
+#define KERNEL_SCALAR 0
+#define KERNEL_SSE2 1
+#define KERNEL_AVX2 2
+
+// Conversions between samples of a format and floats, and gain of
+// interleaved samples for a number of channels
+typedef void (*kernel_decode_t)(float *out, void const *in, size_t samples);
+typedef void (*kernel_encode_t)(void *out, float const *in, size_t samples);
+typedef void (*kernel_gain_t)(dsp_gain_t *gain, float *samples, size_t frames,
+                              unsigned channels);
+
+/**
+ * Variants of the kernels. Each one is specialized for a sample format or a
+ * number of channels, 0 for any, and an instruction set.
+ */
+typedef struct {
+    const char *name;
+    unsigned isa;
+    unsigned format;
+    kernel_decode_t fn;
+} kernel_decoder_t;
+
+typedef struct {
+    const char *name;
+    unsigned isa;
+    unsigned format;
+    kernel_encode_t fn;
+} kernel_encoder_t;
+
+typedef struct {
+    const char *name;
+    unsigned isa;
+    unsigned channels;
+    kernel_gain_t fn;
+} kernel_gainer_t;
+
+/**
+ * Kernels selected for a stream, so that its blocks don't branch on its
+ * format
+ */
+typedef struct {
+    kernel_decoder_t const *decode;
+    kernel_encoder_t const *encode;
+    kernel_gainer_t const *gain;
+} kernels_t;
+
+unsigned kernels_isa();
+const char *kernels_isa_name(unsigned isa);
+int kernels_select(kernels_t *kernels, unsigned in_format, unsigned out_format,
+                   unsigned channels);
+kernel_decoder_t const *kernels_decoder(unsigned format);
+kernel_encoder_t const *kernels_encoder(unsigned format);
+kernel_gainer_t const *kernels_gainer(unsigned channels);
+kernel_decoder_t const *kernels_decoders(size_t *count);
+kernel_encoder_t const *kernels_encoders(size_t *count);
+kernel_gainer_t const *kernels_gainers(size_t *count);
+
+#endif /* KERNELS_H */
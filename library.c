@@ -0,0 +1,527 @@
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "library.h"
+#include "log.h"
+#include "player.h"
+
+/**
+ * Initialise an empty library
+ */
+int library_init(library_t *lib)
+{
+    if (lib == NULL) return 1;
+    memset(lib, 0, sizeof(*lib));
+    int ret = pthread_mutex_init(&(lib->mutex), NULL);
+    if (ret) {
+        LOG_ERROR("pthread_mutex_init failed: %d", ret);
+        return 1;
+    }
+    ret = pthread_cond_init(&(lib->cond), NULL);
+    if (ret) {
+        LOG_ERROR("pthread_cond_init failed: %d", ret);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * (internal) Free the strings of an array of tracks
+ */
+static void free_tracks(track_t *tracks, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++) {
+        free(tracks[i].path);
+        free(tracks[i].name);
+    }
+}
+
+
+/**
+ * Wait for the running scan and free every track
+ */
+int library_destroy(library_t *lib)
+{
+    if (lib == NULL) return 1;
+    library_wait(lib);
+    free_tracks(lib->tracks, lib->count);
+    free(lib->tracks);
+    free(lib->hash);
+    int ret = pthread_cond_destroy(&(lib->cond));
+    if (ret) {
+        LOG_ERROR("pthread_cond_destroy failed: %d", ret);
+        return 1;
+    }
+    ret = pthread_mutex_destroy(&(lib->mutex));
+    if (ret) {
+        LOG_ERROR("pthread_mutex_destroy failed: %d", ret);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * (internal) Case-insensitive hash of a track name
+ */
+static uint64_t hash_name(const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash ^= (unsigned char) tolower((unsigned char) *(name++));
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/**
+ * (internal) Compare tracks by name, then by path
+ */
+static int compare_track_names(const void *a, const void *b)
+{
+    track_t const *ta = a, *tb = b;
+    int ret = strcasecmp(ta->name, tb->name);
+    return ret ? ret : strcmp(ta->path, tb->path);
+}
+
+
+/**
+ * (internal) Compare tracks by path
+ */
+static int compare_track_paths(const void *a, const void *b)
+{
+    return strcmp(((track_t const *) a)->path, ((track_t const *) b)->path);
+}
+
+
+/**
+ * (internal) Merge tracks found by the scan into the index, replacing tracks
+ * with the same path, and rebuild the name hash. Library must be locked.
+ */
+static int merge_found_tracks(library_t *lib)
+{
+    size_t const total = lib->count + lib->found_count;
+    track_t *tracks = malloc((total ? total : 1) * sizeof(track_t));
+    size_t hash_size = 64;
+    while (hash_size < 2 * total) hash_size *= 2;
+    size_t *hash = calloc(hash_size, sizeof(size_t));
+    if (tracks == NULL || hash == NULL) {
+        LOG_ERROR("Couldn't allocate the track index.");
+        free(tracks);
+        free(hash);
+        return 2;
+    }
+
+    // Rescanned paths replace the tracks they had
+    qsort(lib->found, lib->found_count, sizeof(track_t), compare_track_paths);
+    size_t count = 0, i;
+    for (i = 0; i < lib->count; i++) {
+        if (bsearch(&(lib->tracks[i]), lib->found, lib->found_count,
+                    sizeof(track_t), compare_track_paths)) {
+            free_tracks(&(lib->tracks[i]), 1);
+        } else {
+            tracks[count++] = lib->tracks[i];
+        }
+    }
+    memcpy(tracks + count, lib->found, lib->found_count * sizeof(track_t));
+    count += lib->found_count;
+    qsort(tracks, count, sizeof(track_t), compare_track_names);
+
+    // Hash slots contain index + 1, 0 being an empty slot
+    for (i = 0; i < count; i++) {
+        size_t h = hash_name(tracks[i].name) & (hash_size - 1);
+        while (hash[h]) h = (h + 1) & (hash_size - 1);
+        hash[h] = i + 1;
+    }
+
+    free(lib->tracks);
+    free(lib->hash);
+    free(lib->found);
+    lib->tracks = tracks;
+    lib->count = count;
+    lib->hash = hash;
+    lib->hash_size = hash_size;
+    lib->found = NULL;
+    lib->found_count = lib->found_capacity = 0;
+    return 0;
+}
+
+
+/**
+ * (internal) Test if a file name has the extension of a playable file
+ */
+static int is_music_file_name(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext != NULL &&
+        (!strcasecmp(ext, ".wav") || !strcasecmp(ext, ".au") ||
+         !strcasecmp(ext, ".snd"));
+}
+
+
+/**
+ * (internal) Concatenate a directory and a file name
+ */
+static char* join_path(const char *dir, const char *name)
+{
+    size_t const dir_len = strlen(dir), name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path == NULL) return NULL;
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+
+/**
+ * (internal) Probe the header of a file and describe it as a track.
+ * Return 0 if the file is playable.
+ */
+static int probe_track(char *path, track_t *track)
+{
+    music_file_t info;
+    if (probe_music_file(path, &info)) {
+        LOG_DEBUG("[Library] %s is not a playable file", path);
+        return 1;
+    }
+    fclose(info.file);
+
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t const len = strrchr(base, '.') - base;
+    track->name = malloc(len + 1);
+    if (track->name == NULL) return 2;
+    memcpy(track->name, base, len);
+    track->name[len] = 0;
+    track->path = path;
+    track->channels = info.channels;
+    track->sample_rate = info.sample_rate;
+    track->bits_per_sample = info.bits_per_sample;
+    unsigned long const oct_per_sec =
+        info.bits_per_sample * info.sample_rate * info.channels / 8;
+    track->duration_ms = oct_per_sec ?
+        (uint64_t) info.data_size * 1000 / oct_per_sec : 0;
+    return 0;
+}
+
+
+/**
+ * (internal) Add a directory to the queue. Library must be locked.
+ */
+static int push_scan_dir(library_t *lib, char *path)
+{
+    scan_dir_t *dir = malloc(sizeof(scan_dir_t));
+    if (dir == NULL) {
+        LOG_ERROR("Couldn't allocate a directory to scan.");
+        free(path);
+        return 2;
+    }
+    dir->path = path;
+    dir->next = lib->queue;
+    lib->queue = dir;
+    pthread_cond_signal(&(lib->cond));
+    return 0;
+}
+
+
+/**
+ * (internal) Scan one directory: queue sub-directories and probe files.
+ * Return the number of files seen.
+ */
+static unsigned long scan_one_dir(library_t *lib, const char *dir_path,
+                                  track_t **found, size_t *count, size_t *capacity)
+{
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        LOG_ERRNO(dir_path);
+        return 0;
+    }
+    unsigned long files = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        int is_dir = ent->d_type == DT_DIR;
+        int is_reg = ent->d_type == DT_REG;
+        if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+            // Some file systems do not give the type. Links to files are
+            // followed, links to directories are not to avoid cycles.
+            char *path = join_path(dir_path, ent->d_name);
+            struct stat st;
+            if (path != NULL && stat(path, &st) == 0) {
+                is_dir = S_ISDIR(st.st_mode) && ent->d_type != DT_LNK;
+                is_reg = S_ISREG(st.st_mode);
+            }
+            free(path);
+        }
+
+        if (is_dir) {
+            char *path = join_path(dir_path, ent->d_name);
+            if (path != NULL) {
+                pthread_mutex_lock(&(lib->mutex));
+                push_scan_dir(lib, path);
+                pthread_mutex_unlock(&(lib->mutex));
+            }
+        } else if (is_reg) {
+            files++;
+            if (!is_music_file_name(ent->d_name)) continue;
+            if (*count == *capacity) {
+                size_t const new_capacity = *capacity ? 2 * *capacity : 64;
+                track_t *new_found = realloc(*found, new_capacity * sizeof(track_t));
+                if (new_found == NULL) {
+                    LOG_ERROR("Couldn't allocate tracks.");
+                    break;
+                }
+                *found = new_found;
+                *capacity = new_capacity;
+            }
+            char *path = join_path(dir_path, ent->d_name);
+            if (path == NULL) break;
+            if (probe_track(path, &((*found)[*count]))) {
+                free(path);
+            } else {
+                (*count)++;
+            }
+        }
+    }
+    closedir(dir);
+    return files;
+}
+
+
+/**
+ * (internal) Scanning thread. Threads take directories from a shared queue
+ * until it is empty and no other thread may fill it.
+ */
+static void* routine_scan(void *arg)
+{
+    library_t *lib = arg;
+    track_t *found = NULL;
+    size_t count = 0, capacity = 0;
+    unsigned long files = 0;
+
+    pthread_mutex_lock(&(lib->mutex));
+    for (;;) {
+        while (lib->queue == NULL && lib->busy > 0) {
+            pthread_cond_wait(&(lib->cond), &(lib->mutex));
+        }
+        if (lib->queue == NULL) break;
+        scan_dir_t *dir = lib->queue;
+        lib->queue = dir->next;
+        lib->busy++;
+        pthread_mutex_unlock(&(lib->mutex));
+
+        files += scan_one_dir(lib, dir->path, &found, &count, &capacity);
+        free(dir->path);
+        free(dir);
+
+        pthread_mutex_lock(&(lib->mutex));
+        lib->busy--;
+        if (lib->queue == NULL && lib->busy == 0) {
+            pthread_cond_broadcast(&(lib->cond));
+        }
+    }
+
+    // Hand tracks over to the library
+    lib->files += files;
+    if (lib->found_count + count > lib->found_capacity) {
+        size_t const new_capacity = lib->found_count + count;
+        track_t *new_found = realloc(lib->found, new_capacity * sizeof(track_t));
+        if (new_found == NULL) {
+            LOG_ERROR("Couldn't allocate tracks.");
+            free_tracks(found, count);
+            count = 0;
+        } else {
+            lib->found = new_found;
+            lib->found_capacity = new_capacity;
+        }
+    }
+    memcpy(lib->found + lib->found_count, found, count * sizeof(track_t));
+    lib->found_count += count;
+    free(found);
+
+    // The last thread publishes the tracks
+    if (++lib->exited == lib->nthreads) {
+        size_t const found_count = lib->found_count;
+        merge_found_tracks(lib);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double const elapsed = (now.tv_sec - lib->started.tv_sec) +
+            (now.tv_nsec - lib->started.tv_nsec) * 1e-9;
+        LOG_INFO("[Library] Scanned %lu files, %lu tracks in %.3f s with %u threads: "
+                 "%.0f files/s, %lu tracks in library",
+                 lib->files, (unsigned long) found_count, elapsed, lib->nthreads,
+                 elapsed > 0 ? lib->files / elapsed : 0., (unsigned long) lib->count);
+    }
+    pthread_mutex_unlock(&(lib->mutex));
+    return NULL;
+}
+
+
+/**
+ * Wait for the end of the running scan, if any
+ */
+int library_wait(library_t *lib)
+{
+    if (lib->threads == NULL) return 0;
+    unsigned i;
+    for (i = 0; i < lib->nthreads; i++) {
+        int ret = pthread_join(lib->threads[i], NULL);
+        if (ret) {
+            LOG_ERROR("pthread_join returned error code %d", ret);
+        }
+    }
+    free(lib->threads);
+    lib->threads = NULL;
+    lib->nthreads = 0;
+    return 0;
+}
+
+
+/**
+ * Scan a directory tree in the background with nthreads threads,
+ * or one thread per CPU if nthreads is 0
+ */
+int library_scan(library_t *lib, const char *dir, unsigned nthreads)
+{
+    // Only one scan at a time
+    pthread_mutex_lock(&(lib->mutex));
+    int const running = lib->threads != NULL && lib->exited < lib->nthreads;
+    pthread_mutex_unlock(&(lib->mutex));
+    if (running) {
+        LOG_ERROR("A scan is already running.");
+        return 1;
+    }
+    library_wait(lib);
+
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? ncpu : 1;
+    }
+    char *path = strdup(dir);
+    lib->threads = malloc(nthreads * sizeof(pthread_t));
+    if (path == NULL || lib->threads == NULL) {
+        LOG_ERROR("Couldn't allocate scanning threads.");
+        free(path);
+        free(lib->threads);
+        lib->threads = NULL;
+        return 2;
+    }
+
+    pthread_mutex_lock(&(lib->mutex));
+    lib->busy = 0;
+    lib->exited = 0;
+    lib->files = 0;
+    lib->nthreads = 0;
+    clock_gettime(CLOCK_MONOTONIC, &(lib->started));
+    push_scan_dir(lib, path);
+    // Threads which are started wait for the lock before working
+    unsigned i;
+    for (i = 0; i < nthreads; i++) {
+        int ret = pthread_create(&(lib->threads[i]), NULL, routine_scan, lib);
+        if (ret) {
+            LOG_ERROR("pthread_create returned error code %d", ret);
+            break;
+        }
+        lib->nthreads++;
+    }
+    if (lib->nthreads == 0) {
+        free(lib->queue->path);
+        free(lib->queue);
+        lib->queue = NULL;
+        free(lib->threads);
+        lib->threads = NULL;
+        pthread_mutex_unlock(&(lib->mutex));
+        return 1;
+    }
+    pthread_mutex_unlock(&(lib->mutex));
+    return 0;
+}
+
+
+/**
+ * (internal) Index of the first track whose name is not before the prefix.
+ * Library must be locked.
+ */
+static size_t lower_bound(library_t *lib, const char *prefix)
+{
+    size_t const len = strlen(prefix);
+    size_t lo = 0, hi = lib->count;
+    while (lo < hi) {
+        size_t const mid = lo + (hi - lo) / 2;
+        if (strncasecmp(lib->tracks[mid].name, prefix, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/**
+ * Find the path of a track by its name, or else by a prefix of its name.
+ * Return 0 if a track was found, 1 otherwise.
+ */
+int library_find(library_t *lib, const char *name, char *path, size_t path_size)
+{
+    int ret = 1;
+    pthread_mutex_lock(&(lib->mutex));
+    if (lib->count) {
+        track_t const *track = NULL;
+        size_t h = hash_name(name) & (lib->hash_size - 1);
+        for (; lib->hash[h]; h = (h + 1) & (lib->hash_size - 1)) {
+            if (!strcasecmp(lib->tracks[lib->hash[h] - 1].name, name)) {
+                track = &(lib->tracks[lib->hash[h] - 1]);
+                break;
+            }
+        }
+        if (track == NULL) {
+            size_t const i = lower_bound(lib, name);
+            if (i < lib->count && !strncasecmp(lib->tracks[i].name, name, strlen(name))) {
+                track = &(lib->tracks[i]);
+            }
+        }
+        if (track != NULL && strlen(track->path) < path_size) {
+            strcpy(path, track->path);
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&(lib->mutex));
+    return ret;
+}
+
+
+/**
+ * Print the tracks whose name starts with a prefix.
+ * Return the number of printed tracks.
+ */
+size_t library_print_search(library_t *lib, const char *prefix, size_t max_matches)
+{
+    size_t const len = strlen(prefix);
+    size_t n = 0;
+    pthread_mutex_lock(&(lib->mutex));
+    size_t i;
+    for (i = lower_bound(lib, prefix); i < lib->count && n < max_matches; i++, n++) {
+        track_t const *track = &(lib->tracks[i]);
+        if (strncasecmp(track->name, prefix, len)) break;
+        LOG_INFO("[Library] %s: %s (%lu channels, %lu Hz, %lu bits, %lu.%03lu s)",
+                 track->name, track->path, (unsigned long) track->channels,
+                 (unsigned long) track->sample_rate,
+                 (unsigned long) track->bits_per_sample,
+                 (unsigned long) track->duration_ms / 1000,
+                 (unsigned long) track->duration_ms % 1000);
+    }
+    pthread_mutex_unlock(&(lib->mutex));
+    return n;
+}
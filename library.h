@@ -0,0 +1,63 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// Default number of scanning threads, 0 means one per online CPU
+#define LIBRARY_SCAN_THREADS 0
+
+/**
+ * Playable track found by a scan
+ */
+typedef struct {
+    char *path;
+    // Basename of path without its extension, owned by the track
+    char *name;
+    uint_fast32_t channels;
+    uint_fast32_t sample_rate;
+    uint_fast32_t bits_per_sample;
+    uint_fast32_t duration_ms;
+} track_t;
+
+// Directory waiting to be scanned
+typedef struct scan_dir {
+    char *path;
+    struct scan_dir *next;
+} scan_dir_t;
+
+/**
+ * Track index built by parallel directory scans.
+ * Tracks are sorted by name for prefix search and hashed for exact search.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    track_t *tracks;
+    size_t count;
+    size_t *hash;
+    size_t hash_size;
+
+    // State of the running scan, protected by the mutex
+    pthread_cond_t cond;
+    pthread_t *threads;
+    unsigned nthreads;
+    scan_dir_t *queue;
+    unsigned busy;
+    unsigned exited;
+    track_t *found;
+    size_t found_count;
+    size_t found_capacity;
+    unsigned long files;
+    struct timespec started;
+} library_t;
+
+int library_init(library_t *lib);
+int library_destroy(library_t *lib);
+int library_scan(library_t *lib, const char *dir, unsigned nthreads);
+int library_wait(library_t *lib);
+int library_find(library_t *lib, const char *name, char *path, size_t path_size);
+size_t library_print_search(library_t *lib, const char *prefix, size_t max_matches);
+
+#endif /* LIBRARY_H */
@@ -0,0 +1,317 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "log.h"
+
+/**
+ * Log record. seq is the sequence number of the ring slot, which tells
+ * whether the record is free or ready to be written.
+ */
+typedef struct {
+    uint32_t seq;
+    int level;
+    struct timespec ts;
+    char msg[LOG_MSG_MAXLEN];
+} log_record_t;
+
+// Bounded multi-producer ring: producers claim a slot with a CAS on
+// enqueue_pos and the writer thread alone advances dequeue_pos
+static log_record_t ring[LOG_RING_SIZE];
+static uint32_t enqueue_pos = 0;
+static uint32_t dequeue_pos = 0;
+
+// Writer thread, woken up by a semaphore post for each record
+static sem_t ring_sem;
+static pthread_t writer_thread;
+static int running = 0;
+
+// Producers between their check of running and their semaphore post, which
+// log_stop() waits for before the last drain and the semaphore destruction
+static unsigned producers = 0;
+
+// Statistics
+static unsigned long written = 0;
+static unsigned long dropped = 0;
+
+int log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = { "error", "warning", "info", "debug" };
+static const char level_letters[] = "EWID";
+
+
+/**
+ * (internal) Write one formatted record to the log file
+ */
+static void print_record(FILE *f, int level, struct timespec const *ts,
+                         const char *msg)
+{
+    struct tm tm;
+    char date[16];
+    localtime_r(&(ts->tv_sec), &tm);
+    strftime(date, sizeof(date), "%H:%M:%S", &tm);
+    fprintf(f, "%s.%03ld %c %s\n", date, ts->tv_nsec / 1000000,
+            level_letters[level], msg);
+}
+
+
+/**
+ * (internal) Write every ready record. Only the writer thread calls this.
+ * Return the number of written records.
+ */
+static unsigned drain_ring()
+{
+    unsigned n = 0;
+    for (;;) {
+        log_record_t *rec = &ring[dequeue_pos % LOG_RING_SIZE];
+        uint32_t const seq = __atomic_load_n(&(rec->seq), __ATOMIC_ACQUIRE);
+        if ((int32_t) (seq - (dequeue_pos + 1)) < 0) break;
+        print_record(stdout, rec->level, &(rec->ts), rec->msg);
+        __atomic_store_n(&(rec->seq), dequeue_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        dequeue_pos++;
+        n++;
+    }
+    if (n) {
+        fflush(stdout);
+        __atomic_add_fetch(&written, n, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+
+/**
+ * (internal) Writer thread
+ */
+static void* routine_writer(void *arg)
+{
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if (sem_wait(&ring_sem) == -1 && errno != EINTR) {
+            perror("sem_wait");
+            break;
+        }
+        drain_ring();
+    }
+    drain_ring();
+    return NULL;
+}
+
+
+/**
+ * Start the writer thread. Until then, messages are written synchronously.
+ */
+int log_start()
+{
+    uint32_t i;
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        ring[i].seq = i;
+    }
+    enqueue_pos = dequeue_pos = 0;
+    if (sem_init(&ring_sem, 0, 0) == -1) {
+        perror("sem_init");
+        return 1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+    // Signals are for the main thread, block them in the writer thread
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    int ret = pthread_create(&writer_thread, NULL, routine_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (ret) {
+        fprintf(stderr, "pthread_create returned error code %d\n", ret);
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        sem_destroy(&ring_sem);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Write pending messages and stop the writer thread. Producers which
+ * already saw it running finish queueing their message first, and the
+ * next ones write synchronously.
+ */
+int log_stop()
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return 0;
+    __atomic_store_n(&running, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&producers, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+    sem_post(&ring_sem);
+    int ret = pthread_join(writer_thread, NULL);
+    if (ret) {
+        fprintf(stderr, "pthread_join returned error code %d\n", ret);
+        return 1;
+    }
+    sem_destroy(&ring_sem);
+    if (dropped) {
+        printf("[Log] %lu messages written, %lu dropped\n", written, dropped);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+
+/**
+ * Change the level of logged messages
+ */
+void log_set_level(int level)
+{
+    if (level < LOG_LEVEL_ERROR) level = LOG_LEVEL_ERROR;
+    if (level > LOG_LEVEL_DEBUG) level = LOG_LEVEL_DEBUG;
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Get a level from its name, or -1 if the name is unknown
+ */
+int log_parse_level(const char *name)
+{
+    int level;
+    for (level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++) {
+        if (!strcasecmp(name, level_names[level])) return level;
+    }
+    return -1;
+}
+
+
+/**
+ * Get the name of a level
+ */
+const char* log_level_name(int level)
+{
+    if (level < LOG_LEVEL_ERROR || level > LOG_LEVEL_DEBUG) return "?";
+    return level_names[level];
+}
+
+
+/**
+ * (internal) Queue a message without blocking.
+ * The message is dropped if the ring is full.
+ */
+static void vlog_write(int level, const char *format, va_list ap)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    // Either log_stop() sees this producer, or this producer sees that the
+    // writer thread stops
+    __atomic_add_fetch(&producers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&running, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&producers, 1, __ATOMIC_RELEASE);
+        // No writer thread, write synchronously
+        char msg[LOG_MSG_MAXLEN];
+        vsnprintf(msg, sizeof(msg), format, ap);
+        FILE *f = level <= LOG_LEVEL_WARNING ? stderr : stdout;
+        print_record(f, level, &ts, msg);
+        fflush(f);
+        return;
+    }
+
+    // Claim a slot
+    log_record_t *rec;
+    uint32_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &ring[pos % LOG_RING_SIZE];
+        uint32_t const seq = __atomic_load_n(&(rec->seq), __ATOMIC_ACQUIRE);
+        int32_t const diff = (int32_t) (seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Ring is full
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&producers, 1, __ATOMIC_RELEASE);
+            return;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Fill and publish it
+    rec->level = level;
+    rec->ts = ts;
+    vsnprintf(rec->msg, sizeof(rec->msg), format, ap);
+    __atomic_store_n(&(rec->seq), pos + 1, __ATOMIC_RELEASE);
+    sem_post(&ring_sem);
+    __atomic_sub_fetch(&producers, 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Log a message. Callers should use the LOG_* macros, which check the level.
+ */
+void log_write(int level, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vlog_write(level, format, ap);
+    va_end(ap);
+}
+
+
+/**
+ * Log a message followed by the description of errno, like perror()
+ */
+void log_errno(int level, const char *msg)
+{
+    int const err = errno;
+    char desc[128];
+    if (strerror_r(err, desc, sizeof(desc))) {
+        snprintf(desc, sizeof(desc), "error %d", err);
+    }
+    log_write(level, "%s: %s", msg, desc);
+    errno = err;
+}
+
+
+/**
+ * Tell whether a rate-limited call site may log now.
+ * The number of suppressed messages is logged when a new second begins.
+ */
+int log_ratelimit(log_ratelimit_t *state)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t window = __atomic_load_n(&(state->window), __ATOMIC_RELAXED);
+    if (window != now.tv_sec &&
+        __atomic_compare_exchange_n(&(state->window), &window, now.tv_sec, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        uint32_t const suppressed =
+            __atomic_exchange_n(&(state->suppressed), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(state->count), 0, __ATOMIC_RELAXED);
+        if (suppressed) {
+            log_write(LOG_LEVEL_WARNING, "[Log] %u similar messages suppressed",
+                      suppressed);
+        }
+    }
+    if (__atomic_fetch_add(&(state->count), 1, __ATOMIC_RELAXED) < LOG_RATELIMIT_BURST) {
+        return 1;
+    }
+    __atomic_add_fetch(&(state->suppressed), 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/**
+ * Get the number of written and dropped messages
+ */
+void log_stats(unsigned long *written_count, unsigned long *dropped_count)
+{
+    *written_count = __atomic_load_n(&written, __ATOMIC_RELAXED);
+    *dropped_count = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
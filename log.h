@@ -0,0 +1,68 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Log levels, from the most to the least important
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// Number of records in the ring and maximal length of a message
+#define LOG_RING_SIZE 1024
+#define LOG_MSG_MAXLEN 240
+
+// Messages of a rate-limited call site per second before dropping them
+#define LOG_RATELIMIT_BURST 5
+
+/**
+ * Rate limiting state of a call site
+ */
+typedef struct {
+    int64_t window;
+    uint32_t count;
+    uint32_t suppressed;
+} log_ratelimit_t;
+
+extern int log_level;
+
+int log_start();
+int log_stop();
+void log_set_level(int level);
+int log_parse_level(const char *name);
+const char* log_level_name(int level);
+void log_write(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void log_errno(int level, const char *msg);
+int log_ratelimit(log_ratelimit_t *state);
+void log_stats(unsigned long *written, unsigned long *dropped);
+
+#define LOG_ENABLED(level) (__atomic_load_n(&log_level, __ATOMIC_RELAXED) >= (level))
+
+#define LOG_AT(level, ...) \
+    do { \
+        if (LOG_ENABLED(level)) log_write(level, __VA_ARGS__); \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Replacement of perror()
+#define LOG_ERRNO(msg) \
+    do { \
+        if (LOG_ENABLED(LOG_LEVEL_ERROR)) log_errno(LOG_LEVEL_ERROR, msg); \
+    } while (0)
+
+// Log at most LOG_RATELIMIT_BURST messages per second from this call site
+#define LOG_RATELIMITED(level, ...) \
+    do { \
+        static log_ratelimit_t log_ratelimit_state_; \
+        if (LOG_ENABLED(level) && log_ratelimit(&log_ratelimit_state_)) { \
+            log_write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif /* LOG_H */
@@ -1,22 +1,47 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/stat.h>
+#include "cache.h"
 #include "daemon.h"
+#include "library.h"
+#include "log.h"
 #include "player.h"
+#include "playlist.h"
+#include "record.h"
+#include "status.h"
+#include "trace.h"
 
 #define DAEMON_DIRECTORY "."
 #define DAEMON_LOCKFILE "daemon.lock"
 #define DAEMON_LOGFILE "daemon.log"
 #define DAEMON_PIDFILE "daemon.pid"
 #define DAEMON_FIFOFILE "daemon.fifo"
+#define DAEMON_INDEXFILE "daemon.idx"
 
 #define LINE_MAXLEN 1024
 
+// Status a new daemon tells the interface: ready, failed to start, or
+// ready but the file given with --play couldn't be played
+#define READY_OK 0
+#define READY_FAILED 1
+#define READY_PLAY_FAILED 2
+
+// Period at which an active playlist is checked while no command comes,
+// and number of entries it tries at once before skipping them
+#define PLAYLIST_TICK_MSEC 200
+#define PLAYLIST_MAX_TRIES 16
+
 // Set to 1 when an INT, TERM or QUIT signal is received
 static int has_terminated_signal = 0;
 
@@ -85,6 +110,154 @@ int read_line(int fd, char *buffer, size_t bufsize, const char *prompt)
     return 1;
 }
 
+/**
+ * Log the last output levels in dBFS, and their spectrum
+ */
+void log_levels()
+{
+    meter_levels_t levels;
+    unsigned spectrum_hz;
+    int const ret = get_music_levels(&levels, &spectrum_hz);
+    if (ret == 2) {
+        LOG_ERROR("[Levels] The playing thread is stuck in an update");
+        return;
+    }
+    if (ret) {
+        LOG_INFO("[Levels] Off, enable them with \"levels on\"");
+        return;
+    }
+    if (!levels.blocks) {
+        LOG_INFO("[Levels] Nothing was played since levels were enabled");
+        return;
+    }
+    char text[LOG_MSG_MAXLEN];
+    size_t len = 0;
+    unsigned c;
+    for (c = 0; c < levels.channels && len < sizeof(text); c++) {
+        len += snprintf(text + len, sizeof(text) - len, " %.1f/%.1f",
+                        levels.peak[c] > 0 ? 20 * log10f(levels.peak[c]) : -INFINITY,
+                        levels.rms[c] > 0 ? 20 * log10f(levels.rms[c]) : -INFINITY);
+    }
+    LOG_INFO("[Levels] Block %llu, %lld ms ago, peak/RMS dBFS:%s",
+             (unsigned long long) levels.blocks,
+             (long long) ((playback_clock_now_ns() - levels.timestamp_ns) / 1000000), text);
+    if (levels.has_spectrum && spectrum_hz) {
+        len = 0;
+        for (c = 0; c < METER_BANDS && len < sizeof(text); c++) {
+            float const freq = meter_band_freq(c);
+            len += snprintf(text + len, sizeof(text) - len,
+                            freq < 1000 ? " %.0fHz %.0f" : " %.0fk %.0f",
+                            freq < 1000 ? freq : freq / 1000, levels.spectrum[c]);
+        }
+        LOG_INFO("[Levels] Spectrum dB, %u per second:%s", spectrum_hz, text);
+    }
+}
+
+/**
+ * Play a file now, or after the current track if queue is set. The current
+ * track is crossfaded, or stopped when the file can't follow it.
+ * Return 0 if the file plays or follows the current track.
+ */
+int play_music(music_buffer_t *music_buf, pthread_t *music_thread, const char *filename,
+               int queue, int trim)
+{
+    if (music_buf->playing) {
+        // Crossfade, or follow the current track
+        int const next = crossfade_music_buffer(music_buf, filename, !queue, trim);
+        if (next == 0 || next == 2) {
+            return next;
+        } else if (queue && !music_buf->finished) {
+            LOG_ERROR("%s can't follow the current track", filename);
+            return 1;
+        }
+        LOG_INFO("Stopping current music");
+        if (stop_play_loop_music_buffer(*music_thread, music_buf)) {
+            LOG_ERROR("stopping music failed");
+            return 1;
+        }
+        close_music_buffer(music_buf);
+    }
+    LOG_INFO("Playing %s", filename);
+    if (open_music_buffer(filename, music_buf, trim)) {
+        LOG_ERROR("open_music_buffer failed");
+        return 2;
+    } else if (start_play_loop_music_buffer(music_thread, music_buf)) {
+        // If playing fails, close music buffer
+        close_music_buffer(music_buf);
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * Play the next entries of an active playlist. The next entry is queued
+ * as soon as a track plays, so that its header is read before its turn
+ * and it follows without gap, or it plays when the current track ends if
+ * its format can't be converted. Entries which can't be opened are skipped.
+ */
+void advance_playlist(playlist_t *playlist, music_buffer_t *music_buf,
+                      pthread_t *music_thread)
+{
+    char path[PLAYLIST_PATH_MAX];
+    unsigned tries;
+    // A released stream is still paused
+    if (has_released_music()) return;
+    for (tries = 0; playlist->active && tries < PLAYLIST_MAX_TRIES; tries++) {
+        int const idle = !music_buf->playing || music_buf->finished;
+        if (!idle && (playlist->held || !wants_next_music_buffer(music_buf))) return;
+        if (playlist_peek(playlist, path, sizeof(path))) {
+            if (idle) {
+                LOG_INFO("[Playlist] End of %s", playlist->file_name);
+                playlist->active = 0;
+            }
+            return;
+        }
+        int ret;
+        if (idle) {
+            playlist->held = 0;
+            ret = play_music(music_buf, music_thread, path, 0, TRIM_DEFAULT);
+        } else {
+            ret = crossfade_music_buffer(music_buf, path, 0, TRIM_DEFAULT);
+            if (ret == 1) {
+                playlist->held = 1;
+                return;
+            }
+        }
+        playlist_advance(playlist);
+        if (ret) {
+            LOG_WARNING("[Playlist] Skipping %s", path);
+        }
+    }
+}
+
+/**
+ * Read a command from the FIFO, advancing an active playlist and releasing
+ * idle resources while no command comes. Return like read_line().
+ */
+int read_command(int fifo, char *line, playlist_t *playlist, music_buffer_t *music_buf,
+                 pthread_t *music_thread)
+{
+    struct pollfd pfd;
+    pfd.fd = fifo;
+    pfd.events = POLLIN;
+    for (;;) {
+        advance_playlist(playlist, music_buf, music_thread);
+        int timeout = playlist->active ? PLAYLIST_TICK_MSEC : -1;
+        int const idle = idle_music_buffer(*music_thread, music_buf);
+        if (idle >= 0 && (timeout < 0 || idle < timeout)) {
+            timeout = idle;
+        }
+        int const ret = poll(&pfd, 1, timeout);
+        if (ret > 0) break;
+        if (has_terminated_signal) return 1;
+        if (ret == -1 && errno != EINTR) {
+            LOG_ERRNO("poll(fifo)");
+            return -1;
+        }
+    }
+    return read_line(fifo, line, LINE_MAXLEN, NULL);
+}
+
 /**
  * Entry point of the program. Try to launch a daemon and then connect to it.
  */
@@ -92,22 +265,24 @@ int main(int argc, char **argv)
 {
     int ret = 0;
 
+    // "--play FILE" plays a file as soon as the daemon starts
+    const char *play_file = NULL;
+    if (argc == 3 && !strcmp(argv[1], "--play")) {
+        play_file = argv[2];
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [--play FILE]\n", argv[0]);
+        return 1;
+    }
+
     // Invoke a daemon. prog = 0 in daemon, 1 in parent process (= interface)
-    int prog = daemonize(DAEMON_DIRECTORY, DAEMON_LOCKFILE, DAEMON_LOGFILE, DAEMON_PIDFILE);
+    int ready_fd;
+    int prog = daemonize(DAEMON_DIRECTORY, DAEMON_LOCKFILE, DAEMON_LOGFILE, DAEMON_PIDFILE,
+                         &ready_fd);
     if (prog == -1) {
         fprintf(stderr, "Daemonization failed\n");
         return 1;
     }
 
-    // Both daemon and parent try to create a named pipe.
-    // Only the first mkfifo succeeds.
-    if (mkfifo(DAEMON_FIFOFILE, S_IRUSR|S_IWUSR) == -1) {
-        if (errno != EEXIST) {
-            perror("mkfifo");
-            return 1;
-        }
-    }
-
     // Setup signals
     signal(SIGINT, sighandler_term);
     signal(SIGQUIT, sighandler_term);
@@ -117,8 +292,19 @@ int main(int argc, char **argv)
 
     if (prog == 0) {
         // Daemon process
-        printf(">> Daemon is running :)\n");
-        fflush(stdout);
+        log_start();
+        trace_set_thread_name("command");
+        LOG_INFO(">> Daemon is running :)");
+
+        // Create the named pipe before telling the interface to open it
+        if (mkfifo(DAEMON_FIFOFILE, S_IRUSR|S_IWUSR) == -1 && errno != EEXIST) {
+            LOG_ERRNO("mkfifo");
+            daemon_notify_ready(ready_fd, READY_FAILED);
+            log_stop();
+            unlink(DAEMON_PIDFILE);
+            unlink(DAEMON_LOCKFILE);
+            return 1;
+        }
 
         // Main loop
         char line[LINE_MAXLEN + 1];
@@ -126,90 +312,546 @@ int main(int argc, char **argv)
         pthread_t music_thread;
         music_buffer_t music_buf;
         init_music_buffer(&music_buf);
+        clip_cache_t clip_cache;
+        clip_cache_init(&clip_cache, CLIP_CACHE_BUDGET);
+        metadata_index_t metadata_index;
+        metadata_index_init(&metadata_index);
+        metadata_index_load(&metadata_index, DAEMON_INDEXFILE);
+        set_music_metadata_index(&metadata_index);
+        library_t library;
+        library_init(&library);
+        // Without shared memory, the status is only read by commands
+        player_status_t private_status;
+        player_status_t *status = status_open(1);
+        if (status == NULL) {
+            memset(&private_status, 0, sizeof(private_status));
+            status = &private_status;
+        }
+        playback_clock_t *play_clock = &(status->clock);
+        set_music_status(status);
+        char track_path[LINE_MAXLEN + 1];
+        playlist_t playlist;
+        playlist_init(&playlist);
+        record_t recorder;
+        record_init(&recorder);
+
+        // The first file starts before the daemon tells it is ready, so
+        // that its first sample doesn't wait for the interface. Otherwise
+        // the device is left to other programs until a stream plays.
+        unsigned char ready = READY_OK;
+        if (play_file != NULL &&
+            play_music(&music_buf, &music_thread, play_file, 0, TRIM_DEFAULT)) {
+            ready = READY_PLAY_FAILED;
+        }
+        daemon_notify_ready(ready_fd, ready);
+
         while (ret == 0 && running && !has_terminated_signal) {
-            // Open the FIFO
-            int fifo = open(DAEMON_FIFOFILE, O_RDONLY);
+            // Open the FIFO without waiting for a writer, so that a playlist
+            // goes on while no interface is connected. Reads block once
+            // poll() tells there is a command.
+            int fifo = open(DAEMON_FIFOFILE, O_RDONLY | O_NONBLOCK);
+            if (fifo != -1 && fcntl(fifo, F_SETFL, fcntl(fifo, F_GETFL) & ~O_NONBLOCK) == -1) {
+                LOG_ERRNO("fcntl(fifo)");
+                close(fifo);
+                ret = 1;
+                break;
+            }
             if (fifo == -1) {
                 if (errno == EINTR && has_terminated_signal) {
-                    printf("Received termination signal\n");
+                    LOG_INFO("Received termination signal");
                     break;
                 }
-                perror("open(fifo)");
+                LOG_ERRNO("open(fifo)");
                 ret = 1;
                 break;
             }
 
-            // Read lines
+            // Read lines. The command trace event ends when the loop
+            // continues, so that every command is traced.
             int fifo_status = 0;
-            while ((fifo_status = read_line(fifo, line, LINE_MAXLEN, NULL)) == 0) {
-                printf("[Command] Reading '%s'\n", line);
+            for (; (fifo_status = read_command(fifo, line, &playlist, &music_buf,
+                                                &music_thread)) == 0;
+                 TRACE_END("command")) {
+                TRACE_BEGIN("command");
+                LOG_INFO("[Command] Reading '%s'", line);
 
                 if (!strcasecmp(line, "exit")) {
                     running = 0;
                     break;
-                } else if (!strncasecmp(line, "play ", 5)) {
-                    const char *filename = line + 5;
-                    if (music_buf.playing) {
-                        printf("Stopping current music\n");
-                        ret = stop_play_loop_music_buffer(music_thread, &music_buf);
-                        if (ret) {
-                            printf("stopping music failed\n");
-                            fflush(stdout);
-                            continue;
-                        }
-                        close_music_buffer(&music_buf);
+                } else if (!strncasecmp(line, "play ", 5) || !strncasecmp(line, "queue ", 6)) {
+                    int const queue = line[0] == 'q' || line[0] == 'Q';
+                    const char *filename = line + (queue ? 6 : 5);
+                    // The silent ends of this file may be kept or skipped
+                    int trim = TRIM_DEFAULT;
+                    if (!strncmp(filename, "--trim ", 7)) {
+                        trim = TRIM_ON;
+                        filename += 7;
+                    } else if (!strncmp(filename, "--no-trim ", 10)) {
+                        trim = TRIM_OFF;
+                        filename += 10;
                     }
-                    printf("Playing %s\n", filename);
-                    fflush(stdout);
-                    if (open_music_buffer(filename, &music_buf)) {
-                        fprintf(stderr, "open_music_buffer failed\n");
-                    } else if (start_play_loop_music_buffer(&music_thread, &music_buf)) {
-                        // If playing fails, close music buffer
-                        close_music_buffer(&music_buf);
+                    // Unknown files may be names of scanned tracks
+                    if (access(filename, F_OK) &&
+                        !library_find(&library, filename, track_path, sizeof(track_path))) {
+                        filename = track_path;
                     }
+                    if (!queue) {
+                        playlist.active = 0;
+                    }
+                    play_music(&music_buf, &music_thread, filename, queue, trim);
                 } else if (!strcasecmp(line, "stop")) {
+                    playlist.active = 0;
+                    forget_released_music();
                     // A file has to be running before stopping it
                     if (!music_buf.playing) {
                         continue;
                     }
-                    printf("Stopping current music\n");
+                    LOG_INFO("Stopping current music");
                     ret = stop_play_loop_music_buffer(music_thread, &music_buf);
                     if (ret) {
-                        printf("stopping music failed\n");
+                        LOG_ERROR("stopping music failed");
                         continue;
                     }
                     close_music_buffer(&music_buf);
                 } else if (!strcasecmp(line, "pause")) {
                     if (music_buf.playing) {
                         pause_loop_music_buffer(&music_buf);
-                        printf("-- PAUSE --\n");
+                        LOG_INFO("-- PAUSE --");
                     }
                 } else if (!strcasecmp(line, "play") || !strcasecmp(line, "resume")) {
                     if (music_buf.playing) {
                         resume_loop_music_buffer(&music_buf);
-                        printf("-- PLAYING --\n");
+                        LOG_INFO("-- PLAYING --");
+                    } else if (!restore_music_buffer(&music_thread, &music_buf)) {
+                        LOG_INFO("-- PLAYING --");
+                    }
+                } else if (!strncasecmp(line, "playlist", 8) &&
+                           (line[8] == 0 || line[8] == ' ')) {
+                    const char *arg = line[8] ? line + 9 : NULL;
+                    if (arg != NULL && !strncasecmp(arg, "shuffle ", 8) &&
+                        (!strcasecmp(arg + 8, "on") || !strcasecmp(arg + 8, "off"))) {
+                        playlist_set_shuffle(&playlist, !strcasecmp(arg + 8, "on"));
+                    } else if (arg != NULL && !strcasecmp(arg, "off")) {
+                        playlist_destroy(&playlist);
+                    } else if (arg != NULL) {
+                        // The first entry plays now, and the next ones follow
+                        if (playlist_load(&playlist, arg)) {
+                            continue;
+                        }
+                        playlist.active = 1;
+                        char path[PLAYLIST_PATH_MAX];
+                        if (music_buf.playing && !music_buf.finished &&
+                            !playlist_peek(&playlist, path, sizeof(path))) {
+                            playlist_advance(&playlist);
+                            if (play_music(&music_buf, &music_thread, path, 0, TRIM_DEFAULT)) {
+                                LOG_WARNING("[Playlist] Skipping %s", path);
+                            }
+                        }
+                    }
+                    if (playlist.count) {
+                        LOG_INFO("[Playlist] %s: %lu of %lu entries played, shuffle %s, %s",
+                                 playlist.file_name, (unsigned long) playlist.pos,
+                                 (unsigned long) playlist.count,
+                                 playlist.shuffle ? "on" : "off",
+                                 playlist.active ? "playing" : "stopped");
+                    } else {
+                        LOG_INFO("[Playlist] None, shuffle %s",
+                                 playlist.shuffle ? "on" : "off");
+                    }
+                } else if (!strncasecmp(line, "load ", 5)) {
+                    // Split "NAME FILE"
+                    char *name = line + 5;
+                    char *filename = strchr(name, ' ');
+                    if (filename == NULL) {
+                        LOG_ERROR("Usage: load NAME FILE");
+                        continue;
+                    }
+                    *(filename++) = 0;
+                    clip_cache_load(&clip_cache, name, filename);
+                } else if (!strncasecmp(line, "trigger ", 8)) {
+                    struct timespec triggered;
+                    clock_gettime(CLOCK_MONOTONIC, &triggered);
+                    clip_t *clip = clip_cache_acquire(&clip_cache, line + 8);
+                    if (clip == NULL) {
+                        LOG_ERROR("Clip %s is not loaded", line + 8);
+                        continue;
+                    }
+                    // Mix into current output, or start a new one if the
+                    // playing thread has nothing left to play
+                    int trig = trigger_music_buffer(&music_buf, clip, &triggered);
+                    if (trig == 1) {
+                        if (music_buf.playing) {
+                            stop_play_loop_music_buffer(music_thread, &music_buf);
+                            close_music_buffer(&music_buf);
+                        }
+                        if (open_clip_music_buffer(clip, &music_buf)) {
+                            LOG_ERROR("open_clip_music_buffer failed");
+                            clip_release(clip);
+                        } else if (start_play_loop_music_buffer(&music_thread, &music_buf)) {
+                            close_music_buffer(&music_buf);
+                            clip_release(clip);
+                        } else if (trigger_music_buffer(&music_buf, clip, &triggered)) {
+                            clip_release(clip);
+                        }
+                    } else if (trig) {
+                        clip_release(clip);
+                    }
+                } else if (!strncasecmp(line, "info ", 5)) {
+                    music_file_t info;
+                    if (!open_music_file(line + 5, &info)) {
+                        fclose(info.file);
+                        unsigned const oct_per_sec =
+                            info.bits_per_sample * info.sample_rate * info.channels / 8;
+                        LOG_INFO("[Info] %s: %lu channels, %lu Hz, %lu bits, %g seconds",
+                                 line + 5, (unsigned long) info.channels,
+                                 (unsigned long) info.sample_rate,
+                                 (unsigned long) info.bits_per_sample,
+                                 oct_per_sec ? (double) info.data_size / oct_per_sec : 0.);
+                    }
+                } else if (!strncasecmp(line, "scan ", 5)) {
+                    library_scan(&library, line + 5, LIBRARY_SCAN_THREADS);
+                } else if (!strncasecmp(line, "search ", 7)) {
+                    if (!library_print_search(&library, line + 7, 50)) {
+                        LOG_INFO("[Library] No track matches %s", line + 7);
+                    }
+                } else if (!strncasecmp(line, "loglevel", 8) &&
+                           (line[8] == 0 || line[8] == ' ')) {
+                    if (line[8] == ' ') {
+                        int level = log_parse_level(line + 9);
+                        if (level < 0) {
+                            LOG_ERROR("Unknown log level %s", line + 9);
+                            continue;
+                        }
+                        log_set_level(level);
+                    }
+                    // Always shown, even with a lower level
+                    log_write(LOG_LEVEL_ERROR, "[Log] Level is %s",
+                              log_level_name(log_level));
+                } else if (!strcasecmp(line, "position")) {
+                    playback_clock_snapshot_t snapshot;
+                    int64_t now;
+                    uint64_t const position = playback_clock_position(play_clock, &now);
+                    playback_clock_read(play_clock, &snapshot);
+                    if (snapshot.sample_rate) {
+                        LOG_INFO("[Position] %llu.%06llu s, frame %llu at %lld ns, "
+                                 "%llu frames queued",
+                                 (unsigned long long) (position / snapshot.sample_rate),
+                                 (unsigned long long) (position % snapshot.sample_rate *
+                                                       1000000 / snapshot.sample_rate),
+                                 (unsigned long long) position, (long long) now,
+                                 (unsigned long long) (snapshot.frames_written - position));
+                    } else {
+                        LOG_INFO("[Position] Nothing was played");
+                    }
+                } else if (!strncasecmp(line, "volume", 6) &&
+                           (line[6] == 0 || line[6] == ' ')) {
+                    // "volume [stream] PERCENT"
+                    if (line[6] == ' ') {
+                        const char *arg = line + 7;
+                        int const master = strncasecmp(arg, "stream ", 7) != 0;
+                        if (!master) arg += 7;
+                        char *end;
+                        double const percent = strtod(arg, &end);
+                        if (end == arg || *end != 0 ||
+                            set_volume_music_buffer(&music_buf, master, percent / 100)) {
+                            LOG_ERROR("Usage: volume [stream] PERCENT");
+                            continue;
+                        }
+                    }
+                    print_volume_music_buffer(&music_buf);
+                } else if (!strncasecmp(line, "replaygain", 10) &&
+                           (line[10] == 0 || line[10] == ' ')) {
+                    if (line[10] == ' ') {
+                        int mode = replaygain_parse_mode(line + 11);
+                        if (mode < 0) {
+                            LOG_ERROR("Unknown ReplayGain mode %s", line + 11);
+                            continue;
+                        }
+                        set_replaygain_music_buffer(&music_buf, mode);
+                    }
+                    print_volume_music_buffer(&music_buf);
+                } else if (!strncasecmp(line, "eq", 2) && (line[2] == 0 || line[2] == ' ')) {
+                    // "eq off", "eq BAND off" or "eq BAND TYPE FREQ [GAIN [Q]]"
+                    if (!strcasecmp(line, "eq off")) {
+                        eq_band_t const off = { EQ_OFF, 0, 0, 0 };
+                        unsigned i;
+                        for (i = 0; i < EQ_MAX_BANDS; i++) {
+                            set_eq_band_music_buffer(&music_buf, i, &off);
+                        }
+                    } else if (line[2] == ' ') {
+                        char type[16];
+                        unsigned index = 0;
+                        eq_band_t band = { EQ_OFF, 0, 0, 0 };
+                        int const n = sscanf(line + 3, "%u %15s %f %f %f", &index, type,
+                                             &(band.freq), &(band.gain), &(band.q));
+                        if (n >= 2) band.type = eq_parse_type(type);
+                        if (n < 4 && (band.type == EQ_PEAK || band.type == EQ_LOWSHELF ||
+                                      band.type == EQ_HIGHSHELF)) {
+                            band.type = -1;
+                        }
+                        if (n < 5) {
+                            band.q = band.type == EQ_PEAK ? 1 : 0.7071;
+                        }
+                        if (n < 2 || band.type < 0 || (band.type != EQ_OFF && n < 3) ||
+                            index < 1 ||
+                            set_eq_band_music_buffer(&music_buf, index - 1, &band)) {
+                            LOG_ERROR("Usage: eq off | eq BAND off | eq BAND TYPE FREQ [GAIN [Q]]");
+                            continue;
+                        }
+                    }
+                    print_eq_music_buffer(&music_buf);
+                } else if (!strncasecmp(line, "crossfade", 9) &&
+                           (line[9] == 0 || line[9] == ' ')) {
+                    if (line[9] == ' ') {
+                        char *end;
+                        double const seconds = strtod(line + 10, &end);
+                        if (end == line + 10 || *end != 0 || seconds < 0 || seconds > 60) {
+                            LOG_ERROR("Usage: crossfade SECONDS, up to 60");
+                            continue;
+                        }
+                        set_music_crossfade(seconds * 1000);
                     }
+                    LOG_INFO("[Crossfade] %u ms", get_music_crossfade());
+                } else if (!strncasecmp(line, "silence", 7) &&
+                           (line[7] == 0 || line[7] == ' ')) {
+                    // "silence [on [DB]|off]"
+                    float db;
+                    int enabled = get_music_trim(&db);
+                    if (!strcasecmp(line + 7, " off")) {
+                        enabled = 0;
+                    } else if (!strncasecmp(line + 7, " on", 3) &&
+                               (line[10] == 0 || line[10] == ' ')) {
+                        enabled = 1;
+                        if (line[10] == ' ') {
+                            char *end;
+                            db = strtod(line + 11, &end);
+                            if (end == line + 11 || *end != 0 || db < -96 || db > 0) {
+                                LOG_ERROR("Usage: silence on [DB], from -96 to 0");
+                                continue;
+                            }
+                        }
+                    } else if (line[7] != 0) {
+                        LOG_ERROR("Usage: silence [on [DB]|off]");
+                        continue;
+                    }
+                    set_music_trim(enabled, db);
+                    LOG_INFO("[Silence] %s skipping ends under %.1f dBFS",
+                             enabled ? "Now" : "Not", db);
+                } else if (!strncasecmp(line, "levels", 6) &&
+                           (line[6] == 0 || line[6] == ' ')) {
+                    // "levels [on [SPECTRUM_HZ]|off]"
+                    if (!strcasecmp(line + 6, " off")) {
+                        set_music_levels(0, 0);
+                        LOG_INFO("[Levels] Off");
+                        continue;
+                    } else if (!strncasecmp(line + 6, " on", 3) &&
+                               (line[9] == 0 || line[9] == ' ')) {
+                        char *end = line + 9;
+                        long const hz = line[9] ? strtol(line + 10, &end, 10) : 0;
+                        if (*end != 0 || end == line + 10 || hz < 0 || hz > 100) {
+                            LOG_ERROR("Usage: levels on [SPECTRUM_HZ], up to 100");
+                            continue;
+                        }
+                        set_music_levels(1, hz);
+                    } else if (line[6] != 0) {
+                        LOG_ERROR("Usage: levels [on [SPECTRUM_HZ]|off]");
+                        continue;
+                    }
+                    log_levels();
+                } else if (!strncasecmp(line, "output", 6) &&
+                           (line[6] == 0 || line[6] == ' ')) {
+                    // "output [add|remove DEVICE]", from the next stream on
+                    if (!strncasecmp(line + 6, " add ", 5)) {
+                        if (add_music_output(line + 11)) {
+                            LOG_ERROR("Can't add %s: up to %d other devices, "
+                                      "each once", line + 11, FANOUT_MAX_DEVICES);
+                            continue;
+                        }
+                    } else if (!strncasecmp(line + 6, " remove ", 8)) {
+                        if (remove_music_output(line + 14)) {
+                            LOG_ERROR("%s is not an output", line + 14);
+                            continue;
+                        }
+                    } else if (line[6] != 0) {
+                        LOG_ERROR("Usage: output [add|remove DEVICE]");
+                        continue;
+                    }
+                    print_outputs_music_buffer(&music_buf);
+                } else if (!strncasecmp(line, "remap", 5) &&
+                           (line[5] == 0 || line[5] == ' ')) {
+                    int map[MATRIX_MAX_CHANNELS];
+                    if (!strcasecmp(line + 5, " auto")) {
+                        set_music_channel_map(map, 0);
+                    } else if (line[5] == ' ') {
+                        int const count = matrix_parse_map(line + 6, map);
+                        if (count < 0) {
+                            LOG_ERROR("Usage: remap auto | remap CHANNEL,CHANNEL,...");
+                            continue;
+                        }
+                        set_music_channel_map(map, count);
+                    }
+                    unsigned const count = get_music_channel_map(map);
+                    if (!count) {
+                        LOG_INFO("[Remap] Channels are mixed when the device needs it");
+                    } else {
+                        char text[4 * MATRIX_MAX_CHANNELS] = "";
+                        size_t len = 0;
+                        unsigned i;
+                        for (i = 0; i < count; i++) {
+                            const char *const sep = i ? "," : "";
+                            if (map[i] < 0) {
+                                len += snprintf(text + len, sizeof(text) - len, "%s-", sep);
+                            } else {
+                                len += snprintf(text + len, sizeof(text) - len, "%s%d",
+                                                sep, map[i] + 1);
+                            }
+                        }
+                        LOG_INFO("[Remap] Device channels play %s, from the next stream", text);
+                    }
+                } else if (!strncasecmp(line, "speed", 5) &&
+                           (line[5] == 0 || line[5] == ' ')) {
+                    if (line[5] == ' ') {
+                        char *end;
+                        double const speed = strtod(line + 6, &end);
+                        if (end == line + 6 || *end != 0 ||
+                            set_speed_music_buffer(&music_buf, speed)) {
+                            LOG_ERROR("Usage: speed FACTOR, from %.1f to %.1f",
+                                      STRETCH_MIN_SPEED, STRETCH_MAX_SPEED);
+                            continue;
+                        }
+                    }
+                    LOG_INFO("[Speed] %.2fx", get_speed_music_buffer());
+                } else if (!strncasecmp(line, "schedule", 8) &&
+                           (line[8] == 0 || line[8] == ' ')) {
+                    if (!strcasecmp(line + 8, " latency")) {
+                        set_music_schedule(SCHEDULE_LATENCY);
+                    } else if (!strcasecmp(line + 8, " power")) {
+                        set_music_schedule(SCHEDULE_POWER);
+                    } else if (line[8] != 0) {
+                        LOG_ERROR("Usage: schedule [latency|power]");
+                        continue;
+                    }
+                    print_schedule_music_buffer(&music_buf);
+                } else if (!strncasecmp(line, "idle", 4) && (line[4] == 0 || line[4] == ' ')) {
+                    // "idle [SECONDS|off]"
+                    if (!strcasecmp(line + 4, " off")) {
+                        set_music_idle(0);
+                    } else if (line[4] == ' ') {
+                        char *end;
+                        double const seconds = strtod(line + 5, &end);
+                        if (end == line + 5 || *end != 0 || seconds < 1 || seconds > 86400) {
+                            LOG_ERROR("Usage: idle [SECONDS|off], from 1 to 86400");
+                            continue;
+                        }
+                        set_music_idle(seconds * 1000);
+                    }
+                    if (get_music_idle()) {
+                        LOG_INFO("[Idle] The device and the buffers are released after "
+                                 "%g s of pause or stop", get_music_idle() / 1000.);
+                    } else {
+                        LOG_INFO("[Idle] The device and the buffers are kept");
+                    }
+                } else if (!strncasecmp(line, "record", 6) &&
+                           (line[6] == 0 || line[6] == ' ')) {
+                    // "record [FILE [RATE] [CHANNELS] [BITS]|stop]"
+                    if (!strcasecmp(line + 6, " stop")) {
+                        if (record_stop(&recorder)) {
+                            LOG_ERROR("[Record] Not recording");
+                        }
+                        continue;
+                    } else if (line[6] == ' ') {
+                        unsigned rate = RECORD_DEFAULT_RATE;
+                        unsigned channels = RECORD_DEFAULT_CHANNELS;
+                        unsigned bits = RECORD_DEFAULT_BITS;
+                        char *const file_name = line + 7;
+                        char *const args = strchr(file_name, ' ');
+                        int n = 0;
+                        if (args != NULL) {
+                            char extra;
+                            *args = 0;
+                            n = sscanf(args + 1, "%u %u %u %c", &rate, &channels, &bits,
+                                       &extra);
+                        }
+                        if (file_name[0] == 0 || (args != NULL && (n < 1 || n > 3)) ||
+                            rate < 8000 || rate > 192000 || channels < 1 ||
+                            channels > MATRIX_MAX_CHANNELS || (bits != 8 && bits != 16)) {
+                            LOG_ERROR("Usage: record FILE [RATE] [CHANNELS] [BITS], "
+                                      "in 8 or 16 bits | record stop");
+                            continue;
+                        }
+                        record_start(&recorder, file_name, rate, channels, bits);
+                        continue;
+                    }
+                    record_print(&recorder);
+                } else if (!strcasecmp(line, "trace start")) {
+                    trace_start();
+                } else if (!strncasecmp(line, "trace stop ", 11)) {
+                    TRACE_END("command");
+                    trace_stop(line + 11);
+                    continue;
+                } else if (!strcasecmp(line, "stats")) {
+                    unsigned long log_written, log_dropped;
+                    clip_cache_print_stats(&clip_cache);
+                    metadata_index_print_stats(&metadata_index);
+                    print_kernels_music_buffer(&music_buf);
+                    print_schedule_music_buffer(&music_buf);
+                    if (recorder.active) {
+                        record_print(&recorder);
+                    }
+                    log_stats(&log_written, &log_dropped);
+                    LOG_INFO("[Log] %lu messages written, %lu dropped",
+                             log_written, log_dropped);
                 }
-                fflush(stdout);
             }
 
             if (fifo_status == -1) {
-                fprintf(stderr, "Daemon exits now because read_line had a problem\n");
+                LOG_ERROR("Daemon exits now because read_line had a problem");
                 ret = 1;
             }
 
             // Got an error or an end of file, close FIFO
             close(fifo);
         }
+        if (music_buf.playing) {
+            stop_play_loop_music_buffer(music_thread, &music_buf);
+            close_music_buffer(&music_buf);
+        }
+        record_stop(&recorder);
+        release_music_device();
+        forget_released_music();
         destroy_music_buffer(&music_buf);
+        playlist_destroy(&playlist);
+        clip_cache_destroy(&clip_cache);
+        library_destroy(&library);
+        set_music_metadata_index(NULL);
+        set_music_status(NULL);
+        if (status != &private_status) {
+            status_close(status, 1);
+        }
+        metadata_index_save(&metadata_index, DAEMON_INDEXFILE);
+        metadata_index_destroy(&metadata_index);
 
         unlink(DAEMON_FIFOFILE);
-        printf("<< Daemon now exits with value %d\n", ret);
+        LOG_INFO("<< Daemon now exits with value %d", ret);
+        log_stop();
         unlink(DAEMON_PIDFILE);
         unlink(DAEMON_LOCKFILE);
     } else {
         // Interface process
         printf(">> Interface is running :)\n");
+
+        // Wait for a new daemon, whose FIFO may not exist yet
+        if (ready_fd != -1) {
+            int const ready = daemon_wait_ready(ready_fd);
+            if (ready == READY_OK) {
+                printf("Daemon is ready.\n");
+            } else if (ready == READY_PLAY_FAILED) {
+                printf("Daemon is ready, but couldn't play %s.\n", play_file);
+            } else {
+                fprintf(stderr, "Daemon didn't start, see %s\n", DAEMON_LOGFILE);
+                return 1;
+            }
+        }
         printf("Please type \"help\" to get help\n");
         fflush(stdout);
 
@@ -220,6 +862,18 @@ int main(int argc, char **argv)
             ret = 1;
         }
 
+        // A running daemon gets the file as a command
+        if (fifo != -1 && ready_fd == -1 && play_file != NULL) {
+            char command[LINE_MAXLEN + 1];
+            int const len = snprintf(command, sizeof(command), "play %s\n", play_file);
+            if (len < 0 || len >= (int) sizeof(command) || write(fifo, command, len) == -1) {
+                fprintf(stderr, "Couldn't send the file to play\n");
+            }
+        }
+
+        // Status page of the daemon, mapped when first needed
+        player_status_t *status = NULL;
+
         // Read commands from standard input
         int stdin_status = 0;
         char line[LINE_MAXLEN + 1];
@@ -229,16 +883,62 @@ int main(int argc, char **argv)
                 // Show help
                 printf("\
 Daemon control commands:\n\
-    exit          terminate the daemon\n\
-    pause         pause playback\n\
-    play          resume playback\n\
-    play FILE     play given music file, in WAVE or AU format\n\
-    resume        resume playback\n\
-    stop          stop playback\n\
+    crossfade [SECONDS]  show or set the overlap between tracks, 0 to disable\n\
+    eq                show the bands of the equalizer\n\
+    eq BAND TYPE FREQ [GAIN [Q]]  set a band from 1 to 10, of type peak, lowshelf,\n\
+                      highshelf (which need a gain in dB), lowpass or highpass\n\
+    eq BAND off       remove a band, or every band with \"eq off\"\n\
+    exit              terminate the daemon\n\
+    idle [SECONDS|off]  show or set the pause or stop after which the device and\n\
+                      the buffers are released, resuming where it paused\n\
+    info FILE         print the format and duration of a music file\n\
+    levels            print the peak and RMS levels of the output\n\
+    levels on [HZ]    measure levels, and a spectrum HZ times per second\n\
+    levels off        stop measuring levels\n\
+    load NAME FILE    decode a short clip into the in-memory cache\n\
+    loglevel [LEVEL]  show or set the log level: error, warning, info, debug\n\
+    output            list the devices which play the output\n\
+    output add|remove DEVICE  play the output on another device too, or stop,\n\
+                      like /dev/dsp1, from the next stream on\n\
+    pause             pause playback\n\
+    play              resume playback\n\
+    play FILE         play given music file, in WAVE or AU format\n\
+    play NAME         play a scanned track given its name or a prefix of it\n\
+    play --trim|--no-trim FILE|NAME  play, skipping the silent ends or not\n\
+    playlist          show the position in the playlist\n\
+    playlist FILE     play the entries of an M3U or PLS playlist\n\
+    playlist shuffle on|off  play the remaining entries in a random order or not\n\
+    playlist off      forget the playlist\n\
+    position          print the position of the played stream\n\
+    queue [--trim|--no-trim] FILE|NAME  play a file or a track after the current one\n\
+    record FILE [RATE] [CHANNELS] [BITS]  record the device to a WAVE file, at\n\
+                      44100 Hz, 2 channels and 16 bits by default\n\
+    record            show the state of the recording\n\
+    record stop       stop recording and write the sizes of the file\n\
+    remap [MAP]       show or set the stream channel of each device channel,\n\
+                      like 2,1 or 1,1,-,- (\"-\" is silent), or auto\n\
+    replaygain [MODE] show or set which ReplayGain tags apply: off, track, album\n\
+    resume            resume playback\n\
+    schedule [PROFILE]  show or set how the output is written: latency writes\n\
+                      each block, power sleeps until the device runs low and\n\
+                      refills it at once, with wakeups and syscalls per second\n\
+    scan DIR          look for music files in a directory tree\n\
+    search PREFIX     list scanned tracks whose name starts with PREFIX\n\
+    silence [on [DB]|off]  show or set whether silent ends of files are skipped,\n\
+                      under DB dBFS (-60 by default)\n\
+    speed [FACTOR]    show or set the playback speed, without changing the pitch\n\
+    stats             print statistics in the daemon log\n\
+    stop              stop playback\n\
+    trace start       record timing events of the daemon threads\n\
+    trace stop FILE   stop recording and write events as a Chrome trace\n\
+    trigger NAME      mix a cached clip into the output\n\
+    volume [PERCENT]  show or set the master volume\n\
+    volume stream PERCENT  set the volume of the played stream\n\
 \n\
 Interface commands:\n\
-    help          show this help\n\
-    !exit         quit the interface without terminating the daemon\n\
+    help              show this help\n\
+    !exit             quit the interface without terminating the daemon\n\
+    !status           print the status the daemon publishes in shared memory\n\
 \n");
             } else if (line[0] != '!') {
                 // Send command
@@ -260,6 +960,20 @@ Interface commands:\n\
             } else if (!strcasecmp(line, "!exit")) {
                 // Detach the interface by closing the FIFO
                 break;
+            } else if (!strcasecmp(line, "!status")) {
+                // Read the status without sending a command to the daemon
+                if (status == NULL) {
+                    status = status_open(0);
+                }
+                if (status != NULL) {
+                    player_status_t copy;
+                    if (status_read(status, &copy) < 0) {
+                        fprintf(stderr, "The status is stuck in an update, "
+                                "the daemon may have died\n");
+                    } else {
+                        status_print(stdout, &copy);
+                    }
+                }
             }
         }
 
@@ -268,6 +982,9 @@ Interface commands:\n\
             ret = 1;
         }
         close(fifo);
+        if (status != NULL) {
+            status_close(status, 0);
+        }
         printf("<< Interface exits with value %d\n", ret);
     }
 
@@ -0,0 +1,374 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrix.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Speaker positions, in the order of WAVE files
+#define SPEAKER_FL 0
+#define SPEAKER_FR 1
+#define SPEAKER_FC 2
+#define SPEAKER_LFE 3
+#define SPEAKER_BL 4
+#define SPEAKER_BR 5
+#define SPEAKER_SL 6
+#define SPEAKER_SR 7
+#define SPEAKER_BC 8
+
+// Usual layouts by number of channels, from mono to 7.1
+static const int layouts[MATRIX_MAX_CHANNELS][MATRIX_MAX_CHANNELS] = {
+    { SPEAKER_FC },
+    { SPEAKER_FL, SPEAKER_FR },
+    { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC },
+    { SPEAKER_FL, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR },
+    { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_BL, SPEAKER_BR },
+    { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BL, SPEAKER_BR },
+    { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BC, SPEAKER_SL, SPEAKER_SR },
+    { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BL, SPEAKER_BR,
+      SPEAKER_SL, SPEAKER_SR },
+};
+
+// Weight of a speaker which is folded into two others, -3 dB
+#define MATRIX_FOLD 0.70710678f
+
+
+/**
+ * (internal) Find a speaker in the output layout, -1 if it's missing
+ */
+static int find_speaker(unsigned channels, int speaker)
+{
+    unsigned c;
+    for (c = 0; c < channels; c++) {
+        if (layouts[channels - 1][c] == speaker) return c;
+    }
+    return -1;
+}
+
+
+/**
+ * (internal) Add input channel in, played by a speaker, to the output
+ * channels which stand in for that speaker
+ */
+static void route(matrix_t *matrix, unsigned in, int speaker, float gain)
+{
+    int const out = find_speaker(matrix->out_channels, speaker);
+    if (out >= 0) {
+        matrix->coefs[out][in] += gain;
+        return;
+    }
+    switch (speaker) {
+        case SPEAKER_FL:
+        case SPEAKER_FR:
+            // Only mono lacks front speakers, and has a center
+            route(matrix, in, SPEAKER_FC, gain * MATRIX_FOLD);
+            break;
+        case SPEAKER_FC:
+            route(matrix, in, SPEAKER_FL, gain * MATRIX_FOLD);
+            route(matrix, in, SPEAKER_FR, gain * MATRIX_FOLD);
+            break;
+        case SPEAKER_BL:
+        case SPEAKER_SL: {
+            int const other = speaker == SPEAKER_BL ? SPEAKER_SL : SPEAKER_BL;
+            if (find_speaker(matrix->out_channels, other) >= 0) {
+                route(matrix, in, other, gain);
+            } else {
+                route(matrix, in, SPEAKER_FL, gain * MATRIX_FOLD);
+            }
+            break;
+        }
+        case SPEAKER_BR:
+        case SPEAKER_SR: {
+            int const other = speaker == SPEAKER_BR ? SPEAKER_SR : SPEAKER_BR;
+            if (find_speaker(matrix->out_channels, other) >= 0) {
+                route(matrix, in, other, gain);
+            } else {
+                route(matrix, in, SPEAKER_FR, gain * MATRIX_FOLD);
+            }
+            break;
+        }
+        case SPEAKER_BC:
+            route(matrix, in, SPEAKER_BL, gain * MATRIX_FOLD);
+            route(matrix, in, SPEAKER_BR, gain * MATRIX_FOLD);
+            break;
+        default:
+            // The LFE channel is dropped without a subwoofer
+            break;
+    }
+}
+
+
+/**
+ * (internal) Choose the loop for the shape of a matrix
+ */
+static void choose_kernel(matrix_t *matrix)
+{
+    if (matrix->in_channels == 1 && matrix->out_channels == 2) {
+        matrix->kernel = MATRIX_KERNEL_1_TO_2;
+    } else if (matrix->in_channels == 2 && matrix->out_channels == 1) {
+        matrix->kernel = MATRIX_KERNEL_2_TO_1;
+    } else if (matrix->out_channels == 2) {
+        matrix->kernel = MATRIX_KERNEL_TO_2;
+    } else {
+        matrix->kernel = MATRIX_KERNEL_GENERIC;
+    }
+}
+
+
+/**
+ * Build the standard matrix between two channel counts. Downmixes fold
+ * missing speakers into their neighbours at -3 dB, drop the LFE channel,
+ * and are scaled so that they can't clip. Mono plays on both front
+ * speakers, other upmixes leave extra speakers silent.
+ * Return 1 if a channel count is not supported.
+ */
+int matrix_init_default(matrix_t *matrix, unsigned in_channels, unsigned out_channels)
+{
+    if (in_channels < 1 || in_channels > MATRIX_MAX_CHANNELS ||
+        out_channels < 1 || out_channels > MATRIX_MAX_CHANNELS) {
+        return 1;
+    }
+    memset(matrix, 0, sizeof(*matrix));
+    matrix->in_channels = in_channels;
+    matrix->out_channels = out_channels;
+    unsigned i, o;
+    if (in_channels == 1 && out_channels >= 2) {
+        route(matrix, 0, SPEAKER_FL, 1);
+        route(matrix, 0, SPEAKER_FR, 1);
+    } else {
+        for (i = 0; i < in_channels; i++) {
+            route(matrix, i, layouts[in_channels - 1][i], 1);
+        }
+    }
+
+    float max_sum = 0;
+    for (o = 0; o < out_channels; o++) {
+        float sum = 0;
+        for (i = 0; i < in_channels; i++) {
+            sum += fabsf(matrix->coefs[o][i]);
+        }
+        if (sum > max_sum) max_sum = sum;
+    }
+    if (max_sum > 1) {
+        for (o = 0; o < out_channels; o++) {
+            for (i = 0; i < in_channels; i++) {
+                matrix->coefs[o][i] /= max_sum;
+            }
+        }
+    }
+    choose_kernel(matrix);
+    return 0;
+}
+
+
+/**
+ * Build a routing matrix: output channel o copies input channel map[o], or
+ * is silent if map[o] is negative.
+ * Return 1 if the map uses a missing input channel.
+ */
+int matrix_init_map(matrix_t *matrix, unsigned in_channels, int const *map,
+                    unsigned out_channels)
+{
+    if (in_channels < 1 || in_channels > MATRIX_MAX_CHANNELS ||
+        out_channels < 1 || out_channels > MATRIX_MAX_CHANNELS) {
+        return 1;
+    }
+    memset(matrix, 0, sizeof(*matrix));
+    matrix->in_channels = in_channels;
+    matrix->out_channels = out_channels;
+    unsigned o;
+    for (o = 0; o < out_channels; o++) {
+        if (map[o] >= (int) in_channels) return 1;
+        if (map[o] >= 0) {
+            matrix->coefs[o][map[o]] = 1;
+        }
+    }
+    choose_kernel(matrix);
+    return 0;
+}
+
+
+/**
+ * (internal) Multiply frames by any matrix. Each output frame is a sum of
+ * the columns of the matrix weighted by the input samples.
+ */
+static void apply_generic(matrix_t const *matrix, float *out, float const *in,
+                          size_t frames)
+{
+    unsigned const ic = matrix->in_channels, oc = matrix->out_channels;
+    size_t f;
+    unsigned i, o;
+#ifdef __SSE2__
+    // Columns in two vectors of 4 output channels
+    __m128 cols[MATRIX_MAX_CHANNELS][2];
+    for (i = 0; i < ic; i++) {
+        float col[8] = { 0 };
+        for (o = 0; o < oc; o++) {
+            col[o] = matrix->coefs[o][i];
+        }
+        cols[i][0] = _mm_loadu_ps(col);
+        cols[i][1] = _mm_loadu_ps(col + 4);
+    }
+    for (f = 0; f < frames; f++) {
+        __m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+        for (i = 0; i < ic; i++) {
+            __m128 const x = _mm_set1_ps(in[f * ic + i]);
+            lo = _mm_add_ps(lo, _mm_mul_ps(x, cols[i][0]));
+            hi = _mm_add_ps(hi, _mm_mul_ps(x, cols[i][1]));
+        }
+        float y[8];
+        _mm_storeu_ps(y, lo);
+        _mm_storeu_ps(y + 4, hi);
+        memcpy(out + f * oc, y, oc * sizeof(float));
+    }
+#else
+    for (f = 0; f < frames; f++) {
+        for (o = 0; o < oc; o++) {
+            float sum = 0;
+            for (i = 0; i < ic; i++) {
+                sum += matrix->coefs[o][i] * in[f * ic + i];
+            }
+            out[f * oc + o] = sum;
+        }
+    }
+#endif
+}
+
+
+/**
+ * (internal) Spread mono frames to two channels
+ */
+static void apply_1_to_2(matrix_t const *matrix, float *out, float const *in,
+                         size_t frames)
+{
+    float const c0 = matrix->coefs[0][0], c1 = matrix->coefs[1][0];
+    size_t f = 0;
+#ifdef __SSE2__
+    __m128 const k = _mm_setr_ps(c0, c1, c0, c1);
+    for (; f + 4 <= frames; f += 4) {
+        __m128 const x = _mm_loadu_ps(in + f);
+        _mm_storeu_ps(out + 2 * f, _mm_mul_ps(_mm_unpacklo_ps(x, x), k));
+        _mm_storeu_ps(out + 2 * f + 4, _mm_mul_ps(_mm_unpackhi_ps(x, x), k));
+    }
+#endif
+    for (; f < frames; f++) {
+        out[2 * f] = in[f] * c0;
+        out[2 * f + 1] = in[f] * c1;
+    }
+}
+
+
+/**
+ * (internal) Mix stereo frames down to mono
+ */
+static void apply_2_to_1(matrix_t const *matrix, float *out, float const *in,
+                         size_t frames)
+{
+    float const c0 = matrix->coefs[0][0], c1 = matrix->coefs[0][1];
+    size_t f = 0;
+#ifdef __SSE2__
+    __m128 const k0 = _mm_set1_ps(c0), k1 = _mm_set1_ps(c1);
+    for (; f + 4 <= frames; f += 4) {
+        __m128 const a = _mm_loadu_ps(in + 2 * f);
+        __m128 const b = _mm_loadu_ps(in + 2 * f + 4);
+        // Deinterleave the left and right samples of 4 frames
+        __m128 const left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 const right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(out + f, _mm_add_ps(_mm_mul_ps(left, k0), _mm_mul_ps(right, k1)));
+    }
+#endif
+    for (; f < frames; f++) {
+        out[f] = in[2 * f] * c0 + in[2 * f + 1] * c1;
+    }
+}
+
+
+/**
+ * (internal) Mix frames down to two channels, two frames per vector
+ */
+static void apply_to_2(matrix_t const *matrix, float *out, float const *in,
+                       size_t frames)
+{
+    unsigned const ic = matrix->in_channels;
+    size_t f = 0;
+    unsigned i;
+#ifdef __SSE2__
+    __m128 cols[MATRIX_MAX_CHANNELS];
+    for (i = 0; i < ic; i++) {
+        cols[i] = _mm_setr_ps(matrix->coefs[0][i], matrix->coefs[1][i],
+                              matrix->coefs[0][i], matrix->coefs[1][i]);
+    }
+    for (; f + 2 <= frames; f += 2) {
+        float const *const x0 = in + f * ic, *const x1 = x0 + ic;
+        __m128 acc = _mm_setzero_ps();
+        for (i = 0; i < ic; i++) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_setr_ps(x0[i], x0[i], x1[i], x1[i]),
+                                             cols[i]));
+        }
+        _mm_storeu_ps(out + 2 * f, acc);
+    }
+#endif
+    for (; f < frames; f++) {
+        float left = 0, right = 0;
+        for (i = 0; i < ic; i++) {
+            left += matrix->coefs[0][i] * in[f * ic + i];
+            right += matrix->coefs[1][i] * in[f * ic + i];
+        }
+        out[2 * f] = left;
+        out[2 * f + 1] = right;
+    }
+}
+
+
+/**
+ * Multiply interleaved frames by a matrix, from in_channels channels in
+ * to out_channels channels in out
+ */
+void matrix_apply(matrix_t const *matrix, float *out, float const *in, size_t frames)
+{
+    switch (matrix->kernel) {
+        case MATRIX_KERNEL_1_TO_2:
+            apply_1_to_2(matrix, out, in, frames);
+            break;
+        case MATRIX_KERNEL_2_TO_1:
+            apply_2_to_1(matrix, out, in, frames);
+            break;
+        case MATRIX_KERNEL_TO_2:
+            apply_to_2(matrix, out, in, frames);
+            break;
+        default:
+            apply_generic(matrix, out, in, frames);
+            break;
+    }
+}
+
+
+/**
+ * Parse a routing map like "2,1" or "1,1,-,-": for each output channel,
+ * the input channel it copies from 1, or "-" for silence.
+ * Return the number of output channels, -1 if the map is invalid.
+ */
+int matrix_parse_map(const char *text, int map[MATRIX_MAX_CHANNELS])
+{
+    int count = 0;
+    const char *p = text;
+    for (;;) {
+        if (count == MATRIX_MAX_CHANNELS) return -1;
+        if (*p == '-') {
+            map[count++] = -1;
+            p++;
+        } else {
+            char *end;
+            long const channel = strtol(p, &end, 10);
+            if (end == p || channel < 1 || channel > MATRIX_MAX_CHANNELS) return -1;
+            map[count++] = channel - 1;
+            p = end;
+        }
+        if (*p == 0) return count;
+        if (*p++ != ',') return -1;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stddef.h>
+
+// Largest number of input or output channels
+#define MATRIX_MAX_CHANNELS 8
+
+// Loops which compute the product, chosen from the shape of the matrix
+#define MATRIX_KERNEL_GENERIC 0
+#define MATRIX_KERNEL_1_TO_2 1
+#define MATRIX_KERNEL_2_TO_1 2
+#define MATRIX_KERNEL_TO_2 3
+
+/**
+ * Channel matrix: each output channel is a weighted sum of the input
+ * channels of the same frame
+ */
+typedef struct {
+    unsigned in_channels;
+    unsigned out_channels;
+    int kernel;
+    // Weights, by output channel then input channel
+    float coefs[MATRIX_MAX_CHANNELS][MATRIX_MAX_CHANNELS];
+} matrix_t;
+
+int matrix_init_default(matrix_t *matrix, unsigned in_channels, unsigned out_channels);
+int matrix_init_map(matrix_t *matrix, unsigned in_channels, int const *map,
+                    unsigned out_channels);
+void matrix_apply(matrix_t const *matrix, float *out, float const *in, size_t frames);
+int matrix_parse_map(const char *text, int map[MATRIX_MAX_CHANNELS]);
+
+#endif /* MATRIX_H */
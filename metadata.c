@@ -0,0 +1,460 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metadata.h"
+#include "log.h"
+
+// On-disk index format
+#define METADATA_MAGIC "PLIX"
+#define METADATA_VERSION 7
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t strings_offset;
+} metadata_file_header_t;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t path_offset;
+    uint32_t path_len;
+    metadata_t meta;
+} metadata_file_slot_t;
+
+
+/**
+ * (internal) FNV-1a hash of a path
+ */
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    while (*path) {
+        hash ^= (unsigned char) *(path++);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/**
+ * (internal) Test if the identity of two files is the same
+ */
+static int same_file(metadata_t const *a, metadata_t const *b)
+{
+    return a->inode == b->inode && a->mtime_ns == b->mtime_ns && a->size == b->size;
+}
+
+
+/**
+ * Initialise an empty index
+ */
+int metadata_index_init(metadata_index_t *index)
+{
+    if (index == NULL) return 1;
+    memset(index, 0, sizeof(*index));
+    int ret = pthread_mutex_init(&(index->mutex), NULL);
+    if (ret) {
+        LOG_ERROR("pthread_mutex_init failed: %d", ret);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Free an index and unmap its on-disk part
+ */
+int metadata_index_destroy(metadata_index_t *index)
+{
+    if (index == NULL) return 1;
+    size_t i;
+    for (i = 0; i < index->capacity; i++) {
+        free(index->entries[i].path);
+    }
+    free(index->entries);
+    index->entries = NULL;
+    index->capacity = index->count = 0;
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+        index->map = NULL;
+    }
+    int ret = pthread_mutex_destroy(&(index->mutex));
+    if (ret) {
+        LOG_ERROR("pthread_mutex_destroy failed: %d", ret);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Map an index file which was written by metadata_index_save().
+ * A missing or invalid file leaves the index empty.
+ */
+int metadata_index_load(metadata_index_t *index, const char *file_name)
+{
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        LOG_ERRNO("fstat(index)");
+        close(fd);
+        return 1;
+    }
+    if ((size_t) st.st_size < sizeof(metadata_file_header_t)) {
+        close(fd);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERRNO("mmap(index)");
+        return 1;
+    }
+
+    // Check the header before using the mapping
+    // The table must fit in the file before its size is computed
+    metadata_file_header_t const *header = map;
+    uint64_t const capacity = header->capacity;
+    if (memcmp(header->magic, METADATA_MAGIC, 4) ||
+        header->version != METADATA_VERSION ||
+        capacity == 0 || (capacity & (capacity - 1)) ||
+        capacity > (st.st_size - sizeof(*header)) / sizeof(metadata_file_slot_t) ||
+        header->count >= capacity ||
+        header->strings_offset != sizeof(*header) +
+            capacity * sizeof(metadata_file_slot_t) ||
+        header->strings_offset > (uint64_t) st.st_size) {
+        LOG_ERROR("Ignoring invalid index file %s", file_name);
+        munmap(map, st.st_size);
+        return 1;
+    }
+    metadata_file_slot_t const *slots = (metadata_file_slot_t const *) (header + 1);
+    uint64_t const strings_size = st.st_size - header->strings_offset;
+    const char *strings = (const char *) map + header->strings_offset;
+    // Probes stop at an empty slot, so there must be one
+    uint64_t empty = 0;
+    uint64_t i;
+    for (i = 0; i < capacity; i++) {
+        if (slots[i].path_len == 0) empty++;
+        if (slots[i].path_len &&
+            ((uint64_t) slots[i].path_offset + slots[i].path_len >= strings_size ||
+             strings[slots[i].path_offset + slots[i].path_len] != 0)) {
+            LOG_ERROR("Ignoring invalid index file %s", file_name);
+            munmap(map, st.st_size);
+            return 1;
+        }
+    }
+    if (empty == 0) {
+        LOG_ERROR("Ignoring invalid index file %s", file_name);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    pthread_mutex_lock(&(index->mutex));
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+    }
+    index->map = map;
+    index->map_size = st.st_size;
+    pthread_mutex_unlock(&(index->mutex));
+    LOG_INFO("[Index] Mapped %lu entries from %s",
+             (unsigned long) header->count, file_name);
+    return 0;
+}
+
+
+/**
+ * (internal) Find a path in the mapped index. Index must be locked.
+ */
+static metadata_file_slot_t const* find_mapped(metadata_index_t *index,
+                                               const char *path, uint64_t hash)
+{
+    if (index->map == NULL) return NULL;
+    metadata_file_header_t const *header = index->map;
+    metadata_file_slot_t const *slots = (metadata_file_slot_t const *) (header + 1);
+    const char *strings = (const char *) index->map + header->strings_offset;
+    uint64_t const mask = header->capacity - 1;
+    uint64_t i = hash & mask;
+    uint64_t probes;
+    for (probes = 0; probes < header->capacity && slots[i].path_len; probes++) {
+        if (slots[i].hash == hash &&
+            !strcmp(strings + slots[i].path_offset, path)) {
+            return &slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+
+/**
+ * (internal) Find the slot of a path in the in-memory table, which is either
+ * its entry or the empty slot where to insert it. Index must be locked.
+ */
+static metadata_entry_t* find_entry(metadata_index_t *index,
+                                    const char *path, uint64_t hash)
+{
+    if (index->capacity == 0) return NULL;
+    size_t const mask = index->capacity - 1;
+    size_t i;
+    for (i = hash & mask; index->entries[i].path; i = (i + 1) & mask) {
+        if (index->entries[i].hash == hash && !strcmp(index->entries[i].path, path)) {
+            break;
+        }
+    }
+    return &(index->entries[i]);
+}
+
+
+/**
+ * Look for the header of a file.
+ * meta->inode, meta->mtime_ns and meta->size are the identity of the file and
+ * the other fields are filled if the index has an up-to-date entry.
+ * Return 0 if found, 1 otherwise.
+ */
+int metadata_index_lookup(metadata_index_t *index, const char *path,
+                          metadata_t *meta)
+{
+    uint64_t const hash = hash_path(path);
+    int ret = 1;
+    pthread_mutex_lock(&(index->mutex));
+    // New entries supersede mapped ones
+    metadata_entry_t const *entry = find_entry(index, path, hash);
+    if (entry != NULL && entry->path != NULL) {
+        if (same_file(&(entry->meta), meta)) {
+            *meta = entry->meta;
+            ret = 0;
+        }
+    } else {
+        metadata_file_slot_t const *slot = find_mapped(index, path, hash);
+        if (slot != NULL && same_file(&(slot->meta), meta)) {
+            *meta = slot->meta;
+            ret = 0;
+        }
+    }
+    if (ret) index->misses++;
+    else index->hits++;
+    pthread_mutex_unlock(&(index->mutex));
+    return ret;
+}
+
+
+/**
+ * (internal) Grow the in-memory table. Index must be locked.
+ */
+static int grow_index(metadata_index_t *index)
+{
+    size_t const old_capacity = index->capacity;
+    metadata_entry_t *old_entries = index->entries;
+    size_t const capacity = old_capacity ? 2 * old_capacity : 64;
+    metadata_entry_t *entries = calloc(capacity, sizeof(metadata_entry_t));
+    if (entries == NULL) {
+        LOG_ERROR("Couldn't allocate the index.");
+        return 2;
+    }
+    index->entries = entries;
+    index->capacity = capacity;
+    size_t i;
+    for (i = 0; i < old_capacity; i++) {
+        if (old_entries[i].path != NULL) {
+            *find_entry(index, old_entries[i].path, old_entries[i].hash) = old_entries[i];
+        }
+    }
+    free(old_entries);
+    return 0;
+}
+
+
+/**
+ * Add or replace the header of a file
+ */
+int metadata_index_insert(metadata_index_t *index, const char *path,
+                          metadata_t const *meta)
+{
+    uint64_t const hash = hash_path(path);
+    pthread_mutex_lock(&(index->mutex));
+    if (2 * (index->count + 1) > index->capacity && grow_index(index)) {
+        pthread_mutex_unlock(&(index->mutex));
+        return 2;
+    }
+    metadata_entry_t *entry = find_entry(index, path, hash);
+    if (entry->path == NULL) {
+        entry->path = strdup(path);
+        if (entry->path == NULL) {
+            pthread_mutex_unlock(&(index->mutex));
+            LOG_ERROR("Couldn't allocate an index entry.");
+            return 2;
+        }
+        entry->hash = hash;
+        index->count++;
+    }
+    entry->meta = *meta;
+    pthread_mutex_unlock(&(index->mutex));
+    return 0;
+}
+
+
+/**
+ * (internal) Insert a slot in the table of the saved file
+ */
+static void put_slot(metadata_file_slot_t *slots, uint64_t capacity,
+                     uint64_t hash, uint32_t path_offset, uint32_t path_len,
+                     metadata_t const *meta)
+{
+    uint64_t i;
+    for (i = hash & (capacity - 1); slots[i].path_len; i = (i + 1) & (capacity - 1));
+    slots[i].hash = hash;
+    slots[i].path_offset = path_offset;
+    slots[i].path_len = path_len;
+    slots[i].meta = *meta;
+}
+
+
+/**
+ * Write both mapped and new entries to the index file.
+ * The file is replaced atomically.
+ */
+int metadata_index_save(metadata_index_t *index, const char *file_name)
+{
+    pthread_mutex_lock(&(index->mutex));
+
+    // Count entries and the size of strings
+    metadata_file_header_t const *map_header = index->map;
+    metadata_file_slot_t const *map_slots = NULL;
+    const char *map_strings = NULL;
+    uint64_t map_capacity = 0;
+    if (map_header != NULL) {
+        map_slots = (metadata_file_slot_t const *) (map_header + 1);
+        map_strings = (const char *) index->map + map_header->strings_offset;
+        map_capacity = map_header->capacity;
+    }
+    uint64_t count = 0, strings_size = 0, i;
+    for (i = 0; i < index->capacity; i++) {
+        if (index->entries[i].path != NULL) {
+            count++;
+            strings_size += strlen(index->entries[i].path) + 1;
+        }
+    }
+    for (i = 0; i < map_capacity; i++) {
+        if (map_slots[i].path_len) {
+            metadata_entry_t const *entry = find_entry(index,
+                map_strings + map_slots[i].path_offset, map_slots[i].hash);
+            if (entry == NULL || entry->path == NULL) {
+                count++;
+                strings_size += map_slots[i].path_len + 1;
+            }
+        }
+    }
+    if (strings_size > UINT32_MAX) {
+        pthread_mutex_unlock(&(index->mutex));
+        LOG_ERROR("Index is too large to be saved.");
+        return 1;
+    }
+
+    // Build the file in memory
+    uint64_t capacity = 64;
+    while (capacity < 2 * count) capacity *= 2;
+    size_t const strings_offset = sizeof(metadata_file_header_t) +
+        capacity * sizeof(metadata_file_slot_t);
+    size_t const size = strings_offset + strings_size;
+    char *data = calloc(1, size);
+    if (data == NULL) {
+        pthread_mutex_unlock(&(index->mutex));
+        LOG_ERROR("Couldn't allocate %lu bytes to save the index.",
+                  (unsigned long) size);
+        return 2;
+    }
+    metadata_file_header_t *header = (metadata_file_header_t *) data;
+    memcpy(header->magic, METADATA_MAGIC, 4);
+    header->version = METADATA_VERSION;
+    header->capacity = capacity;
+    header->count = count;
+    header->strings_offset = strings_offset;
+    metadata_file_slot_t *slots = (metadata_file_slot_t *) (header + 1);
+    char *strings = data + strings_offset;
+    uint32_t offset = 0;
+    for (i = 0; i < index->capacity; i++) {
+        metadata_entry_t const *entry = &(index->entries[i]);
+        if (entry->path != NULL) {
+            uint32_t const len = strlen(entry->path);
+            memcpy(strings + offset, entry->path, len + 1);
+            put_slot(slots, capacity, entry->hash, offset, len, &(entry->meta));
+            offset += len + 1;
+        }
+    }
+    for (i = 0; i < map_capacity; i++) {
+        if (map_slots[i].path_len) {
+            const char *path = map_strings + map_slots[i].path_offset;
+            metadata_entry_t const *entry = find_entry(index, path, map_slots[i].hash);
+            if (entry == NULL || entry->path == NULL) {
+                memcpy(strings + offset, path, map_slots[i].path_len + 1);
+                put_slot(slots, capacity, map_slots[i].hash, offset,
+                         map_slots[i].path_len, &(map_slots[i].meta));
+                offset += map_slots[i].path_len + 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&(index->mutex));
+
+    // Write to a temporary file and rename it
+    size_t const name_len = strlen(file_name);
+    char *tmp_name = malloc(name_len + 5);
+    if (tmp_name == NULL) {
+        free(data);
+        return 2;
+    }
+    memcpy(tmp_name, file_name, name_len);
+    memcpy(tmp_name + name_len, ".tmp", 5);
+    int ret = 0;
+    FILE *f = fopen(tmp_name, "wb");
+    if (f == NULL) {
+        LOG_ERRNO("fopen(index)");
+        ret = 1;
+    } else {
+        if (fwrite(data, 1, size, f) != size) {
+            LOG_ERRNO("fwrite(index)");
+            ret = 1;
+        }
+        if (fclose(f) == EOF) {
+            LOG_ERRNO("fclose(index)");
+            ret = 1;
+        }
+        if (ret == 0 && rename(tmp_name, file_name) == -1) {
+            LOG_ERRNO("rename(index)");
+            ret = 1;
+        }
+        if (ret) unlink(tmp_name);
+    }
+    if (ret == 0) {
+        LOG_INFO("[Index] Saved %lu entries to %s", (unsigned long) count, file_name);
+    }
+    free(tmp_name);
+    free(data);
+    return ret;
+}
+
+
+/**
+ * Print index statistics
+ */
+void metadata_index_print_stats(metadata_index_t *index)
+{
+    pthread_mutex_lock(&(index->mutex));
+    unsigned long mapped = 0;
+    if (index->map != NULL) {
+        mapped = ((metadata_file_header_t const *) index->map)->count;
+    }
+    LOG_INFO("[Index] %lu mapped entries, %lu new entries, %lu hits, %lu misses",
+             mapped, (unsigned long) index->count, index->hits, index->misses);
+    pthread_mutex_unlock(&(index->mutex));
+}
@@ -0,0 +1,77 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "tags.h"
+
+/**
+ * Parsed header of a music file, stored with the identity of the file
+ * (inode, modification time in nanoseconds and size) which makes it valid,
+ * so that a file rewritten within the same second isn't taken for the
+ * indexed one.
+ * This is also the record of the on-disk index, so only fixed-size fields.
+ */
+typedef struct {
+    uint64_t inode;
+    int64_t mtime_ns;
+    uint64_t size;
+    uint32_t oss_format;
+    uint32_t channels;
+    uint32_t sample_rate;
+    uint32_t bits_per_sample;
+    uint64_t data_size;
+    uint32_t data_offset;
+    uint32_t duration_ms;
+    uint32_t encoding;
+    uint32_t block_align;
+    uint32_t block_frames;
+    replaygain_t replaygain;
+    // Frames between the silent ends of the data, found with the sample
+    // threshold silence_threshold, or 0 if they were not looked for
+    uint64_t audio_start;
+    uint64_t audio_end;
+    int32_t silence_threshold;
+} metadata_t;
+
+// Entry of the in-memory hash table
+typedef struct {
+    uint64_t hash;
+    char *path;
+    metadata_t meta;
+} metadata_entry_t;
+
+/**
+ * Index of music file headers, keyed by path.
+ * Entries loaded from disk stay in the mapped file and new entries go to an
+ * in-memory hash table until the index is saved.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+
+    // Memory-mapped on-disk index
+    void *map;
+    size_t map_size;
+
+    // In-memory open-addressing hash table
+    metadata_entry_t *entries;
+    size_t capacity;
+    size_t count;
+
+    // Statistics
+    unsigned long hits;
+    unsigned long misses;
+} metadata_index_t;
+
+int metadata_index_init(metadata_index_t *index);
+int metadata_index_destroy(metadata_index_t *index);
+int metadata_index_load(metadata_index_t *index, const char *file_name);
+int metadata_index_save(metadata_index_t *index, const char *file_name);
+int metadata_index_lookup(metadata_index_t *index, const char *path,
+                          metadata_t *meta);
+int metadata_index_insert(metadata_index_t *index, const char *path,
+                          metadata_t const *meta);
+void metadata_index_print_stats(metadata_index_t *index);
+
+#endif /* METADATA_H */
@@ -0,0 +1,289 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "meter.h"
+#include "playclock.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define METER_PI 3.14159265358979323846
+
+// Power of a full-scale sine in the one-sided spectrum of a Hann window
+#define METER_FULL_SCALE (3.0f * METER_FFT_SIZE * METER_FFT_SIZE / 32)
+
+
+/**
+ * (internal) Monotonic time in nanoseconds
+ */
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * Prepare the window and the tables of the FFT. The tap starts disabled.
+ */
+void meter_init(meter_t *meter)
+{
+    memset(meter, 0, sizeof(*meter));
+    unsigned bits = 0;
+    while ((1u << bits) < METER_FFT_SIZE) bits++;
+    unsigned i;
+    for (i = 0; i < METER_FFT_SIZE; i++) {
+        unsigned r = 0, b;
+        for (b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        meter->bit_reverse[i] = r;
+        meter->window[i] = 0.5 - 0.5 * cos(2 * METER_PI * i / METER_FFT_SIZE);
+    }
+    for (i = 0; i < METER_FFT_SIZE / 2; i++) {
+        meter->cos_table[i] = cos(2 * METER_PI * i / METER_FFT_SIZE);
+        meter->sin_table[i] = sin(2 * METER_PI * i / METER_FFT_SIZE);
+    }
+}
+
+
+/**
+ * Enable or disable the tap, with a spectrum spectrum_hz times per second
+ * or none if it is 0
+ */
+void meter_enable(meter_t *meter, int enabled, unsigned spectrum_hz)
+{
+    __atomic_store_n(&(meter->spectrum_hz), spectrum_hz, __ATOMIC_RELAXED);
+    __atomic_store_n(&(meter->enabled), enabled, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Test whether the tap is enabled, which is all it costs otherwise
+ */
+int meter_enabled(meter_t const *meter)
+{
+    return __atomic_load_n(&(meter->enabled), __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * Compute the peak magnitude and the sum of squares of each channel of
+ * interleaved samples
+ */
+void meter_measure(float const *samples, size_t frames, unsigned channels,
+                   float *peak, float *sum_squares)
+{
+    unsigned c;
+    for (c = 0; c < channels; c++) {
+        peak[c] = sum_squares[c] = 0;
+    }
+    size_t const n = frames * channels;
+    size_t i = 0;
+#ifdef __SSE2__
+    // Vectors are taken by groups which hold whole frames, so that a lane
+    // of a vector of the group always holds the same channel
+    unsigned const k = channels % 4 == 0 ? channels / 4 :
+        channels % 2 == 0 ? channels / 2 : channels;
+    if (k <= METER_MAX_CHANNELS) {
+        __m128 const abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 vpeak[METER_MAX_CHANNELS], vsum[METER_MAX_CHANNELS];
+        unsigned j;
+        for (j = 0; j < k; j++) {
+            vpeak[j] = vsum[j] = _mm_setzero_ps();
+        }
+        for (; i + 4 * k <= n; i += 4 * k) {
+            for (j = 0; j < k; j++) {
+                __m128 const x = _mm_loadu_ps(samples + i + 4 * j);
+                vpeak[j] = _mm_max_ps(vpeak[j], _mm_and_ps(x, abs_mask));
+                vsum[j] = _mm_add_ps(vsum[j], _mm_mul_ps(x, x));
+            }
+        }
+        for (j = 0; j < k; j++) {
+            float p[4], s[4];
+            _mm_storeu_ps(p, vpeak[j]);
+            _mm_storeu_ps(s, vsum[j]);
+            unsigned l;
+            for (l = 0; l < 4; l++) {
+                c = (4 * j + l) % channels;
+                if (p[l] > peak[c]) peak[c] = p[l];
+                sum_squares[c] += s[l];
+            }
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        c = i % channels;
+        float const x = fabsf(samples[i]);
+        if (x > peak[c]) peak[c] = x;
+        sum_squares[c] += samples[i] * samples[i];
+    }
+}
+
+
+/**
+ * (internal) Append the mono mix of frames to the analysed window
+ */
+static void append_history(meter_t *meter, float const *samples, size_t frames,
+                           unsigned channels)
+{
+    if (frames > METER_FFT_SIZE) {
+        samples += (frames - METER_FFT_SIZE) * channels;
+        frames = METER_FFT_SIZE;
+    }
+    size_t keep = METER_FFT_SIZE - frames;
+    if (keep > meter->history_frames) keep = meter->history_frames;
+    memmove(meter->history, meter->history + meter->history_frames - keep,
+            keep * sizeof(float));
+    float const scale = 1.0f / channels;
+    size_t f;
+    for (f = 0; f < frames; f++) {
+        float sum = 0;
+        unsigned c;
+        for (c = 0; c < channels; c++) {
+            sum += samples[f * channels + c];
+        }
+        meter->history[keep + f] = sum * scale;
+    }
+    meter->history_frames = keep + frames;
+}
+
+
+/**
+ * (internal) Compute the octave bands of the analysed window, with a Hann
+ * window and an in-place radix-2 FFT
+ */
+static void compute_spectrum(meter_t const *meter, unsigned sample_rate,
+                             float bands[METER_BANDS])
+{
+    float re[METER_FFT_SIZE], im[METER_FFT_SIZE];
+    size_t i;
+    for (i = 0; i < METER_FFT_SIZE; i++) {
+        re[meter->bit_reverse[i]] = meter->history[i] * meter->window[i];
+        im[i] = 0;
+    }
+    size_t size;
+    for (size = 2; size <= METER_FFT_SIZE; size *= 2) {
+        size_t const half = size / 2, step = METER_FFT_SIZE / size;
+        size_t start, k;
+        for (start = 0; start < METER_FFT_SIZE; start += size) {
+            for (k = 0; k < half; k++) {
+                float const wr = meter->cos_table[k * step];
+                float const wi = -meter->sin_table[k * step];
+                size_t const a = start + k, b = a + half;
+                float const tr = re[b] * wr - im[b] * wi;
+                float const ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+
+    // Bins are summed by octave, or the nearest bin is taken for octaves
+    // narrower than a bin
+    float const bin_hz = (float) sample_rate / METER_FFT_SIZE;
+    unsigned b;
+    for (b = 0; b < METER_BANDS; b++) {
+        float const center = meter_band_freq(b);
+        float const low = center * 0.70710678f, high = center * 1.41421356f;
+        float power = 0;
+        size_t k;
+        for (k = 1; k < METER_FFT_SIZE / 2; k++) {
+            float const freq = k * bin_hz;
+            if (freq >= low && freq < high) {
+                power += re[k] * re[k] + im[k] * im[k];
+            }
+        }
+        if (power == 0 && center < sample_rate / 2) {
+            k = (size_t) (center / bin_hz + 0.5f);
+            if (k < 1) k = 1;
+            power = re[k] * re[k] + im[k] * im[k];
+        }
+        bands[b] = 10 * log10f(power / METER_FULL_SCALE + 1e-20f);
+    }
+}
+
+
+/**
+ * Measure a block of interleaved output samples and publish its levels,
+ * with a spectrum when one is due
+ */
+void meter_process(meter_t *meter, float const *samples, size_t frames,
+                   unsigned channels, unsigned sample_rate)
+{
+    if (channels < 1 || channels > METER_MAX_CHANNELS || frames == 0) return;
+    float peak[METER_MAX_CHANNELS], sum_squares[METER_MAX_CHANNELS];
+    meter_measure(samples, frames, channels, peak, sum_squares);
+
+    unsigned const spectrum_hz = __atomic_load_n(&(meter->spectrum_hz), __ATOMIC_RELAXED);
+    float bands[METER_BANDS];
+    int has_bands = 0;
+    if (spectrum_hz) {
+        append_history(meter, samples, frames, channels);
+        meter->frames_since_fft += frames;
+        if (meter->history_frames == METER_FFT_SIZE &&
+            meter->frames_since_fft >= sample_rate / spectrum_hz) {
+            meter->frames_since_fft = 0;
+            compute_spectrum(meter, sample_rate, bands);
+            has_bands = 1;
+        }
+    }
+
+    meter_levels_t *levels = &(meter->levels);
+    __atomic_store_n(&(levels->seq), levels->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    levels->channels = channels;
+    levels->blocks++;
+    levels->timestamp_ns = now_ns();
+    unsigned c;
+    for (c = 0; c < channels; c++) {
+        levels->peak[c] = peak[c];
+        levels->rms[c] = sqrtf(sum_squares[c] / frames);
+    }
+    if (has_bands) {
+        memcpy(levels->spectrum, bands, sizeof(bands));
+        levels->has_spectrum = 1;
+    } else if (!spectrum_hz) {
+        levels->has_spectrum = 0;
+    }
+    __atomic_store_n(&(levels->seq), levels->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Copy the last published levels.
+ * Return the number of retries because the playing thread was updating them,
+ * or -1 with a zeroed copy if it never finished an update.
+ */
+int meter_read(meter_t const *meter, meter_levels_t *copy)
+{
+    int retries = -1;
+    uint32_t seq;
+    do {
+        retries++;
+        int64_t const value = playback_clock_seq_wait(&(meter->levels.seq));
+        if (value < 0) {
+            memset(copy, 0, sizeof(*copy));
+            return -1;
+        }
+        seq = value;
+        memcpy(copy, &(meter->levels), sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&(meter->levels.seq), __ATOMIC_RELAXED) != seq);
+    return retries;
+}
+
+
+/**
+ * Center frequency of an octave band of the spectrum
+ */
+float meter_band_freq(unsigned band)
+{
+    return 31.25f * (1u << band);
+}
@@ -0,0 +1,62 @@
+#ifndef METER_H
+#define METER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest number of measured channels
+#define METER_MAX_CHANNELS 8
+
+// Length of the analysed window, and number of octave bands of the
+// spectrum, centered from 31.25 Hz to 16 kHz
+#define METER_FFT_SIZE 1024
+#define METER_BANDS 10
+
+/**
+ * Levels of the last measured block, in linear amplitude, and spectrum of
+ * the last analysed window in dB relative to a full-scale sine
+ */
+typedef struct {
+    uint32_t seq;
+    uint32_t channels;
+    uint64_t blocks;
+    int64_t timestamp_ns;
+    float peak[METER_MAX_CHANNELS];
+    float rms[METER_MAX_CHANNELS];
+    uint32_t has_spectrum;
+    float spectrum[METER_BANDS];
+} meter_levels_t;
+
+/**
+ * Analysis tap on output blocks. It only runs while it is enabled, and
+ * publishes its levels with a sequence lock so that readers never block
+ * the playing thread.
+ */
+typedef struct {
+    // Settings, changed by any thread
+    int enabled;
+    unsigned spectrum_hz;
+
+    // Analysis state, used by the playing thread only
+    float history[METER_FFT_SIZE];
+    size_t history_frames;
+    uint64_t frames_since_fft;
+    float window[METER_FFT_SIZE];
+    float cos_table[METER_FFT_SIZE / 2];
+    float sin_table[METER_FFT_SIZE / 2];
+    uint16_t bit_reverse[METER_FFT_SIZE];
+
+    meter_levels_t levels;
+} meter_t;
+
+void meter_init(meter_t *meter);
+void meter_enable(meter_t *meter, int enabled, unsigned spectrum_hz);
+int meter_enabled(meter_t const *meter);
+void meter_process(meter_t *meter, float const *samples, size_t frames,
+                   unsigned channels, unsigned sample_rate);
+void meter_measure(float const *samples, size_t frames, unsigned channels,
+                   float *peak, float *sum_squares);
+int meter_read(meter_t const *meter, meter_levels_t *copy);
+float meter_band_freq(unsigned band);
+
+#endif /* METER_H */
@@ -0,0 +1,191 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+#include "playclock.h"
+
+/**
+ * Monotonic time in nanoseconds, which is also the time base of clocks
+ */
+int64_t playback_clock_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * (internal) Begin and end an update of the clock fields
+ */
+static void write_begin(playback_clock_t *clock)
+{
+    __atomic_store_n(&(clock->seq), clock->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(playback_clock_t *clock)
+{
+    __atomic_store_n(&(clock->seq), clock->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Restart the clock at frame 0 for a new stream
+ */
+void playback_clock_reset(playback_clock_t *clock, uint32_t sample_rate)
+{
+    if (clock == NULL) return;
+    write_begin(clock);
+    __atomic_store_n(&(clock->sample_rate), sample_rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->frames_written), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->frames_played), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->timestamp_ns), playback_clock_now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->running), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->speed_q16), 1 << 16, __ATOMIC_RELAXED);
+    write_end(clock);
+}
+
+
+/**
+ * (internal) Frames of the stream played per second, which a zeroed clock
+ * plays at its sample rate
+ */
+static uint64_t clock_rate(uint32_t sample_rate, uint32_t speed_q16)
+{
+    if (speed_q16 == 0) return sample_rate;
+    return ((uint64_t) sample_rate * speed_q16) >> 16;
+}
+
+
+/**
+ * Publish the number of frames written to the device so far and the number
+ * of frames which are still queued in the device (SNDCTL_DSP_GETODELAY).
+ * A stopped clock does not move until the next update.
+ */
+void playback_clock_update(playback_clock_t *clock, uint64_t frames_written,
+                           uint64_t frames_queued, int running)
+{
+    if (clock == NULL) return;
+    if (frames_queued > frames_written) frames_queued = frames_written;
+    int64_t const now = playback_clock_now_ns();
+    write_begin(clock);
+    __atomic_store_n(&(clock->frames_written), frames_written, __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->frames_played), frames_written - frames_queued,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->timestamp_ns), now, __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->running), running, __ATOMIC_RELAXED);
+    write_end(clock);
+}
+
+
+/**
+ * Move the origin of the clock forward by some frames, when a new track
+ * starts in the same stream. Until the device plays the first frame of the
+ * new track, the clock stays at 0.
+ */
+void playback_clock_rebase(playback_clock_t *clock, uint64_t frames)
+{
+    if (clock == NULL) return;
+    write_begin(clock);
+    uint64_t played = clock->frames_played;
+    int64_t timestamp_ns = clock->timestamp_ns;
+    uint64_t const rate = clock_rate(clock->sample_rate, clock->speed_q16);
+    if (played < frames && rate) {
+        timestamp_ns += (int64_t) ((frames - played) * 1000000000 / rate);
+        played = frames;
+    }
+    uint64_t const written = clock->frames_written > frames ?
+        clock->frames_written - frames : 0;
+    __atomic_store_n(&(clock->frames_written), written, __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->frames_played), played - frames, __ATOMIC_RELAXED);
+    __atomic_store_n(&(clock->timestamp_ns), timestamp_ns, __ATOMIC_RELAXED);
+    write_end(clock);
+}
+
+
+/**
+ * Change the speed at which the stream plays, from now on
+ */
+void playback_clock_set_speed(playback_clock_t *clock, float speed)
+{
+    if (clock == NULL) return;
+    write_begin(clock);
+    __atomic_store_n(&(clock->speed_q16), (uint32_t) (speed * 65536 + 0.5f),
+                     __ATOMIC_RELAXED);
+    write_end(clock);
+}
+
+
+/**
+ * Wait until the sequence of a sequence lock is even, for at most
+ * PLAYCLOCK_SEQ_TIMEOUT_NS.
+ * Return the sequence, or -1 if it stayed odd because its writer died
+ * during an update.
+ */
+int64_t playback_clock_seq_wait(uint32_t const *seq)
+{
+    int64_t deadline = 0;
+    unsigned spins = 0;
+    uint32_t value;
+    while ((value = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+        if (++spins < PLAYCLOCK_SEQ_SPINS) continue;
+        spins = 0;
+        int64_t const now = playback_clock_now_ns();
+        if (deadline == 0) {
+            deadline = now + PLAYCLOCK_SEQ_TIMEOUT_NS;
+        } else if (now > deadline) {
+            return -1;
+        }
+    }
+    return value;
+}
+
+
+/**
+ * Read a consistent copy of the clock. The copy is zeroed if the writer
+ * never finished its update.
+ * Return 0 on success, 1 if the writer never finished.
+ */
+int playback_clock_read(playback_clock_t const *clock,
+                        playback_clock_snapshot_t *snapshot)
+{
+    uint32_t seq;
+    do {
+        int64_t const value = playback_clock_seq_wait(&(clock->seq));
+        if (value < 0) {
+            memset(snapshot, 0, sizeof(*snapshot));
+            return 1;
+        }
+        seq = value;
+        snapshot->sample_rate = __atomic_load_n(&(clock->sample_rate), __ATOMIC_RELAXED);
+        snapshot->frames_written = __atomic_load_n(&(clock->frames_written), __ATOMIC_RELAXED);
+        snapshot->frames_played = __atomic_load_n(&(clock->frames_played), __ATOMIC_RELAXED);
+        snapshot->timestamp_ns = __atomic_load_n(&(clock->timestamp_ns), __ATOMIC_RELAXED);
+        snapshot->running = __atomic_load_n(&(clock->running), __ATOMIC_RELAXED);
+        snapshot->speed_q16 = __atomic_load_n(&(clock->speed_q16), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&(clock->seq), __ATOMIC_RELAXED) != seq);
+    return 0;
+}
+
+
+/**
+ * Get the frame being heard now, and the time of now if now_ns is not NULL
+ */
+uint64_t playback_clock_position(playback_clock_t const *clock, int64_t *now_ns)
+{
+    playback_clock_snapshot_t snapshot;
+    playback_clock_read(clock, &snapshot);
+    int64_t const now = playback_clock_now_ns();
+    if (now_ns != NULL) *now_ns = now;
+    uint64_t position = snapshot.frames_played;
+    if (snapshot.running && now > snapshot.timestamp_ns) {
+        position += (uint64_t) (now - snapshot.timestamp_ns) *
+            clock_rate(snapshot.sample_rate, snapshot.speed_q16) / 1000000000;
+        if (position > snapshot.frames_written) {
+            position = snapshot.frames_written;
+        }
+    }
+    return position;
+}
@@ -0,0 +1,58 @@
+#ifndef PLAYCLOCK_H
+#define PLAYCLOCK_H
+
+#include <stdint.h>
+
+// Longest wait of a reader for the writer of a sequence lock, which only
+// holds it for a few stores unless it died during an update, and number
+// of tries between two reads of the time
+#define PLAYCLOCK_SEQ_TIMEOUT_NS 10000000
+#define PLAYCLOCK_SEQ_SPINS 1024
+
+/**
+ * Playback clock, published by the playing thread after each write to the
+ * device and read without any system call from the status page.
+ *
+ * frames_played were heard at timestamp_ns (CLOCK_MONOTONIC). Between two
+ * updates, readers extrapolate with the sample rate up to frames_written,
+ * which the device plays before it runs out of data. Frames are those of
+ * the stream, which plays speed_q16 / 65536 times faster than its rate
+ * when it is time-stretched.
+ *
+ * Fields are protected by a sequence lock: seq is odd while the writer
+ * updates them, and readers retry when seq changed during their read.
+ */
+typedef struct {
+    uint32_t seq;
+    uint32_t sample_rate;
+    uint64_t frames_written;
+    uint64_t frames_played;
+    int64_t timestamp_ns;
+    uint32_t running;
+    uint32_t speed_q16;
+} playback_clock_t;
+
+/**
+ * Consistent copy of a playback clock
+ */
+typedef struct {
+    uint32_t sample_rate;
+    uint64_t frames_written;
+    uint64_t frames_played;
+    int64_t timestamp_ns;
+    uint32_t running;
+    uint32_t speed_q16;
+} playback_clock_snapshot_t;
+
+int64_t playback_clock_now_ns();
+void playback_clock_reset(playback_clock_t *clock, uint32_t sample_rate);
+void playback_clock_update(playback_clock_t *clock, uint64_t frames_written,
+                           uint64_t frames_queued, int running);
+void playback_clock_rebase(playback_clock_t *clock, uint64_t frames);
+void playback_clock_set_speed(playback_clock_t *clock, float speed);
+int64_t playback_clock_seq_wait(uint32_t const *seq);
+int playback_clock_read(playback_clock_t const *clock,
+                        playback_clock_snapshot_t *snapshot);
+uint64_t playback_clock_position(playback_clock_t const *clock, int64_t *now_ns);
+
+#endif /* PLAYCLOCK_H */
@@ -0,0 +1,63 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "status.h"
+
+/**
+ * Print the status page of the daemon, once or periodically.
+ * Reading it does not involve the daemon at all.
+ */
+int main(int argc, char **argv)
+{
+    long interval_ms = 0;
+    long count = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval_ms = atol(optarg);
+                if (count == 1) count = 0;
+                break;
+            case 'n':
+                count = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i INTERVAL_MS] [-n COUNT]\n"
+                        "Print the status of the player daemon, every INTERVAL_MS\n"
+                        "milliseconds COUNT times (0 for ever) if an interval is given\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    player_status_t *status = status_open(0);
+    if (status == NULL) {
+        fprintf(stderr, "Is the daemon running?\n");
+        return 1;
+    }
+
+    struct timespec const interval = {
+        interval_ms / 1000, (interval_ms % 1000) * 1000000
+    };
+    long i;
+    for (i = 0; count == 0 || i < count; i++) {
+        if (i > 0) {
+            nanosleep(&interval, NULL);
+            printf("\n");
+        }
+        player_status_t copy;
+        if (status_read(status, &copy) < 0) {
+            fprintf(stderr, "The status is stuck in an update, the daemon may have died\n");
+            status_close(status, 0);
+            return 1;
+        }
+        status_print(stdout, &copy);
+        fflush(stdout);
+    }
+    status_close(status, 0);
+    return 0;
+}
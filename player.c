@@ -1,19 +1,50 @@
-#define _POSIX_C_SOURCE 1
+#define _POSIX_C_SOURCE 200809L
 
 #include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/soundcard.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
+#include "adpcm.h"
+#include "log.h"
 #include "player.h"
+#include "silence.h"
+#include "trace.h"
 #include <errno.h>
 
 // Length of the buffer in milliseconds
 #define BUF_MSEC 40
 
+// Blocks of the next track which are decoded before it starts
+#define LEAD_BLOCKS 4
+
+// Power profile: the device buffer is refilled once it holds less than
+// this many milliseconds, with up to this many blocks in one write
+#define SCHEDULE_LOW_MSEC 100
+#define SCHEDULE_MAX_BLOCKS 16
+
+// Default delay of pause or stop after which the device and the buffers
+// are released, and bytes of the file read ahead when they are restored
+#define IDLE_DEFAULT_MSEC 60000
+#define RESUME_READAHEAD_BYTES (256 * 1024)
+
+// Delay after which a device which ran out of data counts as an underrun
+#define UNDERRUN_SLACK_NS 2000000
+
+// Length of volume changes and fades in milliseconds
+#define GAIN_RAMP_MSEC 10
+
+// Size of data chunks of unknown size, which end with the file
+#define DATA_SIZE_UNKNOWN 0xffffffff
+
 
 // Convenient macros for system calls
 
@@ -23,7 +54,7 @@
         ret = fread (ADDR, 1, SIZE, FILE); \
         if (ret == 0 && ferror(FILE)) \
         { \
-            fprintf (stderr, "fread failed\n"); \
+            LOG_ERROR("fread failed"); \
             return 2; \
         } \
     } \
@@ -35,7 +66,7 @@
         ret = ioctl (FD, ID, ARG); \
         if (ret == -1) \
         { \
-            perror ("ioctl"); \
+            LOG_ERRNO("ioctl"); \
             return 2; \
         } \
     } \
@@ -58,6 +89,189 @@
 
 
 
+/**
+ * (internal) Read a chunk of a WAV file which is not the data, looking for
+ * ReplayGain tags in ID3 chunks and the number of frames of compressed data
+ * in the fact chunk, if frames isn't NULL. The file is positioned after the
+ * chunk.
+ */
+static int read_wave_chunk(music_file_t *file_info, uint32_t id, uint32_t size,
+                           uint32_t *frames)
+{
+    FILE *file = file_info->file;
+    LOG_DEBUG("[WAV] Chunk %c%c%c%c, %u bytes.", id >> 24, (id >> 16) & 0xff,
+              (id >> 8) & 0xff, id & 0xff, size);
+    if (id == 0x66616374 && size >= 4 && frames != NULL) {
+        uint32_t fact;
+        if (fread(&fact, 1, sizeof(fact), file) != sizeof(fact)) {
+            LOG_ERROR("WAVE file ERROR: truncated chunk.");
+            return 1;
+        }
+        *frames = U32_TO_LE(fact);
+        LOG_DEBUG("[WAV] Frames: %u.", *frames);
+        size -= 4;
+    }
+    if ((id == 0x69643320 || id == 0x49443320) && size <= TAG_MAXLEN) {
+        unsigned char *tag = malloc(size);
+        if (tag == NULL) {
+            LOG_ERROR("Couldn't allocate the ID3 tag.");
+            return 2;
+        }
+        if (fread(tag, 1, size, file) != size) {
+            LOG_ERROR("WAVE file ERROR: truncated chunk.");
+            free(tag);
+            return 1;
+        }
+        tags_parse_id3(&(file_info->replaygain), tag, size);
+        free(tag);
+        size = 0;
+    }
+    if (fseek(file, (long) size + (size & 1), SEEK_CUR) == -1) {
+        LOG_ERRNO("fseek");
+        return 2;
+    }
+    return 0;
+}
+
+
+/**
+ * (internal) Read the chunks of a WAV file from the end of the format chunk
+ * up to its data, and the tags which follow the data. frames is set from
+ * the fact chunk, if there is one and it isn't NULL.
+ */
+static int wave_data_opener(music_file_t *file_info, uint32_t *frames)
+{
+    int ret;
+    FILE *file = file_info->file;
+
+    // Chunks like "LIST" or "id3 " may come before data
+    uint32_t chunk[2];
+    for (;;) {
+        MY_READ(file, chunk, sizeof(chunk));
+        if (ret != sizeof(chunk)) {
+            LOG_ERROR("WAVE file ERROR: no data.");
+            return 1;
+        }
+        if (ntohl(chunk[0]) == 0x64617461) break;
+        ret = read_wave_chunk(file_info, ntohl(chunk[0]), U32_TO_LE(chunk[1]), frames);
+        if (ret) return ret;
+    }
+    // RF64 files give the size in their ds64 chunk, which was read before
+    uint_fast64_t data_size = U32_TO_LE(chunk[1]);
+    if (data_size == DATA_SIZE_UNKNOWN) data_size = file_info -> data_size;
+    LOG_DEBUG("[WAV] Data size: %llu.", (unsigned long long) data_size);
+    file_info -> data_size = data_size;
+
+    // Tags are usually written after the data
+    long const data_offset = ftell(file);
+    if (data_offset == -1) {
+        LOG_ERRNO("ftell");
+        return 2;
+    }
+    if (fseek(file, data_offset + (long) data_size + (data_size & 1), SEEK_SET) == 0) {
+        while (fread(chunk, 1, sizeof(chunk), file) == sizeof(chunk)) {
+            if (read_wave_chunk(file_info, ntohl(chunk[0]), U32_TO_LE(chunk[1]),
+                                NULL)) {
+                break;
+            }
+        }
+        clearerr(file);
+    }
+    if (fseek(file, data_offset, SEEK_SET) == -1) {
+        LOG_ERRNO("fseek");
+        return 2;
+    }
+
+    return 0;
+}
+
+
+/**
+ * (internal) Read the end of the format chunk of a WAV file of ADPCM blocks,
+ * and its data. Samples are decoded to 16 bits, so the data size is the
+ * size of the decoded data.
+ */
+static int wave_adpcm_opener(music_file_t *file_info, uint32_t header_size)
+{
+    int ret;
+    FILE *file = file_info->file;
+    unsigned const encoding = file_info->encoding;
+    unsigned const channels = file_info->channels;
+    size_t const block_frames = adpcm_block_frames(encoding, file_info->block_align,
+                                                   channels);
+    if (file_info->bits_per_sample != 4 || block_frames < 2 || channels > 8) {
+        LOG_ERROR("WAVE file error: Internal inconsistency in the header.");
+        return 1;
+    }
+
+    // Extension: its size, frames per block and number of coefficients
+    uint16_t extension[3];
+    uint32_t const extension_size = encoding == WAVE_FORMAT_ADPCM ? 6 : 4;
+    if (header_size < 16 + extension_size) {
+        LOG_ERROR("WAVE file ERROR: truncated header.");
+        return 1;
+    }
+    MY_READ(file, extension, extension_size);
+    if (ret != (int) extension_size) {
+        LOG_ERROR("WAVE file ERROR: truncated header.");
+        return 1;
+    }
+    LOG_DEBUG("[WAV] Frames per block: %u.", U16_TO_LE(extension[1]));
+    if (U16_TO_LE(extension[1]) != block_frames) {
+        LOG_ERROR("WAVE file error: Internal inconsistency in the header.");
+        return 1;
+    }
+    uint32_t header_read = 16 + extension_size;
+
+    // MS ADPCM may define its own predictors, which encoders don't use
+    if (encoding == WAVE_FORMAT_ADPCM) {
+        uint16_t coefs[ADPCM_MS_COEFS][2];
+        if (U16_TO_LE(extension[2]) != ADPCM_MS_COEFS ||
+            header_size < header_read + sizeof(coefs)) {
+            LOG_ERROR("These ADPCM coefficients are not supported. Sorry...");
+            return 1;
+        }
+        MY_READ(file, coefs, sizeof(coefs));
+        if (ret != sizeof(coefs)) {
+            LOG_ERROR("WAVE file ERROR: truncated header.");
+            return 1;
+        }
+        unsigned i;
+        for (i = 0; i < ADPCM_MS_COEFS; i++) {
+            if ((int16_t) U16_TO_LE(coefs[i][0]) != adpcm_ms_coefs[i][0] ||
+                (int16_t) U16_TO_LE(coefs[i][1]) != adpcm_ms_coefs[i][1]) {
+                LOG_ERROR("These ADPCM coefficients are not supported. Sorry...");
+                return 1;
+            }
+        }
+        header_read += sizeof(coefs);
+    }
+    if (fseek(file, header_size - header_read + (header_size & 1), SEEK_CUR) == -1) {
+        LOG_ERRNO("fseek");
+        return 2;
+    }
+
+    uint32_t fact_frames = UINT32_MAX;
+    ret = wave_data_opener(file_info, &fact_frames);
+    if (ret) return ret;
+    file_info -> oss_format = AFMT_S16_NE;
+    file_info -> bits_per_sample = 16;
+    file_info -> block_frames = block_frames;
+
+    // The last block may be shorter, and the fact chunk drops its padding
+    uint_fast64_t const size = file_info -> data_size;
+    if (size != DATA_SIZE_UNKNOWN) {
+        uint64_t frames = (uint64_t) (size / file_info->block_align) * block_frames +
+            adpcm_block_frames(encoding, size % file_info->block_align, channels);
+        if (frames > fact_frames) frames = fact_frames;
+        uint64_t const decoded_size = frames * channels * 2;
+        file_info -> data_size = decoded_size < DATA_SIZE_UNKNOWN ?
+            decoded_size : DATA_SIZE_UNKNOWN;
+    }
+    return 0;
+}
+
+
 /**
  * Read info in WAV files.
  */
@@ -73,65 +287,100 @@ int wave_opener(music_file_t * file_info)
     MY_READ(file, & file_size, sizeof(file_size));
     file_size = U32_TO_LE(file_size);
     file_size += 8;
-    printf("[WAV] File size: %u.\n", file_size);
+    LOG_DEBUG("[WAV] File size: %u.", file_size);
+    file_info -> data_size = DATA_SIZE_UNKNOWN;
 
     uint32_t magic_number;
     MY_READ(file, & magic_number, sizeof(magic_number));
     magic_number = ntohl (magic_number);
     if (magic_number != 0x57415645) {
-        fprintf(stderr, "This RIFF file not a WAVE file.\n");
+        LOG_ERROR("This RIFF file not a WAVE file.");
         return 1;
     }
 
+    // Chunks before the header, like the JUNK chunk which keeps room for
+    // the sizes of RF64 files, are skipped
     uint32_t magic_number_header;
-    MY_READ(file, & magic_number_header, sizeof(magic_number_header));
-    magic_number_header = ntohl (magic_number_header);
-    if (magic_number_header != 0x666d7420) {
-        fprintf(stderr, "WAVE file ERROR: no header!!\n");
-        return 1;
-    }
-
     uint32_t header_size;
-    MY_READ(file, & header_size, sizeof(header_size));
-    header_size = U32_TO_LE (header_size);
-    printf("[WAV] Header size: %u.\n", header_size);
+    for (;;) {
+        MY_READ(file, & magic_number_header, sizeof(magic_number_header));
+        magic_number_header = ntohl (magic_number_header);
+        MY_READ(file, & header_size, sizeof(header_size));
+        header_size = U32_TO_LE (header_size);
+        if (feof(file)) {
+            LOG_ERROR("WAVE file ERROR: no header!!");
+            return 1;
+        }
+        if (magic_number_header == 0x666d7420) break;
+        // The ds64 chunk of RF64 files has the 64-bit sizes of the file and
+        // of the data, whose 32-bit sizes are 0xffffffff
+        if (magic_number_header == 0x64733634 && header_size >= 16) {
+            unsigned char sizes[16];
+            MY_READ(file, sizes, sizeof(sizes));
+            uint64_t data_size = 0;
+            int i;
+            for (i = 15; i >= 8; i--) {
+                data_size = data_size << 8 | sizes[i];
+            }
+            LOG_DEBUG("[WAV] RF64 data size: %llu.", (unsigned long long) data_size);
+            file_info -> data_size = data_size;
+            header_size -= sizeof(sizes);
+        }
+        LOG_DEBUG("[WAV] Skipped chunk %c%c%c%c, %u bytes.", magic_number_header >> 24,
+                  (magic_number_header >> 16) & 0xff, (magic_number_header >> 8) & 0xff,
+                  magic_number_header & 0xff, header_size);
+        if (fseek(file, (long) header_size + (header_size & 1), SEEK_CUR) == -1) {
+            LOG_ERRNO("fseek");
+            return 2;
+        }
+    }
+    LOG_DEBUG("[WAV] Header size: %u.", header_size);
 
     uint16_t encoding;
     MY_READ(file, & encoding, sizeof(encoding));
     encoding = U16_TO_LE (encoding);
-    printf("[WAV] WAVE encoding format: %u.\n", encoding);
-    if (encoding != 1) {
-        fprintf(stderr, "Encoding not supported. Sorry...\n");
+    LOG_DEBUG("[WAV] WAVE encoding format: %u.", encoding);
+    if (encoding != WAVE_FORMAT_PCM && encoding != WAVE_FORMAT_ADPCM &&
+        encoding != WAVE_FORMAT_IMA_ADPCM) {
+        LOG_ERROR("Encoding not supported. Sorry...");
         return 1;
     }
+    file_info -> encoding = encoding;
 
     uint16_t channels;
     MY_READ(file, & channels, sizeof(channels));
     channels = U16_TO_LE (channels);
-    printf("[WAV] Nb of channels: %u.\n", channels);
+    LOG_DEBUG("[WAV] Nb of channels: %u.", channels);
     file_info -> channels = channels;
 
     uint32_t sample_rate;
     MY_READ(file, & sample_rate, sizeof(sample_rate));
     sample_rate = U32_TO_LE (sample_rate);
-    printf("[WAV] Sample rate: %u.\n", sample_rate);
+    LOG_DEBUG("[WAV] Sample rate: %u.", sample_rate);
     file_info -> sample_rate = sample_rate;
 
     uint32_t byte_rate;
     MY_READ(file, & byte_rate, sizeof(byte_rate));
     byte_rate = U32_TO_LE (byte_rate);
-    printf("[WAV] Byte rate: %u.\n", byte_rate);
+    LOG_DEBUG("[WAV] Byte rate: %u.", byte_rate);
 
     uint16_t block_align;
     MY_READ(file, & block_align, sizeof(block_align));
     block_align = U16_TO_LE (block_align);
-    printf("[WAV] Block size: %u.\n", block_align);
+    LOG_DEBUG("[WAV] Block size: %u.", block_align);
 
     uint16_t bits_per_sample;
     MY_READ(file, & bits_per_sample, sizeof(bits_per_sample));
     bits_per_sample = U16_TO_LE (bits_per_sample);
-    printf("[WAV] Bits per sample: %u.\n", bits_per_sample);
+    LOG_DEBUG("[WAV] Bits per sample: %u.", bits_per_sample);
     file_info -> bits_per_sample = bits_per_sample;
+    file_info -> block_align = block_align;
+    file_info -> block_frames = 1;
+
+    // Compressed samples are decoded to 16 bits, block by block
+    if (encoding != WAVE_FORMAT_PCM) {
+        return wave_adpcm_opener(file_info, header_size);
+    }
 
     uint_fast32_t oss_format;
     switch (bits_per_sample) {
@@ -144,7 +393,7 @@ int wave_opener(music_file_t * file_info)
             break;
 
         default:
-            fprintf(stderr, "This value of bits per sample not supported. Sorry...\n");
+            LOG_ERROR("This value of bits per sample not supported. Sorry...");
             return 1;
     }
     file_info -> oss_format = oss_format;
@@ -152,25 +401,18 @@ int wave_opener(music_file_t * file_info)
     // Header sanity checks
     if (block_align != channels * bits_per_sample / 8 ||
         (uint_fast32_t) block_align * sample_rate != byte_rate) {
-        fprintf(stderr, "WAVE file error: Internal inconsistency in the header.\n");
+        LOG_ERROR("WAVE file error: Internal inconsistency in the header.");
         return 1;
     }
 
-    uint32_t magic_number_data;
-    MY_READ(file, & magic_number_data, sizeof(magic_number_data));
-    magic_number_data = ntohl (magic_number_data);
-    if (magic_number_data != 0x64617461) {
-        fprintf(stderr, "WAVE file ERROR: no data.\n");
-        return 1;
+    // Skip the end of the format chunk
+    if (header_size > 16 &&
+        fseek(file, header_size - 16 + (header_size & 1), SEEK_CUR) == -1) {
+        LOG_ERRNO("fseek");
+        return 2;
     }
 
-    uint32_t data_size;
-    MY_READ(file, & data_size, sizeof(data_size));
-    data_size = U32_TO_LE (data_size);
-    printf("[WAV] Data size: %u.\n",data_size);
-    file_info -> data_size = data_size;
-
-    return 0;
+    return wave_data_opener(file_info, NULL);
 }
 
 
@@ -185,12 +427,12 @@ int au_opener(music_file_t * file_info)
     uint32_t header_size;
     MY_READ(file, & header_size, sizeof(header_size));
     header_size = ntohl (header_size);
-    printf("[AU] Header size: %u.\n", header_size);
+    LOG_DEBUG("[AU] Header size: %u.", header_size);
 
     uint32_t data_size;
     MY_READ(file, & data_size, sizeof(data_size));
     data_size = ntohl (data_size);
-    printf("[AU] Data size: %u.\n",data_size);
+    LOG_DEBUG("[AU] Data size: %u.",data_size);
     file_info -> data_size = data_size;
 
     uint32_t encoding;
@@ -203,18 +445,18 @@ int au_opener(music_file_t * file_info)
         case 2:
             bits_per_sample = 8;
             oss_format = AFMT_S8;
-            printf("[AU] Encoding format: Signed 8-bit.\n");
+            LOG_DEBUG("[AU] Encoding format: Signed 8-bit.");
             break;
 
         case 3:
             bits_per_sample = 16;
             oss_format = AFMT_S16_BE;
-            printf("[AU] Encoding format: Signed 16-bit.\n");
+            LOG_DEBUG("[AU] Encoding format: Signed 16-bit.");
             break;
 
         default:
-            printf("[AU] Encoding format: %u.\n", encoding);
-            fprintf(stderr, "Encoding not supported. Sorry...\n");
+            LOG_DEBUG("[AU] Encoding format: %u.", encoding);
+            LOG_ERROR("Encoding not supported. Sorry...");
             return 1;
     }
     file_info -> bits_per_sample = bits_per_sample;
@@ -223,18 +465,27 @@ int au_opener(music_file_t * file_info)
     uint32_t sample_rate;
     MY_READ(file, & sample_rate, sizeof(sample_rate));
     sample_rate = ntohl (sample_rate);
-    printf("[AU] Sample rate: %u.\n", sample_rate);
+    LOG_DEBUG("[AU] Sample rate: %u.", sample_rate);
     file_info -> sample_rate = sample_rate;
 
     uint32_t channels;
     MY_READ(file, & channels, sizeof(channels));
     channels = ntohl (channels);
-    printf("[AU] Nb of channels: %u.\n", channels);
+    LOG_DEBUG("[AU] Nb of channels: %u.", channels);
     file_info -> channels = channels;
 
+    // The annotation field may hold ReplayGain tags as "KEY=VALUE" lines
+    if (header_size > 24) {
+        char annotation[1024];
+        size_t const len = header_size - 24 < sizeof(annotation) ?
+            header_size - 24 : sizeof(annotation);
+        MY_READ(file, annotation, len);
+        tags_parse_text(&(file_info->replaygain), annotation, ret);
+    }
+
     // Position the cursor to the beginning of the data section
     if (fseek(file, header_size, SEEK_SET) == -1) {
-        perror("fseek");
+        LOG_ERRNO("fseek");
         return 2;
     }
 
@@ -242,18 +493,257 @@ int au_opener(music_file_t * file_info)
 }
 
 
+// Index of parsed headers, if any
+static metadata_index_t *music_index = NULL;
+
+// Volume applied to every stream, and which ReplayGain tags are applied
+static float master_volume = 1;
+static int replaygain_mode = REPLAYGAIN_TRACK;
+
+// Duration of crossfades between tracks, 0 to switch tracks without overlap
+static unsigned crossfade_msec = 0;
+
+// Whether silent ends of files are skipped, and the level of silence
+static int trim_enabled = 0;
+static float trim_db = SILENCE_DEFAULT_DB;
+
+// Filters applied to every stream
+static eq_t equalizer;
+
+// Playback speed of every stream, changed without changing the pitch
+static float playback_speed = 1;
+
+// Analysis tap on the output, prepared when it is first enabled
+static meter_t music_meter;
+static int music_meter_ready = 0;
+
+// Routing of stream channels to device channels, if set. The device is
+// then asked for as many channels as the map has.
+static int channel_map[MATRIX_MAX_CHANNELS];
+static unsigned channel_map_size = 0;
+
+// Devices which play a copy of the output besides /dev/dsp, opened with
+// every stream
+static char output_paths[FANOUT_MAX_DEVICES][FANOUT_PATH_MAX];
+static unsigned output_count = 0;
+
+// Scheduling profile of the playing thread, read at each step
+static int music_schedule = SCHEDULE_LATENCY;
+
+// Device opened ahead of the stream which resumes after a release, the
+// format it was configured for and the channels it was asked for and plays
+static int prepared_fd = -1;
+static music_file_t prepared_format;
+static unsigned prepared_channels;
+static unsigned prepared_device_channels;
+static int64_t prepared_ns;
+
+// Device and buffers are released after this many milliseconds of pause or
+// stop, 0 to keep them
+static unsigned idle_msec = IDLE_DEFAULT_MSEC;
+
+/**
+ * Stream released after an idle pause, which resumes where it was with
+ * its format and volume. The next track is queued again, at its position
+ * if it was fading in.
+ */
+typedef struct {
+    char *name;
+    music_file_t info;
+    long offset;
+    uint_fast64_t data_left;
+    size_t skip_frames;
+    uint64_t position;
+    float stream_volume;
+    char *next_name;
+    long next_offset;
+    uint_fast64_t next_data_left;
+    size_t next_skip_frames;
+    size_t fade_pos;
+    size_t fade_frames;
+} released_stream_t;
+
+static released_stream_t released = { NULL };
+
+// Status page and clock of the played stream, if any
+static player_status_t *music_status = NULL;
+static playback_clock_t *music_clock = NULL;
+
+/**
+ * Publish the state and position of played streams in a status page
+ */
+void set_music_status(player_status_t *status)
+{
+    music_status = status;
+    music_clock = status != NULL ? &(status->clock) : NULL;
+}
+
+
 /**
- * Open a music file in AU or WAVE format
- * Please call fclose(file_info->file) to free the file descriptor
+ * Set the duration of crossfades between tracks
  */
-int open_music_file(const char *file_name, music_file_t *file_info)
+void set_music_crossfade(unsigned msec)
 {
-    // Open file
-    file_info->file = fopen (file_name, "rb");
-    if (file_info->file == NULL) {
-        fprintf(stderr, "Couldn't open the file!\n");
-        return 2;
+    crossfade_msec = msec;
+}
+
+/**
+ * Get the duration of crossfades between tracks
+ */
+unsigned get_music_crossfade()
+{
+    return crossfade_msec;
+}
+
+
+/**
+ * Skip or keep the silent ends of files, with the level of silence in dBFS
+ */
+void set_music_trim(int enabled, float threshold_db)
+{
+    trim_enabled = enabled;
+    trim_db = threshold_db;
+}
+
+/**
+ * Tell whether silent ends of files are skipped, and the level of silence
+ */
+int get_music_trim(float *threshold_db)
+{
+    *threshold_db = trim_db;
+    return trim_enabled;
+}
+
+
+/**
+ * (internal) Describe a new stream in the status page
+ */
+static void set_status_stream(music_file_t const *info, const char *name)
+{
+    if (music_status == NULL) return;
+    status_begin_update(music_status);
+    music_status->channels = info->channels;
+    music_status->sample_rate = info->sample_rate;
+    music_status->bits_per_sample = info->bits_per_sample;
+    music_status->duration_frames = info->data_size /
+        (info->channels * info->bits_per_sample / 8);
+    snprintf(music_status->file, sizeof(music_status->file), "%s", name);
+    status_end_update(music_status);
+}
+
+
+/**
+ * (internal) Publish the playback state
+ */
+static void set_status_state(uint32_t state)
+{
+    if (music_status == NULL) return;
+    status_begin_update(music_status);
+    music_status->state = state;
+    status_end_update(music_status);
+}
+
+/**
+ * Use an index to avoid parsing headers of files which were already opened
+ */
+void set_music_metadata_index(metadata_index_t *index)
+{
+    music_index = index;
+}
+
+
+/**
+ * (internal) Fill the identity of an open file in its index record
+ * Return 1 on error.
+ */
+static int stat_music_file(music_file_t const *file_info, metadata_t *meta)
+{
+    struct stat st;
+    if (fstat(fileno(file_info->file), &st) == -1) {
+        LOG_ERRNO("fstat");
+        return 1;
+    }
+    meta->inode = st.st_ino;
+    meta->mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    meta->size = st.st_size;
+    return 0;
+}
+
+
+/**
+ * (internal) Index the header of an open file, whose identity is in meta
+ */
+static void index_music_file(const char *file_name, music_file_t const *file_info,
+                             metadata_t *meta)
+{
+    uint_fast32_t const oct_per_sec =
+        file_info->bits_per_sample * file_info->sample_rate *
+        file_info->channels / 8;
+    meta->oss_format = file_info->oss_format;
+    meta->channels = file_info->channels;
+    meta->sample_rate = file_info->sample_rate;
+    meta->bits_per_sample = file_info->bits_per_sample;
+    meta->data_size = file_info->data_size;
+    meta->data_offset = file_info->data_offset;
+    meta->encoding = file_info->encoding;
+    meta->block_align = file_info->block_align;
+    meta->block_frames = file_info->block_frames;
+    meta->duration_ms = oct_per_sec ?
+        (uint64_t) file_info->data_size * 1000 / oct_per_sec : 0;
+    meta->replaygain = file_info->replaygain;
+    meta->audio_start = file_info->audio_start;
+    meta->audio_end = file_info->audio_end;
+    meta->silence_threshold = file_info->silence_threshold;
+    metadata_index_insert(music_index, file_name, meta);
+}
+
+
+/**
+ * (internal) Fill file_info from the index if the file has not changed since
+ * its header was indexed. The file is positioned at the beginning of its data.
+ * Return 0 on success, 1 if the header needs to be parsed.
+ */
+static int lookup_music_file(const char *file_name, music_file_t *file_info,
+                             metadata_t *meta)
+{
+    if (stat_music_file(file_info, meta) ||
+        metadata_index_lookup(music_index, file_name, meta)) {
+        return 1;
+    }
+    if (fseek(file_info->file, meta->data_offset, SEEK_SET) == -1) {
+        LOG_ERRNO("fseek");
+        return 1;
     }
+    file_info->oss_format = meta->oss_format;
+    file_info->channels = meta->channels;
+    file_info->sample_rate = meta->sample_rate;
+    file_info->bits_per_sample = meta->bits_per_sample;
+    file_info->data_size = meta->data_size;
+    file_info->data_offset = meta->data_offset;
+    file_info->encoding = meta->encoding;
+    file_info->block_align = meta->block_align;
+    file_info->block_frames = meta->block_frames;
+    file_info->replaygain = meta->replaygain;
+    file_info->audio_start = meta->audio_start;
+    file_info->audio_end = meta->audio_end;
+    file_info->silence_threshold = meta->silence_threshold;
+    return 0;
+}
+
+
+/**
+ * (internal) Parse the header of an open music file, in AU or WAVE format,
+ * and position it at the beginning of its data.
+ * Return 0 on success, 1 if the format is not recognized, 2 if the header
+ * is invalid.
+ */
+static int parse_music_header(music_file_t *file_info)
+{
+    memset(&(file_info->replaygain), 0, sizeof(file_info->replaygain));
+    file_info->audio_start = file_info->audio_end = 0;
+    file_info->silence_threshold = 0;
+    file_info->encoding = WAVE_FORMAT_PCM;
+    file_info->block_align = file_info->block_frames = 1;
 
     // Look for magic number to determine file type
     int ret;
@@ -261,43 +751,170 @@ int open_music_file(const char *file_name, music_file_t *file_info)
     MY_READ(file_info->file, & magic_number, sizeof(magic_number));
     magic_number = ntohl (magic_number);
 
-    if (magic_number == 0x52494646) {
-        // Seems to be a RIFF file. Try to see if it's a WAVE one.
+    if (magic_number == 0x52494646 || magic_number == 0x52463634) {
+        // Seems to be a RIFF or RF64 file. Try to see if it's a WAVE one.
         ret = wave_opener(file_info);
     } else if (magic_number == 0x2e736e64) {
         // Decode file header
         ret = au_opener(file_info);
     } else {
-        fprintf(stderr, "File format not recognized.\n");
-        fclose(file_info->file);
+        return 1;
+    }
+    if (ret) return 2;
+
+    // Headers are followed by data
+    long const data_offset = ftell(file_info->file);
+    if (data_offset == -1) {
+        LOG_ERRNO("ftell");
+        return 2;
+    }
+    file_info->data_offset = data_offset;
+    return 0;
+}
+
+
+/**
+ * (internal) Open a music file, see open_music_file()
+ */
+static int open_music_file_untraced(const char *file_name, music_file_t *file_info)
+{
+    // Open file
+    file_info->file = fopen (file_name, "rb");
+    if (file_info->file == NULL) {
+        LOG_ERROR("Couldn't open the file!");
         return 2;
     }
 
+    // Skip header parsing if it is already known
+    metadata_t meta;
+    memset(&meta, 0, sizeof(meta));
+    if (music_index != NULL && !lookup_music_file(file_name, file_info, &meta)) {
+        return 0;
+    }
+
+    TRACE_BEGIN("parse_header");
+    int const ret = parse_music_header(file_info);
+    TRACE_END("parse_header");
+    if (ret == 1) {
+        LOG_ERROR("File format not recognized.");
+    } else if (ret) {
+        LOG_ERROR("Header parsing failed! File may have been corrupted.");
+    }
     if (ret) {
-        fprintf(stderr, "Header parsing failed! File may have been corrupted.\n");
         fclose(file_info->file);
         return 2;
     }
 
+    if (music_index != NULL) {
+        index_music_file(file_name, file_info, &meta);
+    }
+    return 0;
+}
+
+
+/**
+ * Open a music file in AU or WAVE format
+ * Please call fclose(file_info->file) to free the file descriptor
+ */
+int open_music_file(const char *file_name, music_file_t *file_info)
+{
+    TRACE_BEGIN("open_music_file");
+    int ret = open_music_file_untraced(file_name, file_info);
+    TRACE_END("open_music_file");
+    return ret;
+}
+
+
+/**
+ * Parse the header of a music file in AU or WAVE format, like
+ * open_music_file() but without the index of headers, which is only filled
+ * with played files, so that probing files from several threads has no
+ * side effect.
+ * Please call fclose(file_info->file) to free the file descriptor
+ * Return 0 on success, 2 if the file can't be opened or parsed.
+ */
+int probe_music_file(const char *file_name, music_file_t *file_info)
+{
+    file_info->file = fopen(file_name, "rb");
+    if (file_info->file == NULL) return 2;
+    if (parse_music_header(file_info)) {
+        fclose(file_info->file);
+        return 2;
+    }
     return 0;
 }
 
 
 /**
- * Set the parameters of the dsp device
+ * (internal) Skip the silent ends of an open music file if trim is TRIM_ON,
+ * or TRIM_DEFAULT while trimming is enabled. The ends are found the first
+ * time with a threshold and kept in the index, so that replays only seek.
+ */
+static void trim_music_file(const char *file_name, music_file_t *info, int trim)
+{
+    if (trim == TRIM_DEFAULT) trim = trim_enabled;
+    if (trim != TRIM_ON || info->data_size == DATA_SIZE_UNKNOWN) return;
+    // Compressed data is only read block by block from its start
+    if (info->encoding != WAVE_FORMAT_PCM) return;
+    unsigned const frame_bytes = info->channels * info->bits_per_sample / 8;
+    if (frame_bytes == 0) return;
+
+    int const threshold = silence_threshold(trim_db);
+    if (info->silence_threshold != threshold) {
+        uint64_t start, end;
+        TRACE_BEGIN("silence_scan");
+        int const ret = silence_scan(fileno(info->file), info->data_offset,
+                                     info->data_size, info->oss_format,
+                                     info->channels, threshold, &start, &end);
+        TRACE_END("silence_scan");
+        if (ret) return;
+        info->audio_start = start;
+        info->audio_end = end;
+        info->silence_threshold = threshold;
+        metadata_t meta;
+        memset(&meta, 0, sizeof(meta));
+        if (music_index != NULL && !stat_music_file(info, &meta)) {
+            index_music_file(file_name, info, &meta);
+        }
+    }
+    // A file which is silent all along is played as it is
+    if (info->audio_end <= info->audio_start) return;
+
+    uint_fast64_t const frames = info->data_size / frame_bytes;
+    if (info->audio_start == 0 && info->audio_end >= frames) return;
+    if (fseeko(info->file, info->data_offset + (off_t) info->audio_start * frame_bytes,
+               SEEK_SET) == -1) {
+        LOG_ERRNO("fseeko");
+        return;
+    }
+    info->data_size = (uint_fast64_t) (info->audio_end - info->audio_start) * frame_bytes;
+    LOG_INFO("Skipping %.2f s of leading and %.2f s of trailing silence",
+             (float) info->audio_start / info->sample_rate,
+             (float) (frames - info->audio_end) / info->sample_rate);
+}
+
+
+/**
+ * Set the parameters of the dsp device. channels is the number of channels
+ * to ask for, and is changed to the number the device plays.
  */
-int dsp_configuration(int const fd_dsp, music_file_t const * audio_file)
+int dsp_configuration(int const fd_dsp, music_file_t const * audio_file,
+                      unsigned * channels)
 {
     unsigned arg;
     int ret;
 
-    // Nb of channels
-    arg = audio_file -> channels;
+    // Nb of channels, which the device may change
+    arg = *channels;
     MY_IOCTL(fd_dsp, SNDCTL_DSP_CHANNELS, & arg);
-    if (arg != audio_file -> channels) {
-        fprintf(stderr, "This number of channels not supported by OSS! Sorry...\n");
+    if (arg < 1 || arg > MATRIX_MAX_CHANNELS) {
+        LOG_ERROR("This number of channels not supported by OSS! Sorry...");
         return 1;
     }
+    if (arg != *channels) {
+        LOG_WARNING("The sound device uses %u channels instead of %u", arg, *channels);
+        *channels = arg;
+    }
 
     // Sample format
     arg = audio_file -> oss_format;
@@ -309,12 +926,12 @@ int dsp_configuration(int const fd_dsp, music_file_t const * audio_file)
         ret = ioctl(fd_dsp, SNDCTL_DSP_SETFMT, &arg);
     }
     if (ret == -1) {
-        perror ("ioctl");
+        LOG_ERRNO("ioctl");
         return 2;
     }
 
     if (arg != format) {
-        fprintf(stderr, "Unable to set OSS sample format.\n");
+        LOG_ERROR("Unable to set OSS sample format.");
         return 1;
     }
 
@@ -322,7 +939,7 @@ int dsp_configuration(int const fd_dsp, music_file_t const * audio_file)
     arg = audio_file -> sample_rate;
     MY_IOCTL(fd_dsp, SNDCTL_DSP_SPEED, & arg);
     if (arg != audio_file -> sample_rate) {
-        fprintf(stderr, "This sample rate is not supported by OSS... Sorry!\n");
+        LOG_ERROR("This sample rate is not supported by OSS... Sorry!");
         return 1;
     }
 
@@ -331,41 +948,111 @@ int dsp_configuration(int const fd_dsp, music_file_t const * audio_file)
 
 
 /**
- * Initialise a music buffer
+ * (internal) Open and configure the device for a format, to be taken by
+ * the next stream of this format
+ * Return 1 if the device couldn't be prepared.
  */
-int init_music_buffer(music_buffer_t *music_buf)
+static int prepare_device(music_file_t const *format)
 {
-    if (music_buf == NULL) return 1;
-    memset(music_buf, 0, sizeof(*music_buf));
-    music_buf->fd_dsp = -1;
-    int ret = pthread_mutex_init(&(music_buf->mutex), NULL);
-    if (ret) {
-        fprintf(stderr, "pthread_mutex_init failed: %d\n", ret);
+    release_music_device();
+    TRACE_BEGIN("prepare_device");
+    int const fd = open("/dev/dsp", O_WRONLY);
+    if (fd == -1) {
+        TRACE_END("prepare_device");
+        LOG_ERRNO("open: /dev/dsp");
         return 1;
     }
-    ret = pthread_cond_init(&(music_buf->cond), NULL);
-    if (ret) {
-        fprintf(stderr, "pthread_cond_init failed: %d\n", ret);
+    prepared_format = *format;
+    prepared_format.file = NULL;
+    prepared_channels = channel_map_size ? channel_map_size : prepared_format.channels;
+    prepared_device_channels = prepared_channels;
+    if (dsp_configuration(fd, &prepared_format, &prepared_device_channels)) {
+        TRACE_END("prepare_device");
+        LOG_WARNING("The sound device couldn't be prepared");
+        close(fd);
         return 1;
     }
-    return ret;
+    prepared_fd = fd;
+    prepared_ns = playback_clock_now_ns();
+    TRACE_END("prepare_device");
+    return 0;
 }
 
-
 /**
- * Destroy a music buffer
+ * Close the device prepared for a stream if no stream took it
  */
-int destroy_music_buffer(music_buffer_t *music_buf)
+void release_music_device()
 {
-    if (music_buf == NULL) return 1;
-    int ret = pthread_cond_destroy(&(music_buf->cond));
-    if (ret) {
-        fprintf(stderr, "pthread_mutex_destroy failed: %d\n", ret);
-        return 1;
+    if (prepared_fd != -1) {
+        close(prepared_fd);
+        prepared_fd = -1;
     }
-    ret = pthread_mutex_destroy(&(music_buf->mutex));
+}
+
+/**
+ * (internal) Take the prepared device if it is configured for the format
+ * of a stream, asking for device_channels, which is set to the channels
+ * it plays. The device is released otherwise.
+ * Return its file descriptor, or -1.
+ */
+static int take_prepared_device(music_file_t const *info, unsigned *device_channels)
+{
+    if (prepared_fd == -1) return -1;
+    int fd = -1;
+    if (info->oss_format == prepared_format.oss_format &&
+        info->sample_rate == prepared_format.sample_rate &&
+        info->channels == prepared_format.channels &&
+        *device_channels == prepared_channels) {
+        fd = prepared_fd;
+        prepared_fd = -1;
+        *device_channels = prepared_device_channels;
+        LOG_DEBUG("Playing on the prepared device");
+    }
+    release_music_device();
+    return fd;
+}
+
+
+/**
+ * Initialise a music buffer
+ */
+int init_music_buffer(music_buffer_t *music_buf)
+{
+    if (music_buf == NULL) return 1;
+    memset(music_buf, 0, sizeof(*music_buf));
+    music_buf->fd_dsp = -1;
+    music_buf->timer_fd = -1;
+    music_buf->wake_fd = -1;
+    fanout_init(&(music_buf->fanout));
+    music_buf->stream_volume = 1;
+    int ret = pthread_mutex_init(&(music_buf->mutex), NULL);
+    if (ret) {
+        LOG_ERROR("pthread_mutex_init failed: %d", ret);
+        return 1;
+    }
+    ret = pthread_cond_init(&(music_buf->cond), NULL);
+    if (ret) {
+        LOG_ERROR("pthread_cond_init failed: %d", ret);
+        return 1;
+    }
+    return ret;
+}
+
+
+/**
+ * Destroy a music buffer
+ */
+int destroy_music_buffer(music_buffer_t *music_buf)
+{
+    if (music_buf == NULL) return 1;
+    int ret = pthread_cond_destroy(&(music_buf->cond));
+    if (ret) {
+        LOG_ERROR("pthread_mutex_destroy failed: %d", ret);
+        return 1;
+    }
+    ret = pthread_mutex_destroy(&(music_buf->mutex));
     if (ret) {
-        fprintf(stderr, "pthread_mutex_destroy failed: %d\n", ret);
+        LOG_ERROR("pthread_mutex_destroy failed: %d", ret);
         return 1;
     }
     return ret;
@@ -379,7 +1066,7 @@ static int lock_music_buffer(music_buffer_t *music_buf)
 {
     int ret = pthread_mutex_lock(&(music_buf->mutex));
     if (ret) {
-        fprintf(stderr, "pthread_mutex_lock failed: %d\n", ret);
+        LOG_ERROR("pthread_mutex_lock failed: %d", ret);
     }
     return ret;
 }
@@ -392,18 +1079,220 @@ static int unlock_music_buffer(music_buffer_t *music_buf)
 {
     int ret = pthread_mutex_unlock(&(music_buf->mutex));
     if (ret) {
-        fprintf(stderr, "pthread_mutex_unlock failed: %d\n", ret);
+        LOG_ERROR("pthread_mutex_unlock failed: %d", ret);
     }
     return ret;
 }
 
 
 /**
- * Prepare to play a file
+ * (internal) Prepare the decoder of a file whose data is made of
+ * compressed blocks, if it is.
+ * Return 1 if the allocation failed.
+ */
+static int init_decoder_music_file(music_file_t const *info, adpcm_t *decoder)
+{
+    if (info->encoding == WAVE_FORMAT_PCM) return 0;
+    return adpcm_init(decoder, info->encoding, info->channels, info->block_align,
+                      info->block_frames);
+}
+
+
+/**
+ * (internal) Free the frames decoded ahead and the conversion of a track
+ */
+static void release_feed_music_buffer(track_feed_t *feed)
+{
+    free(feed->lead);
+    if (feed->converting) {
+        convert_destroy(&(feed->convert));
+    }
+    memset(feed, 0, sizeof(*feed));
+}
+
+
+/**
+ * (internal) Open and configure the sound device and allocate the buffer
+ * for the format described in music_buf->info.
+ * name is the played stream in the status page.
+ */
+static int open_device_music_buffer(music_buffer_t *music_buf, const char *name)
+{
+    int ret;
+    unsigned const sample_bytes = music_buf->info.bits_per_sample / 8;
+    unsigned const frame_bytes = music_buf->info.channels * sample_bytes;
+
+    // Open and configure sound device, unless it was prepared for this
+    // format
+    unsigned device_channels = channel_map_size ? channel_map_size : music_buf->info.channels;
+    music_buf->fd_dsp = take_prepared_device(&(music_buf->info), &device_channels);
+    if (music_buf->fd_dsp == -1) {
+        music_buf->fd_dsp = open("/dev/dsp", O_WRONLY);
+        if (music_buf->fd_dsp == -1) {
+            LOG_ERRNO("open: /dev/dsp");
+            close_music_buffer(music_buf);
+            return 2;
+        }
+        TRACE_BEGIN("dsp_configuration");
+        ret = dsp_configuration(music_buf->fd_dsp, &(music_buf->info), &device_channels);
+        TRACE_END("dsp_configuration");
+        if (ret) {
+            LOG_ERROR("Configuration of sound device failed... :-(");
+            close(music_buf->fd_dsp);
+            music_buf->fd_dsp = -1;
+            close_music_buffer(music_buf);
+            return 2;
+        }
+    }
+
+    // The device is written by its own thread, from a ring which holds the
+    // largest batch of the power profile. It closes the device on failure.
+    size_t const frames = BUF_MSEC * music_buf->info.sample_rate / 1000;
+    if (fanout_open(&(music_buf->fanout), "/dev/dsp", music_buf->fd_dsp, device_channels,
+                    music_buf->info.oss_format, music_buf->info.sample_rate,
+                    SCHEDULE_MAX_BLOCKS * frames)) {
+        LOG_ERROR("Couldn't start the writer of the sound device");
+        music_buf->fd_dsp = -1;
+        close_music_buffer(music_buf);
+        return 2;
+    }
+
+    // Channels are mixed for the device when it plays another number of
+    // channels than the stream, or when they are routed
+    music_buf->device_channels = device_channels;
+    music_buf->remapping = 0;
+    if (channel_map_size == device_channels &&
+        !matrix_init_map(&(music_buf->matrix), music_buf->info.channels,
+                         channel_map, device_channels)) {
+        music_buf->remapping = 1;
+    } else if (channel_map_size) {
+        LOG_WARNING("The channel map doesn't fit this stream, using the default mix");
+    }
+    if (!music_buf->remapping && device_channels != music_buf->info.channels) {
+        if (matrix_init_default(&(music_buf->matrix), music_buf->info.channels,
+                                device_channels)) {
+            LOG_ERROR("This number of channels not supported by OSS! Sorry...");
+            close_music_buffer(music_buf);
+            return 2;
+        }
+        music_buf->remapping = 1;
+    }
+    if (music_buf->remapping) {
+        LOG_INFO("Mixing %u channels to %u", (unsigned) music_buf->info.channels,
+                 device_channels);
+    }
+    music_buf->frames_written = music_buf->frames_read = 0;
+    music_buf->speed = 1;
+    playback_clock_reset(music_clock, music_buf->info.sample_rate);
+    playback_clock_set_speed(music_clock, playback_speed);
+
+    // The power profile sleeps on a timer, or until a pause or a stop
+    music_buf->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    music_buf->wake_fd = eventfd(0, 0);
+    if (music_buf->timer_fd == -1 || music_buf->wake_fd == -1) {
+        LOG_WARNING("No timer for the power profile, which plays like the latency one: %s",
+                    strerror(errno));
+        if (music_buf->timer_fd != -1) close(music_buf->timer_fd);
+        if (music_buf->wake_fd != -1) close(music_buf->wake_fd);
+        music_buf->timer_fd = music_buf->wake_fd = -1;
+    }
+    music_buf->wakeups = music_buf->syscalls = 0;
+    music_buf->schedule_start_ns = playback_clock_now_ns();
+
+    // Blocks of the stream run the kernels of its format
+    if (kernels_select(&(music_buf->kernels), music_buf->info.oss_format,
+                       music_buf->info.oss_format, music_buf->info.channels)) {
+        LOG_ERROR("This sample format is not supported! Sorry...");
+        close_music_buffer(music_buf);
+        return 2;
+    }
+    LOG_DEBUG("Kernels: decode %s, gain %s, encode %s",
+              music_buf->kernels.decode->name, music_buf->kernels.gain->name,
+              music_buf->kernels.encode->name);
+
+    // Alloc the playing buffer, which holds frames read from the stream,
+    // and its samples as floats
+    music_buf->buf_size = frames * frame_bytes;
+    music_buf->buf = malloc(music_buf->buf_size);
+    music_buf->device_work = music_buf->remapping ?
+        malloc(frames * device_channels * sizeof(float)) : NULL;
+    music_buf->work = malloc(frames * music_buf->info.channels * sizeof(float));
+    music_buf->next_work = malloc(frames * music_buf->info.channels * sizeof(float));
+    music_buf->stretch_work = malloc(frames * music_buf->info.channels * sizeof(float));
+
+    if (!music_buf->buf || !music_buf->work || !music_buf->next_work ||
+        !music_buf->stretch_work || (music_buf->remapping && !music_buf->device_work) ||
+        init_decoder_music_file(&(music_buf->info), &(music_buf->decoder)) ||
+        stretch_init(&(music_buf->stretch), music_buf->info.channels,
+                     music_buf->info.sample_rate, frames)) {
+        LOG_ERROR("Couldn't allocate the buffer to play the file.");
+        close_music_buffer(music_buf);
+        return 2;
+    }
+
+    // Other devices play what they can, without stopping the main one.
+    // They get the channels of the main device, as the channel map routes
+    // them.
+    unsigned d;
+    for (d = 0; d < output_count; d++) {
+        int const fd = open(output_paths[d], O_WRONLY);
+        if (fd == -1) {
+            LOG_WARNING("Couldn't open %s: %s", output_paths[d], strerror(errno));
+            continue;
+        }
+        unsigned channels = device_channels;
+        if (dsp_configuration(fd, &(music_buf->info), &channels)) {
+            LOG_WARNING("Configuration of %s failed, it won't play", output_paths[d]);
+            close(fd);
+            continue;
+        }
+        fanout_add(&(music_buf->fanout), output_paths[d], fd, device_channels,
+                   channels, music_buf->info.oss_format, music_buf->info.sample_rate,
+                   frames);
+    }
+
+    // The output fades in, at the volumes of the stream and master
+    music_buf->data_left = music_buf->info.data_size == DATA_SIZE_UNKNOWN ?
+        UINT_FAST64_MAX : music_buf->info.data_size;
+    music_buf->ramp_frames = GAIN_RAMP_MSEC * music_buf->info.sample_rate / 1000;
+    dsp_gain_init(&(music_buf->stream_gain), music_buf->stream_volume *
+                  replaygain_factor(&(music_buf->info.replaygain), replaygain_mode));
+    dsp_gain_init(&(music_buf->output_gain), 0);
+    dsp_gain_set(&(music_buf->output_gain), master_volume, music_buf->ramp_frames);
+    eq_set_rate(&equalizer, music_buf->info.sample_rate, music_buf->ramp_frames);
+    stretch_set_speed(&(music_buf->stretch), playback_speed);
+    music_buf->stretching = playback_speed != 1;
+
+    // Describe the new stream in the status page
+    size_t const len = strlen(name) + 1;
+    music_buf->name = malloc(len);
+    if (music_buf->name != NULL) {
+        memcpy(music_buf->name, name, len);
+    }
+    set_status_stream(&(music_buf->info), name);
+    if (music_status != NULL) {
+        audio_buf_info space;
+        if (ioctl(music_buf->fd_dsp, SNDCTL_DSP_GETOSPACE, &space) == -1) {
+            space.fragstotal = space.fragsize = 0;
+        }
+        status_begin_update(music_status);
+        music_status->state = STATUS_STOPPED;
+        music_status->buffer_queued = 0;
+        music_status->buffer_size = space.fragstotal * space.fragsize;
+        memset(music_status->peaks, 0, sizeof(music_status->peaks));
+        status_end_update(music_status);
+    }
+    return 0;
+}
+
+
+/**
+ * Prepare to play a file, skipping its silent ends as trim says
  */
-int open_music_buffer(const char *file_name, music_buffer_t *music_buf)
+int open_music_buffer(const char *file_name, music_buffer_t *music_buf, int trim)
 {
     int ret;
+    forget_released_music();
     ret = init_music_buffer(music_buf);
     if (ret) {
         return ret;
@@ -414,41 +1303,43 @@ int open_music_buffer(const char *file_name, music_buffer_t *music_buf)
     if (ret) {
         return ret;
     }
+    trim_music_file(file_name, &(music_buf->info), trim);
 
     // Compute and print file duration
     unsigned const oct_per_sec =
         music_buf->info.bits_per_sample *
         music_buf->info.sample_rate *
         music_buf->info.channels / 8;
-    float const duration = music_buf->info.data_size / oct_per_sec;
-    printf("File duration: %g seconds.\n", duration);
-
-    // Open sound device
-    music_buf->fd_dsp = open("/dev/dsp", O_WRONLY);
-    if (music_buf->fd_dsp == -1) {
-        perror("open: /dev/dsp");
-        close_music_buffer(music_buf);
-        return 2;
+    float const duration = (float) music_buf->info.data_size / oct_per_sec;
+    LOG_INFO("File duration: %g seconds.", duration);
+    replaygain_t const *replaygain = &(music_buf->info.replaygain);
+    if (replaygain->flags) {
+        LOG_INFO("ReplayGain: track %+.2f dB, album %+.2f dB.",
+                 replaygain->track_gain, replaygain->album_gain);
     }
 
-    // Configure sound device
-    ret = dsp_configuration(music_buf->fd_dsp, &(music_buf->info));
-    if (ret) {
-        fprintf(stderr, "Configuration of sound device failed... :-(\n");
-        close_music_buffer(music_buf);
-        return 2;
-    }
+    return open_device_music_buffer(music_buf, file_name);
+}
 
-    // Alloc the playing buffer
-    music_buf->buf = malloc(music_buf->buf_size = BUF_MSEC * oct_per_sec / 1000);
 
-    if (!music_buf->buf) {
-        fprintf(stderr, "Couldn't allocate the buffer to play the file.\n");
-        close_music_buffer(music_buf);
-        return 2;
+/**
+ * Prepare to play cached clips only, in the format of the given clip
+ */
+int open_clip_music_buffer(clip_t const *clip, music_buffer_t *music_buf)
+{
+    forget_released_music();
+    int ret = init_music_buffer(music_buf);
+    if (ret) {
+        return ret;
     }
-
-    return 0;
+    music_buf->info.file = NULL;
+    music_buf->info.oss_format = AFMT_S16_NE;
+    music_buf->info.channels = clip->channels;
+    music_buf->info.sample_rate = clip->sample_rate;
+    music_buf->info.bits_per_sample = 16;
+    music_buf->info.data_size = 0;
+    music_buf->info.encoding = WAVE_FORMAT_PCM;
+    return open_device_music_buffer(music_buf, "(clips)");
 }
 
 
@@ -457,10 +1348,10 @@ int open_music_buffer(const char *file_name, music_buffer_t *music_buf)
  */
 int close_music_buffer(music_buffer_t *music_buf)
 {
-    if (music_buf->fd_dsp != -1) {
-        close(music_buf->fd_dsp);
-        music_buf->fd_dsp = -1;
-    }
+    // The writers close the devices, the main one included
+    fanout_close(&(music_buf->fanout));
+    music_buf->fd_dsp = -1;
+    memset(&(music_buf->kernels), 0, sizeof(music_buf->kernels));
     if (music_buf->info.file != NULL) {
         fclose(music_buf->info.file);
         music_buf->info.file = NULL;
@@ -469,148 +1360,1888 @@ int close_music_buffer(music_buffer_t *music_buf)
         free(music_buf->buf);
         music_buf->buf = NULL;
     }
+    if (music_buf->work != NULL) {
+        free(music_buf->work);
+        music_buf->work = NULL;
+    }
+    if (music_buf->next.file != NULL) {
+        fclose(music_buf->next.file);
+        music_buf->next.file = NULL;
+    }
+    adpcm_destroy(&(music_buf->decoder));
+    adpcm_destroy(&(music_buf->next_decoder));
+    release_feed_music_buffer(&(music_buf->feed));
+    release_feed_music_buffer(&(music_buf->next_feed));
+    if (music_buf->next_work != NULL) {
+        free(music_buf->next_work);
+        music_buf->next_work = NULL;
+    }
+    if (music_buf->stretch_work != NULL) {
+        free(music_buf->stretch_work);
+        music_buf->stretch_work = NULL;
+    }
+    if (music_buf->device_work != NULL) {
+        free(music_buf->device_work);
+        music_buf->device_work = NULL;
+    }
+    if (music_buf->timer_fd != -1) {
+        close(music_buf->timer_fd);
+        music_buf->timer_fd = -1;
+    }
+    if (music_buf->wake_fd != -1) {
+        close(music_buf->wake_fd);
+        music_buf->wake_fd = -1;
+    }
+    music_buf->remapping = 0;
+    stretch_destroy(&(music_buf->stretch));
+    music_buf->stretching = 0;
+    free(music_buf->name);
+    music_buf->name = NULL;
+    free(music_buf->next_name);
+    music_buf->next_name = NULL;
+    free(music_buf->ahead);
+    music_buf->ahead = NULL;
+    music_buf->ahead_size = music_buf->ahead_pos = music_buf->ahead_len = 0;
+    music_buf->fade_frames = 0;
+    int i;
+    for (i = 0; i < MAX_VOICES; i++) {
+        if (music_buf->voices[i].clip != NULL) {
+            clip_release(music_buf->voices[i].clip);
+            music_buf->voices[i].clip = NULL;
+        }
+    }
     return 0;
 }
 
 
 /**
- * Play one step of the buffer
+ * (internal) Cut short the sleep of the power profile, so that a pause or
+ * a stop fades out, or a voice plays, without waiting for the device buffer
+ * to drain
  */
-int play_step_music_buffer(music_buffer_t *music_buf)
+static void wake_music_buffer(music_buffer_t *music_buf)
+{
+    uint64_t const one = 1;
+    if (music_buf->wake_fd != -1 && write(music_buf->wake_fd, &one, sizeof(one)) == -1) {
+        LOG_ERRNO("write(wake)");
+    }
+}
+
+
+/**
+ * Mix a cached clip into the output of a running playing thread, which
+ * plays it even in a pause.
+ * The voice keeps the reference to the clip, which is released once played.
+ * Return 1 if the thread has finished playing, 2 if all voices are busy or
+ * the output can't mix clips.
+ */
+int trigger_music_buffer(music_buffer_t *music_buf, clip_t *clip,
+                         struct timespec const *triggered)
 {
-    size_t ret = 0;
     if (lock_music_buffer(music_buf)) return 1;
-    MY_READ(music_buf->info.file, music_buf->buf, music_buf->buf_size);
-    size_t bytes = ret;
-    if (bytes == 0) {
-        if (!feof(music_buf->info.file)) {
+    if (music_buf->finished || !music_buf->playing) {
+        unlock_music_buffer(music_buf);
+        return 1;
+    }
+    // Voices are mixed as floats, which the kernels of the output convert
+    if (music_buf->kernels.encode == NULL) {
+        unlock_music_buffer(music_buf);
+        LOG_ERROR("The output format can't mix clip %s", clip->name);
+        return 2;
+    }
+    int i;
+    for (i = 0; i < MAX_VOICES; i++) {
+        voice_t *voice = &(music_buf->voices[i]);
+        if (voice->clip == NULL) {
+            voice->clip = clip;
+            voice->pos = 0;
+            voice->step = ((uint_fast64_t) clip->sample_rate << 16) /
+                music_buf->info.sample_rate;
+            voice->triggered = *triggered;
             unlock_music_buffer(music_buf);
+            // A paused thread waits for voices
+            pthread_cond_broadcast(&(music_buf->cond));
+            wake_music_buffer(music_buf);
             return 0;
-        } else {
-            fprintf(stderr, "An error occured while reading the file.\n");
-            unlock_music_buffer(music_buf);
-            return 1;
         }
     }
     unlock_music_buffer(music_buf);
-    ret = write(music_buf->fd_dsp,  music_buf->buf, bytes);
-    // An error may happen when stopping playback
-    if (ret != bytes && music_buf->playing) {
-        fprintf(stderr, "Writing to the sound device failed.\n");
-        return 2;
+    LOG_WARNING("Every voice is busy, dropping clip %s", clip->name);
+    return 2;
+}
+
+
+/**
+ * (internal) Mix active voices into the first frames of the work buffer.
+ * Clip channels are mapped cyclically onto output channels and clip rates
+ * are converted to the output rate by picking the nearest frame.
+ * Return the number of frames which were needed to play voices.
+ * Mutex must be locked.
+ */
+static size_t mix_voices_music_buffer(music_buffer_t *music_buf, size_t frames)
+{
+    uint_fast32_t const channels = music_buf->info.channels;
+    float *const work = music_buf->work;
+    size_t used = 0;
+    int i;
+    for (i = 0; i < MAX_VOICES; i++) {
+        voice_t *voice = &(music_buf->voices[i]);
+        clip_t *clip = voice->clip;
+        if (clip == NULL) continue;
+
+        size_t f;
+        for (f = 0; f < frames; f++) {
+            uint_fast64_t const src = voice->pos >> 16;
+            if (src >= clip->frames) break;
+            int16_t const *in = clip->samples + src * clip->channels;
+            uint_fast32_t c;
+            for (c = 0; c < channels; c++) {
+                work[f * channels + c] += in[c % clip->channels] * (1.0f / 32768);
+            }
+            voice->pos += voice->step;
+        }
+        if (f > used) {
+            used = f;
+        }
+        if ((voice->pos >> 16) >= clip->frames) {
+            clip_release(clip);
+            voice->clip = NULL;
+        }
     }
-    return 0;
+    return used;
 }
 
 
 /**
- * Test end of file
+ * (internal) Compute the peak level of each channel in the first frames of
+ * the work buffer, as 16-bit magnitudes
  */
-int eof_music_buffer(music_buffer_t *music_buf)
+static void peak_levels_music_buffer(music_buffer_t const *music_buf, size_t frames,
+                                     uint16_t peaks[STATUS_MAX_CHANNELS])
 {
-    if (music_buf == NULL || music_buf->info.file == NULL) {
-        return 1;
+    uint_fast32_t const channels = music_buf->info.channels;
+    float const *const work = music_buf->work;
+    uint_fast32_t c;
+    for (c = 0; c < STATUS_MAX_CHANNELS; c++) {
+        float peak = 0;
+        size_t f;
+        for (f = 0; c < channels && f < frames; f++) {
+            float const x = fabsf(work[f * channels + c]);
+            if (x > peak) peak = x;
+        }
+        peaks[c] = peak >= 1 ? 32767 : (uint16_t) (peak * 32767);
     }
-    // music_buf->info.file is a shared resource among threads
-    if (lock_music_buffer(music_buf)) return 1;
-    int ret = feof(music_buf->info.file);
-    unlock_music_buffer(music_buf);
-    return ret;
 }
 
 
 /**
- * Play music file in a loop
+ * (internal) Read the next frames of a file into raw, in its format once
+ * decoded by decoder if it is compressed.
+ * Return the number of frames which were read, -1 on error.
  */
-int play_loop_music_buffer(music_buffer_t *music_buf)
+static long read_file_music_buffer(music_buffer_t *music_buf, music_file_t const *info,
+                                   size_t frame_bytes, uint_fast64_t *data_left,
+                                   adpcm_t *decoder, unsigned char *raw, size_t frames)
 {
-    int ret = 0;
-    music_buf->playing = 1;
-    while (music_buf->playing && !eof_music_buffer(music_buf)) {
-        // Pause music
-        if (lock_music_buffer(music_buf)) return 1;
-        while (music_buf->pausing) {
-            ret = pthread_cond_wait(&(music_buf->cond), &(music_buf->mutex));
-            if (ret) {
-                fprintf(stderr, "pthread_cond_wait failed: %d\n", ret);
-                unlock_music_buffer(music_buf);
-                return 1;
-            }
+    size_t size = frames * frame_bytes;
+    if (size > *data_left) size = *data_left;
+    size_t ret = 0;
+    if (info == &(music_buf->info) && music_buf->ahead_len) {
+        // Data read ahead comes first
+        ret = size < music_buf->ahead_len ? size : music_buf->ahead_len;
+        memcpy(raw, music_buf->ahead + music_buf->ahead_pos, ret);
+        music_buf->ahead_pos += ret;
+        music_buf->ahead_len -= ret;
+    }
+    if (ret == size) {
+        // Nothing to read
+    } else if (info->encoding == WAVE_FORMAT_PCM) {
+        // Each read of the file counts as one system call
+        __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+        TRACE_BEGIN("read");
+        size_t const got = fread(raw + ret, 1, size - ret, info->file);
+        TRACE_END_ARG("read", got);
+        if (ret == 0 && got == 0 && ferror(info->file)) {
+            LOG_ERROR("An error occured while reading the file.");
+            return -1;
         }
-        int is_playing = music_buf->playing;
-        unlock_music_buffer(music_buf);
-        if (!is_playing) break;
+        ret += got;
+    } else {
+        // Blocks are decoded straight into the buffer
+        __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+        TRACE_BEGIN("decode");
+        long const decoded = adpcm_read(decoder, info->file, (int16_t *) raw,
+                                        size / frame_bytes);
+        TRACE_END_ARG("decode", decoded);
+        if (decoded < 0) {
+            LOG_ERROR("An error occured while reading the file.");
+            return -1;
+        }
+        ret = decoded * frame_bytes;
+    }
+    // Data ends with its chunk or with a truncated file
+    *data_left = ret < size ? 0 : *data_left - ret;
+    return ret / frame_bytes;
+}
 
-        // Play again
-        ret = play_step_music_buffer(music_buf);
-        if (ret) break;
+
+/**
+ * (internal) Read ahead with one read the data of the current track which
+ * the next blocks need, so that a batch of the power profile doesn't read
+ * the file once per block. Compressed tracks are read by their decoder,
+ * block by block. Mutex must be locked.
+ */
+static void read_ahead_music_buffer(music_buffer_t *music_buf, size_t blocks)
+{
+    music_file_t const *info = &(music_buf->info);
+    if (info->file == NULL || info->encoding != WAVE_FORMAT_PCM) return;
+    if (music_buf->ahead == NULL) {
+        music_buf->ahead_size = SCHEDULE_MAX_BLOCKS * music_buf->buf_size;
+        music_buf->ahead = malloc(music_buf->ahead_size);
+        if (music_buf->ahead == NULL) return;
     }
-    return ret;
+
+    // Blocks of the output stand for more frames of a track at another
+    // rate or played faster
+    track_feed_t const *feed = &(music_buf->feed);
+    size_t frame_bytes = info->channels * info->bits_per_sample / 8;
+    double frames = (double) blocks * BUF_MSEC * info->sample_rate / 1000;
+    if (feed->converting) {
+        frame_bytes = feed->convert.in_frame_bytes;
+        frames = frames * feed->convert.in_rate / feed->convert.out_rate;
+    }
+    if (music_buf->stretching) {
+        frames *= music_buf->stretch.speed;
+    }
+    size_t size = (size_t) frames * frame_bytes;
+    if (size > music_buf->ahead_size) {
+        size = music_buf->ahead_size / frame_bytes * frame_bytes;
+    }
+    if (size > music_buf->data_left) size = music_buf->data_left;
+    if (size <= music_buf->ahead_len) return;
+
+    memmove(music_buf->ahead, music_buf->ahead + music_buf->ahead_pos, music_buf->ahead_len);
+    music_buf->ahead_pos = 0;
+    __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+    TRACE_BEGIN("read_ahead");
+    size_t const got = fread(music_buf->ahead + music_buf->ahead_len, 1,
+                             size - music_buf->ahead_len, info->file);
+    TRACE_END_ARG("read_ahead", got);
+    music_buf->ahead_len += got;
 }
 
 
 /**
- * Play music file in a thread
+ * (internal) Decode the next frames of a track into a work buffer, as
+ * floats in the format of the output: its frames decoded ahead first, then
+ * its blocks read into raw, or into the buffer of the conversion.
+ * Return the number of frames, -1 on error.
  */
-static void* routine_play_loop_music_buffer(void *music_buf)
+static long decode_stream_music_buffer(music_buffer_t *music_buf, music_file_t const *info,
+                                       uint_fast64_t *data_left, adpcm_t *decoder,
+                                       track_feed_t *feed, unsigned char *raw,
+                                       float *work, size_t frames)
 {
-    play_loop_music_buffer((music_buffer_t*)music_buf);
-    return NULL;
+    unsigned const channels = music_buf->info.channels;
+    size_t done = feed->lead_frames - feed->lead_pos;
+    if (done > frames) done = frames;
+    if (done) {
+        memcpy(work, feed->lead + feed->lead_pos * channels, done * channels * sizeof(float));
+        feed->lead_pos += done;
+    }
+    if (info->file == NULL || done == frames) return done;
+
+    long read;
+    if (!feed->converting) {
+        if (*data_left == 0) return done;
+        size_t const frame_bytes = channels * info->bits_per_sample / 8;
+        read = read_file_music_buffer(music_buf, info, frame_bytes, data_left, decoder,
+                                      raw, frames - done);
+        if (read < 0) return -1;
+        music_buf->kernels.decode->fn(work + done * channels, raw, read * channels);
+        return done + read;
+    }
+
+    convert_t *const conv = &(feed->convert);
+    for (;;) {
+        done += convert_pull(conv, work + done * channels, frames - done);
+        size_t const needed = convert_needed(conv, frames - done);
+        if (done == frames || needed == 0 || *data_left == 0) break;
+        read = read_file_music_buffer(music_buf, info, conv->in_frame_bytes, data_left,
+                                      decoder, conv->raw, needed);
+        if (read < 0) return -1;
+        if (read == 0) break;
+        convert_push(conv, conv->raw, read);
+    }
+    return done;
 }
-int start_play_loop_music_buffer(pthread_t *thread, music_buffer_t *music_buf)
+
+
+/**
+ * (internal) Read the next frames of a track into a work buffer, as floats
+ * at the gain of its stream.
+ * Return the number of frames which were read, -1 on error.
+ * Mutex must be locked.
+ */
+static long read_stream_music_buffer(music_buffer_t *music_buf, music_file_t *info,
+                                     uint_fast64_t *data_left, adpcm_t *decoder,
+                                     track_feed_t *feed, dsp_gain_t *gain, float *work,
+                                     size_t frames)
 {
-    music_buf->playing = 1;
-    music_buf->pausing = 0;
-    pthread_cond_broadcast(&(music_buf->cond));
-    int ret = pthread_create(thread, NULL, routine_play_loop_music_buffer,
-                             music_buf);
-    if (ret) {
-        fprintf(stderr, "pthread_create returned error code %d\n", ret);
-        return 1;
+    long const read = decode_stream_music_buffer(music_buf, info, data_left, decoder, feed,
+                                                 music_buf->buf, work, frames);
+    if (read > 0) {
+        music_buf->kernels.gain->fn(gain, work, read, music_buf->info.channels);
     }
-    return 0;
+    return read;
 }
 
+
 /**
- * Stop playing thread
+ * (internal) Number of frames of the output which remain in the current
+ * track, UINT_FAST64_MAX if its size is unknown. Mutex must be locked.
  */
-int stop_play_loop_music_buffer(pthread_t thread, music_buffer_t *music_buf)
+static uint_fast64_t frames_left_music_buffer(music_buffer_t const *music_buf)
 {
-    int ret;
-    music_buf->playing = 0;
-    music_buf->pausing = 0;
-    pthread_cond_broadcast(&(music_buf->cond));
-    MY_IOCTL(music_buf->fd_dsp, SNDCTL_DSP_RESET, NULL);
-    ret = pthread_join(thread, NULL);
-    if (ret) {
-        fprintf(stderr, "pthread_join returned error code %d\n", ret);
+    track_feed_t const *feed = &(music_buf->feed);
+    uint_fast64_t const lead = feed->lead_frames - feed->lead_pos;
+    if (music_buf->info.file == NULL) return lead;
+    if (music_buf->data_left == UINT_FAST64_MAX) return UINT_FAST64_MAX;
+    if (!feed->converting) {
+        return lead + music_buf->data_left /
+            (music_buf->info.channels * music_buf->info.bits_per_sample / 8);
+    }
+    convert_t const *conv = &(feed->convert);
+    uint_fast64_t const input = music_buf->data_left / conv->in_frame_bytes +
+        conv->input_frames - (conv->pos >> 32);
+    return lead + input * conv->out_rate / conv->in_rate;
+}
+
+
+/**
+ * (internal) Test if the current track has no frame left to play. Mutex
+ * must be locked.
+ */
+static int track_ended_music_buffer(music_buffer_t const *music_buf)
+{
+    track_feed_t const *feed = &(music_buf->feed);
+    if (feed->lead_pos < feed->lead_frames) return 0;
+    return music_buf->info.file == NULL ||
+        (music_buf->data_left == 0 &&
+         (!feed->converting || convert_pending(&(feed->convert)) == 0));
+}
+
+
+/**
+ * (internal) Decode the first frames of a track which will follow the
+ * current one, so that it starts without waiting for its file
+ * Return 1 if the allocation failed or the file couldn't be read.
+ */
+static int lead_music_buffer(music_buffer_t *music_buf, music_file_t const *info,
+                             uint_fast64_t *data_left, adpcm_t *decoder,
+                             track_feed_t *feed, size_t frames)
+{
+    uint_fast32_t const channels = music_buf->info.channels;
+    size_t const block = music_buf->buf_size /
+        (channels * music_buf->info.bits_per_sample / 8);
+    // Converted blocks are read into the buffer of the conversion
+    unsigned char *raw = feed->converting ? NULL :
+        malloc(block * info->channels * info->bits_per_sample / 8);
+    feed->lead = malloc(frames * channels * sizeof(float));
+    if (feed->lead == NULL || (!feed->converting && raw == NULL)) {
+        free(raw);
         return 1;
     }
+    size_t done = 0;
+    while (done < frames) {
+        long const read = decode_stream_music_buffer(
+            music_buf, info, data_left, decoder, feed, raw, feed->lead + done * channels,
+            frames - done < block ? frames - done : block);
+        if (read < 0) {
+            free(raw);
+            return 1;
+        }
+        if (read == 0) break;
+        done += read;
+    }
+    free(raw);
+    feed->lead_frames = done;
     return 0;
 }
 
+
 /**
- * Pause playing
+ * (internal) Move an open file to the frame where a released stream
+ * stopped: to its block, whose first skip_frames frames are skipped if it
+ * is compressed.
+ * Return 1 if the file can't be read there.
  */
-int pause_loop_music_buffer(music_buffer_t *music_buf)
+static int seek_music_file(music_file_t const *info, adpcm_t *decoder, long offset,
+                           size_t skip_frames)
 {
-    if (lock_music_buffer(music_buf)) return 1;
-    music_buf->pausing = 1;
-    unlock_music_buffer(music_buf);
-    pthread_cond_broadcast(&(music_buf->cond));
-    return 0;
+    if (fseek(info->file, offset, SEEK_SET) != 0) return 1;
+    if (skip_frames == 0) return 0;
+    int16_t *skipped = malloc(skip_frames * info->channels * sizeof(int16_t));
+    int const ret = skipped == NULL ||
+        adpcm_read(decoder, info->file, skipped, skip_frames) != (long) skip_frames;
+    free(skipped);
+    return ret;
 }
 
+
 /**
- * Resume playing
+ * (internal) Queue a file after the current track, like
+ * crossfade_music_buffer(). A next track which was fading in when its
+ * stream was released is reopened at its position instead, and its
+ * crossfade goes on before the stream starts again.
  */
-int resume_loop_music_buffer(music_buffer_t *music_buf)
+static int queue_music_buffer(music_buffer_t *music_buf, const char *file_name, int now,
+                              int trim, released_stream_t const *resume)
 {
-    if (lock_music_buffer(music_buf)) return 1;
-    music_buf->pausing = 0;
-    unlock_music_buffer(music_buf);
-    pthread_cond_broadcast(&(music_buf->cond));
-    return 0;
+    if (now && crossfade_msec == 0) return 1;
+    // The format of the output only changes when this thread opens a stream
+    if (music_buf->buf == NULL) return 1;
+    music_file_t const *output = &(music_buf->info);
+    music_file_t next;
+    if (open_music_file(file_name, &next)) return 2;
+    track_feed_t feed;
+    memset(&feed, 0, sizeof(feed));
+    if (next.channels != output->channels || next.sample_rate != output->sample_rate ||
+        next.oss_format != output->oss_format) {
+        if (convert_init(&(feed.convert), next.oss_format, next.channels, next.sample_rate,
+                         output->channels, output->sample_rate,
+                         BUF_MSEC * next.sample_rate / 1000 + 1)) {
+            LOG_INFO("%s has a format which can't be converted to the output",
+                     file_name);
+            fclose(next.file);
+            return 1;
+        }
+        feed.converting = 1;
+        LOG_INFO("Converting %s from %u channels at %u Hz", file_name,
+                 (unsigned) next.channels, (unsigned) next.sample_rate);
+    }
+    size_t const len = strlen(file_name) + 1;
+    char *name = malloc(len);
+    adpcm_t decoder;
+    memset(&decoder, 0, sizeof(decoder));
+    if (name == NULL || init_decoder_music_file(&next, &decoder)) {
+        LOG_ERROR("Couldn't allocate the decoder of %s", file_name);
+        release_feed_music_buffer(&feed);
+        adpcm_destroy(&decoder);
+        fclose(next.file);
+        free(name);
+        return 2;
+    }
+    memcpy(name, file_name, len);
+    uint_fast64_t data_left = next.data_size == DATA_SIZE_UNKNOWN ?
+        UINT_FAST64_MAX : next.data_size;
+    int ret = 0;
+    if (resume == NULL) {
+        trim_music_file(file_name, &next, trim);
+    } else {
+        data_left = resume->next_data_left;
+        ret = seek_music_file(&next, &decoder, resume->next_offset,
+                              resume->next_skip_frames) ? 2 : 0;
+    }
+    size_t const fade_frames = (uint_fast64_t) crossfade_msec * output->sample_rate / 1000;
+    size_t const block = BUF_MSEC * output->sample_rate / 1000;
+    if (!ret) {
+        ret = lead_music_buffer(music_buf, &next, &data_left, &decoder, &feed,
+                                LEAD_BLOCKS * block) ? 2 : 0;
+    }
+    if (ret) {
+        LOG_ERROR("Couldn't decode the first frames of %s", file_name);
+    }
+
+    // A track which is already fading in can't be replaced. A released
+    // crossfade is restored before its stream plays again.
+    if (!ret && lock_music_buffer(music_buf)) {
+        ret = 1;
+    } else if (!ret && ((!music_buf->playing && resume == NULL) || music_buf->pausing ||
+                        music_buf->stopping || music_buf->finished ||
+                        music_buf->fade_frames > 0)) {
+        unlock_music_buffer(music_buf);
+        ret = 1;
+    }
+    if (ret) {
+        release_feed_music_buffer(&feed);
+        adpcm_destroy(&decoder);
+        fclose(next.file);
+        free(name);
+        return ret;
+    }
+    if (music_buf->next.file != NULL) {
+        fclose(music_buf->next.file);
+        free(music_buf->next_name);
+    }
+    adpcm_destroy(&(music_buf->next_decoder));
+    release_feed_music_buffer(&(music_buf->next_feed));
+    music_buf->next = next;
+    music_buf->next_name = name;
+    music_buf->next_data_left = data_left;
+    music_buf->next_decoder = decoder;
+    music_buf->next_feed = feed;
+    dsp_gain_init(&(music_buf->next_gain), music_buf->stream_volume *
+                  replaygain_factor(&(next.replaygain), replaygain_mode));
+    if (resume != NULL) {
+        music_buf->fade_pos = resume->fade_pos;
+        music_buf->fade_frames = resume->fade_frames;
+        music_buf->fade_start = music_buf->frames_read > resume->fade_pos ?
+            music_buf->frames_read - resume->fade_pos : 0;
+    } else {
+        music_buf->fade_pos = 0;
+        music_buf->fade_frames = now ? fade_frames : 0;
+    }
+    unlock_music_buffer(music_buf);
+    LOG_INFO("%s %s", now || resume != NULL ? "Crossfading to" : "Next track is", file_name);
+    return 0;
+}
+
+
+/**
+ * Play a file after the current one, mixing them with equal-power curves
+ * over the crossfade duration: now, or at the end of the current file.
+ * Without crossfade, the file follows the end of the current one without
+ * gap. The file is opened now and its first blocks are decoded, converted
+ * to the format of the output if it has another one, and its silent ends
+ * are skipped as trim says. It plays at the volume of the current stream.
+ * Return 1 if the file can't follow the current one, which is not playing,
+ * or can't be converted, 2 if it can't be opened.
+ */
+int crossfade_music_buffer(music_buffer_t *music_buf, const char *file_name, int now,
+                           int trim)
+{
+    return queue_music_buffer(music_buf, file_name, now, trim, NULL);
+}
+
+
+/**
+ * (internal) Replace the current track by the next one, which started at
+ * frame fade_start of the output. Mutex must be locked.
+ */
+static void next_track_music_buffer(music_buffer_t *music_buf)
+{
+    if (music_buf->info.file != NULL) {
+        fclose(music_buf->info.file);
+    }
+    // The status page describes the file, the buffers the output
+    set_status_stream(&(music_buf->next), music_buf->next_name);
+    music_file_t const output = music_buf->info;
+    music_buf->info = music_buf->next;
+    music_buf->info.oss_format = output.oss_format;
+    music_buf->info.channels = output.channels;
+    music_buf->info.sample_rate = output.sample_rate;
+    music_buf->info.bits_per_sample = output.bits_per_sample;
+    music_buf->data_left = music_buf->next_data_left;
+    // Decoders swap, so that their buffers are reused
+    adpcm_t const decoder = music_buf->decoder;
+    music_buf->decoder = music_buf->next_decoder;
+    music_buf->next_decoder = decoder;
+    release_feed_music_buffer(&(music_buf->feed));
+    music_buf->feed = music_buf->next_feed;
+    music_buf->ahead_pos = music_buf->ahead_len = 0;
+    memset(&(music_buf->next_feed), 0, sizeof(music_buf->next_feed));
+    // The volume of the stream goes on, at the ReplayGain of the track
+    music_buf->stream_gain = music_buf->next_gain;
+    music_buf->next.file = NULL;
+    music_buf->fade_pos = music_buf->fade_frames = 0;
+
+    // Positions are now relative to the first frame of the track
+    music_buf->frames_written = music_buf->frames_written > music_buf->fade_start ?
+        music_buf->frames_written - music_buf->fade_start : 0;
+    music_buf->frames_read -= music_buf->fade_start;
+    playback_clock_rebase(music_clock, music_buf->fade_start);
+    LOG_INFO("Playing %s", music_buf->next_name);
+    free(music_buf->name);
+    music_buf->name = music_buf->next_name;
+    music_buf->next_name = NULL;
+}
+
+
+/**
+ * (internal) Read the next frames of the current track into work, mixed
+ * with the next track during a crossfade. Mutex must be locked.
+ * Return the number of frames, 0 at the end of the tracks or -1 on error.
+ */
+static long read_tracks_music_buffer(music_buffer_t *music_buf, float *work, size_t frames)
+{
+    uint_fast32_t const channels = music_buf->info.channels;
+
+    // Start the crossfade when the current track reaches its last frames,
+    // or switch to the next track without gap
+    if (music_buf->next.file != NULL && music_buf->fade_frames == 0) {
+        uint_fast64_t const fade_frames = (uint_fast64_t) crossfade_msec *
+            music_buf->info.sample_rate / 1000;
+        uint_fast64_t const left = frames_left_music_buffer(music_buf);
+        if (track_ended_music_buffer(music_buf)) {
+            music_buf->fade_start = music_buf->frames_read;
+            next_track_music_buffer(music_buf);
+        } else if (left <= fade_frames) {
+            music_buf->fade_frames = left;
+        }
+    }
+
+    long file_frames = read_stream_music_buffer(music_buf, &(music_buf->info),
+                                                &(music_buf->data_left),
+                                                &(music_buf->decoder), &(music_buf->feed),
+                                                &(music_buf->stream_gain), work, frames);
+    if (file_frames < 0) return -1;
+
+    // Mix the next track over the tail of the current one
+    if (music_buf->fade_frames > 0) {
+        float *const next_work = music_buf->next_work;
+        long const next_frames = read_stream_music_buffer(
+            music_buf, &(music_buf->next), &(music_buf->next_data_left),
+            &(music_buf->next_decoder), &(music_buf->next_feed), &(music_buf->next_gain),
+            next_work, frames);
+        if (next_frames < 0) return -1;
+        long const fade_frames = next_frames > file_frames ? next_frames : file_frames;
+        memset(work + file_frames * channels, 0,
+               (fade_frames - file_frames) * channels * sizeof(float));
+        memset(next_work + next_frames * channels, 0,
+               (fade_frames - next_frames) * channels * sizeof(float));
+        if (music_buf->fade_pos == 0) {
+            music_buf->fade_start = music_buf->frames_read;
+        }
+        dsp_crossfade(work, next_work, fade_frames, channels,
+                      music_buf->fade_pos, music_buf->fade_frames);
+        music_buf->fade_pos += fade_frames;
+        file_frames = fade_frames;
+        // Both tracks may end before the end of the crossfade
+        if (music_buf->fade_pos >= music_buf->fade_frames || fade_frames == 0) {
+            next_track_music_buffer(music_buf);
+        }
+    }
+    music_buf->frames_read += file_frames;
+    return file_frames;
+}
+
+
+/**
+ * (internal) Fill the first frames of the work buffer with the tracks
+ * played at another speed than their own. Mutex must be locked.
+ * Return the number of frames, 0 at the end of the tracks or -1 on error.
+ */
+static long stretch_tracks_music_buffer(music_buffer_t *music_buf, size_t frames)
+{
+    stretch_t *const st = &(music_buf->stretch);
+    uint_fast32_t const channels = music_buf->info.channels;
+    size_t const block = music_buf->buf_size /
+        (channels * music_buf->info.bits_per_sample / 8);
+    size_t done = 0;
+    for (;;) {
+        done += stretch_pull(st, music_buf->work + done * channels, frames - done);
+        if (done == frames) break;
+        size_t const room = stretch_room(st);
+        long const read = read_tracks_music_buffer(music_buf, music_buf->stretch_work,
+                                                   room < block ? room : block);
+        if (read < 0) return -1;
+        if (read > 0) {
+            stretch_push(st, music_buf->stretch_work, read);
+        } else if (stretch_pending(st)) {
+            stretch_flush(st);
+        } else {
+            break;
+        }
+    }
+    return done;
+}
+
+
+/**
+ * (internal) Test if something remains to be played: file data, a next
+ * track or voices.
+ * Mark the buffer as finished otherwise, so that no voice is added later.
+ * Mutex must be locked.
+ */
+static int remains_music_buffer(music_buffer_t *music_buf)
+{
+    int ret = !track_ended_music_buffer(music_buf) || music_buf->next.file != NULL ||
+        (music_buf->stretching && stretch_pending(&(music_buf->stretch)));
+    int i;
+    for (i = 0; !ret && i < MAX_VOICES; i++) {
+        ret = music_buf->voices[i].clip != NULL;
+    }
+    if (!ret && !music_buf->finished) {
+        music_buf->finished = 1;
+        music_buf->idle_ns = playback_clock_now_ns();
+    }
+    return ret;
+}
+
+
+/**
+ * (internal) Render the next block of the output, and queue it for the
+ * writers of the devices. paused is set if the block only holds voices
+ * played in a pause, which don't move the position of the stream. A block
+ * which follows others in a batch isn't rendered once the output faded out
+ * before a pause or a stop, or nothing is left.
+ * Return the number of frames, 0 if nothing was rendered or -1 on error.
+ */
+static long render_music_buffer(music_buffer_t *music_buf, int follows,
+                                uint16_t peaks[STATUS_MAX_CHANNELS], int *paused)
+{
+    if (lock_music_buffer(music_buf)) return -1;
+    if (follows && (((music_buf->pausing || music_buf->stopping) &&
+                     music_buf->output_gain.current == 0) ||
+                    !remains_music_buffer(music_buf))) {
+        unlock_music_buffer(music_buf);
+        return 0;
+    }
+    uint_fast32_t const channels = music_buf->info.channels;
+    size_t const frame_bytes = channels * music_buf->info.bits_per_sample / 8;
+    uint_fast32_t const device_channels = music_buf->device_channels;
+    float *const work = music_buf->work;
+
+    // Once a pause faded out, voices are played alone at the master volume.
+    // Fading out before a pause or a stop only needs a ramp.
+    dsp_gain_t pause_gain;
+    dsp_gain_t *gain = &(music_buf->output_gain);
+    *paused = music_buf->pausing && gain->current == 0 && gain->target == 0;
+    size_t frames = music_buf->buf_size / frame_bytes;
+    if ((music_buf->pausing || music_buf->stopping) && !*paused &&
+        frames > music_buf->ramp_frames) {
+        frames = music_buf->ramp_frames;
+    }
+
+    long file_frames = 0;
+    if (*paused) {
+        dsp_gain_init(&pause_gain, master_volume);
+        gain = &pause_gain;
+    } else {
+        file_frames = music_buf->stretching ?
+            stretch_tracks_music_buffer(music_buf, frames) :
+            read_tracks_music_buffer(music_buf, work, frames);
+    }
+    if (file_frames < 0) {
+        unlock_music_buffer(music_buf);
+        return -1;
+    }
+
+    // Remember which voices start in this step, to measure their latency
+    struct timespec started[MAX_VOICES];
+    clip_cache_t *cache = NULL;
+    int nstarted = 0;
+    int nvoices = 0;
+    int i;
+    for (i = 0; i < MAX_VOICES; i++) {
+        voice_t *voice = &(music_buf->voices[i]);
+        if (voice->clip != NULL) {
+            nvoices++;
+            if (voice->pos == 0) {
+                started[nstarted++] = voice->triggered;
+                cache = voice->clip->cache;
+            }
+        }
+    }
+    size_t out_frames = file_frames;
+    if (nvoices) {
+        // Voices are played over silence after the end of file
+        memset(work + file_frames * channels, 0,
+               (frames - file_frames) * channels * sizeof(float));
+        size_t const used = mix_voices_music_buffer(music_buf, frames);
+        if (used > out_frames) out_frames = used;
+    }
+    if (out_frames == 0) {
+        unlock_music_buffer(music_buf);
+        return 0;
+    }
+
+    // Positions are frames of the tracks: the stretched output stands for
+    // the input frames which the time-stretch consumed
+    if (!*paused && music_buf->stretching) {
+        uint64_t const backlog = stretch_backlog(&(music_buf->stretch));
+        music_buf->frames_written = music_buf->frames_read > backlog ?
+            music_buf->frames_read - backlog : 0;
+        music_buf->speed = music_buf->stretch.speed;
+    } else if (!*paused) {
+        music_buf->frames_written += out_frames;
+        music_buf->frames_read = music_buf->frames_written;
+    }
+
+    eq_process(&equalizer, work, out_frames, channels);
+    music_buf->kernels.gain->fn(gain, work, out_frames, channels);
+    float const *out = work;
+    if (music_buf->remapping) {
+        matrix_apply(&(music_buf->matrix), music_buf->device_work, work, out_frames);
+        out = music_buf->device_work;
+    }
+    if (music_status != NULL) {
+        peak_levels_music_buffer(music_buf, out_frames, peaks);
+    }
+    unlock_music_buffer(music_buf);
+
+    // The output buffers are only used by this thread
+    if (meter_enabled(&music_meter)) {
+        meter_process(&music_meter, out, out_frames, device_channels,
+                      music_buf->info.sample_rate);
+    }
+
+    // Trigger latency is the time until this step plus the time the device
+    // needs to play what was queued before it, in the device and in the
+    // ring of its writer
+    if (nstarted) {
+        struct timespec now;
+        int delay = 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+        if (ioctl(music_buf->fd_dsp, SNDCTL_DSP_GETODELAY, &delay) == -1) {
+            delay = 0;
+        }
+        size_t const device_frame_bytes = device_channels * music_buf->info.bits_per_sample / 8;
+        unsigned long const queued = (delay > 0 ? (unsigned long) delay : 0) /
+            device_frame_bytes + fanout_queued(&(music_buf->fanout));
+        unsigned long const delay_us = (unsigned long)
+            ((uint64_t) queued * 1000000 / music_buf->info.sample_rate);
+        for (i = 0; i < nstarted; i++) {
+            long const latency_us =
+                (now.tv_sec - started[i].tv_sec) * 1000000L +
+                (now.tv_nsec - started[i].tv_nsec) / 1000 + delay_us;
+            LOG_INFO("[Trigger] Latency: %ld us", latency_us);
+            clip_cache_record_latency(cache, latency_us > 0 ? latency_us : 0);
+        }
+    }
+    fanout_queue(&(music_buf->fanout), out, out_frames);
+    if (music_buf->fanout.count) {
+        fanout_push(&(music_buf->fanout), out, out_frames);
+    }
+    return out_frames;
+}
+
+
+/**
+ * (internal) Let the writer of the device write the frames rendered since
+ * the last call, waiting until at most keep of them are not written, and
+ * publish the state of the device in the status page. The clock isn't
+ * moved by blocks of voices played in a pause.
+ * Return 0 on success, 2 if writing failed.
+ */
+static int write_music_buffer(music_buffer_t *music_buf, size_t frames, size_t keep,
+                              uint16_t const peaks[STATUS_MAX_CHANNELS], int paused)
+{
+    size_t const device_frame_bytes =
+        music_buf->device_channels * music_buf->info.bits_per_sample / 8;
+
+    // The device ran out of data if the previous write was all played
+    int underrun = 0;
+    if (music_buf->drain_ns &&
+        playback_clock_now_ns() > music_buf->drain_ns + UNDERRUN_SLACK_NS) {
+        underrun = 1;
+    }
+
+    // The thread counts a wakeup when it slept until the device had room,
+    // as a blocking write would have
+    int waited;
+    TRACE_BEGIN("write");
+    int const failed = fanout_flush(&(music_buf->fanout), keep, &waited);
+    TRACE_END_ARG("write", frames * device_frame_bytes);
+    if (waited) {
+        __atomic_add_fetch(&(music_buf->wakeups), 1, __ATOMIC_RELAXED);
+    }
+    // An error may happen when stopping playback
+    if (failed && music_buf->playing) {
+        LOG_RATELIMITED(LOG_LEVEL_ERROR, "Writing to the sound device failed.");
+        if (music_status != NULL) {
+            status_begin_update(music_status);
+            music_status->write_errors++;
+            status_end_update(music_status);
+        }
+        return 2;
+    }
+
+    if (music_buf->resume_ns) {
+        LOG_INFO("[Idle] First block written %.2f ms after the resume",
+                 (playback_clock_now_ns() - music_buf->resume_ns) * 1e-6);
+        music_buf->resume_ns = 0;
+    }
+
+    // Frames which are still queued in the device or in the ring of its
+    // writer are not heard yet
+    if (music_status != NULL) {
+        int delay = 0;
+        int64_t const now_ns = playback_clock_now_ns();
+        __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+        if (ioctl(music_buf->fd_dsp, SNDCTL_DSP_GETODELAY, &delay) == -1 || delay < 0) {
+            delay = 0;
+        }
+        size_t const queued = delay / device_frame_bytes + fanout_queued(&(music_buf->fanout));
+        if (!paused) {
+            playback_clock_update(music_clock, music_buf->frames_written,
+                                  (uint64_t) (queued * music_buf->speed), 1);
+        }
+        music_buf->drain_ns = now_ns + (int64_t) queued * 1000000000 /
+            music_buf->info.sample_rate;
+
+        status_begin_update(music_status);
+        music_status->buffer_queued = queued * device_frame_bytes;
+        music_status->blocks_written++;
+        music_status->bytes_written += frames * device_frame_bytes;
+        music_status->underruns += underrun;
+        memcpy(music_status->peaks, peaks, STATUS_MAX_CHANNELS * sizeof(peaks[0]));
+        status_end_update(music_status);
+    }
+    return 0;
+}
+
+
+/**
+ * Play one step of the buffer
+ */
+int play_step_music_buffer(music_buffer_t *music_buf)
+{
+    uint16_t peaks[STATUS_MAX_CHANNELS];
+    int paused;
+    long const frames = render_music_buffer(music_buf, 0, peaks, &paused);
+    if (frames <= 0) return frames < 0;
+    return write_music_buffer(music_buf, frames, 0, peaks, paused);
+}
+
+
+/**
+ * Test end of file
+ */
+int eof_music_buffer(music_buffer_t *music_buf)
+{
+    if (music_buf == NULL || music_buf->info.file == NULL) {
+        return 1;
+    }
+    // music_buf->data_left is a shared resource among threads
+    if (lock_music_buffer(music_buf)) return 1;
+    int ret = track_ended_music_buffer(music_buf);
+    unlock_music_buffer(music_buf);
+    return ret;
+}
+
+
+/**
+ * Test if a track may be queued after the current one: a track plays, no
+ * track follows it yet and playback isn't paused or stopping
+ */
+int wants_next_music_buffer(music_buffer_t *music_buf)
+{
+    if (lock_music_buffer(music_buf)) return 0;
+    int const ret = music_buf->playing && !music_buf->pausing && !music_buf->stopping &&
+        !music_buf->finished && music_buf->info.file != NULL &&
+        music_buf->next.file == NULL && music_buf->fade_frames == 0;
+    unlock_music_buffer(music_buf);
+    return ret;
+}
+
+
+/**
+ * (internal) Test if something remains to be played, like
+ * remains_music_buffer()
+ */
+static int has_data_music_buffer(music_buffer_t *music_buf)
+{
+    if (lock_music_buffer(music_buf)) return 0;
+    int const ret = remains_music_buffer(music_buf);
+    unlock_music_buffer(music_buf);
+    return ret;
+}
+
+
+/**
+ * (internal) Sleep for ns nanoseconds on the timer of the power profile,
+ * or until a pause or a stop cuts the wait short.
+ * Return 1 if it was cut short.
+ */
+static int sleep_music_buffer(music_buffer_t *music_buf, int64_t ns)
+{
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    // A zero timer would be disarmed
+    if (ns < 1) ns = 1;
+    timer.it_value.tv_sec = ns / 1000000000;
+    timer.it_value.tv_nsec = ns % 1000000000;
+    __atomic_add_fetch(&(music_buf->syscalls), 2, __ATOMIC_RELAXED);
+    if (timerfd_settime(music_buf->timer_fd, 0, &timer, NULL) == -1) {
+        LOG_ERRNO("timerfd_settime");
+        return 1;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = music_buf->timer_fd;
+    fds[1].fd = music_buf->wake_fd;
+    fds[0].events = fds[1].events = POLLIN;
+    TRACE_BEGIN("sleep");
+    int const ret = poll(fds, 2, -1);
+    TRACE_END("sleep");
+    __atomic_add_fetch(&(music_buf->wakeups), 1, __ATOMIC_RELAXED);
+    if (ret <= 0) return 0;
+    uint64_t count;
+    if (fds[0].revents & POLLIN) {
+        __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+        if (read(music_buf->timer_fd, &count, sizeof(count)) == -1) count = 0;
+    }
+    if (fds[1].revents & POLLIN) {
+        __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+        if (read(music_buf->wake_fd, &count, sizeof(count)) == -1) count = 0;
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Play one batch of the power profile: sleep until the device buffer falls
+ * to its low watermark, then fill it with blocks written at once.
+ * The blocks are rendered in turn into the ring of the device, and its
+ * writer is woken once they all are, so that the threads wake once per
+ * batch instead of per block.
+ * Fall back to one step when the device doesn't tell its buffer space.
+ */
+int play_batch_music_buffer(music_buffer_t *music_buf)
+{
+    size_t const frame_bytes = music_buf->info.channels * music_buf->info.bits_per_sample / 8;
+    size_t const device_frame_bytes =
+        music_buf->device_channels * music_buf->info.bits_per_sample / 8;
+    size_t const block_bytes = music_buf->buf_size / frame_bytes * device_frame_bytes;
+    if (music_buf->timer_fd == -1) {
+        return play_step_music_buffer(music_buf);
+    }
+
+    // Sleep while the device and the ring of its writer hold more than the
+    // low watermark
+    size_t const bytes_per_sec = music_buf->info.sample_rate * device_frame_bytes;
+    audio_buf_info space;
+    __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+    if (ioctl(music_buf->fd_dsp, SNDCTL_DSP_GETOSPACE, &space) == -1 ||
+        space.fragstotal <= 0 || space.fragsize <= 0 || space.bytes < 0) {
+        return play_step_music_buffer(music_buf);
+    }
+    size_t const total = (size_t) space.fragstotal * space.fragsize;
+    size_t const ring = fanout_queued(&(music_buf->fanout)) * device_frame_bytes;
+    size_t const queued = (total > (size_t) space.bytes ? total - space.bytes : 0) + ring;
+    size_t room = (size_t) space.bytes > ring ? space.bytes - ring : 0;
+    size_t low = SCHEDULE_LOW_MSEC * bytes_per_sec / 1000;
+    if (low > total / 2) low = total / 2;
+    // Batches need room for two blocks above the watermark, or the device
+    // buffer is better written block by block
+    if (total - low < 2 * block_bytes) {
+        return play_step_music_buffer(music_buf);
+    }
+    if (queued > low && room < SCHEDULE_MAX_BLOCKS * block_bytes) {
+        // The device holds the low watermark when the timer expires, and
+        // is asked again after a pause or a stop cut the sleep short
+        if (!sleep_music_buffer(music_buf, (int64_t) (queued - low) * 1000000000 /
+                                bytes_per_sec)) {
+            room += queued - low;
+        } else {
+            __atomic_add_fetch(&(music_buf->syscalls), 1, __ATOMIC_RELAXED);
+            if (ioctl(music_buf->fd_dsp, SNDCTL_DSP_GETOSPACE, &space) == -1 ||
+                space.bytes < 0) {
+                space.bytes = 0;
+            }
+            size_t const left = fanout_queued(&(music_buf->fanout)) * device_frame_bytes;
+            room = (size_t) space.bytes > left ? space.bytes - left : 0;
+        }
+    }
+
+    // Fill the free space, at least one block so that a small device
+    // buffer still plays
+    size_t blocks = room / block_bytes;
+    if (blocks < 1) blocks = 1;
+    if (blocks > SCHEDULE_MAX_BLOCKS) blocks = SCHEDULE_MAX_BLOCKS;
+    uint16_t peaks[STATUS_MAX_CHANNELS];
+    memset(peaks, 0, sizeof(peaks));
+    size_t pending = 0;
+    size_t count = 0;
+    int paused = 0;
+    if (lock_music_buffer(music_buf)) return 1;
+    read_ahead_music_buffer(music_buf, blocks);
+    unlock_music_buffer(music_buf);
+    while (count < blocks) {
+        uint16_t block_peaks[STATUS_MAX_CHANNELS];
+        long const frames = render_music_buffer(music_buf, count > 0, block_peaks, &paused);
+        if (frames < 0) return 1;
+        if (frames == 0) break;
+        if (music_status != NULL) {
+            unsigned c;
+            for (c = 0; c < STATUS_MAX_CHANNELS; c++) {
+                if (block_peaks[c] > peaks[c]) peaks[c] = block_peaks[c];
+            }
+        }
+        pending += frames;
+        count++;
+    }
+    if (count == 0) return 0;
+    return write_music_buffer(music_buf, pending, SIZE_MAX, peaks, paused);
+}
+
+
+/**
+ * (internal) Test if voices are being played. Mutex must be locked.
+ */
+static int voices_music_buffer(music_buffer_t const *music_buf)
+{
+    int i;
+    for (i = 0; i < MAX_VOICES; i++) {
+        if (music_buf->voices[i].clip != NULL) return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Play music file in a loop. Voices are played in a pause.
+ */
+int play_loop_music_buffer(music_buffer_t *music_buf)
+{
+    int ret = 0;
+    music_buf->playing = 1;
+    while (music_buf->playing && has_data_music_buffer(music_buf)) {
+        // Stop or pause music once the output faded out.
+        // The device is expected to run out of data in a pause.
+        if (lock_music_buffer(music_buf)) return 1;
+        int const faded = music_buf->output_gain.current == 0;
+        if (music_buf->stopping && faded) {
+            unlock_music_buffer(music_buf);
+            break;
+        }
+        if (music_buf->pausing && faded) {
+            music_buf->drain_ns = 0;
+        }
+        while (music_buf->pausing && faded && !voices_music_buffer(music_buf)) {
+            ret = pthread_cond_wait(&(music_buf->cond), &(music_buf->mutex));
+            if (ret) {
+                LOG_ERROR("pthread_cond_wait failed: %d", ret);
+                unlock_music_buffer(music_buf);
+                return 1;
+            }
+        }
+        int is_playing = music_buf->playing;
+        unlock_music_buffer(music_buf);
+        if (!is_playing) break;
+
+        // Play again
+        ret = __atomic_load_n(&music_schedule, __ATOMIC_RELAXED) == SCHEDULE_POWER ?
+            play_batch_music_buffer(music_buf) : play_step_music_buffer(music_buf);
+        if (ret) break;
+    }
+    return ret;
+}
+
+
+/**
+ * Play music file in a thread
+ */
+static void* routine_play_loop_music_buffer(void *music_buf)
+{
+    trace_set_thread_name("playback");
+    play_loop_music_buffer((music_buffer_t*)music_buf);
+    set_status_state(STATUS_STOPPED);
+    return NULL;
+}
+int start_play_loop_music_buffer(pthread_t *thread, music_buffer_t *music_buf)
+{
+    music_buf->playing = 1;
+    music_buf->pausing = 0;
+    music_buf->finished = 0;
+    music_buf->stopping = 0;
+    pthread_cond_broadcast(&(music_buf->cond));
+    set_status_state(STATUS_PLAYING);
+    int ret = pthread_create(thread, NULL, routine_play_loop_music_buffer,
+                             music_buf);
+    if (ret) {
+        LOG_ERROR("pthread_create returned error code %d", ret);
+        set_status_state(STATUS_STOPPED);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Stop playing thread.
+ * A playing output fades out over a short ramp, then the device drops the
+ * frames it still holds like in a pause, so that stopping doesn't wait for
+ * the device buffer to play.
+ */
+int stop_play_loop_music_buffer(pthread_t thread, music_buffer_t *music_buf)
+{
+    int ret;
+    if (lock_music_buffer(music_buf)) return 1;
+    int const silent = music_buf->pausing && music_buf->output_gain.current == 0;
+    if (silent) {
+        music_buf->playing = 0;
+        music_buf->pausing = 0;
+    } else {
+        music_buf->stopping = 1;
+        dsp_gain_set(&(music_buf->output_gain), 0, music_buf->ramp_frames);
+    }
+    unlock_music_buffer(music_buf);
+    pthread_cond_broadcast(&(music_buf->cond));
+    wake_music_buffer(music_buf);
+    if (silent) {
+        fanout_reset(&(music_buf->fanout));
+    }
+    ret = pthread_join(thread, NULL);
+    if (ret) {
+        LOG_ERROR("pthread_join returned error code %d", ret);
+        return 1;
+    }
+    music_buf->playing = 0;
+    music_buf->stopping = 0;
+    // The clock stops where the device stopped
+    uint64_t const position = music_clock != NULL ?
+        playback_clock_position(music_clock, NULL) : 0;
+    if (!silent) {
+        fanout_reset(&(music_buf->fanout));
+    }
+    playback_clock_update(music_clock, position, 0, 0);
+    set_status_state(STATUS_STOPPED);
+    return 0;
+}
+
+/**
+ * Pause playing, after the output faded out
+ */
+int pause_loop_music_buffer(music_buffer_t *music_buf)
+{
+    if (lock_music_buffer(music_buf)) return 1;
+    music_buf->pausing = 1;
+    music_buf->idle_ns = playback_clock_now_ns();
+    dsp_gain_set(&(music_buf->output_gain), 0, music_buf->ramp_frames);
+    int const finished = music_buf->finished;
+    unlock_music_buffer(music_buf);
+    pthread_cond_broadcast(&(music_buf->cond));
+    wake_music_buffer(music_buf);
+    if (!finished) {
+        set_status_state(STATUS_PAUSED);
+    }
+    return 0;
+}
+
+/**
+ * Resume playing, fading in
+ */
+int resume_loop_music_buffer(music_buffer_t *music_buf)
+{
+    if (lock_music_buffer(music_buf)) return 1;
+    music_buf->pausing = 0;
+    music_buf->idle_ns = 0;
+    if (!music_buf->stopping) {
+        dsp_gain_set(&(music_buf->output_gain), master_volume, music_buf->ramp_frames);
+    }
+    int const finished = music_buf->finished;
+    unlock_music_buffer(music_buf);
+    pthread_cond_broadcast(&(music_buf->cond));
+    if (!finished) {
+        set_status_state(STATUS_PLAYING);
+    }
+    return 0;
+}
+
+/**
+ * Set the delay of pause or stop after which the device and the buffers
+ * are released, 0 to keep them
+ */
+void set_music_idle(unsigned msec)
+{
+    idle_msec = msec;
+}
+
+/**
+ * Delay of pause or stop after which the device and the buffers are
+ * released, 0 if they are kept
+ */
+unsigned get_music_idle()
+{
+    return idle_msec;
+}
+
+/**
+ * Test if a paused stream was released, to be resumed by
+ * restore_music_buffer()
+ */
+int has_released_music()
+{
+    return released.name != NULL;
+}
+
+/**
+ * Forget the stream released after an idle pause, which won't be resumed
+ */
+void forget_released_music()
+{
+    if (released.name != NULL) {
+        set_status_state(STATUS_STOPPED);
+    }
+    free(released.name);
+    free(released.next_name);
+    memset(&released, 0, sizeof(released));
+}
+
+/**
+ * (internal) Bytes allocated for the buffers of the stream being played
+ */
+static size_t memory_music_buffer(music_buffer_t const *music_buf)
+{
+    size_t const sample_bytes = music_buf->info.bits_per_sample / 8;
+    size_t const channels = music_buf->info.channels;
+    size_t const device_channels = music_buf->device_channels;
+    if (sample_bytes == 0 || channels == 0) return 0;
+    size_t const frames = music_buf->buf_size / (channels * sample_bytes);
+    size_t bytes = frames * channels * sample_bytes;
+    bytes += 3 * frames * channels * sizeof(float);
+    if (music_buf->device_work != NULL) bytes += frames * device_channels * sizeof(float);
+    // The writer of the device holds its ring, and a block as big as it as
+    // floats and as samples
+    bytes += music_buf->fanout.main.ring_frames * device_channels *
+        (2 * sizeof(float) + sample_bytes);
+    bytes += music_buf->ahead_size;
+    adpcm_t const *decoders[2] = { &(music_buf->decoder), &(music_buf->next_decoder) };
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (decoders[i]->block != NULL) {
+            bytes += decoders[i]->block_align +
+                decoders[i]->block_frames * decoders[i]->channels * sizeof(int16_t);
+        }
+    }
+    track_feed_t const *feeds[2] = { &(music_buf->feed), &(music_buf->next_feed) };
+    for (i = 0; i < 2; i++) {
+        bytes += feeds[i]->lead_frames * channels * sizeof(float);
+        if (feeds[i]->converting) {
+            convert_t const *conv = &(feeds[i]->convert);
+            bytes += conv->block_frames * (conv->in_frame_bytes +
+                                           conv->in_channels * sizeof(float)) +
+                conv->input_size * conv->out_channels * sizeof(float);
+        }
+    }
+    stretch_t const *st = &(music_buf->stretch);
+    bytes += ((st->input_size + st->output_size + st->overlap) * st->channels +
+              2 * st->overlap + st->seek) * sizeof(float);
+    return bytes;
+}
+
+/**
+ * (internal) Position in a file of its first frame which wasn't played,
+ * from offset where its data was read up to: the frames ahead in the feed
+ * of the track, and unplayed frames of the output before them, are read
+ * again. info is the format of the file. Compressed blocks are read again
+ * from the block of that frame, whose frames before it are skipped.
+ * Return the offset, and update the data left and the frames to skip.
+ */
+static long rewind_music_file(music_file_t const *info, long offset, uint_fast64_t *data_left,
+                              adpcm_t const *decoder, track_feed_t const *feed,
+                              uint_fast64_t unplayed, size_t *skip_frames)
+{
+    unplayed += feed->lead_frames - feed->lead_pos;
+    if (feed->converting) {
+        convert_t const *conv = &(feed->convert);
+        unplayed = unplayed * conv->in_rate / conv->out_rate +
+            conv->input_frames - (conv->pos >> 32);
+    }
+    size_t const frame_bytes = info->channels * info->bits_per_sample / 8;
+    *skip_frames = 0;
+    if (info->encoding != WAVE_FORMAT_PCM) {
+        uint_fast64_t frame = (uint_fast64_t) (offset - (long) info->data_offset) /
+            info->block_align * info->block_frames - (decoder->count - decoder->pos);
+        if (unplayed > frame) unplayed = frame;
+        frame -= unplayed;
+        offset = info->data_offset + frame / info->block_frames * info->block_align;
+        *skip_frames = frame % info->block_frames;
+    } else {
+        offset -= unplayed * frame_bytes;
+    }
+    if (*data_left != UINT_FAST64_MAX) {
+        *data_left += unplayed * frame_bytes;
+    }
+    return offset;
+}
+
+/**
+ * (internal) Stop an idle stream and release the device and the buffers.
+ * A paused file is remembered with its position, its format and the track
+ * which follows it, so that it resumes where it was. Frames which the
+ * time-stretch holds are read again, and a crossfade in progress resumes
+ * with the next track where it was.
+ */
+static void suspend_music_buffer(pthread_t thread, music_buffer_t *music_buf)
+{
+    size_t const freed = memory_music_buffer(music_buf);
+    forget_released_music();
+    int const paused = !music_buf->finished && music_buf->info.file != NULL &&
+        music_buf->name != NULL;
+    if (paused) {
+        released_stream_t r;
+        memset(&r, 0, sizeof(r));
+        r.info = music_buf->info;
+        r.info.file = NULL;
+        r.data_left = music_buf->data_left;
+        r.position = music_buf->frames_written;
+        // The time-stretch holds frames of the output which were read but
+        // not played, after those of the previous track if it just ended
+        uint_fast64_t const backlog = music_buf->stretching ?
+            stretch_backlog(&(music_buf->stretch)) : 0;
+        uint_fast64_t const unplayed = backlog < music_buf->frames_read ?
+            backlog : music_buf->frames_read;
+        // A converted track resumes in its own format
+        track_feed_t const *feed = &(music_buf->feed);
+        convert_t const *conv = feed->converting ? &(feed->convert) : NULL;
+        if (conv != NULL) {
+            r.info.oss_format = conv->in_format;
+            r.info.channels = conv->in_channels;
+            r.info.sample_rate = conv->in_rate;
+            r.info.bits_per_sample = conv->in_frame_bytes / conv->in_channels * 8;
+            r.position = r.position * conv->in_rate / conv->out_rate;
+        }
+        r.offset = rewind_music_file(&(r.info), ftell(music_buf->info.file) -
+                                     (long) music_buf->ahead_len, &(r.data_left),
+                                     &(music_buf->decoder), feed, unplayed,
+                                     &(r.skip_frames));
+        // The next track fading in is read again from the same frame of the
+        // output. The crossfade starts again from its beginning if the
+        // time-stretch still holds frames from before it.
+        if (music_buf->fade_frames > 0 && backlog < music_buf->fade_pos) {
+            r.next_data_left = music_buf->next_data_left;
+            r.next_offset = rewind_music_file(&(music_buf->next), ftell(music_buf->next.file),
+                                              &(r.next_data_left),
+                                              &(music_buf->next_decoder),
+                                              &(music_buf->next_feed), backlog,
+                                              &(r.next_skip_frames));
+            r.fade_pos = music_buf->fade_pos - backlog;
+            r.fade_frames = r.next_offset >= 0 ? music_buf->fade_frames : 0;
+            if (conv != NULL) {
+                r.fade_pos = (uint_fast64_t) r.fade_pos * conv->in_rate / conv->out_rate;
+                r.fade_frames = (uint_fast64_t) r.fade_frames * conv->in_rate /
+                    conv->out_rate;
+            }
+        }
+        r.stream_volume = music_buf->stream_volume;
+        r.name = music_buf->name;
+        music_buf->name = NULL;
+        r.next_name = music_buf->next_name;
+        music_buf->next_name = NULL;
+        if (r.offset >= 0) {
+            released = r;
+        } else {
+            free(r.name);
+            free(r.next_name);
+        }
+    }
+    stop_play_loop_music_buffer(thread, music_buf);
+    close_music_buffer(music_buf);
+    music_buf->playing = 0;
+
+    if (released.name != NULL) {
+        set_status_state(STATUS_PAUSED);
+        LOG_INFO("[Idle] Released the device and the buffers, %s stays paused at %.2f s",
+                 released.name, (double) released.position / released.info.sample_rate);
+    } else {
+        LOG_INFO("[Idle] Released the device and the buffers of the ended stream");
+    }
+    size_t const kept = released.name == NULL ? 0 : sizeof(released) +
+        strlen(released.name) + 1 +
+        (released.next_name != NULL ? strlen(released.next_name) + 1 : 0);
+    LOG_INFO("[Idle] %lu KB of buffers freed, %lu bytes kept to resume",
+             (unsigned long) freed / 1024, (unsigned long) kept);
+}
+
+/**
+ * Release the device and the buffers when playback was paused or ended,
+ * or the prepared device wasn't used, for longer than the idle delay.
+ * Return the delay in milliseconds until it should be checked again, -1 if
+ * nothing waits to be released.
+ */
+int idle_music_buffer(pthread_t thread, music_buffer_t *music_buf)
+{
+    if (idle_msec == 0) return -1;
+    int64_t const now = playback_clock_now_ns();
+    int64_t const idle_ns = (int64_t) idle_msec * 1000000;
+    int64_t wait_ns = -1;
+
+    if (prepared_fd != -1) {
+        if (now - prepared_ns >= idle_ns) {
+            release_music_device();
+            LOG_INFO("[Idle] Released the prepared device");
+        } else {
+            wait_ns = prepared_ns + idle_ns - now;
+        }
+    }
+
+    if (music_buf->playing) {
+        if (lock_music_buffer(music_buf)) return -1;
+        int64_t const since = (music_buf->pausing && !music_buf->stopping) ||
+            music_buf->finished ? music_buf->idle_ns : 0;
+        unlock_music_buffer(music_buf);
+        if (since && now - since >= idle_ns) {
+            suspend_music_buffer(thread, music_buf);
+        } else if (since && (wait_ns < 0 || since + idle_ns - now < wait_ns)) {
+            wait_ns = since + idle_ns - now;
+        }
+    }
+    return wait_ns < 0 ? -1 : (int) ((wait_ns + 999999) / 1000000);
+}
+
+/**
+ * (internal) Prepare the device for a released stream while its file is
+ * opened
+ */
+static void* routine_prepare_device(void *format)
+{
+    trace_set_thread_name("resume");
+    prepare_device(format);
+    return NULL;
+}
+
+/**
+ * Resume a stream which was released after an idle pause. The device is
+ * opened and configured by another thread while the file is opened at its
+ * position and read ahead, then playback fades in where it paused.
+ * Return 0 on success, 1 if no stream was released, 2 if it couldn't be
+ * reopened.
+ */
+int restore_music_buffer(pthread_t *thread, music_buffer_t *music_buf)
+{
+    if (released.name == NULL) return 1;
+    int64_t const start = playback_clock_now_ns();
+    released_stream_t r = released;
+    memset(&released, 0, sizeof(released));
+
+    pthread_t opener;
+    int const threaded = pthread_create(&opener, NULL, routine_prepare_device,
+                                        &(r.info)) == 0;
+    init_music_buffer(music_buf);
+    music_buf->info = r.info;
+    music_buf->info.file = fopen(r.name, "rb");
+    int ret = music_buf->info.file == NULL ||
+        fseek(music_buf->info.file, r.offset, SEEK_SET) != 0;
+    if (!ret) {
+        posix_fadvise(fileno(music_buf->info.file), r.offset, RESUME_READAHEAD_BYTES,
+                      POSIX_FADV_WILLNEED);
+    }
+    if (threaded) {
+        pthread_join(opener, NULL);
+    }
+    if (ret) {
+        LOG_ERRNO("Reopening the released stream");
+        if (music_buf->info.file != NULL) {
+            fclose(music_buf->info.file);
+            music_buf->info.file = NULL;
+        }
+        release_music_device();
+    } else {
+        music_buf->stream_volume = r.stream_volume;
+        ret = open_device_music_buffer(music_buf, r.name);
+    }
+    if (!ret && r.skip_frames) {
+        ret = seek_music_file(&(music_buf->info), &(music_buf->decoder), r.offset,
+                              r.skip_frames);
+        if (ret) close_music_buffer(music_buf);
+    }
+    if (ret) {
+        LOG_ERROR("%s can't be resumed", r.name);
+        set_status_state(STATUS_STOPPED);
+        free(r.name);
+        free(r.next_name);
+        return 2;
+    }
+
+    // The clock goes on from the position of the pause
+    music_buf->data_left = r.data_left;
+    music_buf->frames_written = music_buf->frames_read = r.position;
+    playback_clock_update(music_clock, r.position, 0, 0);
+    music_buf->resume_ns = start;
+    int const fading = r.next_name != NULL && r.fade_frames > 0 &&
+        queue_music_buffer(music_buf, r.next_name, 0, TRIM_DEFAULT, &r) == 0;
+    ret = start_play_loop_music_buffer(thread, music_buf);
+    if (ret) {
+        close_music_buffer(music_buf);
+    } else {
+        LOG_INFO("[Idle] Reopened %s in %.2f ms", r.name,
+                 (playback_clock_now_ns() - start) * 1e-6);
+        if (r.next_name != NULL && !fading) {
+            crossfade_music_buffer(music_buf, r.next_name, 0, TRIM_DEFAULT);
+        }
+    }
+    free(r.name);
+    free(r.next_name);
+    return ret ? 2 : 0;
+}
+
+/**
+ * Set the master volume, which applies to every stream and is kept for the
+ * next ones, or the volume of the current stream. Volumes are amplitude
+ * factors, and changes follow a ramp.
+ */
+int set_volume_music_buffer(music_buffer_t *music_buf, int master, float volume)
+{
+    if (volume < 0) return 1;
+    if (lock_music_buffer(music_buf)) return 1;
+    if (master) {
+        master_volume = volume;
+        if (!music_buf->pausing && !music_buf->stopping) {
+            dsp_gain_set(&(music_buf->output_gain), volume, music_buf->ramp_frames);
+        }
+    } else {
+        music_buf->stream_volume = volume;
+        dsp_gain_set(&(music_buf->stream_gain), volume *
+                     replaygain_factor(&(music_buf->info.replaygain), replaygain_mode),
+                     music_buf->ramp_frames);
+        // The next track goes on at this volume
+        if (music_buf->next.file != NULL) {
+            dsp_gain_set(&(music_buf->next_gain), volume *
+                         replaygain_factor(&(music_buf->next.replaygain), replaygain_mode),
+                         music_buf->ramp_frames);
+        }
+    }
+    unlock_music_buffer(music_buf);
+    return 0;
+}
+
+/**
+ * Choose which ReplayGain tags are applied, to the current stream and the
+ * next ones
+ */
+int set_replaygain_music_buffer(music_buffer_t *music_buf, int mode)
+{
+    if (lock_music_buffer(music_buf)) return 1;
+    replaygain_mode = mode;
+    dsp_gain_set(&(music_buf->stream_gain), music_buf->stream_volume *
+                 replaygain_factor(&(music_buf->info.replaygain), replaygain_mode),
+                 music_buf->ramp_frames);
+    if (music_buf->next.file != NULL) {
+        dsp_gain_set(&(music_buf->next_gain), music_buf->stream_volume *
+                     replaygain_factor(&(music_buf->next.replaygain), replaygain_mode),
+                     music_buf->ramp_frames);
+    }
+    unlock_music_buffer(music_buf);
+    return 0;
+}
+
+/**
+ * Change a band of the equalizer, which applies to every stream
+ */
+int set_eq_band_music_buffer(music_buffer_t *music_buf, unsigned index,
+                             eq_band_t const *band)
+{
+    if (lock_music_buffer(music_buf)) return 1;
+    int const ret = eq_set_band(&equalizer, index, band);
+    unlock_music_buffer(music_buf);
+    return ret;
+}
+
+/**
+ * Log the bands of the equalizer
+ */
+void print_eq_music_buffer(music_buffer_t *music_buf)
+{
+    if (lock_music_buffer(music_buf)) return;
+    int bands = 0;
+    unsigned i;
+    for (i = 0; i < EQ_MAX_BANDS; i++) {
+        eq_band_t const *band = &(equalizer.filters[i].band);
+        if (band->type == EQ_OFF) continue;
+        bands++;
+        if (band->type == EQ_LOWPASS || band->type == EQ_HIGHPASS) {
+            LOG_INFO("[EQ] %u: %s %.0f Hz, Q %.2f",
+                     i + 1, eq_type_name(band->type), band->freq, band->q);
+        } else {
+            LOG_INFO("[EQ] %u: %s %.0f Hz, %+.1f dB, Q %.2f",
+                     i + 1, eq_type_name(band->type), band->freq, band->gain, band->q);
+        }
+    }
+    if (!bands) {
+        LOG_INFO("[EQ] No band");
+    }
+    unlock_music_buffer(music_buf);
+}
+
+/**
+ * Set the playback speed, of the current stream and the next ones
+ */
+int set_speed_music_buffer(music_buffer_t *music_buf, float speed)
+{
+    if (!(speed >= STRETCH_MIN_SPEED && speed <= STRETCH_MAX_SPEED)) return 1;
+    if (lock_music_buffer(music_buf)) return 1;
+    playback_speed = speed;
+    if (music_buf->work != NULL) {
+        stretch_set_speed(&(music_buf->stretch), speed);
+        playback_clock_set_speed(music_clock, speed);
+        // Once started, the time-stretch runs until the end of the stream
+        // so that its buffered frames are played
+        if (speed != 1) music_buf->stretching = 1;
+    }
+    unlock_music_buffer(music_buf);
+    return 0;
+}
+
+/**
+ * Get the playback speed
+ */
+float get_speed_music_buffer()
+{
+    return playback_speed;
+}
+
+/**
+ * Enable or disable the measure of output levels, with a spectrum
+ * spectrum_hz times per second if it is not 0.
+ * Only the command thread calls this.
+ */
+void set_music_levels(int enabled, unsigned spectrum_hz)
+{
+    if (!music_meter_ready) {
+        meter_init(&music_meter);
+        music_meter_ready = 1;
+    }
+    meter_enable(&music_meter, enabled, spectrum_hz);
+}
+
+/**
+ * Copy the last output levels.
+ * Return 1 if they are not measured, 2 if the playing thread never finished
+ * updating them.
+ */
+int get_music_levels(meter_levels_t *levels, unsigned *spectrum_hz)
+{
+    if (!music_meter_ready || !meter_enabled(&music_meter)) return 1;
+    if (meter_read(&music_meter, levels) < 0) return 2;
+    *spectrum_hz = __atomic_load_n(&(music_meter.spectrum_hz), __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Route stream channels to device channels from the next stream on: map
+ * gives the stream channel of each device channel, or -1 for silence.
+ * With no map, channels are mixed only when the device needs it.
+ */
+void set_music_channel_map(int const *map, unsigned count)
+{
+    if (count > MATRIX_MAX_CHANNELS) count = 0;
+    memcpy(channel_map, map, count * sizeof(int));
+    channel_map_size = count;
+}
+
+/**
+ * Get the routing of channels, and return the number of device channels
+ * or 0 if none is set
+ */
+unsigned get_music_channel_map(int map[MATRIX_MAX_CHANNELS])
+{
+    memcpy(map, channel_map, channel_map_size * sizeof(int));
+    return channel_map_size;
+}
+
+/**
+ * Play a copy of the output on another device from the next stream on.
+ * Return 1 if there are too many devices or it is already played.
+ */
+int add_music_output(const char *path)
+{
+    if (output_count >= FANOUT_MAX_DEVICES || strlen(path) >= FANOUT_PATH_MAX ||
+        !strcmp(path, "/dev/dsp")) {
+        return 1;
+    }
+    unsigned d;
+    for (d = 0; d < output_count; d++) {
+        if (!strcmp(output_paths[d], path)) return 1;
+    }
+    strcpy(output_paths[output_count++], path);
+    return 0;
+}
+
+/**
+ * Stop playing the output on a device from the next stream on.
+ * Return 1 if it is not played.
+ */
+int remove_music_output(const char *path)
+{
+    unsigned d;
+    for (d = 0; d < output_count; d++) {
+        if (!strcmp(output_paths[d], path)) {
+            memmove(output_paths[d], output_paths[d + 1],
+                    (output_count - d - 1) * sizeof(output_paths[0]));
+            output_count--;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Log the devices which play the output, and the state of the open ones.
+ * Only call it from the thread which opens and closes music_buf.
+ */
+void print_outputs_music_buffer(music_buffer_t *music_buf)
+{
+    LOG_INFO("[Output] /dev/dsp: main device%s",
+             music_buf->fd_dsp != -1 ? ", open" : "");
+    fanout_print(&(music_buf->fanout));
+    unsigned d, o;
+    for (d = 0; d < output_count; d++) {
+        for (o = 0; o < music_buf->fanout.count; o++) {
+            if (!strcmp(music_buf->fanout.devices[o].path, output_paths[d])) break;
+        }
+        if (o == music_buf->fanout.count) {
+            LOG_INFO("[Output] %s: not open", output_paths[d]);
+        }
+    }
+}
+
+/**
+ * Log the instruction set of the kernels, and the kernels of the stream
+ */
+void print_kernels_music_buffer(music_buffer_t *music_buf)
+{
+    if (lock_music_buffer(music_buf)) return;
+    if (music_buf->kernels.decode != NULL) {
+        LOG_INFO("[Kernels] CPU %s: decode %s, gain %s, encode %s",
+                 kernels_isa_name(kernels_isa()), music_buf->kernels.decode->name,
+                 music_buf->kernels.gain->name, music_buf->kernels.encode->name);
+    } else {
+        LOG_INFO("[Kernels] CPU %s, no stream", kernels_isa_name(kernels_isa()));
+    }
+    unlock_music_buffer(music_buf);
+}
+
+/**
+ * Set the scheduling profile of the playing thread, which applies from its
+ * next step: SCHEDULE_LATENCY writes each block as soon as the device takes
+ * it, SCHEDULE_POWER sleeps until the device buffer runs low and refills it
+ * at once
+ */
+void set_music_schedule(int profile)
+{
+    __atomic_store_n(&music_schedule, profile, __ATOMIC_RELAXED);
+}
+
+/**
+ * Log the scheduling profile, and the wakeups and system calls per second
+ * of the playing thread since the last report or the start of the stream
+ */
+void print_schedule_music_buffer(music_buffer_t *music_buf)
+{
+    const char *const name =
+        __atomic_load_n(&music_schedule, __ATOMIC_RELAXED) == SCHEDULE_POWER ?
+        "power" : "latency";
+    if (music_buf->schedule_start_ns == 0) {
+        LOG_INFO("[Schedule] %s profile, no stream", name);
+        return;
+    }
+    int64_t const now_ns = playback_clock_now_ns();
+    double const elapsed = (now_ns - music_buf->schedule_start_ns) * 1e-9;
+    uint64_t const wakeups = __atomic_exchange_n(&(music_buf->wakeups), 0, __ATOMIC_RELAXED);
+    uint64_t const syscalls = __atomic_exchange_n(&(music_buf->syscalls), 0, __ATOMIC_RELAXED);
+    music_buf->schedule_start_ns = now_ns;
+    LOG_INFO("[Schedule] %s profile, %.1f wakeups/s and %.1f syscalls/s in the last %.1f s",
+             name, elapsed > 0 ? wakeups / elapsed : 0, elapsed > 0 ? syscalls / elapsed : 0,
+             elapsed);
+}
+
+/**
+ * Log volumes and the ReplayGain applied to the current stream
+ */
+void print_volume_music_buffer(music_buffer_t *music_buf)
+{
+    if (lock_music_buffer(music_buf)) return;
+    float const factor =
+        replaygain_factor(&(music_buf->info.replaygain), replaygain_mode);
+    LOG_INFO("[Volume] Master %.0f%%, stream %.0f%%, ReplayGain %s (%+.2f dB)",
+             master_volume * 100, music_buf->stream_volume * 100,
+             replaygain_mode_name(replaygain_mode), 20 * log10f(factor));
+    unlock_music_buffer(music_buf);
 }
 
 /**
@@ -619,9 +3250,8 @@ int resume_loop_music_buffer(music_buffer_t *music_buf)
 int play_file(const char *file_name)
 {
     music_buffer_t music_buf;
-    int ret = open_music_buffer(file_name, &music_buf);
+    int ret = open_music_buffer(file_name, &music_buf, TRIM_DEFAULT);
     if (ret) return ret;
-    fflush(stdout);
 
     // Play the file
     ret = play_loop_music_buffer(&music_buf);
@@ -636,12 +3266,12 @@ int player_main(int argc, char ** argv)
 {
     // Args
     if (argc != 2) {
-        fprintf(stderr, "Wrong number of args.\n");
+        LOG_ERROR("Wrong number of args.");
         return 1;
     }
 
     // File name
     char const * file_name = argv[1];
-    printf("File name: '%s'.\n", file_name);
+    LOG_INFO("File name: '%s'.", file_name);
     return play_file(file_name);
 }
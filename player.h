@@ -2,7 +2,37 @@
 #define PLAYER_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <pthread.h>
+#include <time.h>
+#include "adpcm.h"
+#include "cache.h"
+#include "convert.h"
+#include "dsp.h"
+#include "eq.h"
+#include "fanout.h"
+#include "kernels.h"
+#include "matrix.h"
+#include "meter.h"
+#include "metadata.h"
+#include "playclock.h"
+#include "status.h"
+#include "stretch.h"
+#include "tags.h"
+
+// Whether silent ends of a file are skipped: as set by set_music_trim(),
+// or forced for one file
+#define TRIM_DEFAULT -1
+#define TRIM_OFF 0
+#define TRIM_ON 1
+
+// Scheduling profiles of the playing thread: write each block as soon as
+// the device takes it, or sleep until the device buffer runs low
+#define SCHEDULE_LATENCY 0
+#define SCHEDULE_POWER 1
+
+// Maximum number of clips played at the same time
+#define MAX_VOICES 16
 
 // Music file handle
 typedef struct
@@ -12,9 +42,45 @@ typedef struct
     uint_fast32_t channels;
     uint_fast32_t sample_rate;
     uint_fast32_t bits_per_sample;
-    uint_fast32_t data_size;
+    uint_fast64_t data_size;
+    uint_fast32_t data_offset;
+    // WAVE encoding, and blocks of compressed data, which are decoded to
+    // the format above. Sizes are those of the decoded data.
+    uint_fast32_t encoding;
+    uint_fast32_t block_align;
+    uint_fast32_t block_frames;
+    replaygain_t replaygain;
+    // Frames between the silent ends, found with silence_threshold
+    uint_fast64_t audio_start;
+    uint_fast64_t audio_end;
+    int silence_threshold;
 } music_file_t;
 
+/**
+ * Cached clip being mixed into the output
+ */
+typedef struct {
+    clip_t *clip;
+    // Position in the clip and increment per output frame, in 16.16 frames
+    uint_fast64_t pos;
+    uint_fast64_t step;
+    // Time of the trigger command, to measure latency
+    struct timespec triggered;
+} voice_t;
+
+/**
+ * Frames of a track in the format of the output: its first frames, decoded
+ * ahead of its start, then its blocks, converted when the track has another
+ * format than the output
+ */
+typedef struct {
+    float *lead;
+    size_t lead_pos;
+    size_t lead_frames;
+    int converting;
+    convert_t convert;
+} track_feed_t;
+
 /**
  * Playing music state is a buffer with a file descriptor to /dev/dsp
  * and a music file
@@ -22,34 +88,160 @@ typedef struct
 typedef struct {
     int fd_dsp;
     music_file_t info;
+    char *name;
     size_t buf_size;
     unsigned char *buf;
+    // Samples of the buffer being processed, as floats, and the kernels
+    // which convert them
+    float *work;
+    kernels_t kernels;
+    // Channels of the device, and mix of the samples for it when they
+    // differ from the stream or are routed
+    uint_fast32_t device_channels;
+    int remapping;
+    matrix_t matrix;
+    float *device_work;
+    // Writer of the device, and other devices which play a copy of the
+    // output. fd_dsp stays open as long as the writer.
+    fanout_t fanout;
+    // Bytes of audio data which remain in the file, decoder of its blocks
+    // if it is compressed, and its frames in the format of the output.
+    // info has the format of the output when the file is converted.
+    uint_fast64_t data_left;
+    adpcm_t decoder;
+    track_feed_t feed;
+    // Data of the current track which a batch of the power profile read
+    // ahead and which wasn't decoded yet. It isn't counted out of
+    // data_left until it is.
+    unsigned char *ahead;
+    size_t ahead_size;
+    size_t ahead_pos;
+    size_t ahead_len;
 
     // Playing thread, mutex and condition
     pthread_t thread;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
 
-    // State: playing file, in a pause
+    // State: playing file, in a pause, thread has nothing left to play,
+    // fading out before the thread stops
     int playing;
     int pausing;
+    int finished;
+    int stopping;
+
+    // Gain of the file, from its volume and ReplayGain, and gain of the
+    // output, from the master volume and fades. Protected by the mutex.
+    float stream_volume;
+    dsp_gain_t stream_gain;
+    dsp_gain_t output_gain;
+    unsigned ramp_frames;
+
+    // Track which follows the current one, and the progress of the
+    // crossfade between them. The next track is read block by block like
+    // the current one, once its first frames decoded ahead are played.
+    // Protected by the mutex.
+    music_file_t next;
+    char *next_name;
+    uint_fast64_t next_data_left;
+    adpcm_t next_decoder;
+    track_feed_t next_feed;
+    dsp_gain_t next_gain;
+    float *next_work;
+    uint64_t fade_start;
+    size_t fade_pos;
+    size_t fade_frames;
+
+    // Time-stretch of the tracks when the speed isn't 1, and its input
+    // block. Protected by the mutex.
+    int stretching;
+    stretch_t stretch;
+    float *stretch_work;
+
+    // Clips mixed into the output, protected by the mutex
+    voice_t voices[MAX_VOICES];
+
+    // Number of frames of the tracks written to the device and read from
+    // their files since it was opened, which differ by the frames the
+    // time-stretch holds, and speed of the last written frames. Written
+    // frames of a time-stretched stream are the input frames which its
+    // output stands for.
+    uint64_t frames_written;
+    uint64_t frames_read;
+    float speed;
+    // Time at which the device runs out of queued frames, 0 if unknown
+    int64_t drain_ns;
+    // Time at which playback paused or ended, 0 while it plays, and time
+    // at which a released stream resumed, until its first write
+    int64_t idle_ns;
+    int64_t resume_ns;
+
+    // Timer which the power profile sleeps on and the event which cuts its
+    // sleep short
+    int timer_fd;
+    int wake_fd;
+    // Wakeups and system calls of the playing thread since they were last
+    // reported, counted with atomics
+    uint64_t wakeups;
+    uint64_t syscalls;
+    int64_t schedule_start_ns;
 } music_buffer_t;
 
 int wave_opener(music_file_t * file_info);
 int au_opener(music_file_t * file_info);
+void set_music_metadata_index(metadata_index_t *index);
+void set_music_status(player_status_t *status);
+void set_music_crossfade(unsigned msec);
+unsigned get_music_crossfade();
+void set_music_trim(int enabled, float threshold_db);
+int get_music_trim(float *threshold_db);
+void set_music_levels(int enabled, unsigned spectrum_hz);
+int get_music_levels(meter_levels_t *levels, unsigned *spectrum_hz);
+void set_music_channel_map(int const *map, unsigned count);
+unsigned get_music_channel_map(int map[MATRIX_MAX_CHANNELS]);
+int add_music_output(const char *path);
+int remove_music_output(const char *path);
+void print_outputs_music_buffer(music_buffer_t *music_buf);
+void print_kernels_music_buffer(music_buffer_t *music_buf);
 int open_music_file(const char *file_name, music_file_t *file_info);
-int dsp_configuration(int const fd_dsp, music_file_t const * audio_file);
+int probe_music_file(const char *file_name, music_file_t *file_info);
+int dsp_configuration(int const fd_dsp, music_file_t const * audio_file,
+                      unsigned * channels);
+void release_music_device();
 int init_music_buffer(music_buffer_t *music_buf);
 int destroy_music_buffer(music_buffer_t *music_buf);
-int open_music_buffer(const char *file_name, music_buffer_t *music_buf);
+int open_music_buffer(const char *file_name, music_buffer_t *music_buf, int trim);
+int open_clip_music_buffer(clip_t const *clip, music_buffer_t *music_buf);
 int close_music_buffer(music_buffer_t *music_buf);
+int trigger_music_buffer(music_buffer_t *music_buf, clip_t *clip,
+                         struct timespec const *triggered);
+int crossfade_music_buffer(music_buffer_t *music_buf, const char *file_name, int now,
+                           int trim);
 int play_step_music_buffer(music_buffer_t *music_buf);
+int play_batch_music_buffer(music_buffer_t *music_buf);
 int eof_music_buffer(music_buffer_t *music_buf);
+int wants_next_music_buffer(music_buffer_t *music_buf);
 int play_loop_music_buffer(music_buffer_t *music_buf);
 int start_play_loop_music_buffer(pthread_t *thread, music_buffer_t *music_buf);
 int stop_play_loop_music_buffer(pthread_t thread, music_buffer_t *music_buf);
 int pause_loop_music_buffer(music_buffer_t *music_buf);
 int resume_loop_music_buffer(music_buffer_t *music_buf);
+void set_music_idle(unsigned msec);
+unsigned get_music_idle();
+int has_released_music();
+void forget_released_music();
+int idle_music_buffer(pthread_t thread, music_buffer_t *music_buf);
+int restore_music_buffer(pthread_t *thread, music_buffer_t *music_buf);
+int set_volume_music_buffer(music_buffer_t *music_buf, int master, float volume);
+int set_replaygain_music_buffer(music_buffer_t *music_buf, int mode);
+int set_eq_band_music_buffer(music_buffer_t *music_buf, unsigned index,
+                             eq_band_t const *band);
+void print_eq_music_buffer(music_buffer_t *music_buf);
+int set_speed_music_buffer(music_buffer_t *music_buf, float speed);
+float get_speed_music_buffer();
+void set_music_schedule(int profile);
+void print_schedule_music_buffer(music_buffer_t *music_buf);
+void print_volume_music_buffer(music_buffer_t *music_buf);
 int play_file(const char *file_name);
 int player_main(int argc, char ** argv);
 
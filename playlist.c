@@ -0,0 +1,274 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "playlist.h"
+
+
+/**
+ * Initialise an empty playlist
+ */
+void playlist_init(playlist_t *playlist)
+{
+    memset(playlist, 0, sizeof(*playlist));
+    playlist->seed = (uint32_t) time(NULL) ^ (uint32_t) getpid() << 16;
+    if (playlist->seed == 0) playlist->seed = 1;
+}
+
+
+/**
+ * Unmap a playlist and free its index. Shuffle stays as it was set.
+ */
+void playlist_destroy(playlist_t *playlist)
+{
+    if (playlist->map != NULL) {
+        munmap(playlist->map, playlist->map_size);
+    }
+    free(playlist->file_name);
+    free(playlist->dir);
+    free(playlist->entries);
+    free(playlist->order);
+    int const shuffle = playlist->shuffle;
+    uint32_t const seed = playlist->seed;
+    memset(playlist, 0, sizeof(*playlist));
+    playlist->shuffle = shuffle;
+    playlist->seed = seed;
+}
+
+
+/**
+ * (internal) Add an entry to the index, growing it as needed.
+ * Return 1 if the allocation failed.
+ */
+static int add_entry(playlist_t *playlist, size_t *capacity, size_t offset, size_t length)
+{
+    if (playlist->count == *capacity) {
+        size_t const new_capacity = *capacity ? 2 * *capacity : 1024;
+        playlist_entry_t *entries = realloc(playlist->entries,
+                                            new_capacity * sizeof(playlist_entry_t));
+        if (entries == NULL) return 1;
+        playlist->entries = entries;
+        *capacity = new_capacity;
+    }
+    playlist->entries[playlist->count].offset = offset;
+    playlist->entries[playlist->count].length = length;
+    playlist->count++;
+    return 0;
+}
+
+
+/**
+ * (internal) Index the entries of a mapped playlist: lines which are not
+ * comments in M3U files, and the values of "FileN=" lines in PLS files.
+ * Return the number of entries which were too long, or -1 if the
+ * allocation failed.
+ */
+static long index_entries(playlist_t *playlist)
+{
+    const char *const text = playlist->map;
+    size_t const size = playlist->map_size;
+    size_t capacity = 0;
+    long skipped = 0;
+    int pls = -1;
+    size_t pos = 0;
+    // UTF-8 byte order mark
+    if (size >= 3 && !memcmp(text, "\xef\xbb\xbf", 3)) pos = 3;
+    while (pos < size) {
+        const char *const eol = memchr(text + pos, '\n', size - pos);
+        size_t const next = eol != NULL ? (size_t) (eol - text) + 1 : size;
+        size_t start = pos, end = eol != NULL ? next - 1 : size;
+        pos = next;
+        while (start < end && (text[start] == ' ' || text[start] == '\t')) start++;
+        while (end > start && (text[end - 1] == '\r' || text[end - 1] == ' ' ||
+                               text[end - 1] == '\t')) {
+            end--;
+        }
+        if (start == end) continue;
+
+        // The first line tells the format
+        if (pls < 0) {
+            pls = end - start == 10 && !strncasecmp(text + start, "[playlist]", 10);
+            if (pls) continue;
+        }
+        if (pls) {
+            if (end - start < 6 || strncasecmp(text + start, "file", 4)) continue;
+            size_t i = start + 4;
+            while (i < end && text[i] >= '0' && text[i] <= '9') i++;
+            if (i == start + 4 || i == end || text[i] != '=') continue;
+            start = i + 1;
+        } else if (text[start] == '#') {
+            continue;
+        }
+        if (end - start + 2 > PLAYLIST_PATH_MAX) {
+            skipped++;
+            continue;
+        }
+        if (add_entry(playlist, &capacity, start, end - start)) return -1;
+    }
+    return skipped;
+}
+
+
+/**
+ * Map a playlist file in M3U or PLS format and index its entries, in place
+ * of the entries of the playlist. Nothing is copied from the file, so it
+ * stays mapped until another one is loaded.
+ * Return 0 on success, 1 if the file can't be read or has no entry.
+ */
+int playlist_load(playlist_t *playlist, const char *file_name)
+{
+    struct timespec started, ended;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        LOG_ERRNO("open(playlist)");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        LOG_ERRNO("fstat(playlist)");
+        close(fd);
+        return 1;
+    }
+    // Offsets of entries are 32-bit
+    if (st.st_size == 0 || (uint64_t) st.st_size > UINT32_MAX) {
+        LOG_ERROR("[Playlist] %s is empty or too large", file_name);
+        close(fd);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERRNO("mmap(playlist)");
+        return 1;
+    }
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    playlist_destroy(playlist);
+    playlist->map = map;
+    playlist->map_size = st.st_size;
+    long const skipped = index_entries(playlist);
+    playlist->file_name = strdup(file_name);
+    const char *slash = strrchr(file_name, '/');
+    playlist->dir = slash == NULL ? strdup("") : strndup(file_name, slash - file_name + 1);
+    playlist->order = playlist->count ? malloc(playlist->count * sizeof(uint32_t)) : NULL;
+    if (skipped < 0 || playlist->file_name == NULL || playlist->dir == NULL ||
+        (playlist->count && playlist->order == NULL)) {
+        LOG_ERROR("Couldn't allocate the index of the playlist.");
+        playlist_destroy(playlist);
+        return 1;
+    }
+    if (playlist->count == 0) {
+        LOG_ERROR("[Playlist] %s has no entry", file_name);
+        playlist_destroy(playlist);
+        return 1;
+    }
+    posix_madvise(map, st.st_size, POSIX_MADV_RANDOM);
+    playlist_entry_t *entries = realloc(playlist->entries,
+                                        playlist->count * sizeof(playlist_entry_t));
+    if (entries != NULL) playlist->entries = entries;
+    size_t i;
+    for (i = 0; i < playlist->count; i++) {
+        playlist->order[i] = i;
+    }
+    if (skipped) {
+        LOG_WARNING("[Playlist] Skipped %ld entries with a too long path", skipped);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    LOG_INFO("[Playlist] %lu entries from %s in %.2f ms, %lu KB of index",
+             (unsigned long) playlist->count, file_name,
+             (ended.tv_sec - started.tv_sec) * 1e3 +
+             (ended.tv_nsec - started.tv_nsec) * 1e-6,
+             (unsigned long) playlist_memory(playlist) / 1024);
+    return 0;
+}
+
+
+/**
+ * (internal) Compare entries by their index in the file
+ */
+static int compare_entry_indices(const void *a, const void *b)
+{
+    uint32_t const ia = *(uint32_t const *) a, ib = *(uint32_t const *) b;
+    return ia < ib ? -1 : ia > ib;
+}
+
+
+/**
+ * Play the entries which were not played yet in a random order, or in the
+ * order of the file. Turning shuffle off puts the entries which were not
+ * picked yet back in the order of the file, since shuffling swapped them.
+ */
+void playlist_set_shuffle(playlist_t *playlist, int shuffle)
+{
+    if (playlist->shuffle && !shuffle) {
+        size_t const from = playlist->picked > playlist->pos ? playlist->picked : playlist->pos;
+        if (from < playlist->count) {
+            qsort(playlist->order + from, playlist->count - from, sizeof(uint32_t),
+                  compare_entry_indices);
+        }
+    }
+    playlist->shuffle = shuffle;
+}
+
+
+/**
+ * Get the path of the next entry, picking it first when shuffling.
+ * Return 1 at the end of the playlist.
+ */
+int playlist_peek(playlist_t *playlist, char *path, size_t path_size)
+{
+    if (playlist->pos >= playlist->count) return 1;
+    if (playlist->picked <= playlist->pos) {
+        if (playlist->shuffle) {
+            // xorshift32 picks an entry which was not played yet
+            uint32_t x = playlist->seed;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            playlist->seed = x;
+            size_t const j = playlist->pos + x % (playlist->count - playlist->pos);
+            uint32_t const index = playlist->order[j];
+            playlist->order[j] = playlist->order[playlist->pos];
+            playlist->order[playlist->pos] = index;
+        }
+        playlist->picked = playlist->pos + 1;
+    }
+
+    playlist_entry_t const *entry = &(playlist->entries[playlist->order[playlist->pos]]);
+    const char *text = (const char *) playlist->map + entry->offset;
+    int const relative = text[0] != '/';
+    int const len = snprintf(path, path_size, "%s%.*s", relative ? playlist->dir : "",
+                             (int) entry->length, text);
+    if (len < 0 || (size_t) len >= path_size) {
+        path[0] = 0;
+    }
+    return 0;
+}
+
+
+/**
+ * Move to the entry which follows the one playlist_peek() returned
+ */
+void playlist_advance(playlist_t *playlist)
+{
+    if (playlist->pos < playlist->count) playlist->pos++;
+}
+
+
+/**
+ * Memory used by the index of a playlist, without its mapping
+ */
+size_t playlist_memory(playlist_t const *playlist)
+{
+    return playlist->count * (sizeof(playlist_entry_t) + sizeof(uint32_t));
+}
@@ -0,0 +1,53 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest path of an entry, once joined with the directory of the playlist
+#define PLAYLIST_PATH_MAX 1024
+
+// Entry of a playlist: its path in the mapped file, which is not copied
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} playlist_entry_t;
+
+/**
+ * Playlist in M3U or PLS format, mapped in memory.
+ * Loading only indexes the entries. Their paths are joined with the
+ * directory of the playlist and their headers are read when they are about
+ * to play. Shuffle picks the next entry at random among the entries which
+ * were not played yet, by swapping indices in the play order.
+ */
+typedef struct {
+    char *file_name;
+    char *dir;
+    void *map;
+    size_t map_size;
+    playlist_entry_t *entries;
+    uint32_t *order;
+    size_t count;
+
+    // Position in the play order of the next entry, which is picked once
+    // at random when shuffling
+    size_t pos;
+    size_t picked;
+    int shuffle;
+    uint32_t seed;
+
+    // Entries play as tracks end, and the next one waits for the current
+    // track to end because it can't follow it without a gap
+    int active;
+    int held;
+} playlist_t;
+
+void playlist_init(playlist_t *playlist);
+void playlist_destroy(playlist_t *playlist);
+int playlist_load(playlist_t *playlist, const char *file_name);
+void playlist_set_shuffle(playlist_t *playlist, int shuffle);
+int playlist_peek(playlist_t *playlist, char *path, size_t path_size);
+void playlist_advance(playlist_t *playlist);
+size_t playlist_memory(playlist_t const *playlist);
+
+#endif /* PLAYLIST_H */
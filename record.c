@@ -0,0 +1,469 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/soundcard.h>
+#include "adpcm.h"
+#include "log.h"
+#include "playclock.h"
+#include "record.h"
+#include "trace.h"
+
+// Size of the header, so that the samples start on a page, and alignment
+// of the chunks appended to the file
+#define RECORD_HEADER_SIZE 4096
+#define RECORD_ALIGN 4096
+
+// Input the ring holds, which is the longest stall of the disk without
+// loss, duration of a chunk written at once, and of a read of the device
+#define RECORD_RING_SEC 10
+#define RECORD_CHUNK_MSEC 500
+#define RECORD_CHUNK_MAX (1024 * 1024)
+#define RECORD_READ_MSEC 20
+
+
+/**
+ * (internal) Store a little-endian 16-bit integer of a header
+ */
+static void put_le16(unsigned char *p, uint16_t x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+}
+
+
+/**
+ * (internal) Store a little-endian 32-bit integer of a header
+ */
+static void put_le32(unsigned char *p, uint32_t x)
+{
+    put_le16(p, x);
+    put_le16(p + 2, x >> 16);
+}
+
+
+/**
+ * (internal) Store a little-endian 64-bit integer of a header
+ */
+static void put_le64(unsigned char *p, uint64_t x)
+{
+    put_le32(p, x);
+    put_le32(p + 4, x >> 32);
+}
+
+
+/**
+ * (internal) Fill the header of a file of data_bytes of samples. Until the
+ * size is known, the sizes are those of a stream which goes on to the end
+ * of the file. Files over 4 GB take the RF64 form, whose ds64 chunk takes
+ * the place of the first JUNK chunk.
+ * Return 1 if the header is in RF64 form.
+ */
+static int fill_header(unsigned char *h, music_file_t const *format, unsigned frame_bytes,
+                       uint64_t data_bytes, int known)
+{
+    uint64_t const riff_size = RECORD_HEADER_SIZE - 8 + data_bytes + (data_bytes & 1);
+    int const rf64 = known && riff_size > UINT32_MAX;
+    memset(h, 0, RECORD_HEADER_SIZE);
+    memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+    put_le32(h + 4, known && !rf64 ? riff_size : UINT32_MAX);
+    memcpy(h + 8, "WAVE", 4);
+    memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+    put_le32(h + 16, 28);
+    if (rf64) {
+        put_le64(h + 20, riff_size);
+        put_le64(h + 28, data_bytes);
+        put_le64(h + 36, data_bytes / frame_bytes);
+    }
+    memcpy(h + 48, "fmt ", 4);
+    put_le32(h + 52, 16);
+    put_le16(h + 56, WAVE_FORMAT_PCM);
+    put_le16(h + 58, format->channels);
+    put_le32(h + 60, format->sample_rate);
+    put_le32(h + 64, format->sample_rate * frame_bytes);
+    put_le16(h + 68, frame_bytes);
+    put_le16(h + 70, format->bits_per_sample);
+    memcpy(h + 72, "JUNK", 4);
+    put_le32(h + 76, RECORD_HEADER_SIZE - 88);
+    memcpy(h + RECORD_HEADER_SIZE - 8, "data", 4);
+    put_le32(h + RECORD_HEADER_SIZE - 4, known && !rf64 ? data_bytes : UINT32_MAX);
+    return rf64;
+}
+
+
+/**
+ * (internal) Write size bytes at an offset of a file, across short writes.
+ * Return 1 on error.
+ */
+static int write_at(int fd, unsigned char const *buf, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t const ret = pwrite(fd, buf, size, offset);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret <= 0) return 1;
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+
+/**
+ * Initialise a recording, which is stopped
+ */
+void record_init(record_t *record)
+{
+    memset(record, 0, sizeof(*record));
+    record->fd_dsp = -1;
+    record->fd = -1;
+    record->wake_fd = -1;
+}
+
+
+/**
+ * (internal) Count the overruns of the device since the last read. Without
+ * the error counters of OSS 4, a read which finds the input buffer of the
+ * device full is taken as an overrun.
+ */
+static void count_device_overruns(record_t *record)
+{
+#ifdef SNDCTL_DSP_GETERROR
+    audio_errinfo errinfo;
+    if (ioctl(record->fd_dsp, SNDCTL_DSP_GETERROR, &errinfo) == 0 && errinfo.rec_overruns > 0) {
+        __atomic_add_fetch(&(record->device_overruns), errinfo.rec_overruns,
+                           __ATOMIC_RELAXED);
+    }
+#else
+    audio_buf_info info;
+    if (ioctl(record->fd_dsp, SNDCTL_DSP_GETISPACE, &info) == 0 && info.fragstotal > 0 &&
+        info.bytes >= info.fragstotal * info.fragsize) {
+        __atomic_add_fetch(&(record->device_overruns), 1, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+
+/**
+ * (internal) Wait until the device has input or recording stops
+ */
+static void wait_device(record_t *record)
+{
+    struct pollfd fds[2];
+    fds[0].fd = record->fd_dsp;
+    fds[1].fd = record->wake_fd;
+    fds[0].events = fds[1].events = POLLIN;
+    TRACE_BEGIN("capture_poll");
+    int const ret = poll(fds, 2, -1);
+    TRACE_END("capture_poll");
+    if (ret == -1 && errno != EINTR) {
+        LOG_RATELIMITED(LOG_LEVEL_ERROR, "Waiting for %s failed.", RECORD_DEVICE);
+        struct timespec const wait = { 0, RECORD_READ_MSEC * 1000000L };
+        nanosleep(&wait, NULL);
+    }
+}
+
+
+/**
+ * (internal) Read the device into the ring until recording stops. Reads
+ * don't block, so that stopping never waits for input. When the writer is
+ * so far behind that a read doesn't fit, it is read anyway and dropped, so
+ * that the device never overruns.
+ */
+static void* routine_capture(void *arg)
+{
+    record_t *record = arg;
+    trace_set_thread_name("capture");
+    uint64_t head = record->head;
+    while (!__atomic_load_n(&(record->stopping), __ATOMIC_ACQUIRE)) {
+        count_device_overruns(record);
+        uint64_t const tail = __atomic_load_n(&(record->tail), __ATOMIC_ACQUIRE);
+        size_t const offset = head % record->ring_size;
+        size_t size = record->read_size;
+        if (size > record->ring_size - offset) size = record->ring_size - offset;
+        int const room = record->ring_size - (head - tail) >= size;
+        TRACE_BEGIN("capture_read");
+        ssize_t const ret = read(record->fd_dsp,
+                                 room ? record->ring + offset : record->scratch, size);
+        TRACE_END_ARG("capture_read", ret);
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1 && errno == EAGAIN) {
+                wait_device(record);
+                continue;
+            }
+            __atomic_add_fetch(&(record->read_errors), 1, __ATOMIC_RELAXED);
+            LOG_RATELIMITED(LOG_LEVEL_ERROR, "Reading %s failed.", RECORD_DEVICE);
+            struct timespec const wait = { 0, RECORD_READ_MSEC * 1000000L };
+            nanosleep(&wait, NULL);
+            continue;
+        }
+        if (!room) {
+            __atomic_add_fetch(&(record->dropped_bytes), ret, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        uint64_t const fill = head + ret - tail;
+        if (fill > __atomic_load_n(&(record->peak_fill), __ATOMIC_RELAXED)) {
+            __atomic_store_n(&(record->peak_fill), fill, __ATOMIC_RELAXED);
+        }
+        int const crossed = (head + ret) / record->chunk_size != head / record->chunk_size;
+        head += ret;
+        __atomic_store_n(&(record->head), head, __ATOMIC_RELEASE);
+        if (crossed) {
+            sem_post(&(record->chunk_ready));
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * (internal) Append the chunks of the ring to the file as they fill, then
+ * what remains once the capture thread is done. A chunk which can't be
+ * written is lost, and the next ones follow the last one written.
+ */
+static void* routine_writer(void *arg)
+{
+    record_t *record = arg;
+    trace_set_thread_name("record");
+    uint64_t tail = record->tail;
+    for (;;) {
+        // The head is final once the capture thread is done
+        int const draining = __atomic_load_n(&(record->draining), __ATOMIC_ACQUIRE);
+        uint64_t const head = __atomic_load_n(&(record->head), __ATOMIC_ACQUIRE);
+        size_t size = record->chunk_size - tail % record->chunk_size;
+        if (head - tail < size) {
+            if (!draining) {
+                while (sem_wait(&(record->chunk_ready)) == -1 && errno == EINTR) {
+                }
+                continue;
+            }
+            if (head == tail) break;
+            size = head - tail;
+        }
+
+        uint64_t const offset = RECORD_HEADER_SIZE + record->data_bytes;
+        int64_t const started = playback_clock_now_ns();
+        TRACE_BEGIN("record_write");
+        int const failed = write_at(record->fd, record->ring + tail % record->ring_size,
+                                    size, offset);
+        TRACE_END_ARG("record_write", size);
+        int64_t const elapsed = playback_clock_now_ns() - started;
+        if (elapsed > __atomic_load_n(&(record->longest_write_ns), __ATOMIC_RELAXED)) {
+            __atomic_store_n(&(record->longest_write_ns), elapsed, __ATOMIC_RELAXED);
+        }
+        if (failed) {
+            __atomic_add_fetch(&(record->write_errors), 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&(record->lost_bytes), size, __ATOMIC_RELAXED);
+            LOG_RATELIMITED(LOG_LEVEL_ERROR, "Writing %s failed.", record->file_name);
+        } else {
+            __atomic_add_fetch(&(record->data_bytes), size, __ATOMIC_RELAXED);
+        }
+        tail += size;
+        __atomic_store_n(&(record->tail), tail, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+
+/**
+ * (internal) Close the device and the file, and free the buffers
+ */
+static void free_record(record_t *record)
+{
+    if (record->fd_dsp != -1) close(record->fd_dsp);
+    if (record->fd != -1) close(record->fd);
+    if (record->wake_fd != -1) close(record->wake_fd);
+    free(record->file_name);
+    free(record->ring);
+    free(record->scratch);
+    record_init(record);
+}
+
+
+/**
+ * Start recording the device to a WAVE file, in 8 or 16 bits. The file
+ * gets the channels the device records, which may differ from those asked.
+ * Return 1 on error.
+ */
+int record_start(record_t *record, const char *file_name, unsigned rate, unsigned channels,
+                 unsigned bits)
+{
+    if (record->active) {
+        LOG_ERROR("[Record] Already recording to %s", record->file_name);
+        return 1;
+    }
+    if ((bits != 8 && bits != 16) || channels < 1 || rate < 1) {
+        LOG_ERROR("[Record] Can't record %u channels of %u bits at %u Hz",
+                  channels, bits, rate);
+        return 1;
+    }
+    record_init(record);
+    music_file_t *const format = &(record->format);
+    format->oss_format = bits == 8 ? AFMT_U8 : AFMT_S16_LE;
+    format->channels = channels;
+    format->sample_rate = rate;
+    format->bits_per_sample = bits;
+    format->encoding = WAVE_FORMAT_PCM;
+
+    record->fd_dsp = open(RECORD_DEVICE, O_RDONLY);
+    if (record->fd_dsp == -1) {
+        LOG_ERRNO("open(" RECORD_DEVICE ")");
+        return 1;
+    }
+    unsigned device_channels = channels;
+    if (dsp_configuration(record->fd_dsp, format, &device_channels)) {
+        free_record(record);
+        return 1;
+    }
+    format->channels = device_channels;
+    format->block_align = record->frame_bytes = device_channels * bits / 8;
+    int const flags = fcntl(record->fd_dsp, F_GETFL);
+    if (flags == -1 || fcntl(record->fd_dsp, F_SETFL, flags | O_NONBLOCK) == -1) {
+        LOG_ERRNO("fcntl(O_NONBLOCK)");
+        free_record(record);
+        return 1;
+    }
+    record->wake_fd = eventfd(0, 0);
+    if (record->wake_fd == -1) {
+        LOG_ERRNO("eventfd(record)");
+        free_record(record);
+        return 1;
+    }
+
+    // Chunks are whole pages, and the ring whole chunks so that a chunk is
+    // never split by its end
+    size_t const byte_rate = (size_t) rate * record->frame_bytes;
+    size_t chunk = byte_rate * RECORD_CHUNK_MSEC / 1000;
+    if (chunk > RECORD_CHUNK_MAX) chunk = RECORD_CHUNK_MAX;
+    chunk = (chunk + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+    size_t const chunks = (byte_rate * RECORD_RING_SEC + chunk - 1) / chunk;
+    record->chunk_size = chunk;
+    record->ring_size = (chunks < 4 ? 4 : chunks) * chunk;
+    record->read_size = byte_rate * RECORD_READ_MSEC / 1000 / record->frame_bytes *
+        record->frame_bytes;
+    if (record->read_size == 0) record->read_size = record->frame_bytes;
+
+    size_t const name_len = strlen(file_name);
+    record->file_name = malloc(name_len + 1);
+    record->scratch = malloc(record->read_size);
+    void *ring = NULL;
+    if (record->file_name == NULL || record->scratch == NULL ||
+        posix_memalign(&ring, RECORD_ALIGN, record->ring_size)) {
+        LOG_ERROR("Couldn't allocate the ring of the recording.");
+        free_record(record);
+        return 1;
+    }
+    record->ring = ring;
+    memcpy(record->file_name, file_name, name_len + 1);
+    // Touch the ring now rather than in the capture thread
+    memset(record->ring, 0, record->ring_size);
+
+    unsigned char header[RECORD_HEADER_SIZE];
+    fill_header(header, format, record->frame_bytes, 0, 0);
+    record->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (record->fd == -1 || write_at(record->fd, header, sizeof(header), 0)) {
+        LOG_ERRNO("open(record)");
+        free_record(record);
+        return 1;
+    }
+
+    sem_init(&(record->chunk_ready), 0, 0);
+    record->start_ns = playback_clock_now_ns();
+    int ret = pthread_create(&(record->writer_thread), NULL, routine_writer, record);
+    if (ret == 0) {
+        ret = pthread_create(&(record->capture_thread), NULL, routine_capture, record);
+        if (ret) {
+            __atomic_store_n(&(record->draining), 1, __ATOMIC_RELEASE);
+            sem_post(&(record->chunk_ready));
+            pthread_join(record->writer_thread, NULL);
+        }
+    }
+    if (ret) {
+        LOG_ERROR("pthread_create returned error code %d", ret);
+        sem_destroy(&(record->chunk_ready));
+        unlink(file_name);
+        free_record(record);
+        return 1;
+    }
+    record->active = 1;
+    LOG_INFO("[Record] Recording %s: %u Hz, %u channels, %u bits, %.1f s of buffer "
+             "written in chunks of %lu KB", file_name, rate, device_channels, bits,
+             (double) record->ring_size / byte_rate, (unsigned long) chunk / 1024);
+    return 0;
+}
+
+
+/**
+ * Stop recording, write the rest of the ring and the sizes of the file.
+ * Return 1 if nothing was recording.
+ */
+int record_stop(record_t *record)
+{
+    if (!record->active) return 1;
+    __atomic_store_n(&(record->stopping), 1, __ATOMIC_RELEASE);
+    uint64_t const one = 1;
+    if (write(record->wake_fd, &one, sizeof(one)) == -1) {
+        LOG_ERRNO("write(wake)");
+    }
+    pthread_join(record->capture_thread, NULL);
+    close(record->fd_dsp);
+    record->fd_dsp = -1;
+    __atomic_store_n(&(record->draining), 1, __ATOMIC_RELEASE);
+    sem_post(&(record->chunk_ready));
+    pthread_join(record->writer_thread, NULL);
+    sem_destroy(&(record->chunk_ready));
+
+    // Chunks are padded to an even size
+    uint64_t const data_bytes = record->data_bytes;
+    unsigned char const pad = 0;
+    unsigned char header[RECORD_HEADER_SIZE];
+    int const rf64 = fill_header(header, &(record->format), record->frame_bytes,
+                                 data_bytes, 1);
+    if ((data_bytes & 1 && write_at(record->fd, &pad, 1, RECORD_HEADER_SIZE + data_bytes)) ||
+        write_at(record->fd, header, sizeof(header), 0) || fdatasync(record->fd) == -1) {
+        LOG_ERRNO("Couldn't write the header of the recording");
+    }
+    record_print(record);
+    LOG_INFO("[Record] Closed %s, %s file", record->file_name, rf64 ? "RF64" : "WAVE");
+    free_record(record);
+    return 0;
+}
+
+
+/**
+ * Print the statistics of the recording in the log
+ */
+void record_print(record_t *record)
+{
+    if (!record->active) {
+        LOG_INFO("[Record] Not recording");
+        return;
+    }
+    double const byte_rate = (double) record->format.sample_rate * record->frame_bytes;
+    uint64_t const head = __atomic_load_n(&(record->head), __ATOMIC_ACQUIRE);
+    uint64_t const tail = __atomic_load_n(&(record->tail), __ATOMIC_ACQUIRE);
+    LOG_INFO("[Record] %s: %.1f s of %.1f s written, %.0f ms buffered, peak %.0f ms of "
+             "%.0f, longest write %.0f ms, %lu device overruns, %.0f ms dropped, "
+             "%.0f ms lost, %lu read errors, %lu write errors", record->file_name,
+             __atomic_load_n(&(record->data_bytes), __ATOMIC_RELAXED) / byte_rate,
+             (playback_clock_now_ns() - record->start_ns) * 1e-9,
+             (head - tail) * 1e3 / byte_rate,
+             __atomic_load_n(&(record->peak_fill), __ATOMIC_RELAXED) * 1e3 / byte_rate,
+             record->ring_size * 1e3 / byte_rate,
+             __atomic_load_n(&(record->longest_write_ns), __ATOMIC_RELAXED) * 1e-6,
+             __atomic_load_n(&(record->device_overruns), __ATOMIC_RELAXED),
+             __atomic_load_n(&(record->dropped_bytes), __ATOMIC_RELAXED) * 1e3 / byte_rate,
+             __atomic_load_n(&(record->lost_bytes), __ATOMIC_RELAXED) * 1e3 / byte_rate,
+             __atomic_load_n(&(record->read_errors), __ATOMIC_RELAXED),
+             __atomic_load_n(&(record->write_errors), __ATOMIC_RELAXED));
+}
@@ -0,0 +1,70 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "player.h"
+
+// Recorded device, and format of the record command by default
+#define RECORD_DEVICE "/dev/dsp"
+#define RECORD_DEFAULT_RATE 44100
+#define RECORD_DEFAULT_CHANNELS 2
+#define RECORD_DEFAULT_BITS 16
+
+/**
+ * Recording of the input of the device to a WAVE file.
+ * The capture thread only reads the device into a ring which holds several
+ * seconds, waiting for input with poll() so that it stops even if the
+ * device gives none, and the writer thread appends whole chunks of it to the file, at
+ * offsets aligned to pages, so that the disk may stall for as long as the
+ * ring lasts without losing input. Each side of the ring is moved by one
+ * thread only, so they share no lock. The sizes in the header are written
+ * when recording stops, in RF64 form if the file grew over 4 GB.
+ */
+typedef struct {
+    char *file_name;
+    int fd_dsp;
+    int fd;
+    // Wakes the capture thread out of its wait for the device to stop it
+    int wake_fd;
+    music_file_t format;
+    unsigned frame_bytes;
+    int active;
+    pthread_t capture_thread;
+    pthread_t writer_thread;
+
+    // Ring of captured bytes. Head and tail count bytes since the start:
+    // the capture thread moves the head, the writer the tail, and the
+    // writer is woken when the head crosses a chunk.
+    unsigned char *ring;
+    size_t ring_size;
+    size_t chunk_size;
+    size_t read_size;
+    unsigned char *scratch;
+    uint64_t head;
+    uint64_t tail;
+    sem_t chunk_ready;
+    int stopping;
+    int draining;
+
+    // Statistics, updated with atomic operations
+    int64_t start_ns;
+    uint64_t data_bytes;
+    uint64_t peak_fill;
+    int64_t longest_write_ns;
+    unsigned long device_overruns;
+    uint64_t dropped_bytes;
+    uint64_t lost_bytes;
+    unsigned long read_errors;
+    unsigned long write_errors;
+} record_t;
+
+void record_init(record_t *record);
+int record_start(record_t *record, const char *file_name, unsigned rate, unsigned channels,
+                 unsigned bits);
+int record_stop(record_t *record);
+void record_print(record_t *record);
+
+#endif /* RECORD_H */
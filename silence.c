@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/soundcard.h>
+#include "log.h"
+#include "silence.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Size of the reads of a scan. Only the silent ends of a file and the
+// chunks where they stop are read, from each end towards the middle.
+#define SILENCE_CHUNK 65536
+
+
+/**
+ * Convert a level in dBFS to a threshold on 16-bit sample magnitudes
+ */
+int silence_threshold(float db)
+{
+    float const x = 32768 * powf(10, db / 20);
+    return x < 1 ? 1 : x > 32767 ? 32767 : (int) x;
+}
+
+
+/**
+ * (internal) Magnitude of a sample on the 16-bit scale
+ */
+static int sample_magnitude(unsigned char const *p, unsigned oss_format)
+{
+    int x;
+    switch (oss_format) {
+        case AFMT_U8:
+            x = (p[0] - 128) * 256;
+            break;
+        case AFMT_S8:
+            x = (signed char) p[0] * 256;
+            break;
+        case AFMT_S16_LE:
+            x = (int16_t) (p[0] | p[1] << 8);
+            break;
+        default:
+            x = (int16_t) (p[0] << 8 | p[1]);
+            break;
+    }
+    return x < 0 ? -x : x;
+}
+
+
+/**
+ * (internal) Find the first or the last sample above threshold in a
+ * buffer of samples.
+ * Return its index, or -1 if every sample is silent.
+ */
+static long find_loud(unsigned char const *buf, size_t samples, unsigned oss_format,
+                      int threshold, int last)
+{
+    unsigned const sample_bytes = oss_format == AFMT_U8 || oss_format == AFMT_S8 ? 1 : 2;
+    size_t lo = 0, hi = samples;
+#ifdef __SSE2__
+    // Native 16-bit samples are compared 8 at a time, and only the
+    // vector which holds a loud sample is searched sample by sample
+    if (oss_format == AFMT_S16_NE) {
+        __m128i const max = _mm_set1_epi16(threshold);
+        __m128i const min = _mm_set1_epi16(-threshold);
+        int16_t const *q = (int16_t const *) buf;
+        if (!last) {
+            for (; lo + 8 <= samples; lo += 8) {
+                __m128i const x = _mm_loadu_si128((__m128i const *) (q + lo));
+                __m128i const loud = _mm_or_si128(_mm_cmpgt_epi16(x, max),
+                                                  _mm_cmplt_epi16(x, min));
+                if (_mm_movemask_epi8(loud)) break;
+            }
+        } else {
+            for (; hi >= lo + 8; hi -= 8) {
+                __m128i const x = _mm_loadu_si128((__m128i const *) (q + hi - 8));
+                __m128i const loud = _mm_or_si128(_mm_cmpgt_epi16(x, max),
+                                                  _mm_cmplt_epi16(x, min));
+                if (_mm_movemask_epi8(loud)) break;
+            }
+        }
+    }
+#endif
+    size_t i;
+    if (!last) {
+        for (i = lo; i < samples; i++) {
+            if (sample_magnitude(buf + i * sample_bytes, oss_format) > threshold) return i;
+        }
+    } else {
+        for (i = hi; i > 0; i--) {
+            if (sample_magnitude(buf + (i - 1) * sample_bytes, oss_format) > threshold) {
+                return i - 1;
+            }
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Find the audio of a file between silent ends: start is the first frame
+ * with a sample above threshold, and end follows the last one. Both are 0
+ * if the whole data is silent.
+ * Return 1 on error.
+ */
+int silence_scan(int fd, uint64_t data_offset, uint64_t data_size, unsigned oss_format,
+                 unsigned channels, int threshold, uint64_t *start, uint64_t *end)
+{
+    unsigned const sample_bytes = oss_format == AFMT_U8 || oss_format == AFMT_S8 ? 1 : 2;
+    unsigned const frame_bytes = channels * sample_bytes;
+    if (frame_bytes == 0) return 1;
+    uint64_t const frames = data_size / frame_bytes;
+    // Chunks hold whole frames, and 16-bit samples stay aligned
+    size_t const chunk_frames = SILENCE_CHUNK / frame_bytes;
+    unsigned char *buf = malloc(chunk_frames * frame_bytes);
+    if (buf == NULL) return 1;
+
+    // Forward from the start to the first loud sample
+    uint64_t pos = 0;
+    long found = -1;
+    while (pos < frames && found < 0) {
+        size_t n = frames - pos < chunk_frames ? frames - pos : chunk_frames;
+        ssize_t const ret = pread(fd, buf, n * frame_bytes, data_offset + pos * frame_bytes);
+        if (ret < 0) {
+            LOG_ERRNO("pread");
+            free(buf);
+            return 1;
+        }
+        n = ret / frame_bytes;
+        if (n == 0) break;
+        found = find_loud(buf, n * channels, oss_format, threshold, 0);
+        if (found < 0) pos += n;
+    }
+    if (found < 0) {
+        *start = *end = 0;
+        free(buf);
+        return 0;
+    }
+    *start = pos + found / channels;
+
+    // Backward from the end to the last loud sample, which is at or after
+    // the first one
+    uint64_t stop = frames;
+    found = -1;
+    while (stop > *start && found < 0) {
+        size_t const n = stop - *start < chunk_frames ? stop - *start : chunk_frames;
+        ssize_t const ret = pread(fd, buf, n * frame_bytes,
+                                  data_offset + (stop - n) * frame_bytes);
+        if (ret < (ssize_t) (n * frame_bytes)) {
+            // The file is shorter than its header says
+            if (ret < 0) LOG_ERRNO("pread");
+            stop -= n;
+            continue;
+        }
+        found = find_loud(buf, n * channels, oss_format, threshold, 1);
+        if (found < 0) stop -= n;
+        else stop = stop - n + found / channels + 1;
+    }
+    *end = found < 0 ? *start + 1 : stop;
+    free(buf);
+    return 0;
+}
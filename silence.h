@@ -0,0 +1,13 @@
+#ifndef SILENCE_H
+#define SILENCE_H
+
+#include <stdint.h>
+
+// Default level under which samples are silent, in dBFS
+#define SILENCE_DEFAULT_DB -60
+
+int silence_threshold(float db);
+int silence_scan(int fd, uint64_t data_offset, uint64_t data_size, unsigned oss_format,
+                 unsigned channels, int threshold, uint64_t *start, uint64_t *end);
+
+#endif /* SILENCE_H */
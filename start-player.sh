@@ -3,4 +3,4 @@
 # Use Readline wrapper and ALSA-OSS programs
 
 export RLWRAP_HOME=`pwd`
-exec rlwrap aoss ./player
+exec rlwrap aoss ./player "$@"
@@ -12,6 +12,11 @@ PID=`cat "$PIDFILE"`
 if kill -0 $PID 2> /dev/null
 then
     echo "Daemon is running with PID $PID"
+    # Print the status page without disturbing the daemon
+    if [ -x ./player-status ]
+    then
+        exec ./player-status
+    fi
 else
     echo "Daemon is stopped"
 fi
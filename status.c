@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "log.h"
+#include "status.h"
+
+// Both the command and the playing threads update the status, the sequence
+// lock only allows one writer at a time
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Map the status shared memory segment. The daemon creates it and
+ * initializes the header, readers map it read-only.
+ * Return NULL on error.
+ */
+player_status_t* status_open(int create)
+{
+    int fd = shm_open(PLAYER_STATUS_SHM, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd == -1) {
+        LOG_ERRNO("shm_open(status)");
+        return NULL;
+    }
+    if (create && ftruncate(fd, sizeof(player_status_t)) == -1) {
+        LOG_ERRNO("ftruncate(status)");
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, sizeof(player_status_t),
+                     create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERRNO("mmap(status)");
+        return NULL;
+    }
+    player_status_t *status = map;
+    if (create) {
+        memset(status, 0, sizeof(*status));
+        status->version = PLAYER_STATUS_VERSION;
+        status->size = sizeof(*status);
+        // Readers check the magic number last
+        __atomic_store_n(&(status->magic), PLAYER_STATUS_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&(status->magic), __ATOMIC_ACQUIRE) != PLAYER_STATUS_MAGIC ||
+               status->version != PLAYER_STATUS_VERSION ||
+               status->size < sizeof(*status)) {
+        LOG_ERROR("Unsupported status page, version %u", status->version);
+        munmap(map, sizeof(player_status_t));
+        return NULL;
+    }
+    return status;
+}
+
+
+/**
+ * Unmap the status page, and remove its segment if unlink is set
+ */
+void status_close(player_status_t *status, int unlink)
+{
+    munmap(status, sizeof(player_status_t));
+    if (unlink) {
+        shm_unlink(PLAYER_STATUS_SHM);
+    }
+}
+
+
+/**
+ * Begin an update of the status fields.
+ * Fields are then written with plain stores until status_end_update().
+ */
+void status_begin_update(player_status_t *status)
+{
+    pthread_mutex_lock(&writer_mutex);
+    __atomic_store_n(&(status->seq), status->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * End an update of the status fields
+ */
+void status_end_update(player_status_t *status)
+{
+    __atomic_store_n(&(status->seq), status->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+
+/**
+ * Copy a consistent status, including a consistent copy of its clock.
+ * Return the number of retries because the daemon was updating it, or -1
+ * if the daemon never finished an update, because it died during it.
+ */
+int status_read(player_status_t const *status, player_status_t *copy)
+{
+    int retries = -1;
+    uint32_t seq;
+    do {
+        retries++;
+        int64_t const value = playback_clock_seq_wait(&(status->seq));
+        if (value < 0) return -1;
+        seq = value;
+        memcpy(copy, status, offsetof(player_status_t, clock));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&(status->seq), __ATOMIC_RELAXED) != seq);
+    copy->file[STATUS_FILE_MAXLEN - 1] = 0;
+
+    playback_clock_snapshot_t snapshot;
+    if (playback_clock_read(&(status->clock), &snapshot)) return -1;
+    memset(&(copy->clock), 0, sizeof(copy->clock));
+    copy->clock.sample_rate = snapshot.sample_rate;
+    copy->clock.frames_written = snapshot.frames_written;
+    copy->clock.frames_played = snapshot.frames_played;
+    copy->clock.timestamp_ns = snapshot.timestamp_ns;
+    copy->clock.running = snapshot.running;
+    copy->clock.speed_q16 = snapshot.speed_q16;
+    return retries;
+}
+
+
+/**
+ * Print a status copied with status_read()
+ */
+void status_print(FILE *f, player_status_t const *status)
+{
+    static const char *const states[] = { "stopped", "playing", "paused" };
+    uint64_t const position = playback_clock_position(&(status->clock), NULL);
+    uint32_t const rate = status->sample_rate ? status->sample_rate : 1;
+    // The clock counts frames of the output, which may have another rate
+    uint32_t const clock_rate = status->clock.sample_rate ? status->clock.sample_rate : rate;
+    fprintf(f, "State:     %s\n", status->state < 3 ? states[status->state] : "unknown");
+    if (status->file[0]) {
+        fprintf(f, "File:      %s\n", status->file);
+        fprintf(f, "Format:    %u channels, %u Hz, %u bits\n",
+                status->channels, status->sample_rate, status->bits_per_sample);
+        fprintf(f, "Position:  %llu.%03llu / %llu.%03llu s\n",
+                (unsigned long long) (position / clock_rate),
+                (unsigned long long) (position % clock_rate * 1000 / clock_rate),
+                (unsigned long long) (status->duration_frames / rate),
+                (unsigned long long) (status->duration_frames % rate * 1000 / rate));
+    }
+    fprintf(f, "Buffer:    %u / %u bytes queued\n", status->buffer_queued, status->buffer_size);
+    fprintf(f, "Written:   %llu blocks, %llu bytes\n",
+            (unsigned long long) status->blocks_written,
+            (unsigned long long) status->bytes_written);
+    fprintf(f, "Errors:    %u underruns, %u write errors\n",
+            status->underruns, status->write_errors);
+    fprintf(f, "Peaks:    ");
+    uint32_t c;
+    for (c = 0; c < status->channels && c < STATUS_MAX_CHANNELS; c++) {
+        fprintf(f, " %3u%%", (unsigned) status->peaks[c] * 100 / 32767);
+    }
+    fprintf(f, "\n");
+}
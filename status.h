@@ -0,0 +1,69 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "playclock.h"
+
+// Name of the shared memory segment of the daemon status
+#define PLAYER_STATUS_SHM "/inf583-player-status"
+
+// Layout identification. Readers check magic and version before reading,
+// and new fields are only appended so size tells which ones are present.
+#define PLAYER_STATUS_MAGIC 0x504c5354
+#define PLAYER_STATUS_VERSION 1
+
+#define STATUS_MAX_CHANNELS 8
+#define STATUS_FILE_MAXLEN 256
+
+// Playback states
+#define STATUS_STOPPED 0
+#define STATUS_PLAYING 1
+#define STATUS_PAUSED 2
+
+/**
+ * Status page published by the daemon in shared memory.
+ *
+ * Fields after seq are protected by a sequence lock: seq is odd while the
+ * daemon updates them, and readers retry when it changed during their
+ * copy. The playback clock has its own sequence lock so that position
+ * readers don't retry on status updates.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t seq;
+
+    // Current stream
+    uint32_t state;
+    uint32_t channels;
+    uint32_t sample_rate;
+    uint32_t bits_per_sample;
+    uint64_t duration_frames;
+    char file[STATUS_FILE_MAXLEN];
+
+    // Device buffer fill after the last write, in bytes
+    uint32_t buffer_queued;
+    uint32_t buffer_size;
+
+    // Counters since the daemon started
+    uint64_t blocks_written;
+    uint64_t bytes_written;
+    uint32_t underruns;
+    uint32_t write_errors;
+
+    // Peak levels of the last written block, from 0 to 32767
+    uint16_t peaks[STATUS_MAX_CHANNELS];
+
+    playback_clock_t clock;
+} player_status_t;
+
+player_status_t* status_open(int create);
+void status_close(player_status_t *status, int unlink);
+void status_begin_update(player_status_t *status);
+void status_end_update(player_status_t *status);
+int status_read(player_status_t const *status, player_status_t *copy);
+void status_print(FILE *f, player_status_t const *status);
+
+#endif /* STATUS_H */
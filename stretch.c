@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stretch.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Durations of sequences, of the search window and of overlaps in ms,
+// which suit speech and most music
+#define STRETCH_SEQUENCE_MSEC 40
+#define STRETCH_SEEK_MSEC 15
+#define STRETCH_OVERLAP_MSEC 8
+
+
+/**
+ * Allocate the buffers of a time-stretch for a stream, which pushes at
+ * most block_frames frames at once. Speed starts at 1.
+ * Return 1 if the allocation failed.
+ */
+int stretch_init(stretch_t *st, unsigned channels, unsigned sample_rate, size_t block_frames)
+{
+    memset(st, 0, sizeof(*st));
+    st->channels = channels;
+    st->speed = 1;
+    // Overlaps are a multiple of 4 frames, for the vectorized search
+    st->overlap = (STRETCH_OVERLAP_MSEC * sample_rate / 1000) & ~(size_t) 3;
+    if (st->overlap < 4) st->overlap = 4;
+    st->sequence = STRETCH_SEQUENCE_MSEC * sample_rate / 1000;
+    if (st->sequence < 2 * st->overlap) st->sequence = 2 * st->overlap;
+    st->seek = STRETCH_SEEK_MSEC * sample_rate / 1000 + 1;
+
+    st->input_size = st->sequence + st->seek + block_frames;
+    st->output_size = st->input_size + st->sequence;
+    st->input = malloc(st->input_size * channels * sizeof(float));
+    st->output = malloc(st->output_size * channels * sizeof(float));
+    st->mid = malloc(st->overlap * channels * sizeof(float));
+    st->ref = malloc(st->overlap * sizeof(float));
+    st->mono = malloc((st->seek + st->overlap) * sizeof(float));
+    if (!st->input || !st->output || !st->mid || !st->ref || !st->mono) {
+        stretch_destroy(st);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Free the buffers of a time-stretch
+ */
+void stretch_destroy(stretch_t *st)
+{
+    free(st->input);
+    free(st->output);
+    free(st->mid);
+    free(st->ref);
+    free(st->mono);
+    st->input = st->output = st->mid = st->ref = st->mono = NULL;
+    st->input_frames = st->output_frames = 0;
+    st->has_mid = 0;
+}
+
+
+/**
+ * Change the speed, from the next sequence on
+ */
+void stretch_set_speed(stretch_t *st, float speed)
+{
+    st->speed = speed;
+}
+
+
+/**
+ * Drop buffered frames, for a new stream
+ */
+void stretch_reset(stretch_t *st)
+{
+    st->input_frames = st->output_frames = st->output_pos = 0;
+    st->skip_left = 0;
+    st->skip_fract = 0;
+    st->has_mid = 0;
+    st->output_input = st->output_filled = 0;
+    st->pushed = st->consumed = 0;
+}
+
+
+/**
+ * Number of frames which can be pushed
+ */
+size_t stretch_room(stretch_t const *st)
+{
+    return st->input_size - st->input_frames;
+}
+
+
+/**
+ * Number of frames which remain to be pulled, once flushed
+ */
+size_t stretch_pending(stretch_t const *st)
+{
+    return st->input_frames + st->output_frames + (st->has_mid ? st->overlap : 0);
+}
+
+
+/**
+ * Number of pushed frames which the pulled output doesn't stand for yet
+ */
+uint64_t stretch_backlog(stretch_t const *st)
+{
+    return st->pushed > st->consumed ? st->pushed - st->consumed : 0;
+}
+
+
+/**
+ * (internal) Input frames which the first pulled frames of the output
+ * stand for
+ */
+static size_t output_share(stretch_t const *st, size_t pulled)
+{
+    if (st->output_filled == 0) return 0;
+    return (uint64_t) st->output_input * pulled / st->output_filled;
+}
+
+
+/**
+ * Append input frames, as many as there is room for.
+ * Return the number of frames which were consumed.
+ */
+size_t stretch_push(stretch_t *st, float const *in, size_t frames)
+{
+    unsigned const channels = st->channels;
+    // Frames skipped by the last sequence may not have been pushed yet
+    size_t const dropped = frames < st->skip_left ? frames : st->skip_left;
+    st->skip_left -= dropped;
+    size_t n = frames - dropped;
+    if (n > stretch_room(st)) n = stretch_room(st);
+    memcpy(st->input + st->input_frames * channels, in + dropped * channels,
+           n * channels * sizeof(float));
+    st->input_frames += n;
+    st->pushed += dropped + n;
+    return dropped + n;
+}
+
+
+/**
+ * (internal) Dot product of two vectors of floats
+ */
+static float dot_product(float const *a, float const *b, size_t n)
+{
+    float sum = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    // Two accumulators hide the latency of additions
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+                                           _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+
+/**
+ * (internal) Mix interleaved frames down to mono
+ */
+static void mono_mix(float *out, float const *in, size_t frames, unsigned channels)
+{
+    size_t f;
+    for (f = 0; f < frames; f++) {
+        float sum = 0;
+        unsigned c;
+        for (c = 0; c < channels; c++) {
+            sum += in[f * channels + c];
+        }
+        out[f] = sum;
+    }
+}
+
+
+/**
+ * (internal) Find where the next sequence starts in the search window: the
+ * offset at which the input is the most similar to the end of the previous
+ * sequence, by normalized cross-correlation of their mono mixes
+ */
+static size_t best_offset(stretch_t *st)
+{
+    size_t const overlap = st->overlap;
+    float const *const mono = st->mono;
+    mono_mix(st->mono, st->input, st->seek + overlap, st->channels);
+
+    // The energy of the compared input slides with the offset
+    float energy = dot_product(mono, mono, overlap);
+    size_t best = 0;
+    float best_score = -INFINITY;
+    size_t offset;
+    for (offset = 0; offset < st->seek; offset++) {
+        float const score = dot_product(st->ref, mono + offset, overlap) /
+            sqrtf(energy + 1e-9f);
+        if (score > best_score) {
+            best_score = score;
+            best = offset;
+        }
+        energy += mono[offset + overlap] * mono[offset + overlap] -
+            mono[offset] * mono[offset];
+        if (energy < 0) energy = 0;
+    }
+    return best;
+}
+
+
+/**
+ * (internal) Fade from the end of the previous sequence to frames at src,
+ * into out
+ */
+static void fade_mid(stretch_t const *st, float *out, float const *src)
+{
+    unsigned const channels = st->channels;
+    float const *restrict mid = st->mid;
+    float const step = 1.0f / st->overlap;
+    size_t f;
+    for (f = 0; f < st->overlap; f++) {
+        float const t = f * step;
+        unsigned c;
+        for (c = 0; c < channels; c++) {
+            size_t const i = f * channels + c;
+            out[i] = mid[i] + (src[i] - mid[i]) * t;
+        }
+    }
+}
+
+
+/**
+ * (internal) Output one sequence into the empty output buffer, and skip
+ * the input it stands for at the current speed
+ */
+static void run_sequence(stretch_t *st)
+{
+    unsigned const channels = st->channels;
+    size_t const overlap = st->overlap;
+    // At normal speed, sequences follow each other without search
+    size_t const offset = st->has_mid && st->speed != 1 ? best_offset(st) : 0;
+    float const *src = st->input + offset * channels;
+    float *out = st->output;
+    if (st->has_mid) {
+        fade_mid(st, out, src);
+    } else {
+        memcpy(out, src, overlap * channels * sizeof(float));
+    }
+    memcpy(out + overlap * channels, src + overlap * channels,
+           (st->sequence - 2 * overlap) * channels * sizeof(float));
+    st->output_pos = 0;
+    st->output_frames = st->sequence - overlap;
+    st->output_filled = st->output_frames;
+
+    // The end of the sequence overlaps the next one
+    memcpy(st->mid, src + (st->sequence - overlap) * channels,
+           overlap * channels * sizeof(float));
+    mono_mix(st->ref, st->mid, overlap, channels);
+    st->has_mid = 1;
+
+    double const skip = st->speed * (st->sequence - overlap) + st->skip_fract;
+    size_t const n = (size_t) skip;
+    st->skip_fract = skip - n;
+    st->output_input = n;
+    size_t const dropped = n < st->input_frames ? n : st->input_frames;
+    memmove(st->input, st->input + dropped * channels,
+            (st->input_frames - dropped) * channels * sizeof(float));
+    st->input_frames -= dropped;
+    st->skip_left = n - dropped;
+}
+
+
+/**
+ * Get up to frames output frames. Fewer frames are returned when more
+ * input is needed.
+ */
+size_t stretch_pull(stretch_t *st, float *out, size_t frames)
+{
+    unsigned const channels = st->channels;
+    size_t done = 0;
+    while (done < frames) {
+        if (st->output_frames == 0) {
+            if (st->input_frames < st->sequence + st->seek) break;
+            run_sequence(st);
+        }
+        size_t n = frames - done;
+        if (n > st->output_frames) n = st->output_frames;
+        memcpy(out + done * channels, st->output + st->output_pos * channels,
+               n * channels * sizeof(float));
+        size_t const pulled = st->output_filled - st->output_frames;
+        st->consumed += output_share(st, pulled + n) - output_share(st, pulled);
+        st->output_pos += n;
+        st->output_frames -= n;
+        done += n;
+    }
+    return done;
+}
+
+
+/**
+ * Move the remaining input to the output, at the end of the stream
+ */
+void stretch_flush(stretch_t *st)
+{
+    unsigned const channels = st->channels;
+    memmove(st->output, st->output + st->output_pos * channels,
+            st->output_frames * channels * sizeof(float));
+    st->output_pos = 0;
+    // The flushed frames stand for the input which is left
+    st->output_input -= output_share(st, st->output_filled - st->output_frames);
+    st->output_input += st->input_frames;
+    float *out = st->output + st->output_frames * channels;
+    size_t start = 0;
+    if (st->has_mid) {
+        if (st->input_frames >= st->overlap) {
+            fade_mid(st, out, st->input);
+            start = st->overlap;
+        } else {
+            memcpy(out, st->mid, st->overlap * channels * sizeof(float));
+        }
+        out += st->overlap * channels;
+        st->output_frames += st->overlap;
+    }
+    memcpy(out, st->input + start * channels,
+           (st->input_frames - start) * channels * sizeof(float));
+    st->output_frames += st->input_frames - start;
+    st->output_filled = st->output_frames;
+    st->input_frames = 0;
+    st->skip_left = 0;
+    st->skip_fract = 0;
+    st->has_mid = 0;
+}
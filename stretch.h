@@ -0,0 +1,71 @@
+#ifndef STRETCH_H
+#define STRETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Range of playback speeds
+#define STRETCH_MIN_SPEED 0.5f
+#define STRETCH_MAX_SPEED 4.0f
+
+/**
+ * Time-stretch of a stream by WSOLA (waveform similarity overlap-add).
+ * The output is made of sequences of the input which overlap their
+ * neighbours. Each sequence starts where the input best matches the end of
+ * the previous one, near the position given by the speed, so that the
+ * pitch doesn't change.
+ *
+ * Frames are interleaved floats. The input is pushed in blocks and the
+ * output is pulled once enough input is buffered.
+ */
+typedef struct {
+    unsigned channels;
+    float speed;
+    // Lengths in frames: sequence, search window and overlap
+    size_t sequence;
+    size_t seek;
+    size_t overlap;
+
+    // Input frames which wait for a sequence, and input frames to drop
+    // before the next one, with the fractional part of the skip
+    float *input;
+    size_t input_frames;
+    size_t input_size;
+    size_t skip_left;
+    double skip_fract;
+
+    // End of the previous sequence, which the next one fades in over, and
+    // its mono mix for the similarity search
+    float *mid;
+    float *ref;
+    int has_mid;
+    // Mono mix of the search window
+    float *mono;
+
+    // Output frames which were not pulled yet
+    float *output;
+    size_t output_pos;
+    size_t output_frames;
+    size_t output_size;
+
+    // Input frames which the output frames stand for, and the number of
+    // output frames they were spread over. Frames pushed, and input frames
+    // consumed by the pulled output.
+    size_t output_input;
+    size_t output_filled;
+    uint64_t pushed;
+    uint64_t consumed;
+} stretch_t;
+
+int stretch_init(stretch_t *st, unsigned channels, unsigned sample_rate, size_t block_frames);
+void stretch_destroy(stretch_t *st);
+void stretch_set_speed(stretch_t *st, float speed);
+void stretch_reset(stretch_t *st);
+size_t stretch_room(stretch_t const *st);
+size_t stretch_push(stretch_t *st, float const *in, size_t frames);
+size_t stretch_pull(stretch_t *st, float *out, size_t frames);
+void stretch_flush(stretch_t *st);
+size_t stretch_pending(stretch_t const *st);
+uint64_t stretch_backlog(stretch_t const *st);
+
+#endif /* STRETCH_H */
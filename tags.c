@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "tags.h"
+
+static const char *const mode_names[] = { "off", "track", "album" };
+
+
+/**
+ * Store a ReplayGain tag given as a key and a value which are not
+ * 0-terminated, like "REPLAYGAIN_TRACK_GAIN" and "-6.50 dB".
+ * Return 1 if the key is not a ReplayGain tag.
+ */
+int tags_parse_pair(replaygain_t *replaygain, const char *key, size_t key_len,
+                    const char *value, size_t value_len)
+{
+    static const char prefix[] = "REPLAYGAIN_";
+    size_t const prefix_len = sizeof(prefix) - 1;
+    if (key_len <= prefix_len || strncasecmp(key, prefix, prefix_len)) return 1;
+    key += prefix_len;
+    key_len -= prefix_len;
+
+    char number[32];
+    if (value_len >= sizeof(number)) value_len = sizeof(number) - 1;
+    memcpy(number, value, value_len);
+    number[value_len] = 0;
+    char *end;
+    float const x = strtod(number, &end);
+    if (end == number) return 1;
+
+    if (key_len == 10 && !strncasecmp(key, "TRACK_GAIN", 10)) {
+        replaygain->track_gain = x;
+        replaygain->flags |= REPLAYGAIN_TRACK;
+    } else if (key_len == 10 && !strncasecmp(key, "TRACK_PEAK", 10)) {
+        replaygain->track_peak = x;
+    } else if (key_len == 10 && !strncasecmp(key, "ALBUM_GAIN", 10)) {
+        replaygain->album_gain = x;
+        replaygain->flags |= REPLAYGAIN_ALBUM;
+    } else if (key_len == 10 && !strncasecmp(key, "ALBUM_PEAK", 10)) {
+        replaygain->album_peak = x;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Parse "KEY=VALUE" lines, like the annotation field of AU files
+ */
+int tags_parse_text(replaygain_t *replaygain, const char *text, size_t size)
+{
+    int found = 0;
+    size_t start = 0;
+    while (start < size) {
+        size_t end = start;
+        while (end < size && text[end] && text[end] != '\n' && text[end] != '\r') end++;
+        char const *equal = memchr(text + start, '=', end - start);
+        if (equal != NULL &&
+            !tags_parse_pair(replaygain, text + start, equal - text - start,
+                             equal + 1, text + end - equal - 1)) {
+            found++;
+        }
+        start = end + 1;
+    }
+    return found;
+}
+
+
+/**
+ * (internal) Read a big-endian integer, which is synchsafe in ID3v2.4
+ * (7 bits per byte)
+ */
+static uint32_t id3_size(unsigned char const *p, int synchsafe)
+{
+    if (synchsafe) {
+        return (uint32_t) (p[0] & 0x7f) << 21 | (p[1] & 0x7f) << 14 |
+            (p[2] & 0x7f) << 7 | (p[3] & 0x7f);
+    }
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+/**
+ * (internal) Convert an ID3 string to ASCII in out, which has room for
+ * size bytes. Non-ASCII characters of UTF-16 strings become '?'.
+ * Return the length of the string, which ends at the first null character.
+ */
+static size_t id3_string(unsigned char encoding, unsigned char const *p, size_t len,
+                         char *out, size_t size)
+{
+    size_t n = 0;
+    if (encoding == 1 || encoding == 2) {
+        // UTF-16 with a byte order mark, or big-endian without it
+        int little = 0;
+        if (encoding == 1 && len >= 2) {
+            little = p[0] == 0xff && p[1] == 0xfe;
+            p += 2;
+            len -= 2;
+        }
+        size_t i;
+        for (i = 0; i + 1 < len && n + 1 < size; i += 2) {
+            unsigned const c = little ? p[i] | p[i + 1] << 8 : p[i] << 8 | p[i + 1];
+            if (c == 0) break;
+            out[n++] = c < 0x80 ? c : '?';
+        }
+    } else {
+        // ISO-8859-1 or UTF-8
+        while (n < len && n + 1 < size && p[n]) {
+            out[n] = p[n];
+            n++;
+        }
+    }
+    out[n] = 0;
+    return n;
+}
+
+
+/**
+ * Parse the TXXX frames of an ID3v2.3 or ID3v2.4 tag, which is how
+ * ReplayGain is stored in "id3 " chunks of WAV files.
+ * Return the number of tags which were found.
+ */
+int tags_parse_id3(replaygain_t *replaygain, unsigned char const *tag, size_t size)
+{
+    if (size < 10 || memcmp(tag, "ID3", 3) || (tag[3] != 3 && tag[3] != 4)) return 0;
+    int const v4 = tag[3] == 4;
+    size_t end = 10 + id3_size(tag + 6, 1);
+    if (end > size) end = size;
+    size_t pos = 10;
+
+    // Skip the extended header
+    if (tag[5] & 0x40) {
+        if (pos + 4 > end) return 0;
+        pos += v4 ? id3_size(tag + pos, 1) : 4 + id3_size(tag + pos, 0);
+    }
+
+    int found = 0;
+    while (pos + 10 <= end && tag[pos] != 0) {
+        unsigned char const *frame = tag + pos;
+        size_t const frame_size = id3_size(frame + 4, v4);
+        if (frame_size > end - pos - 10) break;
+        // Compressed or encrypted frames are not supported
+        int const encoded = v4 ? frame[9] & 0x0c : frame[9] & 0xc0;
+        if (!memcmp(frame, "TXXX", 4) && !encoded && frame_size > 1) {
+            unsigned char const encoding = frame[10];
+            unsigned char const *data = frame + 11;
+            size_t const len = frame_size - 1;
+            // The description ends with a null character of its encoding
+            size_t const unit = encoding == 1 || encoding == 2 ? 2 : 1;
+            size_t i;
+            for (i = 0; i + unit <= len; i += unit) {
+                if (data[i] == 0 && (unit == 1 || data[i + 1] == 0)) break;
+            }
+            char key[64], value[64];
+            size_t const key_len = id3_string(encoding, data, i, key, sizeof(key));
+            i += unit;
+            if (i <= len) {
+                size_t const value_len =
+                    id3_string(encoding, data + i, len - i, value, sizeof(value));
+                if (!tags_parse_pair(replaygain, key, key_len, value, value_len)) {
+                    found++;
+                }
+            }
+        }
+        pos += 10 + frame_size;
+    }
+    return found;
+}
+
+
+/**
+ * Get the amplitude factor to apply to a stream given its tags.
+ * Missing album gain falls back to the track gain and conversely.
+ * The factor is reduced so that the tagged peak does not clip.
+ */
+float replaygain_factor(replaygain_t const *replaygain, int mode)
+{
+    if (mode == REPLAYGAIN_OFF || !replaygain->flags) return 1;
+    int const album = mode == REPLAYGAIN_ALBUM ?
+        (replaygain->flags & REPLAYGAIN_ALBUM) != 0 :
+        !(replaygain->flags & REPLAYGAIN_TRACK);
+    float const gain = album ? replaygain->album_gain : replaygain->track_gain;
+    float const peak = album ? replaygain->album_peak : replaygain->track_peak;
+    float factor = powf(10, gain / 20);
+    if (peak > 0 && factor * peak > 1) {
+        factor = 1 / peak;
+    }
+    return factor;
+}
+
+
+/**
+ * Get a ReplayGain mode from its name, -1 if unknown
+ */
+int replaygain_parse_mode(const char *name)
+{
+    int mode;
+    for (mode = REPLAYGAIN_OFF; mode <= REPLAYGAIN_ALBUM; mode++) {
+        if (!strcasecmp(name, mode_names[mode])) return mode;
+    }
+    return -1;
+}
+
+
+/**
+ * Get the name of a ReplayGain mode
+ */
+const char* replaygain_mode_name(int mode)
+{
+    if (mode < REPLAYGAIN_OFF || mode > REPLAYGAIN_ALBUM) return "?";
+    return mode_names[mode];
+}
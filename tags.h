@@ -0,0 +1,34 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+#include <stddef.h>
+
+// Largest tag which is read from a music file
+#define TAG_MAXLEN 65536
+
+// Which ReplayGain values are known, and which one is applied
+#define REPLAYGAIN_OFF 0
+#define REPLAYGAIN_TRACK 1
+#define REPLAYGAIN_ALBUM 2
+
+/**
+ * ReplayGain tags of a music file: gains in dB and peaks as linear
+ * amplitudes, 0 if unknown
+ */
+typedef struct {
+    unsigned flags;
+    float track_gain;
+    float track_peak;
+    float album_gain;
+    float album_peak;
+} replaygain_t;
+
+int tags_parse_pair(replaygain_t *replaygain, const char *key, size_t key_len,
+                    const char *value, size_t value_len);
+int tags_parse_text(replaygain_t *replaygain, const char *text, size_t size);
+int tags_parse_id3(replaygain_t *replaygain, unsigned char const *tag, size_t size);
+float replaygain_factor(replaygain_t const *replaygain, int mode);
+int replaygain_parse_mode(const char *name);
+const char* replaygain_mode_name(int mode);
+
+#endif /* TAGS_H */
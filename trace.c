@@ -0,0 +1,251 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+/**
+ * Traced event, with a monotonic timestamp in nanoseconds
+ */
+typedef struct {
+    uint64_t ts;
+    const char *name;
+    uint32_t arg;
+    char phase;
+} trace_event_t;
+
+/**
+ * Ring of events of a thread. Only its thread writes events, and they are
+ * copied when tracing is stopped, while late events may still be written.
+ */
+typedef struct trace_buffer {
+    char name[16];
+    unsigned id;
+    unsigned generation;
+    int exited;
+    uint64_t head;
+    trace_event_t events[TRACE_RING_SIZE];
+    struct trace_buffer *next;
+} trace_buffer_t;
+
+// Every buffer ever allocated. Buffers of exited threads are reused by new
+// threads once they are not part of the current trace.
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *buffers = NULL;
+static unsigned next_id = 1;
+static unsigned generation = 0;
+
+// Buffer of the current thread
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+int trace_enabled = 0;
+
+
+/**
+ * (internal) Release the buffer of an exiting thread
+ */
+static void release_buffer(void *buffer)
+{
+    pthread_mutex_lock(&buffers_mutex);
+    ((trace_buffer_t *) buffer)->exited = 1;
+    pthread_mutex_unlock(&buffers_mutex);
+}
+
+
+/**
+ * (internal) Create the key of per-thread buffers
+ */
+static void create_buffer_key()
+{
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+
+/**
+ * (internal) Get the buffer of the current thread, allocating it if needed
+ */
+static trace_buffer_t* get_buffer()
+{
+    pthread_once(&buffer_key_once, create_buffer_key);
+    trace_buffer_t *buffer = pthread_getspecific(buffer_key);
+    if (buffer != NULL) return buffer;
+
+    pthread_mutex_lock(&buffers_mutex);
+    int const enabled = TRACE_ENABLED();
+    for (buffer = buffers; buffer != NULL; buffer = buffer->next) {
+        if (buffer->exited && (!enabled || buffer->generation != generation)) break;
+    }
+    if (buffer == NULL) {
+        buffer = malloc(sizeof(trace_buffer_t));
+        if (buffer == NULL) {
+            pthread_mutex_unlock(&buffers_mutex);
+            return NULL;
+        }
+        buffer->next = buffers;
+        buffers = buffer;
+    }
+    buffer->id = next_id++;
+    snprintf(buffer->name, sizeof(buffer->name), "thread-%u", buffer->id);
+    buffer->generation = generation;
+    buffer->exited = 0;
+    buffer->head = 0;
+    pthread_mutex_unlock(&buffers_mutex);
+    pthread_setspecific(buffer_key, buffer);
+    return buffer;
+}
+
+
+/**
+ * Record an event in the buffer of the current thread.
+ * Use TRACE_* macros, which check whether tracing is enabled.
+ */
+void trace_event(const char *name, char phase, uint32_t arg)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace_buffer_t *buffer = get_buffer();
+    if (buffer == NULL) return;
+
+    // Events of a previous trace are dropped
+    unsigned const gen = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+    if (buffer->generation != gen) {
+        buffer->generation = gen;
+        __atomic_store_n(&(buffer->head), 0, __ATOMIC_RELAXED);
+    }
+    uint64_t const head = buffer->head;
+    trace_event_t *event = &(buffer->events[head % TRACE_RING_SIZE]);
+    event->ts = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    event->name = name;
+    event->arg = arg;
+    event->phase = phase;
+    __atomic_store_n(&(buffer->head), head + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Name the current thread in traces.
+ * This also allocates the buffer before the thread starts its work.
+ */
+void trace_set_thread_name(const char *name)
+{
+    trace_buffer_t *buffer = get_buffer();
+    if (buffer == NULL) return;
+    pthread_mutex_lock(&buffers_mutex);
+    snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+    pthread_mutex_unlock(&buffers_mutex);
+}
+
+
+/**
+ * Start a new trace, dropping previous events
+ */
+int trace_start()
+{
+    pthread_mutex_lock(&buffers_mutex);
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&buffers_mutex);
+    LOG_INFO("[Trace] Started");
+    return 0;
+}
+
+
+/**
+ * (internal) Copy the events of a ring, which its thread may still write.
+ * Events which the thread overwrote during the copy are dropped.
+ * Return the index of the first copied event, copy[i % TRACE_RING_SIZE]
+ * holding event i up to *head.
+ */
+static uint64_t copy_buffer(trace_buffer_t const *buffer, trace_event_t *copy,
+                            uint64_t *head)
+{
+    uint64_t const before = __atomic_load_n(&(buffer->head), __ATOMIC_ACQUIRE);
+    uint64_t first = before > TRACE_RING_SIZE ? before - TRACE_RING_SIZE : 0;
+    memcpy(copy, buffer->events, sizeof(buffer->events));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // The thread may be writing the slot of event after, over the event
+    // after - TRACE_RING_SIZE
+    uint64_t const after = __atomic_load_n(&(buffer->head), __ATOMIC_RELAXED);
+    if (after >= TRACE_RING_SIZE && after - TRACE_RING_SIZE + 1 > first) {
+        first = after - TRACE_RING_SIZE + 1;
+    }
+    *head = before > first ? before : first;
+    return first;
+}
+
+
+/**
+ * Stop tracing and write events to a file in Chrome trace event format,
+ * which Perfetto and chrome://tracing open. Ends of spans which began before
+ * the oldest kept event are dropped, so that every span is complete.
+ */
+int trace_stop(const char *file_name)
+{
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    trace_event_t *copy = malloc(TRACE_RING_SIZE * sizeof(trace_event_t));
+    if (copy == NULL) {
+        LOG_ERROR("Couldn't allocate the copy of the trace.");
+        return 1;
+    }
+    FILE *f = fopen(file_name, "w");
+    if (f == NULL) {
+        LOG_ERRNO("fopen(trace)");
+        free(copy);
+        return 1;
+    }
+
+    pthread_mutex_lock(&buffers_mutex);
+    int const pid = getpid();
+    unsigned long count = 0;
+    int first = 1;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    trace_buffer_t *buffer;
+    for (buffer = buffers; buffer != NULL; buffer = buffer->next) {
+        if (buffer->generation != generation) continue;
+        fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                "\"args\":{\"name\":\"%s\"}}", first ? "" : ",", pid, buffer->id,
+                buffer->name);
+        first = 0;
+
+        uint64_t head;
+        uint64_t i = copy_buffer(buffer, copy, &head);
+        unsigned depth = 0;
+        for (; i < head; i++) {
+            trace_event_t const *event = &(copy[i % TRACE_RING_SIZE]);
+            if (event->phase == 'B') {
+                depth++;
+            } else if (event->phase == 'E') {
+                if (depth == 0) continue;
+                depth--;
+            }
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,"
+                    "\"ts\":%llu.%03u", event->name, event->phase, pid, buffer->id,
+                    (unsigned long long) (event->ts / 1000),
+                    (unsigned) (event->ts % 1000));
+            if (event->phase == 'i') {
+                fprintf(f, ",\"s\":\"t\"");
+            }
+            if (event->arg) {
+                fprintf(f, ",\"args\":{\"bytes\":%lu}", (unsigned long) event->arg);
+            }
+            fprintf(f, "}");
+            count++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    pthread_mutex_unlock(&buffers_mutex);
+    free(copy);
+
+    if (fclose(f) == EOF) {
+        LOG_ERRNO("fclose(trace)");
+        return 1;
+    }
+    LOG_INFO("[Trace] Wrote %lu events to %s", count, file_name);
+    return 0;
+}
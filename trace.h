@@ -0,0 +1,26 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Number of events kept by each thread, older events are overwritten
+#define TRACE_RING_SIZE 8192
+
+extern int trace_enabled;
+
+void trace_event(const char *name, char phase, uint32_t arg);
+void trace_set_thread_name(const char *name);
+int trace_start();
+int trace_stop(const char *file_name);
+
+#define TRACE_ENABLED() __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)
+
+// Tracepoints are expressions which cost a load when tracing is disabled.
+// name must be a string literal as only its address is recorded.
+#define TRACE_BEGIN(name) (TRACE_ENABLED() ? trace_event(name, 'B', 0) : (void) 0)
+#define TRACE_END(name) (TRACE_ENABLED() ? trace_event(name, 'E', 0) : (void) 0)
+#define TRACE_END_ARG(name, arg) \
+    (TRACE_ENABLED() ? trace_event(name, 'E', arg) : (void) 0)
+#define TRACE_INSTANT(name) (TRACE_ENABLED() ? trace_event(name, 'i', 0) : (void) 0)
+
+#endif /* TRACE_H */